@@ -24,7 +24,10 @@
 #include "rtspclient.h"
 
 #include "ga-common.h"
+#include "ga-conf.h"
 #include "ga-avcodec.h"
+#include "rtcp.h"
+#include "rtp-fec.h"
 
 #include <string.h>
 #include <list>
@@ -43,6 +46,47 @@ static const char *audio_codec = NULL;
 static int video_framing = 0;
 static int audio_framing = 0;
 
+// startup bandwidth probing: arrivals of the server's probe train
+struct probe_train {
+	int received;
+	int total;
+	unsigned int bytes;	// on the wire, excluding the first packet
+	struct timeval first, last;
+	bool reported;
+};
+static struct probe_train probe;
+
+// the receive path of RTP/UDP video, ahead of live555's reordering buffer:
+// FEC packets recover single losses in place, and remaining gaps in the
+// sequence numbers are reported with generic NACKs.  packets that still
+// miss after NACK_LOST_TIMEOUT are counted as lost.
+#define	NACK_GAP_MAX		RTCP_NACK_MAX	// larger gaps are not requested
+#define	NACK_LOST_TIMEOUT	1000000		// us
+#define	RECV_REPORT_INTERVAL	10		// seconds
+#define	PLI_RETRY_INTERVAL	500000		// us, while the picture is not repaired
+struct recv_state {
+	MediaSubsession *subsession;
+	bool nack;
+	struct rtp_fec_decoder *fec;
+	bool started;
+	unsigned short expected;	// the next sequence number
+	map<unsigned short,struct timeval> missing;
+	unsigned int nlost, nrecovered, nnack;
+	// picture loss: a packet skipped by live555, or a decoding error,
+	// until the next keyframe is decoded
+	bool pli;
+	bool delivered_valid;
+	unsigned short delivered;	// the last packet passed to the decoder
+	struct timeval lost_tv;		// 0 - the picture is intact
+	struct timeval pli_tv;
+	unsigned int npli, nrepaired;
+	long long repair_us;
+	struct timeval last_report;
+};
+static struct recv_state recvstate[IMAGE_SOURCE_CHANNEL_MAX];
+static void picture_lost(int ch, const char *reason);
+static void picture_repaired(int ch);
+
 #ifdef COUNT_FRAME_RATE
 static int cf_frame[IMAGE_SOURCE_CHANNEL_MAX];
 static struct timeval cf_tv0[IMAGE_SOURCE_CHANNEL_MAX];
@@ -54,6 +98,7 @@ static long long cf_interval[IMAGE_SOURCE_CHANNEL_MAX];
 static void continueAfterDESCRIBE(RTSPClient* rtspClient, int resultCode, char* resultString);
 static void continueAfterSETUP(RTSPClient* rtspClient, int resultCode, char* resultString);
 static void continueAfterPLAY(RTSPClient* rtspClient, int resultCode, char* resultString);
+static void continueAfterSET_PARAMETER(RTSPClient* rtspClient, int resultCode, char* resultString);
 
 static void subsessionAfterPlaying(void* clientData);
 static void subsessionByeHandler(void* clientData);
@@ -224,6 +269,9 @@ init_adecoder() {
 
 static void
 play_video_priv(int ch/*channel*/, unsigned char *buffer, int bufsize, struct timeval pts) {
+	// source size of the scaler, changes with the stream resolution
+	static int swswidth[IMAGE_SOURCE_CHANNEL_MAX];
+	static int swsheight[IMAGE_SOURCE_CHANNEL_MAX];
 	AVPacket avpkt;
 	int got_picture, len;
 	union SDL_Event evt;
@@ -237,9 +285,12 @@ play_video_priv(int ch/*channel*/, unsigned char *buffer, int bufsize, struct ti
 		//
 		if((len = avcodec_decode_video2(vdecoder[ch], vframe[ch], &got_picture, &avpkt)) < 0) {
 			//rtsperror("decode video frame %d error\n", frame);
+			picture_lost(ch, "decoding error");
 			break;
 		}
 		if(got_picture) {
+			if(vframe[ch]->key_frame)
+				picture_repaired(ch);
 #if ! SDL_VERSION_ATLEAST(2,0,0)
 			AVPicture pict;
 			SDL_Rect rect;
@@ -282,6 +333,30 @@ play_video_priv(int ch/*channel*/, unsigned char *buffer, int bufsize, struct ti
 				// for event handler to create/setup surfaces
 				goto skip_frame;
 			}
+			// resolution changed, e.g., switched to another simulcast tier:
+			// keep the window, and rescale into it
+			if(swswidth[ch] == 0) {
+				swswidth[ch] = rtspParam->width[ch];
+				swsheight[ch] = rtspParam->height[ch];
+			}
+			if(vframe[ch]->width != swswidth[ch] || vframe[ch]->height != swsheight[ch]) {
+				struct SwsContext *swsctx;
+				if((swsctx = sws_getContext(vframe[ch]->width, vframe[ch]->height,
+						(PixelFormat) vframe[ch]->format,
+						rtspParam->width[ch], rtspParam->height[ch], PIX_FMT_YUV420P,
+						SWS_FAST_BILINEAR, NULL, NULL, NULL)) == NULL) {
+					pthread_mutex_unlock(&rtspParam->surfaceMutex[ch]);
+					rtsperror("video decoder(%d): cannot rescale %dx%d frames.\n",
+						ch, vframe[ch]->width, vframe[ch]->height);
+					goto skip_frame;
+				}
+				sws_freeContext(rtspParam->swsctx[ch]);
+				rtspParam->swsctx[ch] = swsctx;
+				swswidth[ch] = vframe[ch]->width;
+				swsheight[ch] = vframe[ch]->height;
+				rtsperror("video decoder(%d): resolution changed to %dx%d.\n",
+					ch, swswidth[ch], swsheight[ch]);
+			}
 			pthread_mutex_unlock(&rtspParam->surfaceMutex[ch]);
 			// copy into pool
 			data = rtspParam->pipe[ch]->allocate_data();
@@ -369,6 +444,217 @@ play_video(int channel, unsigned char *buffer, int bufsize, struct timeval pts,
 	return;
 }
 
+#define	PROBE_OVERHEAD	40	// RTP + UDP + IPv4 headers
+
+// check for a probe packet (a H.264 filler data NAL unit with a signature),
+// and report the arrival rate once the last one of the train arrives.
+// returns true if the NAL unit is a probe packet.
+static bool
+probe_check(MediaSubsession& subsession, const unsigned char *nal, unsigned size) {
+	RTSPClient *rtspClient = (RTSPClient*) subsession.miscPtr;
+	int siglen = strlen(RTSP_PROBE_SIGNATURE);
+	int index = -1, total = 0, kbps;
+	long long elapsed;
+	struct timeval tv;
+	char value[64];
+	//
+	if(size <= (unsigned) siglen+1
+	|| (nal[0] & 0x1f) != 12
+	|| memcmp(nal+1, RTSP_PROBE_SIGNATURE, siglen) != 0)
+		return false;
+	gettimeofday(&tv, NULL);
+	if(sscanf((const char*) nal+1+siglen, "%d/%d", &index, &total) != 2
+	|| probe.reported || rtspClient == NULL)
+		return true;
+	if(probe.received++ == 0) {
+		probe.first = tv;
+	} else {
+		probe.bytes += size + PROBE_OVERHEAD;
+	}
+	probe.last = tv;
+	probe.total = total;
+	if(index < total-1)
+		return true;
+	// the dispersion of the train gives the bottleneck rate
+	elapsed = tvdiff_us(&probe.last, &probe.first);
+	if(elapsed <= 0)
+		elapsed = 1;
+	kbps = (int) (8000LL * probe.bytes / elapsed);
+	if(probe.received < 2)
+		kbps = 0;
+	snprintf(value, sizeof(value), "%d %d/%d", kbps, probe.received, probe.total);
+	rtsperror("probe: %d/%d packets in %.3f ms, %d kbps.\n",
+		probe.received, probe.total, 0.001 * elapsed, kbps);
+	rtspClient->sendSetParameterCommand(subsession.parentSession(),
+		continueAfterSET_PARAMETER, RTSP_PROBE_PARAMETER, value);
+	probe.reported = true;
+	return true;
+}
+
+static void
+nack_check(struct recv_state *rs, const unsigned char *packet, unsigned packetSize, struct timeval *now) {
+	RTCPInstance *rtcp = rs->subsession->rtcpInstance();
+	map<unsigned short,struct timeval>::iterator mi;
+	unsigned short seq, lost[NACK_GAP_MAX];
+	unsigned char buf[16 + 4*NACK_GAP_MAX];
+	unsigned int ssrc;
+	int gap, n = 0, len;
+	//
+	seq = (packet[2] << 8) | packet[3];
+	ssrc = (packet[8] << 24) | (packet[9] << 16) | (packet[10] << 8) | packet[11];
+	if(rs->started == false) {
+		rs->started = true;
+		rs->expected = seq + 1;
+		return;
+	}
+	gap = (short) (seq - rs->expected);
+	if(gap == 0) {
+		rs->expected++;
+	} else if(gap > 0) {
+		if(gap <= NACK_GAP_MAX) {
+			for(; rs->expected != seq; rs->expected++) {
+				lost[n++] = rs->expected;
+				rs->missing[rs->expected] = *now;
+			}
+		}
+		rs->expected = seq + 1;
+	} else if((mi = rs->missing.find(seq)) != rs->missing.end()) {
+		// late, retransmitted, or recovered from parity
+		rs->nrecovered++;
+		rs->missing.erase(mi);
+	}
+	if(rs->nack && n > 0 && rtcp != NULL && rs->subsession->rtpSource() != NULL
+	&& (len = rtcp_build_nack(buf, sizeof(buf),
+			rs->subsession->rtpSource()->SSRC(), ssrc, lost, n)) > 0) {
+		rtcp->RTCPgs()->output(rtcp->envir(), 255, buf, len);
+		rs->nnack++;
+	}
+	// give up on old losses
+	for(mi = rs->missing.begin(); mi != rs->missing.end(); ) {
+		if(tvdiff_us(now, &mi->second) > NACK_LOST_TIMEOUT) {
+			rs->nlost++;
+			rs->missing.erase(mi++);
+		} else {
+			mi++;
+		}
+	}
+	return;
+}
+
+// request a keyframe with a PLI, and repeat it until one arrives
+static void
+pli_check(struct recv_state *rs, struct timeval *now) {
+	RTCPInstance *rtcp = rs->subsession->rtcpInstance();
+	RTPSource *rtpsrc = rs->subsession->rtpSource();
+	unsigned char buf[16];
+	int len;
+	//
+	if(rs->pli == false || rs->lost_tv.tv_sec == 0 || rtcp == NULL || rtpsrc == NULL)
+		return;
+	if(rs->pli_tv.tv_sec != 0 && tvdiff_us(now, &rs->pli_tv) < PLI_RETRY_INTERVAL)
+		return;
+	if((len = rtcp_build_pli(buf, sizeof(buf), rtpsrc->SSRC(), rtpsrc->lastReceivedSSRC())) < 0)
+		return;
+	rtcp->RTCPgs()->output(rtcp->envir(), 255, buf, len);
+	rs->pli_tv = *now;
+	rs->npli++;
+	return;
+}
+
+static void
+picture_lost(int ch, const char *reason) {
+	struct recv_state *rs = &recvstate[ch];
+	struct timeval now;
+	//
+	if(rs->subsession == NULL)
+		return;
+	gettimeofday(&now, NULL);
+	if(rs->lost_tv.tv_sec == 0) {
+		rs->lost_tv = now;
+		rtsperror("video(%d): picture lost (%s).\n", ch, reason);
+	}
+	pli_check(rs, &now);
+	return;
+}
+
+// a keyframe is decoded: the picture is repaired
+static void
+picture_repaired(int ch) {
+	struct recv_state *rs = &recvstate[ch];
+	struct timeval now;
+	long long elapsed;
+	//
+	if(rs->lost_tv.tv_sec == 0)
+		return;
+	gettimeofday(&now, NULL);
+	elapsed = tvdiff_us(&now, &rs->lost_tv);
+	rs->nrepaired++;
+	rs->repair_us += elapsed;
+	rs->lost_tv.tv_sec = rs->lost_tv.tv_usec = 0;
+	rs->pli_tv.tv_sec = rs->pli_tv.tv_usec = 0;
+	rtsperror("video(%d): picture repaired in %.1f ms (mean %.1f ms over %u).\n",
+		ch, 0.001 * elapsed, 0.001 * rs->repair_us / rs->nrepaired, rs->nrepaired);
+	return;
+}
+
+// called for each frame passed to the decoder: packets skipped by
+// live555's reordering buffer are still in the missing list
+static void
+picture_check(int ch, unsigned short seq) {
+	struct recv_state *rs = &recvstate[ch];
+	map<unsigned short,struct timeval>::iterator mi;
+	struct timeval now;
+	unsigned short span;
+	//
+	if(rs->subsession == NULL)
+		return;
+	if(rs->delivered_valid) {
+		span = seq - rs->delivered;
+		for(mi = rs->missing.begin(); mi != rs->missing.end(); mi++) {
+			if((unsigned short) (mi->first - rs->delivered - 1) < span) {
+				picture_lost(ch, "packet loss");
+				break;
+			}
+		}
+	}
+	rs->delivered = seq;
+	rs->delivered_valid = true;
+	gettimeofday(&now, NULL);
+	pli_check(rs, &now);
+	return;
+}
+
+// called for each RTP packet read from the socket
+static void
+recv_packet(void *clientData, unsigned char *packet, unsigned &packetSize) {
+	struct recv_state *rs = (struct recv_state*) clientData;
+	struct timeval now;
+	//
+	if(packetSize < 12 || (packet[0] >> 6) != 2)
+		return;
+	gettimeofday(&now, NULL);
+	if(rs->last_report.tv_sec == 0)
+		rs->last_report = now;
+	// unused parity packets are dropped by live555 for their payload type
+	if(rs->fec == NULL || rtp_fec_decode(rs->fec, packet, &packetSize) >= 0)
+		nack_check(rs, packet, packetSize, &now);
+	if(tvdiff_us(&now, &rs->last_report) > RECV_REPORT_INTERVAL * 1000000LL) {
+		unsigned int total = rs->nlost + rs->nrecovered;
+		struct rtp_fec_stats st;
+		rtsperror("recv: %u/%u lost packets recovered (%.1f%%), %u nacks, %u plis sent.\n",
+			rs->nrecovered, total,
+			total > 0 ? 100.0 * rs->nrecovered / total : 100.0, rs->nnack, rs->npli);
+		if(rs->fec != NULL) {
+			rtp_fec_decoder_get_stats(rs->fec, &st);
+			rtsperror("recv: fec recovered %u, unrecoverable %u, overhead %.1f%%.\n",
+				st.recovered, st.unrecoverable,
+				st.media_bytes > 0 ? 100.0 * st.fec_bytes / st.media_bytes : 0.0);
+		}
+		rs->last_report = now;
+	}
+	return;
+}
+
 void
 audio_fill_buffer(void *userdata, unsigned char *stream, int ssize) {
 	static const int abmaxsize = AVCODEC_MAX_AUDIO_FRAME_SIZE*4;
@@ -748,6 +1034,23 @@ setupNextSubsession(RTSPClient* rtspClient) {
 	}
 	//
 
+	// Pin a simulcast tier, if configured.  The request goes out ahead of "PLAY".
+	do {
+		char tier[16];
+		if(ga_conf_readv("video-tier", tier, sizeof(tier)) != NULL) {
+			rtspClient->sendSetParameterCommand(*scs.session,
+				continueAfterSET_PARAMETER, RTSP_TIER_PARAMETER, tier);
+		}
+	} while(0);
+	// Ask the server to pace (or not to pace) video packets, if configured.
+	do {
+		char pacing[16];
+		if(ga_conf_readv("video-pacing", pacing, sizeof(pacing)) != NULL) {
+			rtspClient->sendSetParameterCommand(*scs.session,
+				continueAfterSET_PARAMETER, RTSP_PACING_PARAMETER,
+				ga_conf_readbool("video-pacing", 0) ? "1" : "0");
+		}
+	} while(0);
 	// We've finished setting up all of the subsessions.  Now, send a RTSP "PLAY" command to start the streaming:
 	scs.duration = scs.session->playEndTime() - scs.session->playStartTime();
 	rtspClient->sendPlayCommand(*scs.session, continueAfterPLAY);
@@ -783,6 +1086,22 @@ continueAfterSETUP(RTSPClient* rtspClient, int resultCode, char* resultString) {
 		if (scs.subsession->rtcpInstance() != NULL) {
 			scs.subsession->rtcpInstance()->setByeHandler(subsessionByeHandler, scs.subsession);
 		}
+		// Recover lost video packets from parity, and request retransmissions if configured:
+		if(strcmp("video", scs.subsession->mediumName()) == 0
+		&& rtspconf->proto != IPPROTO_TCP
+		&& scs.subsession->rtpSource() != NULL) {
+			int cid = port2channel[scs.subsession->clientPortNum()];
+			struct recv_state *rs = &recvstate[cid];
+			rs->subsession = scs.subsession;
+			rs->nack = ga_conf_readbool("video-nack", 0) != 0;
+			rs->pli = ga_conf_readbool("video-pli", 0) != 0;
+			if(rs->fec == NULL)
+				rs->fec = rtp_fec_decoder_create(RTSP_FEC_PAYLOAD_TYPE);
+			scs.subsession->rtpSource()->setAuxilliaryReadHandler(recv_packet, rs);
+			rtsperror("recv: video channel %d, fec %s, nack %s, pli %s.\n", cid,
+				rs->fec ? "on" : "off", rs->nack ? "on" : "off",
+				rs->pli ? "on" : "off");
+		}
 	} while (0);
 
 	// Set up the next subsession, if any:
@@ -820,6 +1139,15 @@ continueAfterPLAY(RTSPClient* rtspClient, int resultCode, char* resultString) {
 	shutdownStream(rtspClient);
 }
 
+void
+continueAfterSET_PARAMETER(RTSPClient* rtspClient, int resultCode, char* resultString) {
+	UsageEnvironment& env = rtspClient->envir(); // alias
+	if (resultCode != 0) {
+		env << *rtspClient << "Failed to set parameter: " << resultString << "\n";
+	}
+	delete[] resultString;
+}
+
 void
 subsessionAfterPlaying(void* clientData) {
 	MediaSubsession* subsession = (MediaSubsession*)clientData;
@@ -1013,6 +1341,13 @@ DummySink::afterGettingFrame(unsigned frameSize, unsigned numTruncatedBytes,
 		if(rtpsrc != NULL) {
 			marker = rtpsrc->curPacketMarkerBit();
 		}
+		// probe packets are not for the decoder
+		if(video_framing > 0
+		&& probe_check(fSubsession, fReceiveBuffer+MAX_FRAMING_SIZE, frameSize))
+			goto dropped;
+		if(rtpsrc != NULL) {
+			picture_check(channel, rtpsrc->curPacketRTPSeqNum());
+		}
 		play_video(channel,
 			fReceiveBuffer+MAX_FRAMING_SIZE-video_framing,
 			frameSize+video_framing, presentationTime,
@@ -166,6 +166,15 @@ audio_source_buffer_read(AudioBuffer *ab, unsigned char *buf, int frames) {
 	return copyframe;
 }
 
+void
+audio_source_buffer_purge(AudioBuffer *ab) {
+	pthread_mutex_lock(&ab->bufmutex);
+	ab->bufhead = ab->buftail = 0;
+	ab->bframes = 0;
+	pthread_mutex_unlock(&ab->bufmutex);
+	return;
+}
+
 void
 audio_source_client_register(long tid, AudioBuffer *ab) {
 	pthread_mutex_lock(&ccmutex);
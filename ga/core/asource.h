@@ -36,6 +36,7 @@ EXPORT struct AudioBuffer * audio_source_buffer_init();
 EXPORT void audio_source_buffer_fill_one(AudioBuffer *ab, const unsigned char *data, int frames);
 EXPORT void audio_source_buffer_fill(const unsigned char *data, int frames);
 EXPORT int audio_source_buffer_read(AudioBuffer *ab, unsigned char *buf, int frames);
+EXPORT void audio_source_buffer_purge(AudioBuffer *ab);
 EXPORT void audio_source_client_register(long tid, AudioBuffer *ab);
 EXPORT void audio_source_client_unregister(long tid);
 EXPORT int audio_source_client_count();
@@ -16,6 +16,8 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <map>
 
@@ -23,6 +25,9 @@
 #include "vsource.h"
 //#include "filter-rgb2yuv.h"
 #include "encoder-common.h"
+#include "pacer.h"
+#include "recorder.h"
+#include "shm-publish.h"
 //#include "encoder-video.h"
 //#include "encoder-audio.h"
 //#include "encoder-video2.h"
@@ -39,15 +44,50 @@ using namespace std;
 static pthread_rwlock_t encoder_lock = PTHREAD_RWLOCK_INITIALIZER;
 static map<RTSPContext*,RTSPContext*> encoder_clients;
 
-static bool threadLaunched = false;
-static pthread_t vethreadId[IMAGE_SOURCE_CHANNEL_MAX];	// multi-channel support
-static pthread_t aethreadId;
+// encoder states
+enum EncoderState {
+	ENCODER_STOPPED = 0,
+	ENCODER_RUNNING,
+	ENCODER_LINGER		// initialized but idle, waiting for clients
+};
+
+static pthread_mutex_t statemutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t statecond = PTHREAD_COND_INITIALIZER;
+static volatile int encoder_state = ENCODER_STOPPED;
+static int encoder_threads = 0;		// number of live encoder threads
+static struct timeval linger_deadline;
+
+struct encoder_thread_arg {
+	void * (*threadproc)(void *);
+	void *arg;
+};
 
 // for pts sync between encoders
 static pthread_mutex_t syncmutex = PTHREAD_MUTEX_INITIALIZER;
 static bool sync_reset = true;
 static struct timeval synctv;
 
+// for on-demand keyframes
+static pthread_mutex_t kfmutex = PTHREAD_MUTEX_INITIALIZER;
+static bool kf_pending[IMAGE_SOURCE_CHANNEL_MAX][RTSPCONF_TIER_MAX];
+static struct timeval kf_last[IMAGE_SOURCE_CHANNEL_MAX][RTSPCONF_TIER_MAX];
+
+// for runtime reconfiguration
+static pthread_mutex_t reconfmutex = PTHREAD_MUTEX_INITIALIZER;
+static bool reconf_pending[IMAGE_SOURCE_CHANNEL_MAX];
+static struct encoder_reconf reconf_queued[IMAGE_SOURCE_CHANNEL_MAX];
+
+// for rate control
+#define	RATECONTROL_INCREASE_INTERVAL	1000000	// us
+static pthread_mutex_t rcmutex = PTHREAD_MUTEX_INITIALIZER;
+static int rc_applied[IMAGE_SOURCE_CHANNEL_MAX];
+static struct timeval rc_applied_tv[IMAGE_SOURCE_CHANNEL_MAX];
+
+// for statistics
+static pthread_mutex_t statsmutex = PTHREAD_MUTEX_INITIALIZER;
+static bool stats_valid[IMAGE_SOURCE_CHANNEL_MAX][RTSPCONF_TIER_MAX];
+static struct encoder_stats stats[IMAGE_SOURCE_CHANNEL_MAX][RTSPCONF_TIER_MAX];
+
 // list of encoders
 static map<void *, void* (*)(void *)> vencoder;
 static map<void *, void* (*)(void *)> aencoder;
@@ -72,9 +112,107 @@ encoder_pts_sync(int samplerate) {
 	return ret > 0 ? ret : 0;
 }
 
+// the capture time of a pts, in time base tb, from the origin of encoder_pts_sync()
+void
+encoder_pts_time(int64_t pts, AVRational tb, struct timeval *tv) {
+	AVRational us_tb;
+	long long us;
+	//
+	us_tb.num = 1;
+	us_tb.den = 1000000;
+	us = av_rescale_q(pts, tb, us_tb);
+	pthread_mutex_lock(&syncmutex);
+	us += synctv.tv_usec;
+	tv->tv_sec = synctv.tv_sec + us / 1000000;
+	tv->tv_usec = us % 1000000;
+	pthread_mutex_unlock(&syncmutex);
+	if(tv->tv_usec < 0) {
+		tv->tv_sec--;
+		tv->tv_usec += 1000000;
+	}
+	return;
+}
+
 int
 encoder_running() {
-	return threadLaunched ? 1 : 0;
+	return encoder_state == ENCODER_RUNNING ? 1 : 0;
+}
+
+// called by encoder threads when encoder_running() returns 0.
+// it blocks while the encoders linger, and returns 1 if clients are back
+// or 0 if the encoder thread should terminate.
+int
+encoder_linger_wait() {
+	int ret;
+	struct timeval tv;
+	struct timespec to;
+	//
+	pthread_mutex_lock(&statemutex);
+	while(encoder_state == ENCODER_LINGER) {
+		gettimeofday(&tv, NULL);
+		if(tvdiff_us(&linger_deadline, &tv) <= 0) {
+			encoder_state = ENCODER_STOPPED;
+			pthread_cond_broadcast(&statecond);
+			ga_error("encoder: linger period expired, quitting ...\n");
+			break;
+		}
+		to.tv_sec = linger_deadline.tv_sec;
+		to.tv_nsec = linger_deadline.tv_usec * 1000;
+		pthread_cond_timedwait(&statecond, &statemutex, &to);
+	}
+	ret = encoder_state == ENCODER_RUNNING ? 1 : 0;
+	pthread_mutex_unlock(&statemutex);
+	return ret;
+}
+
+static void *
+encoder_thread_wrapper(void *arg) {
+	struct encoder_thread_arg *targ = (struct encoder_thread_arg*) arg;
+	void *ret;
+	//
+	ret = targ->threadproc(targ->arg);
+	free(targ);
+	//
+	pthread_mutex_lock(&statemutex);
+	if(--encoder_threads == 0) {
+		ga_error("encoder: all threads terminated.\n");
+	}
+	pthread_cond_broadcast(&statecond);
+	pthread_mutex_unlock(&statemutex);
+	return ret;
+}
+
+// threads are detached: encoder_unregister_client never has to join them
+static int
+encoder_thread_launch(void * (*threadproc)(void *), void *arg) {
+	pthread_t t;
+	struct encoder_thread_arg *targ;
+	//
+	if((targ = (struct encoder_thread_arg*) malloc(sizeof(*targ))) == NULL)
+		return -1;
+	targ->threadproc = threadproc;
+	targ->arg = arg;
+	pthread_mutex_lock(&statemutex);
+	encoder_threads++;
+	pthread_mutex_unlock(&statemutex);
+	if(pthread_create(&t, NULL, encoder_thread_wrapper, targ) != 0) {
+		pthread_mutex_lock(&statemutex);
+		encoder_threads--;
+		pthread_mutex_unlock(&statemutex);
+		free(targ);
+		return -1;
+	}
+	pthread_detach(t);
+	return 0;
+}
+
+static void
+encoder_set_state(int state) {
+	pthread_mutex_lock(&statemutex);
+	encoder_state = state;
+	pthread_cond_broadcast(&statecond);
+	pthread_mutex_unlock(&statemutex);
+	return;
 }
 
 int
@@ -92,135 +230,527 @@ encoder_register_aencoder(void *(threadproc)(void *), void *arg) {
 int
 encoder_register_client(RTSPContext *rtsp) {
 	int vcount = 0;
+again:
 	pthread_rwlock_wrlock(&encoder_lock);
 	if(encoder_clients.size() == 0) {
 		map<void *, void* (*)(void *)>::iterator mi;
+		//
+		pthread_mutex_lock(&statemutex);
+		if(encoder_state == ENCODER_LINGER) {
+			// encoders are still warm, just wake them up
+			encoder_state = ENCODER_RUNNING;
+			pthread_cond_broadcast(&statecond);
+			pthread_mutex_unlock(&statemutex);
+			ga_error("encoder: resumed from lingering.\n");
+			goto registered;
+		}
+		// wait for threads of the previous run, if they are still quitting.
+		// they may take encoder_lock on their way out, so it is released
+		// meanwhile, and the registration starts over
+		if(encoder_threads > 0) {
+			pthread_rwlock_unlock(&encoder_lock);
+			while(encoder_threads > 0) {
+				pthread_cond_wait(&statecond, &statemutex);
+			}
+			pthread_mutex_unlock(&statemutex);
+			goto again;
+		}
 		// must be set before encoder starts!
-		threadLaunched = true;
+		encoder_state = ENCODER_RUNNING;
+		pthread_mutex_unlock(&statemutex);
+		// reset sync pts
+		pthread_mutex_lock(&syncmutex);
+		sync_reset = true;
+		pthread_mutex_unlock(&syncmutex);
+		// new encoders start with the configured bitrate
+		pthread_mutex_lock(&rcmutex);
+		bzero(rc_applied, sizeof(rc_applied));
+		pthread_mutex_unlock(&rcmutex);
 		// start video encoder threads
 		for(mi = vencoder.begin(); mi != vencoder.end(); mi++) {
-			if(pthread_create(&vethreadId[vcount++], NULL, mi->second,
-					pipeline::lookup((const char *) mi->first)) != 0) {
+			vcount++;
+			if(encoder_thread_launch(mi->second,
+					pipeline::lookup((const char *) mi->first)) < 0) {
+				encoder_set_state(ENCODER_STOPPED);
 				pthread_rwlock_unlock(&encoder_lock);
 				ga_error("encoder-registration: start video encoder thread(%d) failed.\n", vcount);
-				threadLaunched = false;
 				return -1;
 			}
 		}
 		// start audio encoder threads
 		if((mi = aencoder.begin()) != aencoder.end()) {
-			if(pthread_create(&aethreadId, NULL, mi->second, mi->first) != 0) {
+			if(encoder_thread_launch(mi->second, mi->first) < 0) {
+				encoder_set_state(ENCODER_STOPPED);
 				pthread_rwlock_unlock(&encoder_lock);
 				ga_error("encoder-registration: start audio encoder thread failed.\n");
-				threadLaunched = false;
 				return -1;
 			}
 		}
-#if 0
-		for(i = 0; i < video_source_channels(); i++) {
-			char pipename[64];
-			snprintf(pipename, sizeof(pipename), SRCPIPEFORMAT, i);
-			if(pthread_create(&vethreadId[i], NULL, vencoder_thread2,
-					pipeline::lookup(pipename)) != 0) {
-				pthread_rwlock_unlock(&encoder_lock);
-				ga_error("encoder-registration: start video encoder thread(%d) failed.\n", i);
-				threadLaunched = false;
-				return -1;
-			}
-		}
-#ifdef ENABLE_AUDIO
-		if(pthread_create(&aethreadId, NULL, aencoder_thread2, NULL) != 0) {
-			pthread_rwlock_unlock(&encoder_lock);
-			ga_error("encoder-registration: start audio encoder thread failed.\n");
-			threadLaunched = false;
-			return -1;
-		}
-#endif
-#endif
 	}
+registered:
 	encoder_clients[rtsp] = rtsp;
 	ga_error("encoder client registered: total %d clients.\n", encoder_clients.size());
 	pthread_rwlock_unlock(&encoder_lock);
 	return 0;
 }
 
+// never blocks: encoder threads either linger or terminate by themselves
 int
 encoder_unregister_client(RTSPContext *rtsp) {
-	int i;
-	void *ignored;
+	int linger;
 	pthread_rwlock_wrlock(&encoder_lock);
-	encoder_clients.erase(rtsp);
+	if(encoder_clients.erase(rtsp) == 0) {
+		// not registered, e.g., never played
+		pthread_rwlock_unlock(&encoder_lock);
+		return 0;
+	}
 	ga_error("encoder client unregistered: %d clients left.\n", encoder_clients.size());
 	if(encoder_clients.size() == 0) {
-		threadLaunched = false;
-		ga_error("encoder: no more clients, quitting ...\n");
-		for(i = 0; i < video_source_channels(); i++) {
-			pthread_join(vethreadId[i], &ignored);
+		linger = rtspconf_global()->encoder_linger;
+		pthread_mutex_lock(&statemutex);
+		if(linger > 0) {
+			gettimeofday(&linger_deadline, NULL);
+			linger_deadline.tv_sec += linger / 1000;
+			linger_deadline.tv_usec += (linger % 1000) * 1000;
+			if(linger_deadline.tv_usec >= 1000000) {
+				linger_deadline.tv_sec++;
+				linger_deadline.tv_usec -= 1000000;
+			}
+			encoder_state = ENCODER_LINGER;
+			ga_error("encoder: no more clients, lingering for %d ms ...\n", linger);
+		} else {
+			encoder_state = ENCODER_STOPPED;
+			ga_error("encoder: no more clients, quitting ...\n");
+		}
+		pthread_cond_broadcast(&statecond);
+		pthread_mutex_unlock(&statemutex);
+	}
+	pthread_rwlock_unlock(&encoder_lock);
+	return 0;
+}
+
+// ask the video encoder of a channel to make its next frame a keyframe,
+// on a given simulcast tier, or on all tiers if tier < 0.
+// requests are coalesced: a pending request is served at most once
+// per 'video-keyframe-min-interval' milliseconds.
+int
+encoder_keyframe_request(int channelId, int tier) {
+	int i;
+	if(channelId < 0 || channelId >= IMAGE_SOURCE_CHANNEL_MAX
+	|| tier >= RTSPCONF_TIER_MAX)
+		return -1;
+	pthread_mutex_lock(&kfmutex);
+	for(i = 0; i < RTSPCONF_TIER_MAX; i++) {
+		if(tier < 0 || tier == i)
+			kf_pending[channelId][i] = true;
+	}
+	pthread_mutex_unlock(&kfmutex);
+	return 0;
+}
+
+// called by a video encoder before encoding a frame.
+// returns 1 if the frame should be encoded as a keyframe, or 0 otherwise.
+int
+encoder_keyframe_check(int channelId, int tier) {
+	struct timeval tv;
+	long long mininterval;
+	//
+	if(channelId < 0 || channelId >= IMAGE_SOURCE_CHANNEL_MAX
+	|| tier < 0 || tier >= RTSPCONF_TIER_MAX)
+		return 0;
+	pthread_mutex_lock(&kfmutex);
+	if(kf_pending[channelId][tier] == false) {
+		pthread_mutex_unlock(&kfmutex);
+		return 0;
+	}
+	gettimeofday(&tv, NULL);
+	mininterval = 1000LL * rtspconf_global()->video_keyframe_min_interval;
+	if(kf_last[channelId][tier].tv_sec != 0
+	&& tvdiff_us(&tv, &kf_last[channelId][tier]) < mininterval) {
+		// too soon: keep it pending
+		pthread_mutex_unlock(&kfmutex);
+		return 0;
+	}
+	kf_pending[channelId][tier] = false;
+	kf_last[channelId][tier] = tv;
+	pthread_mutex_unlock(&kfmutex);
+	return 1;
+}
+
+// simulcast: the tier a bandwidth estimate (in bps) affords.
+// stepping up needs 25% headroom over the tier bitrate, against oscillation.
+static int
+encoder_tier_choose(int current, int bitrate) {
+	struct RTSPConf *conf = rtspconf_global();
+	int tier, need;
+	for(tier = 0; tier < conf->video_tiers-1; tier++) {
+		need = conf->video_tier_bitrate[tier];
+		if(tier < current)
+			need += need / 4;
+		if(bitrate >= need)
+			break;
+	}
+	return tier;
+}
+
+// simulcast: set the tier a client starts with, before it plays.
+// tier < 0 selects a tier from the client's bandwidth estimate.
+int
+encoder_tier_init(RTSPContext *rtsp, int channelId, int tier) {
+	struct RTSPConf *conf = rtspconf_global();
+	if(channelId < 0 || channelId >= IMAGE_SOURCE_CHANNEL_MAX)
+		return -1;
+	if(tier < 0) {
+		tier = 0;
+		if(rtsp->ratectl[channelId].bitrate > 0)
+			tier = encoder_tier_choose(0, rtsp->ratectl[channelId].bitrate);
+	}
+	if(tier >= conf->video_tiers)
+		tier = conf->video_tiers-1;
+	rtsp->tier[channelId] = rtsp->tier_next[channelId] = tier;
+	return tier;
+}
+
+// simulcast: switch a playing client to another tier.
+// the switch takes place at the next keyframe of the new tier.
+// tier < 0 selects a tier from the client's bandwidth estimate.
+int
+encoder_tier_switch(RTSPContext *rtsp, int channelId, int tier) {
+	struct RTSPConf *conf = rtspconf_global();
+	if(channelId < 0 || channelId >= IMAGE_SOURCE_CHANNEL_MAX)
+		return -1;
+	if(tier < 0) {
+		if(rtsp->ratectl[channelId].bitrate <= 0)
+			return rtsp->tier_next[channelId];
+		tier = encoder_tier_choose(rtsp->tier_next[channelId],
+				rtsp->ratectl[channelId].bitrate);
+	}
+	if(tier >= conf->video_tiers)
+		tier = conf->video_tiers-1;
+	if(tier == rtsp->tier_next[channelId])
+		return tier;
+	ga_error("encoder: session %s, channel %d: switch tier %d -> %d\n",
+		rtsp->session_id ? rtsp->session_id : "-",
+		channelId, rtsp->tier[channelId], tier);
+	rtsp->tier_next[channelId] = tier;
+	encoder_keyframe_request(channelId, tier);
+	return tier;
+}
+
+// returns 1 if the packet resets all references, which is not the case of
+// H.264 keyframes with intra-refresh (recovery points)
+int
+encoder_packet_idr(int codec_id, AVPacket *pkt) {
+	int i;
+	if((pkt->flags & AV_PKT_FLAG_KEY) == 0)
+		return 0;
+	if(codec_id != CODEC_ID_H264)
+		return 1;
+	// annexb: look for an IDR slice
+	for(i = 0; i + 3 < pkt->size; i++) {
+		if(pkt->data[i] == 0 && pkt->data[i+1] == 0 && pkt->data[i+2] == 1) {
+			if((pkt->data[i+3] & 0x1f) == 5)
+				return 1;
+			i += 2;
+		}
+	}
+	return 0;
+}
+
+// copy the parameter sets in front of an H.264 keyframe, i.e., SPS and PPS,
+// each with a 4-byte start code, the form of the extradata of the encoders.
+// returns the number of bytes copied, or 0 if there are none (or no room).
+int
+encoder_packet_headers(int codec_id, AVPacket *pkt, unsigned char *buf, int bufsize) {
+	int i, n, type, start = -1, len = 0;
+	//
+	if(codec_id != CODEC_ID_H264 || (pkt->flags & AV_PKT_FLAG_KEY) == 0)
+		return 0;
+	for(i = 0; i <= pkt->size; i++) {
+		if(i + 2 < pkt->size
+		&& (pkt->data[i] != 0 || pkt->data[i+1] != 0 || pkt->data[i+2] != 1))
+			continue;
+		if(i + 2 >= pkt->size && i < pkt->size)
+			continue;
+		// a NAL unit ends here
+		if(start >= 0) {
+			// leave out the leading zero of a 4-byte start code
+			for(n = i - start; n > 0 && pkt->data[start+n-1] == 0; n--)
+				;
+			if(n > 0) {
+				type = pkt->data[start] & 0x1f;
+				if(type == 1 || type == 5)
+					break;	// the slices follow the headers
+				if(type == 7 || type == 8) {
+					if(len + 4 + n > bufsize)
+						return 0;
+					buf[len] = buf[len+1] = buf[len+2] = 0;
+					buf[len+3] = 1;
+					bcopy(pkt->data + start, buf + len + 4, n);
+					len += 4 + n;
+				}
+			}
+		}
+		start = i + 3;
+		i += 2;
+	}
+	return len;
+}
+
+// simulcast: returns 1 if any playing client receives (or waits for)
+// a tier, i.e., the encoder of the tier has work to do.
+int
+encoder_tier_active(int channelId, int tier) {
+	map<RTSPContext*,RTSPContext*>::iterator mi;
+	int active = 0;
+	// the recorder and shared memory readers take tier 0
+	if(tier == 0 && (rtspconf_global()->record_file != NULL || shm_publish_active()))
+		return 1;
+	while(pthread_rwlock_tryrdlock(&encoder_lock) != 0) {
+		if(encoder_state != ENCODER_RUNNING)
+			return 0;	// clients are leaving
+	}
+	for(mi = encoder_clients.begin(); mi != encoder_clients.end(); mi++) {
+		if(mi->second->state != SERVER_STATE_PLAYING)
+			continue;
+		if(mi->second->tier[channelId] == tier
+		|| mi->second->tier_next[channelId] == tier) {
+			active = 1;
+			break;
 		}
-#ifdef ENABLE_AUDIO
-		pthread_join(aethreadId, &ignored);
-#endif
-		ga_error("encoder: all threads terminated.\n");
-		// reset sync pts
-		pthread_mutex_lock(&syncmutex);
-		sync_reset = true;
-		pthread_mutex_unlock(&syncmutex);
 	}
 	pthread_rwlock_unlock(&encoder_lock);
+	return active;
+}
+
+// queue a reconfiguration request for the video encoder of a channel.
+// requests made before the encoder picks them up are merged.
+int
+encoder_reconf_request(int channelId, const struct encoder_reconf *reconf) {
+	struct encoder_reconf *q;
+	if(channelId < 0 || channelId >= IMAGE_SOURCE_CHANNEL_MAX || reconf == NULL)
+		return -1;
+	pthread_mutex_lock(&reconfmutex);
+	q = &reconf_queued[channelId];
+	if(reconf_pending[channelId] == false) {
+		bzero(q, sizeof(*q));
+		reconf_pending[channelId] = true;
+	}
+	if(reconf->bitrateKbps > 0)
+		q->bitrateKbps = reconf->bitrateKbps;
+	if(reconf->bufsize > 0)
+		q->bufsize = reconf->bufsize;
+	if(reconf->framerate > 0)
+		q->framerate = reconf->framerate;
+	if(reconf->preset[0] != '\0')
+		strncpy(q->preset, reconf->preset, ENCODER_PRESET_MAXLEN);
+	q->preset[ENCODER_PRESET_MAXLEN-1] = '\0';
+	pthread_mutex_unlock(&reconfmutex);
 	return 0;
 }
 
+// called by a video encoder between frames.
+// returns 1 and fills 'reconf' if there is a pending request, or 0 otherwise.
+int
+encoder_reconf_fetch(int channelId, struct encoder_reconf *reconf) {
+	if(channelId < 0 || channelId >= IMAGE_SOURCE_CHANNEL_MAX)
+		return 0;
+	pthread_mutex_lock(&reconfmutex);
+	if(reconf_pending[channelId] == false) {
+		pthread_mutex_unlock(&reconfmutex);
+		return 0;
+	}
+	*reconf = reconf_queued[channelId];
+	reconf_pending[channelId] = false;
+	pthread_mutex_unlock(&reconfmutex);
+	return 1;
+}
+
+// published by video encoders, e.g., once per second
+void
+encoder_stats_update(int channelId, int tier, const struct encoder_stats *st) {
+	if(channelId < 0 || channelId >= IMAGE_SOURCE_CHANNEL_MAX
+	|| tier < 0 || tier >= RTSPCONF_TIER_MAX)
+		return;
+	pthread_mutex_lock(&statsmutex);
+	stats[channelId][tier] = *st;
+	stats_valid[channelId][tier] = true;
+	pthread_mutex_unlock(&statsmutex);
+	return;
+}
+
+// returns 1 and fills 'st' if the encoder has published statistics, or 0 otherwise
+int
+encoder_stats_get(int channelId, int tier, struct encoder_stats *st) {
+	int ret = 0;
+	if(channelId < 0 || channelId >= IMAGE_SOURCE_CHANNEL_MAX
+	|| tier < 0 || tier >= RTSPCONF_TIER_MAX)
+		return 0;
+	pthread_mutex_lock(&statsmutex);
+	if(stats_valid[channelId][tier]) {
+		*st = stats[channelId][tier];
+		ret = 1;
+	}
+	pthread_mutex_unlock(&statsmutex);
+	return ret;
+}
+
+// a shared encoder serves all clients, so it follows the lowest estimate.
+// decreases are applied at once, increases at most once per second,
+// and changes below 10% are ignored.
+int
+encoder_ratecontrol_update(int channelId) {
+	map<RTSPContext*,RTSPContext*>::iterator mi;
+	struct encoder_reconf reconf;
+	struct timeval tv;
+	int minrate = 0;
+	//
+	if(channelId < 0 || channelId >= IMAGE_SOURCE_CHANNEL_MAX)
+		return -1;
+	// simulcast tiers keep their bitrates, clients switch tiers instead
+	if(rtspconf_global()->video_tiers > 1)
+		return 0;
+	pthread_rwlock_rdlock(&encoder_lock);
+	for(mi = encoder_clients.begin(); mi != encoder_clients.end(); mi++) {
+		int rate = mi->second->ratectl[channelId].bitrate;
+		if(mi->second->state != SERVER_STATE_PLAYING || rate <= 0)
+			continue;
+		if(minrate == 0 || rate < minrate)
+			minrate = rate;
+	}
+	pthread_rwlock_unlock(&encoder_lock);
+	if(minrate <= 0)
+		return 0;
+	//
+	gettimeofday(&tv, NULL);
+	pthread_mutex_lock(&rcmutex);
+	if(rc_applied[channelId] > 0) {
+		int diff = minrate - rc_applied[channelId];
+		if(diff < 0)
+			diff = -diff;
+		if(diff < rc_applied[channelId] / 10
+		|| (minrate > rc_applied[channelId]
+		 && tvdiff_us(&tv, &rc_applied_tv[channelId]) < RATECONTROL_INCREASE_INTERVAL)) {
+			pthread_mutex_unlock(&rcmutex);
+			return 0;
+		}
+	}
+	rc_applied[channelId] = minrate;
+	rc_applied_tv[channelId] = tv;
+	pthread_mutex_unlock(&rcmutex);
+	//
+	bzero(&reconf, sizeof(reconf));
+	reconf.bitrateKbps = minrate / 1000;
+	ga_error("encoder: rate control sets channel %d to %d kbps.\n",
+		channelId, reconf.bitrateKbps);
+	return encoder_reconf_request(channelId, &reconf);
+}
+
 int
 encoder_send_packet(const char *prefix, RTSPContext *rtsp, int channelId, AVPacket *pkt, int64_t encoderPts) {
+	int iolen, err;
+	uint8_t *iobuf;
+	//
 	if(rtsp->fmtctx[channelId] == NULL) {
 		// not initialized - disabled?
 		return 0;
 	}
 	if(encoderPts != (int64_t) AV_NOPTS_VALUE) {
 		pkt->pts = av_rescale_q(encoderPts,
-				rtsp->encoder[channelId]->time_base,
+				rtsp->stream[channelId]->codec->time_base,
 				rtsp->stream[channelId]->time_base);
 	}
-	if(rtsp->lower_transport[channelId] == RTSP_LOWER_TRANSPORT_TCP) {
-		//if(avio_open_dyn_buf(&rtsp->fmtctx[channelId]->pb) < 0)
-		if(ffio_open_dyn_packet_buf(&rtsp->fmtctx[channelId]->pb, RTSP_TCP_MAX_PACKET_SIZE) < 0) {
-			ga_error("%s: buffer allocation failed.\n", prefix);
-			return -1;
-		}
+	if(ffio_open_dyn_packet_buf(&rtsp->fmtctx[channelId]->pb, rtsp->max_packet_size[channelId]) < 0) {
+		ga_error("%s: buffer allocation failed.\n", prefix);
+		return -1;
 	}
 	if(av_write_frame(rtsp->fmtctx[channelId], pkt) != 0) {
 		ga_error("%s: write failed.\n", prefix);
 		return -1;
 	}
-	if(rtsp->lower_transport[channelId] == RTSP_LOWER_TRANSPORT_TCP) {
-		int iolen;
-		uint8_t *iobuf;
-		iolen = avio_close_dyn_buf(rtsp->fmtctx[channelId]->pb, &iobuf);
-		if(rtsp_write_bindata(rtsp, channelId, iobuf, iolen) < 0) {
-			av_free(iobuf);
-			ga_error("%s: write failed.\n", prefix);
-			return -1;
-		}
-		av_free(iobuf);
+	iolen = avio_close_dyn_buf(rtsp->fmtctx[channelId]->pb, &iobuf);
+	rtsp->fmtctx[channelId]->pb = NULL;
+	// sender reports map RTP timestamps to the capture clock, not to
+	// the time packets leave, which differs among streams and is paced
+	if(pkt->pts != (int64_t) AV_NOPTS_VALUE) {
+		struct timeval captured;
+		encoder_pts_time(pkt->pts, rtsp->stream[channelId]->time_base, &captured);
+		rtsp_write_captured(rtsp, channelId, iobuf, iolen, &captured);
+	}
+	// video packets may be paced, spread over the frame interval
+	if(rtsp->pacer != NULL && channelId < video_source_channels()) {
+		pacer_set_rate(rtsp->pacer, channelId,
+			rtsp->ratectl[channelId].bitrate > 0 ?
+				rtsp->ratectl[channelId].bitrate :
+				rtspconf_global()->video_tier_bitrate[rtsp->tier[channelId]]);
+		err = pacer_enqueue(rtsp->pacer, channelId, iobuf, iolen);
+	} else {
+		err = rtsp_write_bindata(rtsp, channelId, iobuf, iolen);
+	}
+	av_free(iobuf);
+	if(err < 0) {
+		ga_error("%s: write failed.\n", prefix);
+		return -1;
+	}
+	// report time-to-first-frame
+	if(rtsp->ttff_pending[channelId] && (pkt->flags & AV_PKT_FLAG_KEY)) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		rtsp->ttff_pending[channelId] = 0;
+		ga_error("%s: time-to-first-frame (session %s, channel %d) = %.3f ms\n",
+			prefix, rtsp->session_id ? rtsp->session_id : "-",
+			channelId, 0.001 * tvdiff_us(&tv, &rtsp->play_tv));
 	}
 	return 0;
 }
 
 int
 encoder_send_packet_all(const char *prefix, int channelId, AVPacket *pkt, int64_t encoderPts) {
+	return encoder_send_packet_tier(prefix, channelId, 0, pkt, encoderPts);
+}
+
+// deliver a packet of a simulcast tier to the clients receiving it.
+// a client waiting for a switch joins the new tier at its keyframe.
+int
+encoder_send_packet_tier(const char *prefix, int channelId, int tier, AVPacket *pkt, int64_t encoderPts) {
 	map<RTSPContext*,RTSPContext*>::iterator mi;
+	RTSPContext *rtsp;
+	int idr = -1;
+	//
+	if(tier == 0) {
+		recorder_write(channelId, pkt, encoderPts);
+		shm_publish_write(channelId, pkt, encoderPts);
+	}
 	//pthread_rwlock_rdlock(&encoder_lock);
 again:
 	if(pthread_rwlock_tryrdlock(&encoder_lock) != 0) {
-		if(threadLaunched == false)
-			return -1;
+		if(encoder_state != ENCODER_RUNNING)
+			return 0;	// clients are leaving, drop it
 		goto again;
 	}
 	for(mi = encoder_clients.begin(); mi != encoder_clients.end(); mi++) {
-		if(mi->second->state != SERVER_STATE_PLAYING)
+		rtsp = mi->second;
+		if(rtsp->state != SERVER_STATE_PLAYING)
+			continue;
+		// only the encoder of the new tier changes rtsp->tier, at an IDR
+		// frame: a recovery point refers to frames the client never got.
+		// the lock is shared, so the switch is an atomic store.
+		if(rtsp->tier_next[channelId] == tier
+		&& rtsp->tier[channelId] != tier
+		&& (pkt->flags & AV_PKT_FLAG_KEY)) {
+			int current = rtsp->tier[channelId];
+			if(idr < 0)
+				idr = encoder_packet_idr(rtspconf_global()->video_encoder_codec->id, pkt);
+			if(idr > 0 && __sync_bool_compare_and_swap(&rtsp->tier[channelId], current, tier)) {
+				ga_error("%s: session %s, channel %d: now on tier %d\n",
+					prefix, rtsp->session_id ? rtsp->session_id : "-",
+					channelId, tier);
+			}
+		}
+		if(rtsp->tier[channelId] != tier)
 			continue;
-		if(encoder_send_packet(prefix, mi->second, channelId, pkt, encoderPts) < 0) {
-			//rtsp_cleanup(mi->second, -1);
+		if(encoder_send_packet(prefix, rtsp, channelId, pkt, encoderPts) < 0) {
+			//rtsp_cleanup(rtsp, -1);
 		}
 	}
 	pthread_rwlock_unlock(&encoder_lock);
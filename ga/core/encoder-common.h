@@ -24,13 +24,55 @@
 #include "ga-avcodec.h"
 
 EXPORT int encoder_pts_sync(int samplerate);
+EXPORT void encoder_pts_time(int64_t pts, AVRational tb, struct timeval *tv);
 EXPORT int encoder_running();
+EXPORT int encoder_linger_wait();
 EXPORT int encoder_register_vencoder(void* (*threadproc)(void *), void *arg);
 EXPORT int encoder_register_aencoder(void* (*threadproc)(void *), void *arg);
 EXPORT int encoder_register_client(RTSPContext *rtsp);
 EXPORT int encoder_unregister_client(RTSPContext *rtsp);
 
+EXPORT int encoder_keyframe_request(int channelId, int tier);
+EXPORT int encoder_keyframe_check(int channelId, int tier);
+
+EXPORT int encoder_tier_init(RTSPContext *rtsp, int channelId, int tier);
+EXPORT int encoder_tier_switch(RTSPContext *rtsp, int channelId, int tier);
+EXPORT int encoder_tier_active(int channelId, int tier);
+EXPORT int encoder_packet_idr(int codec_id, AVPacket *pkt);
+EXPORT int encoder_packet_headers(int codec_id, AVPacket *pkt, unsigned char *buf, int bufsize);
+
+// runtime reconfiguration of video encoders; zero (or empty) fields are unchanged
+#define	ENCODER_PRESET_MAXLEN	32
+struct encoder_reconf {
+	int bitrateKbps;	// target bitrate, in kbps
+	int bufsize;		// VBV buffer size, in kbits
+	int framerate;		// output frame rate, no more than the capture rate
+	char preset[ENCODER_PRESET_MAXLEN];
+};
+
+EXPORT int encoder_reconf_request(int channelId, const struct encoder_reconf *reconf);
+EXPORT int encoder_reconf_fetch(int channelId, struct encoder_reconf *reconf);
+
+EXPORT int encoder_ratecontrol_update(int channelId);
+
+// per-encoder statistics, exported through the encoder control socket
+#define	ENCODER_SIZE_BUCKETS	6
+struct encoder_stats {
+	int speed;		// speed tier of the encode-time governor, -1 - not governed
+	char preset[ENCODER_PRESET_MAXLEN];
+	int encode_us;		// smoothed encoding time per frame, in us
+	int budget_us;		// encoding time budget per frame, in us
+	// frame sizes, in multiples of the average: < 1/2, 1, 2, 4, 8, and above
+	unsigned int sizehist[ENCODER_SIZE_BUCKETS];
+	unsigned int capped;	// frames over the cap
+	unsigned int reencoded;	// keyframes encoded again to fit the cap
+};
+
+EXPORT void encoder_stats_update(int channelId, int tier, const struct encoder_stats *stats);
+EXPORT int encoder_stats_get(int channelId, int tier, struct encoder_stats *stats);
+
 EXPORT int encoder_send_packet(const char *prefix, struct RTSPContext *rtsp, int channelId, AVPacket *pkt, int64_t encoderPts);
 EXPORT int encoder_send_packet_all(const char *prefix, int channelId, AVPacket *pkt, int64_t encoderPts);
+EXPORT int encoder_send_packet_tier(const char *prefix, int channelId, int tier, AVPacket *pkt, int64_t encoderPts);
 
 #endif
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#endif
+
+#include "vsource.h"
+#include "encoder-common.h"
+#include "encoder-control.h"
+#include "pacer.h"
+#include "ioengine.h"
+#include "recorder.h"
+#include "shm-publish.h"
+
+#include "ga-common.h"
+
+#define	DELIM	" \t\r\n"
+
+static const char *helpmsg =
+	"reconf <channel|all> [bitrate=<kbps>] [vbv=<kbits>] [fps=<fps>] [preset=<name>]\n"
+	"stats\n"
+	"help\n"
+	"quit\n";
+
+static int
+encoder_control_reconf(char *args, char *reply, int replylen) {
+	struct encoder_reconf reconf;
+	char *token, *value, *saveptr;
+	int i, channel;
+	//
+	bzero(&reconf, sizeof(reconf));
+	if((token = strtok_r(args, DELIM, &saveptr)) == NULL) {
+		snprintf(reply, replylen, "ERROR: no channel specified.\n");
+		return -1;
+	}
+	if(strcmp(token, "all") == 0) {
+		channel = -1;
+	} else {
+		channel = strtol(token, NULL, 0);
+		if(channel < 0 || channel >= video_source_channels()) {
+			snprintf(reply, replylen, "ERROR: invalid channel %s.\n", token);
+			return -1;
+		}
+	}
+	while((token = strtok_r(NULL, DELIM, &saveptr)) != NULL) {
+		if((value = strchr(token, '=')) == NULL) {
+			snprintf(reply, replylen, "ERROR: bad parameter '%s'.\n", token);
+			return -1;
+		}
+		*value++ = '\0';
+		if(strcmp(token, "bitrate") == 0) {
+			reconf.bitrateKbps = strtol(value, NULL, 0);
+		} else if(strcmp(token, "vbv") == 0) {
+			reconf.bufsize = strtol(value, NULL, 0);
+		} else if(strcmp(token, "fps") == 0) {
+			reconf.framerate = strtol(value, NULL, 0);
+		} else if(strcmp(token, "preset") == 0) {
+			strncpy(reconf.preset, value, ENCODER_PRESET_MAXLEN);
+			reconf.preset[ENCODER_PRESET_MAXLEN-1] = '\0';
+		} else {
+			snprintf(reply, replylen, "ERROR: unknown parameter '%s'.\n", token);
+			return -1;
+		}
+	}
+	if(reconf.bitrateKbps < 0 || reconf.bufsize < 0 || reconf.framerate < 0) {
+		snprintf(reply, replylen, "ERROR: negative value.\n");
+		return -1;
+	}
+	for(i = 0; i < video_source_channels(); i++) {
+		if(channel >= 0 && channel != i)
+			continue;
+		encoder_reconf_request(i, &reconf);
+	}
+	ga_error("encoder control: reconf channel %d: bitrate=%d kbps, vbv=%d kbits, fps=%d, preset=%s\n",
+		channel, reconf.bitrateKbps, reconf.bufsize, reconf.framerate,
+		reconf.preset[0] ? reconf.preset : "-");
+	snprintf(reply, replylen, "OK\n");
+	return 0;
+}
+
+// one line per running video encoder, one per paced session, the figures
+// of the I/O engine, one line per stream of each session, the recorder,
+// and the shared memory publisher
+static int
+encoder_control_stats(char *reply, int replylen) {
+	struct encoder_stats st;
+	int ch, tier, len = 0;
+	//
+	for(ch = 0; ch < video_source_channels(); ch++) {
+		for(tier = 0; tier < rtspconf_global()->video_tiers; tier++) {
+			if(encoder_stats_get(ch, tier, &st) == 0)
+				continue;
+			len += snprintf(reply + len, replylen - len,
+				"channel %d tier %d: speed=%d preset=%s encode=%d us budget=%d us"
+				" sizes=%u/%u/%u/%u/%u/%u capped=%u reencoded=%u\n",
+				ch, tier, st.speed, st.preset[0] ? st.preset : "-",
+				st.encode_us, st.budget_us,
+				st.sizehist[0], st.sizehist[1], st.sizehist[2],
+				st.sizehist[3], st.sizehist[4], st.sizehist[5],
+				st.capped, st.reencoded);
+			if(len >= replylen)
+				return 0;
+		}
+	}
+	len += pacer_report(reply + len, replylen - len);
+	if(len >= replylen)
+		return 0;
+	len += ioengine_report(reply + len, replylen - len);
+	if(len >= replylen)
+		return 0;
+	len += rtsp_stats_report(reply + len, replylen - len);
+	if(len >= replylen)
+		return 0;
+	len += recorder_report(reply + len, replylen - len);
+	if(len >= replylen)
+		return 0;
+	len += shm_publish_report(reply + len, replylen - len);
+	if(len >= replylen)
+		return 0;
+	len += pipeline::report(reply + len, replylen - len);
+	if(len >= replylen)
+		return 0;
+	snprintf(reply + len, replylen - len, "OK\n");
+	return 0;
+}
+
+// returns 0 on success, -1 on error, or 1 if the connection should be closed
+int
+encoder_control_exec(const char *cmdline, char *reply, int replylen) {
+	char buf[ENCODER_CONTROL_MAX_LINE], *cmd, *saveptr;
+	//
+	strncpy(buf, cmdline, sizeof(buf));
+	buf[sizeof(buf)-1] = '\0';
+	if((cmd = strtok_r(buf, DELIM, &saveptr)) == NULL) {
+		reply[0] = '\0';
+		return 0;
+	}
+	if(strcmp(cmd, "reconf") == 0) {
+		return encoder_control_reconf(saveptr, reply, replylen);
+	} else if(strcmp(cmd, "stats") == 0) {
+		return encoder_control_stats(reply, replylen);
+	} else if(strcmp(cmd, "help") == 0) {
+		snprintf(reply, replylen, "%sOK\n", helpmsg);
+		return 0;
+	} else if(strcmp(cmd, "quit") == 0) {
+		snprintf(reply, replylen, "OK\n");
+		return 1;
+	}
+	snprintf(reply, replylen, "ERROR: unknown command '%s'.\n", cmd);
+	return -1;
+}
+
+void *
+encoder_control_thread(void *rtspconf) {
+#ifdef WIN32
+	ga_error("encoder control: unix domain socket is not supported.\n");
+	return NULL;
+#else
+	struct RTSPConf *conf = (struct RTSPConf*) rtspconf;
+	struct sockaddr_un sun;
+	struct stat sb;
+	char line[ENCODER_CONTROL_MAX_LINE], reply[ENCODER_CONTROL_MAX_REPLY];
+	int s, fd;
+	FILE *fp;
+	//
+	if(conf->encoder_control == NULL) {
+		ga_error("encoder control: no socket specified, terminated.\n");
+		return NULL;
+	}
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if(strlen(conf->encoder_control) >= sizeof(sun.sun_path)) {
+		ga_error("encoder control: socket path too long (%s), terminated.\n",
+			conf->encoder_control);
+		return NULL;
+	}
+	strcpy(sun.sun_path, conf->encoder_control);
+	if((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		ga_error("encoder control: socket failed - %s.\n", strerror(errno));
+		return NULL;
+	}
+	// a socket left by a previous run; anything else is not ours
+	if(lstat(sun.sun_path, &sb) == 0) {
+		if(!S_ISSOCK(sb.st_mode)) {
+			ga_error("encoder control: %s exists and is not a socket, terminated.\n",
+				sun.sun_path);
+			close(s);
+			return NULL;
+		}
+		unlink(sun.sun_path);
+	}
+	if(bind(s, (struct sockaddr*) &sun, sizeof(sun)) < 0) {
+		ga_error("encoder control: bind %s failed - %s.\n",
+			sun.sun_path, strerror(errno));
+		close(s);
+		return NULL;
+	}
+	if(listen(s, 4) < 0) {
+		ga_error("encoder control: listen failed - %s.\n", strerror(errno));
+		close(s);
+		return NULL;
+	}
+	ga_error("encoder control: listening on %s, tid=%ld.\n",
+		sun.sun_path, ga_gettid());
+	// handle one client at a time
+	while(true) {
+		if((fd = accept(s, NULL, NULL)) < 0) {
+			if(errno == EINTR)
+				continue;
+			ga_error("encoder control: accept failed - %s.\n", strerror(errno));
+			break;
+		}
+		if((fp = fdopen(fd, "r+")) == NULL) {
+			close(fd);
+			continue;
+		}
+		while(fgets(line, sizeof(line), fp) != NULL) {
+			int ret = encoder_control_exec(line, reply, sizeof(reply));
+			if(reply[0] != '\0') {
+				fputs(reply, fp);
+				fflush(fp);
+			}
+			if(ret > 0)
+				break;
+		}
+		fclose(fp);
+	}
+	close(s);
+	ga_error("encoder control: terminated.\n");
+	return NULL;
+#endif
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __ENCODER_CONTROL_H__
+#define __ENCODER_CONTROL_H__
+
+#include "rtspconf.h"
+
+#define	ENCODER_CONTROL_MAX_LINE	1024
+#define	ENCODER_CONTROL_MAX_REPLY	65536	/* stats of all sessions */
+
+// the encoder control server accepts text commands from a local socket,
+// one command per line, and replies 'OK' or 'ERROR: <reason>'.
+//	reconf <channel|all> [bitrate=<kbps>] [vbv=<kbits>] [fps=<fps>] [preset=<name>]
+//	stats
+//	help
+//	quit
+EXPORT	int	encoder_control_exec(const char *cmdline, char *reply, int replylen);
+EXPORT	void*	encoder_control_thread(void *rtspconf);
+
+#endif
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+
+#include <list>
+
+#include "rtspconf.h"
+#include "encoder-common.h"
+#include "encoder-sched.h"
+
+using namespace std;
+
+#define	SCHED_SHARED_INTERVAL	10000	// us, polls pipelines fed by other processes
+#define	SCHED_OWNER_INTERVAL	100000	// us, owners poll for the encoder state
+
+struct encoder_sched_job {
+	pipeline *pipe;
+	long owner;			// thread id of the encoder attached
+	encoder_sched_encode_t encode;
+	void *ctx;
+	long long interval;		// frame interval, in us
+	struct pooldata *pending;	// the next frame to encode
+	struct timeval deadline;	// of the pending frame
+	bool busy;			// being encoded by a worker
+	bool failed;
+	// accounting
+	long long cost;			// smoothed encoding time per frame, in us
+	long long cost_max;
+	unsigned int frames;
+	unsigned int dropped;
+};
+
+static pthread_mutex_t schedmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t schedcond = PTHREAD_COND_INITIALIZER;	// frames arrived
+static pthread_cond_t donecond = PTHREAD_COND_INITIALIZER;	// a frame has been encoded
+static list<struct encoder_sched_job*> jobs;
+static int workers = 0;		// number of running workers
+static int shared = 0;		// jobs whose frames come from other processes
+
+static void
+sched_abstime(struct timespec *to, long long us) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	us += tv.tv_usec;
+	to->tv_sec = tv.tv_sec + us / 1000000;
+	to->tv_nsec = (us % 1000000) * 1000;
+	return;
+}
+
+// a frame should be encoded before the next one arrives, counted from when
+// the frame was stored into the pipe, not from when a worker is free
+static void
+sched_deadline(struct encoder_sched_job *job, struct timeval *now) {
+	long long us = job->pending->stored;
+	if(us <= 0)
+		us = now->tv_sec * 1000000LL + now->tv_usec;
+	us += job->interval;
+	job->deadline.tv_sec = us / 1000000;
+	job->deadline.tv_usec = us % 1000000;
+	return;
+}
+
+// fair share of the pool per frame: a job never runs on more than one worker
+static long long
+sched_budget(struct encoder_sched_job *job) {
+	if((int) jobs.size() <= workers)
+		return job->interval;
+	return job->interval * workers / jobs.size();
+}
+
+// pick the job with the earliest deadline; must be called with schedmutex locked
+static struct encoder_sched_job *
+sched_pick() {
+	list<struct encoder_sched_job*>::iterator li;
+	struct encoder_sched_job *job, *best = NULL;
+	struct pooldata *data;
+	struct timeval now;
+	long long slack, bestslack = 0;
+	//
+	if(encoder_running() == 0)
+		return NULL;
+	gettimeofday(&now, NULL);
+	for(li = jobs.begin(); li != jobs.end(); li++) {
+		job = *li;
+		if(job->busy || job->failed)
+			continue;
+		if(job->pending == NULL) {
+			if((job->pending = job->pipe->load_data()) == NULL)
+				continue;
+			sched_deadline(job, &now);
+		}
+		// a frame missed its deadline: skip to the newest one, if any
+		while(tvdiff_us(&now, &job->deadline) > 0
+		&& (data = job->pipe->load_data()) != NULL) {
+			job->pipe->release_data(job->pending);
+			job->pending = data;
+			sched_deadline(job, &now);
+			job->dropped++;
+		}
+		slack = tvdiff_us(&job->deadline, &now);
+		// encoders over their budget yield to the others
+		if(job->cost > sched_budget(job))
+			slack += job->interval;
+		if(best == NULL || slack < bestslack) {
+			best = job;
+			bestslack = slack;
+		}
+	}
+	return best;
+}
+
+static void *
+sched_worker(void *arg) {
+	struct encoder_sched_job *job;
+	struct pooldata *data;
+	struct timeval tv1, tv2;
+	struct timespec to;
+	long long cost;
+	int ret;
+	//
+	ga_error("encoder-sched: worker started (tid=%ld).\n", ga_gettid());
+	pthread_mutex_lock(&schedmutex);
+	while(true) {
+		if((job = sched_pick()) == NULL) {
+			// producers signal schedcond with schedmutex held, so
+			// frames stored after sched_pick() are not missed.
+			// producers in other processes cannot signal it.
+			if(shared > 0) {
+				sched_abstime(&to, SCHED_SHARED_INTERVAL);
+				pthread_cond_timedwait(&schedcond, &schedmutex, &to);
+			} else {
+				pthread_cond_wait(&schedcond, &schedmutex);
+			}
+			continue;
+		}
+		data = job->pending;
+		job->pending = NULL;
+		job->busy = true;
+		pthread_mutex_unlock(&schedmutex);
+		//
+		gettimeofday(&tv1, NULL);
+		ret = job->encode(job->ctx, data);
+		gettimeofday(&tv2, NULL);
+		cost = tvdiff_us(&tv2, &tv1);
+		//
+		pthread_mutex_lock(&schedmutex);
+		job->busy = false;
+		job->cost = job->frames == 0 ? cost : (7 * job->cost + cost) / 8;
+		if(cost > job->cost_max)
+			job->cost_max = cost;
+		job->frames++;
+		if(ret < 0) {
+			job->failed = true;
+		}
+		pthread_cond_broadcast(&donecond);
+	}
+	pthread_mutex_unlock(&schedmutex);
+	return NULL;
+}
+
+// returns the size of the worker pool, or 0 if each encoder runs its own thread
+int
+encoder_sched_workers() {
+	return rtspconf_global()->encoder_workers;
+}
+
+// attach an encoder to the pool.  frames from pipe are passed to encode(ctx, data)
+// by the workers until the encoder is detached, at most one frame at a time.
+struct encoder_sched_job *
+encoder_sched_attach(pipeline *pipe, int fps, encoder_sched_encode_t encode, void *ctx) {
+	struct encoder_sched_job *job;
+	pthread_t t;
+	//
+	if((job = (struct encoder_sched_job*) malloc(sizeof(*job))) == NULL) {
+		ga_error("encoder-sched: alloc job failed.\n");
+		return NULL;
+	}
+	bzero(job, sizeof(*job));
+	job->pipe = pipe;
+	job->owner = ga_gettid();
+	job->encode = encode;
+	job->ctx = ctx;
+	job->interval = 1000000LL / (fps > 0 ? fps : 1);
+	//
+	pthread_mutex_lock(&schedmutex);
+	// workers are started once, and serve all later runs
+	while(workers < encoder_sched_workers()) {
+		if(pthread_create(&t, NULL, sched_worker, NULL) != 0) {
+			ga_error("encoder-sched: start worker(%d) failed.\n", workers);
+			break;
+		}
+		pthread_detach(t);
+		workers++;
+	}
+	if(workers == 0) {
+		pthread_mutex_unlock(&schedmutex);
+		free(job);
+		return NULL;
+	}
+	jobs.push_back(job);
+	if(pipe->shared())
+		shared++;
+	ga_error("encoder-sched: '%s' attached, %d encoders on %d workers.\n",
+		pipe->name(), jobs.size(), workers);
+	pthread_mutex_unlock(&schedmutex);
+	//
+	pipe->client_register(job->owner, &schedcond, &schedmutex);
+	return job;
+}
+
+// called by the owner of a job: blocks until the encoders stop running (returns 0),
+// or the job has failed (returns -1)
+int
+encoder_sched_wait(struct encoder_sched_job *job) {
+	struct timespec to;
+	int ret;
+	//
+	pthread_mutex_lock(&schedmutex);
+	while(job->failed == false && encoder_running()) {
+		sched_abstime(&to, SCHED_OWNER_INTERVAL);
+		pthread_cond_timedwait(&donecond, &schedmutex, &to);
+	}
+	ret = job->failed ? -1 : 0;
+	pthread_mutex_unlock(&schedmutex);
+	return ret;
+}
+
+// drop all queued frames, e.g., those captured while lingering
+void
+encoder_sched_flush(struct encoder_sched_job *job) {
+	struct pooldata *data;
+	//
+	pthread_mutex_lock(&schedmutex);
+	while(job->busy) {
+		pthread_cond_wait(&donecond, &schedmutex);
+	}
+	if(job->pending != NULL) {
+		job->pipe->release_data(job->pending);
+		job->pending = NULL;
+	}
+	while((data = job->pipe->load_data()) != NULL) {
+		job->pipe->release_data(data);
+	}
+	pthread_mutex_unlock(&schedmutex);
+	return;
+}
+
+// waits for the frame in progress, if any; the job is freed
+void
+encoder_sched_detach(struct encoder_sched_job *job) {
+	job->pipe->client_unregister(job->owner);
+	//
+	pthread_mutex_lock(&schedmutex);
+	while(job->busy) {
+		pthread_cond_wait(&donecond, &schedmutex);
+	}
+	ga_error("encoder-sched: '%s' detached, %u frames encoded, %u dropped, %lld/%lld us per frame (avg/max, budget %lld us).\n",
+		job->pipe->name(), job->frames, job->dropped,
+		job->cost, job->cost_max, sched_budget(job));
+	jobs.remove(job);
+	if(job->pipe->shared())
+		shared--;
+	if(job->pending != NULL) {
+		job->pipe->release_data(job->pending);
+		job->pending = NULL;
+	}
+	pthread_mutex_unlock(&schedmutex);
+	free(job);
+	return;
+}
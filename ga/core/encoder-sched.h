@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __ENCODER_SCHED_H__
+#define __ENCODER_SCHED_H__
+
+#include "ga-common.h"
+#include "pipeline.h"
+
+// a shared pool of encoding workers.  each video encoder attaches its
+// source pipeline and a per-frame callback; idle workers take the pending
+// frame with the earliest deadline among all attached encoders.
+
+// returns 0 if frames have been consumed (and released), or -1 if the encoder failed
+typedef int (*encoder_sched_encode_t)(void *ctx, struct pooldata *data);
+
+struct encoder_sched_job;
+
+EXPORT int encoder_sched_workers();
+EXPORT struct encoder_sched_job * encoder_sched_attach(pipeline *pipe, int fps, encoder_sched_encode_t encode, void *ctx);
+EXPORT int encoder_sched_wait(struct encoder_sched_job *job);
+EXPORT void encoder_sched_flush(struct encoder_sched_job *job);
+EXPORT void encoder_sched_detach(struct encoder_sched_job *job);
+
+#endif
@@ -135,6 +135,20 @@ ga_gettid() {
 #endif
 }
 
+// number of online processors, at least 1
+int
+ga_cpu_count() {
+	int n;
+#ifdef WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	n = si.dwNumberOfProcessors;
+#else
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return n > 0 ? n : 1;
+}
+
 static int
 winsock_init() {
 #ifdef WIN32
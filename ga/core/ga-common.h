@@ -59,6 +59,7 @@ EXPORT int	ga_error(const char *fmt, ...);
 //	*ptr+*alignment = start at an aligned address with size s
 EXPORT int	ga_malloc(int size, void **ptr, int *alignment);
 EXPORT long	ga_gettid();
+EXPORT int	ga_cpu_count();
 EXPORT int	ga_init(const char *config, const char *url);
 EXPORT void	ga_deinit();
 EXPORT void	ga_openlog();
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __GA_SHM_H__
+#define __GA_SHM_H__
+
+// layout of the shared-memory packet ring, shared by the server (the
+// publisher, see shm-publish.h) and local readers (see shm-client/).
+// plain C, no dependencies on the rest of GA.
+//
+// the object holds a header, a ring of packet entries, and a ring of
+// packet data.  the publisher never waits for readers: it overwrites the
+// oldest packets, and a reader finds it has been overrun when the entry it
+// reads has changed, or when the data has been written over.
+//
+// publishing a packet with sequence number s:
+//	1. entry[s % nentries].seq = GA_SHM_SEQ_BUSY
+//	2. write_pos += size, then the data is copied at the old write_pos
+//	3. the other fields of the entry are set, then entry.seq = s
+//	4. write_seq = s + 1, notify++, and waiters are woken up (Linux futex)
+// reading packet s: seq, the fields, and the data are read, and the
+// packet is valid if seq is still s and write_pos - pos <= data_size.
+
+#include <stdint.h>
+
+#define	GA_SHM_MAGIC		0x4d485347	/* "GSHM" */
+#define	GA_SHM_VERSION		1
+#define	GA_SHM_STREAM_MAX	9	/* video channels, then audio */
+#define	GA_SHM_READER_MAX	32
+#define	GA_SHM_EXTRADATA_MAX	1024
+#define	GA_SHM_SEQ_BUSY		0xffffffffffffffffULL
+
+// stream types
+#define	GA_SHM_VIDEO		1
+#define	GA_SHM_AUDIO		2
+
+// packet flags
+#define	GA_SHM_FLAG_KEY		0x0001
+
+struct ga_shm_stream {
+	uint32_t type;			// GA_SHM_VIDEO, GA_SHM_AUDIO, or 0 - not (yet/again) described
+	uint32_t codec_id;		// enum AVCodecID of libavcodec
+	uint32_t width, height;		// video
+	uint32_t samplerate, channels;	// audio
+	uint32_t extradata_size;
+	uint8_t extradata[GA_SHM_EXTRADATA_MAX];	// e.g., H.264 SPS and PPS
+};
+
+struct ga_shm_entry {
+	volatile uint64_t seq;		// sequence number, GA_SHM_SEQ_BUSY while written
+	uint64_t pos;			// of the data, in bytes written since creation
+	int64_t pts;			// in microseconds
+	uint32_t size;
+	uint16_t stream;
+	uint16_t flags;
+};
+
+struct ga_shm_reader_slot {
+	volatile uint32_t pid;		// 0 - free
+	uint32_t reserved;
+};
+
+struct ga_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;			// of the publisher
+	uint32_t nstreams;
+	uint64_t entry_offset;		// of the entry ring, from the start of the object
+	uint64_t nentries;		// power of 2
+	uint64_t data_offset;
+	uint64_t data_size;		// power of 2
+	volatile uint64_t write_seq;	// packets published
+	volatile uint64_t write_pos;	// bytes reserved for packet data
+	volatile uint32_t notify;	// futex word, incremented for each packet
+	volatile uint32_t waiters;	// readers waiting on notify
+	volatile uint32_t keyreq;	// incremented by readers that need a keyframe
+	volatile uint32_t attach;	// futex word, incremented when readers come and go
+	struct ga_shm_reader_slot readers[GA_SHM_READER_MAX];
+	struct ga_shm_stream streams[GA_SHM_STREAM_MAX];
+};
+
+#endif
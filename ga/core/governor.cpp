@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "governor.h"
+
+#define	GOV_LOW_WATER		60	// percent of the budget: room for a slower tier
+#define	GOV_FASTER_AFTER	4	// 1/4 second over the budget
+#define	GOV_SLOWER_AFTER	3	// 3 seconds well below the budget
+#define	GOV_HOLD		1	// second, ignore frames after a change
+
+static const struct governor_tier tiers[] = {
+	{ "ultrafast",	0, "dia", 1, 4 },
+	{ "superfast",	1, "dia", 1, 4 },
+	{ "veryfast",	2, "hex", 1, 2 },
+	{ "faster",	4, "hex", 2, 2 },
+	{ "fast",	6, "hex", 2, 1 }
+};
+
+int
+governor_levels() {
+	return sizeof(tiers) / sizeof(tiers[0]);
+}
+
+const struct governor_tier *
+governor_get_tier(int level) {
+	if(level < 0 || level >= governor_levels())
+		return NULL;
+	return &tiers[level];
+}
+
+// returns the level of a preset, or -1 if the preset is not a speed tier
+int
+governor_find(const char *preset) {
+	int i;
+	if(preset == NULL)
+		return -1;
+	for(i = 0; i < governor_levels(); i++) {
+		if(strcmp(tiers[i].preset, preset) == 0)
+			return i;
+	}
+	return -1;
+}
+
+// budget is in percent of the frame interval
+void
+governor_init(struct governor *gov, int fps, int budget, int level) {
+	bzero(gov, sizeof(struct governor));
+	gov->fps = fps > 0 ? fps : 1;
+	gov->budget = 1000000LL * budget / 100 / gov->fps;
+	gov->level = level;
+	gov->avg = -1;
+	return;
+}
+
+// feed the wall time of one encoded frame.
+// returns the new level if the encoder should switch, or -1 otherwise.
+int
+governor_update(struct governor *gov, long long encode_us) {
+	if(gov->hold > 0) {
+		gov->hold--;
+		return -1;
+	}
+	gov->avg = gov->avg < 0 ? encode_us : (7 * gov->avg + encode_us) / 8;
+	if(gov->avg > gov->budget) {
+		gov->over++;
+		gov->under = 0;
+	} else if(gov->avg * 100 < gov->budget * GOV_LOW_WATER) {
+		gov->under++;
+		gov->over = 0;
+	} else {
+		gov->over = gov->under = 0;
+	}
+	if(gov->over > 0 && gov->over * GOV_FASTER_AFTER >= gov->fps && gov->level > 0) {
+		gov->level--;
+	} else if(gov->under >= gov->fps * GOV_SLOWER_AFTER && gov->level + 1 < governor_levels()) {
+		gov->level++;
+	} else {
+		return -1;
+	}
+	// the new tier is measured from scratch
+	gov->over = gov->under = 0;
+	gov->avg = -1;
+	gov->hold = gov->fps * GOV_HOLD;
+	return gov->level;
+}
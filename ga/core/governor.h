@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __GOVERNOR_H__
+#define __GOVERNOR_H__
+
+#include "ga-common.h"
+
+// speed tiers of the encode-time governor, from the fastest to the slowest
+struct governor_tier {
+	const char *preset;
+	int subme;		// sub-pixel motion estimation quality
+	const char *me;		// motion estimation method
+	int refs;		// number of reference frames
+	int slices;
+};
+
+// keeps the encoding time of a frame within a fraction of the frame interval
+struct governor {
+	int level;		// current speed tier
+	long long budget;	// in us per frame
+	long long avg;		// smoothed encoding time, in us
+	int fps;
+	int over;		// consecutive frames over the budget
+	int under;		// consecutive frames well below the budget
+	int hold;		// frames to skip after a change
+};
+
+EXPORT int governor_levels();
+EXPORT const struct governor_tier * governor_get_tier(int level);
+EXPORT int governor_find(const char *preset);
+EXPORT void governor_init(struct governor *gov, int fps, int budget, int level);
+EXPORT int governor_update(struct governor *gov, long long encode_us);
+
+#endif
@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#endif
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "ioengine.h"
+
+#define	IOENGINE_REPORT_INTERVAL	10	/* seconds */
+#define	IOENGINE_LATENCY_BUCKETS	24	/* log2 of us, up to 16 s */
+#define	IOENGINE_PENDING		(-0x7fffffff)
+#define	IOENGINE_INFLIGHT		(-EINPROGRESS)	/* submitted, outcome unknown */
+
+static int engine = IOENGINE_SYSCALL;
+
+// figures counted by each sending thread without locks, and summed up for
+// reports.  they only grow: a report is the difference to the last one.
+struct ioengine_counters {
+	unsigned long long nbatch, nmsg, nbyte, nsyscall, nerror;
+	unsigned long long latency[IOENGINE_LATENCY_BUCKETS];	// per batch
+	struct ioengine_counters *next;
+};
+
+static pthread_mutex_t statmutex = PTHREAD_MUTEX_INITIALIZER;	// guards all below
+static pthread_once_t statonce = PTHREAD_ONCE_INIT;
+static pthread_key_t statkey;
+static struct ioengine_counters *statthreads = NULL;	// of running threads
+static struct ioengine_counters statretired;		// of threads gone
+static struct ioengine_counters statlast;		// sums at the last report
+static struct timeval statsince;
+static volatile time_t statnext;	// when the next periodic report is due
+
+// io_uring headers of 5.4 or later: SENDMSG is an enum, test for a macro
+#if defined __linux__ && defined __NR_io_uring_setup && defined IORING_FEAT_SINGLE_MMAP
+#define	IOENGINE_HAVE_URING
+
+// a ring per sending thread, so no locks on the submission path.  entries
+// are submitted and reaped in the same call.
+struct uring {
+	int fd;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqring, *cqring;
+	size_t sqsize, cqsize, sqesize;
+	struct msghdr hdr[IOENGINE_BATCH_MAX];
+	struct iovec iov[IOENGINE_BATCH_MAX];
+};
+
+static pthread_once_t uringonce = PTHREAD_ONCE_INIT;
+static pthread_key_t uringkey;
+static int uringfailed = 0;	// the kernel refused, use system calls
+
+static void
+uring_destroy(void *arg) {
+	struct uring *r = (struct uring*) arg;
+	//
+	if(r == NULL)
+		return;
+	if(r->sqes != NULL && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqesize);
+	if(r->cqring != NULL && r->cqring != MAP_FAILED && r->cqring != r->sqring)
+		munmap(r->cqring, r->cqsize);
+	if(r->sqring != NULL && r->sqring != MAP_FAILED)
+		munmap(r->sqring, r->sqsize);
+	if(r->fd >= 0)
+		close(r->fd);
+	free(r);
+	return;
+}
+
+static void
+uring_key_init() {
+	pthread_key_create(&uringkey, uring_destroy);
+	return;
+}
+
+static struct uring *
+uring_create() {
+	struct io_uring_params p;
+	struct uring *r;
+	char *sq, *cq;
+	//
+	if((r = (struct uring*) malloc(sizeof(struct uring))) == NULL)
+		return NULL;
+	bzero(r, sizeof(struct uring));
+	bzero(&p, sizeof(p));
+	if((r->fd = syscall(__NR_io_uring_setup, IOENGINE_BATCH_MAX, &p)) < 0)
+		goto error;
+	// single mmap came with 5.4, after SENDMSG (5.3): errors of the
+	// requests are then about the messages, not about the opcode
+	if((p.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+		ga_error("io engine: io_uring without SENDMSG (kernel < 5.4).\n");
+		uring_destroy(r);
+		return NULL;
+	}
+	r->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+	if(r->cqsize > r->sqsize)
+		r->sqsize = r->cqsize;
+	r->cqsize = r->sqsize;
+	r->sqring = mmap(NULL, r->sqsize, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sqring == MAP_FAILED)
+		goto error;
+	r->cqring = r->sqring;
+	r->sqes = (struct io_uring_sqe*) mmap(NULL, r->sqesize, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED)
+		goto error;
+	sq = (char*) r->sqring;
+	cq = (char*) r->cqring;
+	r->sqhead = (unsigned*) (sq + p.sq_off.head);
+	r->sqtail = (unsigned*) (sq + p.sq_off.tail);
+	r->sqmask = (unsigned*) (sq + p.sq_off.ring_mask);
+	r->sqarray = (unsigned*) (sq + p.sq_off.array);
+	r->cqhead = (unsigned*) (cq + p.cq_off.head);
+	r->cqtail = (unsigned*) (cq + p.cq_off.tail);
+	r->cqmask = (unsigned*) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+	return r;
+error:
+	ga_error("io engine: io_uring setup failed: %s\n", strerror(errno));
+	uring_destroy(r);
+	return NULL;
+}
+
+static struct uring *
+uring_get() {
+	struct uring *r;
+	//
+	if(uringfailed)
+		return NULL;
+	pthread_once(&uringonce, uring_key_init);
+	if((r = (struct uring*) pthread_getspecific(uringkey)) != NULL)
+		return r;
+	if((r = uring_create()) == NULL) {
+		uringfailed = 1;
+		return NULL;
+	}
+	pthread_setspecific(uringkey, r);
+	return r;
+}
+
+// drop the ring of this thread, e.g., if its requests cannot be completed
+static void
+uring_fail(struct uring *r) {
+	pthread_setspecific(uringkey, NULL);
+	uring_destroy(r);
+	uringfailed = 1;
+	return;
+}
+
+// n <= IOENGINE_BATCH_MAX.  returns the number of system calls, or -1 if
+// the ring cannot be used: messages never submitted are left pending, and
+// those submitted but not completed are marked in flight, not to be sent
+// again.
+static int
+uring_send(struct uring *r, struct ioengine_msg *msgs, int n) {
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned tail, head, idx;
+	int i, ret, submitted = 0, completed = 0, calls = 0;
+	//
+	tail = *r->sqtail;	// written by this thread only
+	for(i = 0; i < n; i++) {
+		r->iov[i].iov_base = (void*) msgs[i].buf;
+		r->iov[i].iov_len = msgs[i].len;
+		bzero(&r->hdr[i], sizeof(struct msghdr));
+		r->hdr[i].msg_name = (void*) msgs[i].addr;
+		r->hdr[i].msg_namelen = msgs[i].addr ? msgs[i].addrlen : 0;
+		r->hdr[i].msg_iov = &r->iov[i];
+		r->hdr[i].msg_iovlen = 1;
+		idx = (tail + i) & *r->sqmask;
+		sqe = &r->sqes[idx];
+		bzero(sqe, sizeof(struct io_uring_sqe));
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = msgs[i].fd;
+		sqe->addr = (uint64_t) (uintptr_t) &r->hdr[i];
+		sqe->len = 1;
+		sqe->user_data = i;
+		r->sqarray[idx] = idx;
+	}
+	__atomic_store_n(r->sqtail, tail + n, __ATOMIC_RELEASE);
+	// submit all, and wait for all
+	while(completed < n) {
+		ret = syscall(__NR_io_uring_enter, r->fd, n - submitted, n - completed,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		calls++;
+		if(ret < 0) {
+			if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			ga_error("io engine: io_uring_enter failed: %s\n", strerror(errno));
+			// entries are consumed in order
+			for(i = 0; i < submitted; i++) {
+				if(msgs[i].result == IOENGINE_PENDING)
+					msgs[i].result = IOENGINE_INFLIGHT;
+			}
+			uring_fail(r);
+			return -1;
+		}
+		submitted += ret;
+		head = *r->cqhead;
+		while(head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) {
+			cqe = &r->cqes[head & *r->cqmask];
+			if(cqe->user_data < (unsigned) n)
+				msgs[cqe->user_data].result = cqe->res;
+			completed++;
+			head++;
+		}
+		__atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+	}
+	return calls;
+}
+#endif	/* IOENGINE_HAVE_URING */
+
+// send pending messages with system calls.  returns the number of calls.
+static int
+syscall_send(struct ioengine_msg *msgs, int n) {
+	int i, calls = 0;
+#ifdef __linux__
+	struct mmsghdr mm[IOENGINE_BATCH_MAX];
+	struct iovec iov[IOENGINE_BATCH_MAX];
+	int j, k, cnt, ret;
+	//
+	for(i = 0; i < n; i = j) {
+		if(msgs[i].result != IOENGINE_PENDING) {
+			j = i + 1;
+			continue;
+		}
+		// a run of pending messages on the same socket
+		for(j = i; j < n && msgs[j].fd == msgs[i].fd
+				&& msgs[j].result == IOENGINE_PENDING; j++) {
+			iov[j-i].iov_base = (void*) msgs[j].buf;
+			iov[j-i].iov_len = msgs[j].len;
+			bzero(&mm[j-i], sizeof(struct mmsghdr));
+			mm[j-i].msg_hdr.msg_name = (void*) msgs[j].addr;
+			mm[j-i].msg_hdr.msg_namelen = msgs[j].addr ? msgs[j].addrlen : 0;
+			mm[j-i].msg_hdr.msg_iov = &iov[j-i];
+			mm[j-i].msg_hdr.msg_iovlen = 1;
+		}
+		cnt = j - i;
+		for(k = 0; k < cnt; ) {
+			ret = sendmmsg(msgs[i].fd, &mm[k], cnt - k, 0);
+			calls++;
+			if(ret < 0) {
+				if(errno == EINTR)
+					continue;
+				// the first message failed, go on with the next
+				msgs[i+k].result = -errno;
+				k++;
+				continue;
+			}
+			for(ret += k; k < ret; k++) {
+				msgs[i+k].result = mm[k].msg_len;
+			}
+		}
+	}
+#else
+	int ret;
+	//
+	for(i = 0; i < n; i++) {
+		if(msgs[i].result != IOENGINE_PENDING)
+			continue;
+		ret = sendto(msgs[i].fd, (const char*) msgs[i].buf, msgs[i].len, 0,
+				msgs[i].addr, msgs[i].addr ? msgs[i].addrlen : 0);
+		calls++;
+#ifdef WIN32
+		msgs[i].result = ret < 0 ? -WSAGetLastError() : ret;
+#else
+		msgs[i].result = ret < 0 ? -errno : ret;
+#endif
+	}
+#endif
+	return calls;
+}
+
+static void
+ioengine_counters_add(struct ioengine_counters *sum, const struct ioengine_counters *c) {
+	int i;
+	sum->nbatch += c->nbatch;
+	sum->nmsg += c->nmsg;
+	sum->nbyte += c->nbyte;
+	sum->nsyscall += c->nsyscall;
+	sum->nerror += c->nerror;
+	for(i = 0; i < IOENGINE_LATENCY_BUCKETS; i++)
+		sum->latency[i] += c->latency[i];
+	return;
+}
+
+// a thread leaves its figures behind
+static void
+ioengine_counters_retire(void *arg) {
+	struct ioengine_counters *c = (struct ioengine_counters*) arg, **pc;
+	//
+	pthread_mutex_lock(&statmutex);
+	for(pc = &statthreads; *pc != NULL; pc = &(*pc)->next) {
+		if(*pc == c) {
+			*pc = c->next;
+			break;
+		}
+	}
+	ioengine_counters_add(&statretired, c);
+	pthread_mutex_unlock(&statmutex);
+	free(c);
+	return;
+}
+
+static void
+ioengine_counters_key_init() {
+	pthread_key_create(&statkey, ioengine_counters_retire);
+	return;
+}
+
+static struct ioengine_counters *
+ioengine_counters_get() {
+	struct ioengine_counters *c;
+	//
+	pthread_once(&statonce, ioengine_counters_key_init);
+	if((c = (struct ioengine_counters*) pthread_getspecific(statkey)) != NULL)
+		return c;
+	if((c = (struct ioengine_counters*) malloc(sizeof(struct ioengine_counters))) == NULL)
+		return NULL;
+	bzero(c, sizeof(struct ioengine_counters));
+	pthread_mutex_lock(&statmutex);
+	c->next = statthreads;
+	statthreads = c;
+	pthread_mutex_unlock(&statmutex);
+	pthread_setspecific(statkey, c);
+	return c;
+}
+
+// figures since the last periodic report.  if 'reset', a new interval starts.
+// must be called with statmutex locked
+static int
+ioengine_report_locked(char *buf, int buflen, struct timeval *now, int reset) {
+	struct ioengine_counters sum, *c;
+	unsigned long long count = 0, p50 = 0, p99 = 0;
+	unsigned long long nmsg, nbyte, nsyscall, nerror;
+	long long us;
+	int i;
+	//
+	sum = statretired;
+	for(c = statthreads; c != NULL; c = c->next)
+		ioengine_counters_add(&sum, c);
+	nmsg = sum.nmsg - statlast.nmsg;
+	nbyte = sum.nbyte - statlast.nbyte;
+	nsyscall = sum.nsyscall - statlast.nsyscall;
+	nerror = sum.nerror - statlast.nerror;
+	for(i = 0; i < IOENGINE_LATENCY_BUCKETS; i++)
+		count += sum.latency[i] - statlast.latency[i];
+	for(i = 0; i < IOENGINE_LATENCY_BUCKETS && count > 0; i++) {
+		p50 += sum.latency[i] - statlast.latency[i];
+		if(p50 * 2 >= count)
+			break;
+	}
+	p50 = 1 << (i + 1);
+	for(i = 0; i < IOENGINE_LATENCY_BUCKETS && count > 0; i++) {
+		p99 += sum.latency[i] - statlast.latency[i];
+		if(p99 * 100 >= count * 99)
+			break;
+	}
+	p99 = 1 << (i + 1);
+	if((us = tvdiff_us(now, &statsince)) <= 0)
+		us = 1;
+	i = snprintf(buf, buflen,
+		"io engine %s: %.0f syscalls/s, %.0f packets/s, %.1f packets/syscall,"
+		" %.1f Mbps, batch latency p50 < %llu us, p99 < %llu us, %llu errors\n",
+		ioengine_name(),
+		1000000.0 * nsyscall / us, 1000000.0 * nmsg / us,
+		nsyscall > 0 ? 1.0 * nmsg / nsyscall : 0.0,
+		8.0 * nbyte / us, count > 0 ? p50 : 0, count > 0 ? p99 : 0, nerror);
+	if(reset) {
+		statlast = sum;
+		statsince = *now;
+		statnext = now->tv_sec + IOENGINE_REPORT_INTERVAL;
+	}
+	return i < buflen ? i : buflen;
+}
+
+// 'now' is when the batch has been sent
+static void
+ioengine_stats(struct ioengine_msg *msgs, int n, int calls, long long us, struct timeval *now) {
+	struct ioengine_counters *c;
+	char report[256];
+	int i, b, bytes = 0, errors = 0;
+	//
+	for(i = 0; i < n; i++) {
+		if(msgs[i].result >= 0)
+			bytes += msgs[i].result;
+		else
+			errors++;
+	}
+	for(b = 0; b < IOENGINE_LATENCY_BUCKETS-1 && (1LL << (b + 1)) <= us; b++)
+		;
+	if((c = ioengine_counters_get()) != NULL) {
+		c->nbatch++;
+		c->nmsg += n;
+		c->nbyte += bytes;
+		c->nsyscall += calls;
+		c->nerror += errors;
+		c->latency[b]++;
+	}
+	if(now->tv_sec < statnext)
+		return;
+	report[0] = '\0';
+	pthread_mutex_lock(&statmutex);
+	if(now->tv_sec >= statnext)
+		ioengine_report_locked(report, sizeof(report), now, 1);
+	pthread_mutex_unlock(&statmutex);
+	if(report[0] != '\0')
+		ga_error("%s", report);
+	return;
+}
+
+int
+ioengine_init(int e) {
+	engine = e;
+	gettimeofday(&statsince, NULL);
+	statnext = statsince.tv_sec + IOENGINE_REPORT_INTERVAL;
+#ifdef IOENGINE_HAVE_URING
+	if(engine == IOENGINE_URING) {
+		// probe on this thread, senders create their own rings
+		struct uring *r;
+		pthread_once(&uringonce, uring_key_init);
+		if((r = uring_create()) == NULL) {
+			uringfailed = 1;
+		} else {
+			uring_destroy(r);
+		}
+	}
+#else
+	if(engine == IOENGINE_URING) {
+		ga_error("io engine: io_uring not supported on this platform.\n");
+	}
+#endif
+	ga_error("io engine: sending with %s.\n", ioengine_name());
+	return 0;
+}
+
+const char *
+ioengine_name() {
+#ifdef IOENGINE_HAVE_URING
+	if(engine == IOENGINE_URING && uringfailed == 0)
+		return "io_uring";
+#endif
+#ifdef __linux__
+	return "sendmmsg";
+#else
+	return "sendto";
+#endif
+}
+
+// send a batch of messages, see ioengine.h.
+// returns the number of messages sent.
+int
+ioengine_send(struct ioengine_msg *msgs, int n) {
+	struct timeval t0, t1;
+	int i, j, k, calls, sent = 0;
+	//
+	for(i = 0; i < n; i += k) {
+		k = n - i < IOENGINE_BATCH_MAX ? n - i : IOENGINE_BATCH_MAX;
+		for(j = i; j < i + k; j++)
+			msgs[j].result = IOENGINE_PENDING;
+		calls = 0;
+		gettimeofday(&t0, NULL);
+#ifdef IOENGINE_HAVE_URING
+		if(engine == IOENGINE_URING) {
+			struct uring *r = uring_get();
+			if(r != NULL)
+				calls = uring_send(r, msgs + i, k);
+			if(calls < 0)
+				calls = 0;
+		}
+#endif
+		calls += syscall_send(msgs + i, k);
+		gettimeofday(&t1, NULL);
+		ioengine_stats(msgs + i, k, calls, tvdiff_us(&t1, &t0), &t1);
+	}
+	for(i = 0; i < n; i++) {
+		if(msgs[i].result >= 0)
+			sent++;
+	}
+	return sent;
+}
+
+// figures since the last periodic report, for the encoder control socket
+int
+ioengine_report(char *buf, int buflen) {
+	struct timeval now;
+	int len;
+	//
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&statmutex);
+	len = ioengine_report_locked(buf, buflen, &now, 0);
+	pthread_mutex_unlock(&statmutex);
+	return len;
+}
+
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __IOENGINE_H__
+#define __IOENGINE_H__
+
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
+#include "ga-common.h"
+
+// batched datagram sends.  a batch (e.g., the RTP packets of a frame for a
+// viewer) is submitted with a single system call: io_uring SENDMSG
+// requests on Linux kernels that have them, otherwise sendmmsg(), or one
+// sendto() per packet where neither exists.  a batch is complete when the
+// call returns, so buffers are owned by the caller as with sendto().
+
+#define	IOENGINE_SYSCALL	0	// sendmmsg or sendto
+#define	IOENGINE_URING		1	// io_uring, falls back to IOENGINE_SYSCALL
+
+#define	IOENGINE_BATCH_MAX	256	// messages per system call
+
+struct ioengine_msg {
+#ifdef WIN32
+	SOCKET fd;
+#else
+	int fd;
+#endif
+	const void *buf;
+	int len;
+	const struct sockaddr *addr;	// NULL for connected sockets
+	int addrlen;
+	int result;			// bytes sent, or -errno
+};
+
+EXPORT int ioengine_init(int engine);
+EXPORT const char * ioengine_name();
+EXPORT int ioengine_send(struct ioengine_msg *msgs, int n);
+EXPORT int ioengine_report(char *buf, int buflen);
+
+#endif
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+
+#include <list>
+
+#include "rtspconf.h"
+#include "rtspserver.h"
+#include "pacer.h"
+
+using namespace std;
+
+#define	PACER_BURST		5000	// us, tokens the bucket holds at the pacing rate
+#define	PACER_BURST_MIN		3000	// bytes, about two packets
+#define	PACER_MAX_DELAY		100000	// us, packets never wait longer
+#define	PACER_IDLE_INTERVAL	100000	// us
+#define	PACER_REPORT_INTERVAL	10	// seconds
+#define	PACER_SEND_BATCH	64	// packets per rtsp_write_packets()
+
+struct pacer_packet {
+	int streamid;
+	int len;
+	struct timeval queued;
+	uint8_t data[1];
+};
+
+struct pacer {
+	RTSPContext *ctx;
+	bool enabled;
+	bool sending;			// the timer thread is writing packets
+	bool failed;			// a write failed, packets are dropped; set with pacermutex locked
+	int rate[RTSP_CHANNEL_MAX];	// target bitrate per stream, in bps
+	double tokens;			// in bytes, negative while in debt
+	struct timeval refill;
+	list<struct pacer_packet*> queue;
+	int queued;			// in bytes
+	// queue delay, in us
+	long long delay_avg;
+	long long delay_max;
+	struct timeval report;
+};
+
+static pthread_mutex_t pacermutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pacercond = PTHREAD_COND_INITIALIZER;	// packets queued
+static pthread_cond_t sentcond = PTHREAD_COND_INITIALIZER;	// packets written
+static list<struct pacer*> pacers;
+static bool pacer_started = false;
+
+// pacing rate of a session, in bps; 0 - unknown
+static long long
+pacer_rate(struct pacer *p) {
+	long long rate = 0;
+	int i;
+	for(i = 0; i < RTSP_CHANNEL_MAX; i++)
+		rate += p->rate[i];
+	return rate * rtspconf_global()->pacing_rate / 100;
+}
+
+// move packets that may leave now into 'batch'.
+// returns the time (in us) until the next packet may leave.
+static long long
+pacer_release(struct pacer *p, struct timeval *now, list<struct pacer_packet*> *batch) {
+	struct pacer_packet *pkt;
+	long long rate = pacer_rate(p), delay;
+	double burst;
+	//
+	if(p->enabled && rate > 0) {
+		burst = rate / 8.0 * PACER_BURST / 1000000.0;
+		if(burst < PACER_BURST_MIN)
+			burst = PACER_BURST_MIN;
+		p->tokens += rate / 8.0 * tvdiff_us(now, &p->refill) / 1000000.0;
+		if(p->tokens > burst)
+			p->tokens = burst;
+		if(p->tokens < -burst)
+			p->tokens = -burst;
+	}
+	p->refill = *now;
+	while(!p->queue.empty()) {
+		pkt = p->queue.front();
+		delay = tvdiff_us(now, &pkt->queued);
+		if(p->enabled && rate > 0 && p->tokens < 0 && delay < PACER_MAX_DELAY)
+			return (long long) (-p->tokens * 8000000.0 / rate) + 1;
+		p->queue.pop_front();
+		p->queued -= pkt->len;
+		if(p->enabled && rate > 0)
+			p->tokens -= pkt->len;
+		p->delay_avg = (15 * p->delay_avg + delay) / 16;
+		if(delay > p->delay_max)
+			p->delay_max = delay;
+		batch->push_back(pkt);
+	}
+	return PACER_IDLE_INTERVAL;
+}
+
+// released packets of a stream are sent together
+static void
+pacer_send(struct pacer *p, list<struct pacer_packet*> *batch) {
+	list<struct pacer_packet*>::iterator li;
+	struct pacer_packet *pkt;
+	const uint8_t *pkts[PACER_SEND_BATCH];
+	int lens[PACER_SEND_BATCH];
+	int n = 0, streamid = -1;
+	//
+	for(li = batch->begin(); ; li++) {
+		pkt = li != batch->end() ? *li : NULL;
+		if(n > 0 && (pkt == NULL || pkt->streamid != streamid || n == PACER_SEND_BATCH)) {
+			if(p->failed == false
+			&& rtsp_write_packets(p->ctx, streamid, pkts, lens, n) < 0) {
+				ga_error("pacer: write failed (session %s), dropping packets.\n",
+					p->ctx->session_id ? p->ctx->session_id : "-");
+				pthread_mutex_lock(&pacermutex);
+				p->failed = true;
+				pthread_mutex_unlock(&pacermutex);
+			}
+			n = 0;
+		}
+		if(pkt == NULL)
+			break;
+		streamid = pkt->streamid;
+		pkts[n] = pkt->data;
+		lens[n] = pkt->len;
+		n++;
+	}
+	for(li = batch->begin(); li != batch->end(); li++) {
+		free(*li);
+	}
+	batch->clear();
+	return;
+}
+
+static void *
+pacer_thread(void *arg) {
+	list<struct pacer*>::iterator pi;
+	list<struct pacer_packet*> batch;
+	struct pacer *p;
+	struct timeval now;
+	struct timespec to;
+	long long wait, next;
+	//
+	ga_error("pacer: thread started (tid=%ld).\n", ga_gettid());
+	pthread_mutex_lock(&pacermutex);
+	while(true) {
+		next = PACER_IDLE_INTERVAL;
+		for(pi = pacers.begin(); pi != pacers.end(); pi++) {
+			p = *pi;
+			gettimeofday(&now, NULL);
+			if(now.tv_sec - p->report.tv_sec >= PACER_REPORT_INTERVAL) {
+				if(p->enabled) {
+					ga_error("pacer: session %s, %lld kbps, queue delay avg %.1f ms, max %.1f ms, %d bytes queued.\n",
+						p->ctx->session_id ? p->ctx->session_id : "-",
+						pacer_rate(p) / 1000,
+						0.001 * p->delay_avg, 0.001 * p->delay_max,
+						p->queued);
+				}
+				p->delay_max = 0;
+				p->report = now;
+			}
+			if((wait = pacer_release(p, &now, &batch)) < next)
+				next = wait;
+			if(batch.empty())
+				continue;
+			// other pacers may come and go meanwhile, but not this one
+			p->sending = true;
+			pthread_mutex_unlock(&pacermutex);
+			pacer_send(p, &batch);
+			pthread_mutex_lock(&pacermutex);
+			p->sending = false;
+			pthread_cond_broadcast(&sentcond);
+		}
+		gettimeofday(&now, NULL);
+		next += now.tv_usec;
+		to.tv_sec = now.tv_sec + next / 1000000;
+		to.tv_nsec = (next % 1000000) * 1000;
+		pthread_cond_timedwait(&pacercond, &pacermutex, &to);
+	}
+	pthread_mutex_unlock(&pacermutex);
+	return NULL;
+}
+
+struct pacer *
+pacer_create(RTSPContext *ctx, int enabled) {
+	struct pacer *p;
+	pthread_t t;
+	//
+	p = new pacer;
+	p->ctx = ctx;
+	p->enabled = enabled ? true : false;
+	p->sending = false;
+	p->failed = false;
+	bzero(p->rate, sizeof(p->rate));
+	p->tokens = PACER_BURST_MIN;
+	gettimeofday(&p->refill, NULL);
+	p->queued = 0;
+	p->delay_avg = p->delay_max = 0;
+	p->report = p->refill;
+	//
+	pthread_mutex_lock(&pacermutex);
+	if(pacer_started == false) {
+		if(pthread_create(&t, NULL, pacer_thread, NULL) != 0) {
+			pthread_mutex_unlock(&pacermutex);
+			ga_error("pacer: cannot create the timer thread.\n");
+			delete p;
+			return NULL;
+		}
+		pthread_detach(t);
+		pacer_started = true;
+	}
+	pacers.push_back(p);
+	pthread_mutex_unlock(&pacermutex);
+	ga_error("pacer: session %s, pacing %s.\n",
+		ctx->session_id ? ctx->session_id : "-", enabled ? "on" : "off");
+	return p;
+}
+
+// queued packets are dropped
+void
+pacer_destroy(struct pacer *p) {
+	list<struct pacer_packet*>::iterator li;
+	//
+	pthread_mutex_lock(&pacermutex);
+	while(p->sending) {
+		pthread_cond_wait(&sentcond, &pacermutex);
+	}
+	pacers.remove(p);
+	for(li = p->queue.begin(); li != p->queue.end(); li++) {
+		free(*li);
+	}
+	pthread_mutex_unlock(&pacermutex);
+	delete p;
+	return;
+}
+
+// a disabled pacer releases packets at once, in order
+void
+pacer_enable(struct pacer *p, int enabled) {
+	pthread_mutex_lock(&pacermutex);
+	p->enabled = enabled ? true : false;
+	pthread_cond_signal(&pacercond);
+	pthread_mutex_unlock(&pacermutex);
+	ga_error("pacer: session %s, pacing %s.\n",
+		p->ctx->session_id ? p->ctx->session_id : "-", enabled ? "on" : "off");
+	return;
+}
+
+// target bitrate of a stream, in bps
+void
+pacer_set_rate(struct pacer *p, int streamid, int bitrate) {
+	if(streamid < 0 || streamid >= RTSP_CHANNEL_MAX)
+		return;
+	pthread_mutex_lock(&pacermutex);
+	p->rate[streamid] = bitrate;
+	pthread_mutex_unlock(&pacermutex);
+	return;
+}
+
+// queue RTP packets from a dynamic packet buffer, see rtsp_write_bindata().
+// returns 0 on success, or -1 on error.
+int
+pacer_enqueue(struct pacer *p, int streamid, const uint8_t *buf, int buflen) {
+	list<struct pacer_packet*> pkts;
+	struct pacer_packet *pkt;
+	struct timeval now;
+	int i, pktlen, total = 0, ret;
+	//
+	gettimeofday(&now, NULL);
+	for(i = 0; i + 4 <= buflen; i += 4 + pktlen) {
+		pktlen = (buf[i] << 24) | (buf[i+1] << 16) | (buf[i+2] << 8) | buf[i+3];
+		if(pktlen == 0)
+			continue;
+		if(i + 4 + pktlen > buflen)
+			break;
+		if((pkt = (struct pacer_packet*) malloc(sizeof(*pkt) + pktlen)) == NULL)
+			break;
+		pkt->streamid = streamid;
+		pkt->len = pktlen;
+		pkt->queued = now;
+		memcpy(pkt->data, &buf[i+4], pktlen);
+		pkts.push_back(pkt);
+		total += pktlen;
+	}
+	pthread_mutex_lock(&pacermutex);
+	p->queue.splice(p->queue.end(), pkts);
+	p->queued += total;
+	ret = p->failed ? -1 : 0;
+	pthread_cond_signal(&pacercond);
+	pthread_mutex_unlock(&pacermutex);
+	return ret;
+}
+
+// one line per paced session, for the encoder control socket
+int
+pacer_report(char *buf, int buflen) {
+	list<struct pacer*>::iterator pi;
+	struct pacer *p;
+	int len = 0;
+	//
+	pthread_mutex_lock(&pacermutex);
+	for(pi = pacers.begin(); pi != pacers.end() && len < buflen; pi++) {
+		p = *pi;
+		len += snprintf(buf + len, buflen - len,
+			"session %s: pacing=%s rate=%lld kbps delay=%lld/%lld us queued=%d bytes\n",
+			p->ctx->session_id ? p->ctx->session_id : "-",
+			p->enabled ? "on" : "off", pacer_rate(p) / 1000,
+			p->delay_avg, p->delay_max, p->queued);
+	}
+	pthread_mutex_unlock(&pacermutex);
+	return len < buflen ? len : buflen;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PACER_H__
+#define __PACER_H__
+
+#include "ga-common.h"
+#include "rtspserver.h"
+
+// a token-bucket pacer per session.  packets queued by encoders are
+// released by a shared timer thread at pacing-rate percent of the target
+// bitrate, so a frame is spread over the frame interval.
+
+EXPORT struct pacer * pacer_create(RTSPContext *ctx, int enabled);
+EXPORT void pacer_destroy(struct pacer *pacer);
+EXPORT void pacer_enable(struct pacer *pacer, int enabled);
+EXPORT void pacer_set_rate(struct pacer *pacer, int streamid, int bitrate);
+EXPORT int pacer_enqueue(struct pacer *pacer, int streamid, const uint8_t *buf, int buflen);
+EXPORT int pacer_report(char *buf, int buflen);
+
+#endif
@@ -19,6 +19,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 #include "ga-common.h"
 
@@ -72,6 +84,159 @@ pipeline::lookup(const char *provider) {
 
 //////////////////////////////////////////////////////////////////////////////
 
+// shared-memory arena of a cross-process pipeline:
+//	struct pipeline_shm | slot headers | (page aligned) slot data
+// queues link slots by index, and are protected by a robust
+// process-shared mutex, so a crashed process does not block the others.
+// consumers sleep on the notify futex, in wait() and timedwait().
+
+#define	PIPELINE_SHM_MAGIC	0x45504950	/* "PIPE" */
+#define	PIPELINE_SHM_VERSION	1
+#define	PIPELINE_SHM_PRIVDATA	1024
+#define	PIPELINE_SHM_CLIENTS	16
+
+enum pipeline_slot_state {
+	SLOT_FREE = 0,
+	SLOT_OWNED,		// allocated or loaded by slot.owner
+	SLOT_QUEUED
+};
+
+#ifdef __linux__
+struct pipeline_shm_slot {
+	int32_t next;		// next slot in the same queue, -1 - none
+	int32_t state;
+	uint32_t owner;		// pid
+	uint32_t reserved;
+	int64_t stored;		// in us
+};
+
+struct pipeline_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;		// of the creator
+	uint32_t nslots;
+	uint32_t datasize;
+	uint32_t slotsize;	// datasize, aligned
+	uint64_t data_offset;
+	pthread_mutex_t mutex;
+	int32_t freehead;
+	int32_t datahead, datatail;
+	int32_t datacount, bufcount;
+	volatile uint32_t notify;	// futex word, incremented by notify_*()
+	volatile uint32_t waiters;
+	struct {
+		uint32_t pid;
+		int32_t count;	// registered threads
+	} clients[PIPELINE_SHM_CLIENTS];
+	int32_t privdata_size;
+	uint8_t privdata[PIPELINE_SHM_PRIVDATA];
+	struct pipeline_shm_slot slots[];
+};
+
+static int
+shm_alive(uint32_t pid) {
+	return pid != 0 && (kill((pid_t) pid, 0) == 0 || errno != ESRCH);
+}
+
+static void shm_reclaim(struct pipeline_shm *s, bool dropqueued, bool self);
+
+static int
+shm_lock(struct pipeline_shm *s) {
+	int err = pthread_mutex_lock(&s->mutex);
+	if(err == EOWNERDEAD) {
+		// the queues may be half updated: drop the queued frames and
+		// rebuild the free list from the slot states
+		ga_error("pipeline: process holding the shared pool died, recovered.\n");
+		shm_reclaim(s, true, false);
+		pthread_mutex_consistent(&s->mutex);
+		return 0;
+	}
+	return err;
+}
+
+static void
+shm_unlock(struct pipeline_shm *s) {
+	pthread_mutex_unlock(&s->mutex);
+}
+
+// rebuild the free list and work pool, keeping the slots still owned by
+// a live process (other than the caller, if self is set).  called with
+// the lock held.
+static void
+shm_reclaim(struct pipeline_shm *s, bool dropqueued, bool self) {
+	struct pipeline_shm_slot *slot;
+	int32_t prev = -1, i;
+	//
+	s->freehead = -1;
+	s->bufcount = 0;
+	// keep the order of queued slots
+	for(i = s->datahead; i >= 0 && !dropqueued; i = slot->next) {
+		slot = &s->slots[i];
+		prev = i;
+	}
+	if(dropqueued) {
+		s->datahead = s->datatail = -1;
+		s->datacount = 0;
+	} else {
+		s->datatail = prev;
+	}
+	for(i = 0; i < (int32_t) s->nslots; i++) {
+		slot = &s->slots[i];
+		if(slot->state == SLOT_QUEUED && !dropqueued)
+			continue;
+		if(slot->state == SLOT_OWNED && shm_alive(slot->owner)
+		&& (!self || slot->owner != (uint32_t) getpid()))
+			continue;
+		slot->state = SLOT_FREE;
+		slot->owner = 0;
+		slot->next = s->freehead;
+		s->freehead = i;
+		s->bufcount++;
+	}
+	return;
+}
+
+static void
+shm_futex_wake(volatile uint32_t *addr) {
+	syscall(__NR_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// abstime NULL: no timeout
+static void
+shm_futex_wait(volatile uint32_t *addr, uint32_t val, const struct timespec *abstime) {
+	struct timeval tv;
+	struct timespec to;
+	long long us;
+	//
+	if(abstime == NULL) {
+		syscall(__NR_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+		return;
+	}
+	// FUTEX_WAIT takes a relative timeout
+	gettimeofday(&tv, NULL);
+	us = (abstime->tv_sec - tv.tv_sec) * 1000000LL
+		+ abstime->tv_nsec / 1000 - tv.tv_usec;
+	if(us <= 0)
+		return;
+	to.tv_sec = us / 1000000;
+	to.tv_nsec = (us % 1000000) * 1000;
+	syscall(__NR_futex, addr, FUTEX_WAIT, val, &to, NULL, 0);
+}
+#else
+struct pipeline_shm {
+	int unused;
+};
+#endif
+
+static long long
+pipeline_now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
 pipeline::pipeline(int privdata_size) {
 	pthread_mutex_init(&condMutex, NULL);
 	pthread_mutex_init(&poolmutex, NULL);
@@ -79,6 +244,11 @@ pipeline::pipeline(int privdata_size) {
 	datahead = datatail = NULL;
 	privdata = NULL;
 	privdata_size = 0;
+	shm = NULL;
+	shmsize = 0;
+	shmdata = NULL;
+	shmfixup = NULL;
+	handoffs = handoff_total = handoff_max = 0;
 	if(privdata_size > 0) {
 		alloc_privdata(privdata_size);
 	}
@@ -86,6 +256,22 @@ pipeline::pipeline(int privdata_size) {
 }
 
 pipeline::~pipeline() {
+#ifdef __linux__
+	if(shm != NULL) {
+		// slots owned by this process go back to the free list
+		if(shm_lock(shm) == 0) {
+			shm_reclaim(shm, shm->pid == (uint32_t) getpid(), true);
+			shm_unlock(shm);
+		}
+		munmap(shm, shmsize);
+		free(shmdata);
+		shm = NULL;
+		shmdata = NULL;
+		privdata = NULL;
+		privdata_size = 0;
+		return;
+	}
+#endif
 	bufpool = datapool_free(bufpool);
 	datahead = datapool_free(datahead);
 	datatail = NULL;
@@ -126,6 +312,197 @@ pipeline::datapool_init(int n, int datasize) {
 	return bufpool;
 }
 
+struct pooldata *
+pipeline::datapool_init_shm(const char *shmname, int n, int datasize, pipeline_shm_fixup fixup) {
+#ifdef __linux__
+	struct pipeline_shm *s = NULL;
+	struct pooldata *head = NULL;
+	pthread_mutexattr_t attr;
+	uint64_t hdrsize, slotsize, size;
+	struct stat st;
+	int i, fd;
+	//
+	if(n <= 0 || datasize <= 0 || shm != NULL)
+		return NULL;
+	hdrsize = sizeof(struct pipeline_shm) + n * sizeof(struct pipeline_shm_slot);
+	hdrsize = (hdrsize + 4095) & ~4095ULL;
+	slotsize = (datasize + 63) & ~63ULL;
+	size = hdrsize + n * slotsize;
+	// reuse the arena of a previous run with the same layout, so that
+	// consumers keep working across a restart of the producer
+	if((fd = shm_open(shmname, O_RDWR, 0600)) >= 0) {
+		if(fstat(fd, &st) == 0 && (uint64_t) st.st_size == size
+		&& (s = (struct pipeline_shm*) mmap(NULL, size, PROT_READ|PROT_WRITE,
+				MAP_SHARED, fd, 0)) != MAP_FAILED) {
+			if(s->magic != PIPELINE_SHM_MAGIC || s->version != PIPELINE_SHM_VERSION
+			|| s->nslots != (uint32_t) n || s->datasize != (uint32_t) datasize) {
+				munmap(s, size);
+				s = NULL;
+			} else if(s->pid != (uint32_t) getpid() && shm_alive(s->pid)) {
+				ga_error("pipeline: shared pool '%s' is used by process %u.\n",
+					shmname, s->pid);
+				munmap(s, size);
+				close(fd);
+				return NULL;
+			}
+		} else {
+			s = NULL;
+		}
+		close(fd);
+		if(s == NULL)
+			shm_unlink(shmname);
+	}
+	if(s != NULL) {
+		if(shm_lock(s) != 0) {
+			munmap(s, size);
+			return NULL;
+		}
+		s->pid = getpid();
+		shm_reclaim(s, true, true);
+		shm_unlock(s);
+		ga_error("pipeline: shared pool '%s' reused, %d of %d slots free.\n",
+			shmname, s->bufcount, n);
+		goto attached;
+	}
+	//
+	if((fd = shm_open(shmname, O_RDWR|O_CREAT|O_EXCL, 0600)) < 0) {
+		ga_error("pipeline: create shared pool '%s' failed: %s\n",
+			shmname, strerror(errno));
+		return NULL;
+	}
+	if(ftruncate(fd, size) < 0
+	|| (s = (struct pipeline_shm*) mmap(NULL, size, PROT_READ|PROT_WRITE,
+			MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		ga_error("pipeline: map shared pool '%s' (%llu bytes) failed: %s\n",
+			shmname, (unsigned long long) size, strerror(errno));
+		close(fd);
+		shm_unlink(shmname);
+		return NULL;
+	}
+	close(fd);
+	// a new object is zero-filled
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&s->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	s->pid = getpid();
+	s->nslots = n;
+	s->datasize = datasize;
+	s->slotsize = slotsize;
+	s->data_offset = hdrsize;
+	s->datahead = s->datatail = -1;
+	shm_reclaim(s, true, true);
+	s->version = PIPELINE_SHM_VERSION;
+	__sync_synchronize();
+	s->magic = PIPELINE_SHM_MAGIC;
+	ga_error("pipeline: shared pool '%s' created, %d x %d bytes.\n",
+		shmname, n, datasize);
+attached:
+	if((shmdata = (struct pooldata*) calloc(n, sizeof(struct pooldata))) == NULL) {
+		munmap(s, size);
+		return NULL;
+	}
+	shm = s;
+	shmsize = size;
+	shmfixup = fixup;
+	privdata = s->privdata;
+	privdata_size = s->privdata_size;
+	// free slots are returned for initialization, in index order
+	for(i = n - 1; i >= 0; i--) {
+		shmdata[i].ptr = ((unsigned char*) s) + s->data_offset + i * s->slotsize;
+		if(s->slots[i].state != SLOT_FREE)
+			continue;
+		shmdata[i].next = head;
+		head = &shmdata[i];
+	}
+	return head;
+#else
+	ga_error("pipeline: shared pools are not supported on this platform.\n");
+	return NULL;
+#endif
+}
+
+int
+pipeline::datapool_attach_shm(const char *shmname, pipeline_shm_fixup fixup) {
+#ifdef __linux__
+	struct pipeline_shm *s;
+	struct stat st;
+	int i, fd;
+	//
+	if(shm != NULL)
+		return -1;
+	if((fd = shm_open(shmname, O_RDWR, 0600)) < 0)
+		return -1;
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct pipeline_shm)
+	|| (s = (struct pipeline_shm*) mmap(NULL, st.st_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	if(s->magic != PIPELINE_SHM_MAGIC || s->version != PIPELINE_SHM_VERSION
+	|| s->data_offset + (uint64_t) s->nslots * s->slotsize > (uint64_t) st.st_size) {
+		ga_error("pipeline: bad shared pool '%s'.\n", shmname);
+		munmap(s, st.st_size);
+		errno = EPROTO;
+		return -1;
+	}
+	if((shmdata = (struct pooldata*) calloc(s->nslots, sizeof(struct pooldata))) == NULL) {
+		munmap(s, st.st_size);
+		return -1;
+	}
+	for(i = 0; i < (int) s->nslots; i++) {
+		shmdata[i].ptr = ((unsigned char*) s) + s->data_offset + i * s->slotsize;
+	}
+	// slots held by a previous consumer that died
+	if(shm_lock(s) == 0) {
+		shm_reclaim(s, false, false);
+		shm_unlock(s);
+	}
+	shm = s;
+	shmsize = st.st_size;
+	shmfixup = fixup;
+	privdata = s->privdata;
+	privdata_size = s->privdata_size;
+	ga_error("pipeline: attached to shared pool '%s' (producer %u).\n",
+		shmname, s->pid);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+bool
+pipeline::shared() {
+	return shm != NULL;
+}
+
+struct pooldata *
+pipeline::shm_acquire(int slot) {
+#ifdef __linux__
+	shm->slots[slot].state = SLOT_OWNED;
+	shm->slots[slot].owner = getpid();
+	shmdata[slot].next = NULL;
+	shmdata[slot].stored = shm->slots[slot].stored;
+	return &shmdata[slot];
+#else
+	return NULL;
+#endif
+}
+
+void
+pipeline::handoff_count(long long stored) {
+	long long delay = pipeline_now() - stored;
+	if(stored == 0 || delay < 0)
+		return;
+	handoffs++;
+	handoff_total += delay;
+	if(delay > handoff_max)
+		handoff_max = delay;
+	return;
+}
+
 struct pooldata *
 pipeline::datapool_free(struct pooldata *head) {
 	struct pooldata *next;
@@ -149,6 +526,35 @@ struct pooldata *
 pipeline::allocate_data() {
 	// allocate a data from buffer pool
 	struct pooldata *data = NULL;
+#ifdef __linux__
+	if(shm != NULL) {
+		int32_t i;
+		if(shm_lock(shm) != 0)
+			return NULL;
+		if(shm->freehead < 0 && shm->datahead < 0) {
+			// slots are held by consumers: take back those that died
+			shm_reclaim(shm, false, false);
+		}
+		if((i = shm->freehead) >= 0) {
+			shm->freehead = shm->slots[i].next;
+			shm->bufcount--;
+		} else if((i = shm->datahead) >= 0) {
+			// force to release the eldest one
+			if((shm->datahead = shm->slots[i].next) < 0)
+				shm->datatail = -1;
+			shm->datacount--;
+		} else {
+			ga_error("data pool: FATAL - no free slot in shared pool (pipe '%s').\n",
+				this->name());
+			exit(-1);
+		}
+		data = shm_acquire(i);
+		shm_unlock(shm);
+		if(shmfixup != NULL)
+			shmfixup(data->ptr);
+		return data;
+	}
+#endif
 	pthread_mutex_lock(&poolmutex);
 	if(bufpool == NULL) {
 		// no more available free data - force to release the eldest one
@@ -172,6 +578,27 @@ void
 pipeline::store_data(struct pooldata *data) {
 	// store a data into data pool (at the end)
 	data->next = NULL;
+	data->stored = pipeline_now();
+#ifdef __linux__
+	if(shm != NULL) {
+		int32_t i = (int32_t) (data - shmdata);
+		if(shm_lock(shm) != 0)
+			return;
+		shm->slots[i].state = SLOT_QUEUED;
+		shm->slots[i].owner = 0;
+		shm->slots[i].stored = data->stored;
+		shm->slots[i].next = -1;
+		if(shm->datatail < 0) {
+			shm->datahead = shm->datatail = i;
+		} else {
+			shm->slots[shm->datatail].next = i;
+			shm->datatail = i;
+		}
+		shm->datacount++;
+		shm_unlock(shm);
+		return;
+	}
+#endif
 	pthread_mutex_lock(&poolmutex);
 	if(datatail == NULL) {
 		// data pool is empty
@@ -205,8 +632,32 @@ pipeline::load_data_unlocked() {
 struct pooldata *
 pipeline::load_data() {
 	struct pooldata *data;
+#ifdef __linux__
+	if(shm != NULL) {
+		int32_t i;
+		if(shm_lock(shm) != 0)
+			return NULL;
+		if((i = shm->datahead) < 0) {
+			shm_unlock(shm);
+			return NULL;
+		}
+		if((shm->datahead = shm->slots[i].next) < 0)
+			shm->datatail = -1;
+		shm->datacount--;
+		data = shm_acquire(i);
+		shm_unlock(shm);
+		pthread_mutex_lock(&poolmutex);
+		handoff_count(data->stored);
+		pthread_mutex_unlock(&poolmutex);
+		if(shmfixup != NULL)
+			shmfixup(data->ptr);
+		return data;
+	}
+#endif
 	pthread_mutex_lock(&poolmutex);
 	data = load_data_unlocked();
+	if(data != NULL)
+		handoff_count(data->stored);
 	pthread_mutex_unlock(&poolmutex);
 	return data;
 }
@@ -214,6 +665,20 @@ pipeline::load_data() {
 void
 pipeline::release_data(struct pooldata *data) {
 	// return a data to buffer pool
+#ifdef __linux__
+	if(shm != NULL) {
+		int32_t i = (int32_t) (data - shmdata);
+		if(shm_lock(shm) != 0)
+			return;
+		shm->slots[i].state = SLOT_FREE;
+		shm->slots[i].owner = 0;
+		shm->slots[i].next = shm->freehead;
+		shm->freehead = i;
+		shm->bufcount++;
+		shm_unlock(shm);
+		return;
+	}
+#endif
 	pthread_mutex_lock(&poolmutex);
 	data->next = bufpool;
 	bufpool = data;
@@ -224,16 +689,35 @@ pipeline::release_data(struct pooldata *data) {
 
 int
 pipeline::data_count() {
+#ifdef __linux__
+	if(shm != NULL)
+		return shm->datacount;
+#endif
 	return datacount;
 }
 
 int
 pipeline::buf_count() {
+#ifdef __linux__
+	if(shm != NULL)
+		return shm->bufcount;
+#endif
 	return bufcount;
 }
 
 void *
 pipeline::alloc_privdata(int size) {
+#ifdef __linux__
+	if(shm != NULL) {
+		// fixed space in the arena
+		if(size > PIPELINE_SHM_PRIVDATA)
+			return NULL;
+		if(size > shm->privdata_size)
+			shm->privdata_size = size;
+		privdata_size = shm->privdata_size;
+		return privdata;
+	}
+#endif
 	if(privdata == NULL) {
 alloc_again:
 		if((privdata = malloc(size)) != NULL) {
@@ -272,10 +756,38 @@ pipeline::get_privdata_size() {
 }
 
 void
-pipeline::client_register(long tid, pthread_cond_t *cond) {
+pipeline::client_register(long tid, pthread_cond_t *cond, pthread_mutex_t *mutex) {
 	pthread_mutex_lock(&condMutex);
 	condmap[tid] = cond;
+	if(mutex != NULL)
+		mutexmap[tid] = mutex;
+	else
+		mutexmap.erase(tid);
 	pthread_mutex_unlock(&condMutex);
+#ifdef __linux__
+	// clients are counted per process in a shared pool
+	if(shm != NULL && shm_lock(shm) == 0) {
+		int i, slot = -1;
+		for(i = 0; i < PIPELINE_SHM_CLIENTS; i++) {
+			if(shm->clients[i].pid == (uint32_t) getpid()) {
+				slot = i;
+				break;
+			}
+			if(slot < 0 && (shm->clients[i].pid == 0 || !shm_alive(shm->clients[i].pid)))
+				slot = i;
+		}
+		if(slot >= 0) {
+			if(shm->clients[slot].pid != (uint32_t) getpid()) {
+				shm->clients[slot].pid = getpid();
+				shm->clients[slot].count = 0;
+			}
+			shm->clients[slot].count++;
+		} else {
+			ga_error("pipeline: too many processes on shared pool '%s'.\n", name());
+		}
+		shm_unlock(shm);
+	}
+#endif
 	return;
 }
 
@@ -283,13 +795,42 @@ void
 pipeline::client_unregister(long tid) {
 	pthread_mutex_lock(&condMutex);
 	condmap.erase(tid);
+	mutexmap.erase(tid);
 	pthread_mutex_unlock(&condMutex);
+#ifdef __linux__
+	if(shm != NULL && shm_lock(shm) == 0) {
+		int i;
+		for(i = 0; i < PIPELINE_SHM_CLIENTS; i++) {
+			if(shm->clients[i].pid != (uint32_t) getpid())
+				continue;
+			if(--shm->clients[i].count <= 0) {
+				shm->clients[i].pid = 0;
+				shm->clients[i].count = 0;
+			}
+			break;
+		}
+		shm_unlock(shm);
+	}
+#endif
 	return;
 }
 
 int
 pipeline::wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
 	int ret;
+#ifdef __linux__
+	if(shm != NULL) {
+		// the producer is in another process, see timedwait()
+		uint32_t val;
+		__sync_fetch_and_add(&shm->waiters, 1);
+		val = shm->notify;
+		__sync_synchronize();
+		if(shm->datacount <= 0)
+			shm_futex_wait(&shm->notify, val, NULL);
+		__sync_fetch_and_sub(&shm->waiters, 1);
+		return 0;
+	}
+#endif
 	pthread_mutex_lock(mutex);
 	ret = pthread_cond_wait(cond, mutex);
 	pthread_mutex_unlock(mutex);
@@ -299,6 +840,21 @@ pipeline::wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
 int 
 pipeline::timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime) {
 	int ret;
+#ifdef __linux__
+	if(shm != NULL) {
+		// the producer is in another process: sleep on the arena futex.
+		// notify is read before datacount, so a store in between is not
+		// missed.
+		uint32_t val;
+		__sync_fetch_and_add(&shm->waiters, 1);
+		val = shm->notify;
+		__sync_synchronize();
+		if(shm->datacount <= 0)
+			shm_futex_wait(&shm->notify, val, abstime);
+		__sync_fetch_and_sub(&shm->waiters, 1);
+		return shm->datacount > 0 ? 0 : ETIMEDOUT;
+	}
+#endif
 	pthread_mutex_lock(mutex);
 	ret = pthread_cond_timedwait(cond, mutex, abstime);
 	pthread_mutex_unlock(mutex);
@@ -308,8 +864,22 @@ pipeline::timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct t
 void
 pipeline::notify_all() {
 	map<long,pthread_cond_t*>::iterator mi;
+	map<long,pthread_mutex_t*>::iterator xi;
+#ifdef __linux__
+	if(shm != NULL) {
+		__sync_fetch_and_add(&shm->notify, 1);
+		if(shm->waiters > 0)
+			shm_futex_wake(&shm->notify);
+	}
+#endif
 	pthread_mutex_lock(&condMutex);
 	for(mi = condmap.begin(); mi != condmap.end(); mi++) {
+		if((xi = mutexmap.find(mi->first)) != mutexmap.end()) {
+			pthread_mutex_lock(xi->second);
+			pthread_cond_signal(mi->second);
+			pthread_mutex_unlock(xi->second);
+			continue;
+		}
 		pthread_cond_signal(mi->second);
 	}
 	pthread_mutex_unlock(&condMutex);
@@ -319,9 +889,22 @@ pipeline::notify_all() {
 void
 pipeline::notify_one(long tid) {
 	map<long,pthread_cond_t*>::iterator mi;
+	map<long,pthread_mutex_t*>::iterator xi;
+#ifdef __linux__
+	// threads of other processes are not known by id
+	if(shm != NULL) {
+		__sync_fetch_and_add(&shm->notify, 1);
+		if(shm->waiters > 0)
+			shm_futex_wake(&shm->notify);
+	}
+#endif
 	pthread_mutex_lock(&condMutex);
 	if((mi = condmap.find(tid)) != condmap.end()) {
+		if((xi = mutexmap.find(tid)) != mutexmap.end())
+			pthread_mutex_lock(xi->second);
 		pthread_cond_signal(mi->second);
+		if(xi != mutexmap.end())
+			pthread_mutex_unlock(xi->second);
 	}
 	pthread_mutex_unlock(&condMutex);
 	return;
@@ -330,9 +913,49 @@ pipeline::notify_one(long tid) {
 int
 pipeline::client_count() {
 	int n;
+#ifdef __linux__
+	if(shm != NULL) {
+		int i;
+		if(shm_lock(shm) != 0)
+			return 0;
+		for(i = n = 0; i < PIPELINE_SHM_CLIENTS; i++) {
+			if(shm->clients[i].count > 0 && shm_alive(shm->clients[i].pid))
+				n += shm->clients[i].count;
+		}
+		shm_unlock(shm);
+		return n;
+	}
+#endif
 	pthread_mutex_lock(&condMutex);
 	n = (int) condmap.size();
 	pthread_mutex_unlock(&condMutex);
 	return n;
 }
 
+int
+pipeline::report(char *buf, int buflen) {
+	map<string,pipeline*>::iterator mi;
+	int len = 0, n;
+	//
+	pthread_mutex_lock(&pipelinemutex);
+	for(mi = pipelinemap.begin(); mi != pipelinemap.end() && len < buflen; mi++) {
+		pipeline *pipe = mi->second;
+		long long count, total, max;
+		pthread_mutex_lock(&pipe->poolmutex);
+		count = pipe->handoffs;
+		total = pipe->handoff_total;
+		max = pipe->handoff_max;
+		pipe->handoff_max = 0;
+		pthread_mutex_unlock(&pipe->poolmutex);
+		if(count == 0)
+			continue;
+		n = snprintf(buf + len, buflen - len,
+			"pipeline %s (%s): frames=%lld handoff avg=%lld us max=%lld us\n",
+			mi->first.c_str(), pipe->shared() ? "shared" : "local",
+			count, total / count, max);
+		len += n < buflen - len ? n : buflen - len;
+	}
+	pthread_mutex_unlock(&pipelinemutex);
+	return len;
+}
+
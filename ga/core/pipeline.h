@@ -26,14 +26,21 @@
 struct pooldata {
 	void *ptr;
 	struct pooldata *next;
+	long long stored;	// when stored into the work pool, in us
 };
 
+// shared-memory pools: rebuilds the process-local pointers of a data
+// after it is acquired by allocate_data() or load_data()
+typedef void (*pipeline_shm_fixup)(void *ptr);
+struct pipeline_shm;
+
 class EXPORT pipeline {
 private:
 	std::string myname;
 	// management of listeners
 	pthread_mutex_t condMutex;
 	std::map<long,pthread_cond_t*> condmap;
+	std::map<long,pthread_mutex_t*> mutexmap;
 	// buffer pool queue
 	pthread_mutex_t poolmutex;
 	struct pooldata *bufpool;		// unused free pool
@@ -44,6 +51,15 @@ private:
 	// private data
 	void *privdata;
 	int privdata_size;
+	// cross-process pool in a named shared-memory arena
+	struct pipeline_shm *shm;
+	int shmsize;
+	struct pooldata *shmdata;	// per-process view of the arena slots
+	pipeline_shm_fixup shmfixup;
+	struct pooldata * shm_acquire(int slot);
+	// latency from store_data() to load_data()
+	long long handoffs, handoff_total, handoff_max;
+	void handoff_count(long long stored);
 public:
 	// static functions
 	static int do_register(const char *provider, pipeline *pipe);
@@ -55,6 +71,11 @@ public:
 	const char * name();
 	// buffer pool
 	struct pooldata * datapool_init(int n, int datasize);
+	// buffer pool shared with other processes: the creator (producer)
+	// initializes the data, and consumers attach to it by name
+	struct pooldata * datapool_init_shm(const char *shmname, int n, int datasize, pipeline_shm_fixup fixup);
+	int datapool_attach_shm(const char *shmname, pipeline_shm_fixup fixup);
+	bool shared();
 	struct pooldata * allocate_data();	  // allocate one free data from free pool
 	void store_data(struct pooldata *data);	  // store one data into work pool
 	struct pooldata * load_data();		  // load one data from work pool
@@ -67,12 +88,15 @@ public:
 	void * get_privdata();
 	int get_privdata_size();
 	// work with clients
-	void client_register(long tid, pthread_cond_t *cond);
+	// with a mutex, notifications are signaled while holding it
+	void client_register(long tid, pthread_cond_t *cond, pthread_mutex_t *mutex = NULL);
 	void client_unregister(long tid);
 	int wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
 	int timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime);
 	void notify_all();
 	void notify_one(long tid);
 	int client_count();
+	// handoff latency of all registered pipelines
+	static int report(char *buf, int buflen);
 };
 #endif /* __PIPELINE_H__ */
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ratecontrol.h"
+
+#define	RC_LOSS_DECREASE	26	// fraction lost > 10%: decrease
+#define	RC_LOSS_HOLD		5	// fraction lost > 2%: hold
+#define	RC_DELAY_THRESHOLD	30	// queuing delay (ms) that signals overuse
+#define	RC_DELAY_BACKOFF	0.85	// decrease factor on delay-based overuse
+#define	RC_INCREASE_RATE	0.08	// multiplicative increase per second
+#define	RC_RTT_MIN_WINDOW	30	// seconds, the baseline is refreshed afterwards
+
+void
+ratecontrol_init(struct ratecontrol *rc, int startrate, int minrate, int maxrate) {
+	bzero(rc, sizeof(struct ratecontrol));
+	rc->minrate = minrate;
+	rc->maxrate = maxrate;
+	if(startrate < minrate)
+		startrate = minrate;
+	if(startrate > maxrate)
+		startrate = maxrate;
+	rc->bitrate = startrate;
+	rc->rtt_min = -1;
+	rc->rtt = -1;
+	gettimeofday(&rc->last_update, NULL);
+	return;
+}
+
+// feed a receiver report into the estimator.
+// returns the new estimate in bps.
+int
+ratecontrol_update(struct ratecontrol *rc, const struct rtcp_feedback *fb) {
+	struct timeval now;
+	double dt, rate = rc->bitrate;
+	int queuing = 0, threshold;
+	//
+	if(rc->bitrate <= 0)
+		return 0;
+	gettimeofday(&now, NULL);
+	if(fb->has_report) {
+		dt = 0.000001 * tvdiff_us(&now, &rc->last_update);
+		if(dt > 5.0)
+			dt = 5.0;
+		rc->last_update = now;
+		rc->loss = fb->report.fraction_lost;
+		rc->rtt = rtcp_rtt_ms(&fb->report, &now);
+		// delay signal: growth of the round-trip time over its baseline
+		if(rc->rtt >= 0) {
+			if(rc->rtt_min < 0 || rc->rtt < rc->rtt_min
+			|| tvdiff_us(&now, &rc->rtt_min_tv) > RC_RTT_MIN_WINDOW * 1000000LL) {
+				rc->rtt_min = rc->rtt;
+				rc->rtt_min_tv = now;
+			}
+			queuing = rc->rtt - rc->rtt_min;
+		}
+		threshold = RC_DELAY_THRESHOLD;
+		if(rc->rtt_min / 2 > threshold)
+			threshold = rc->rtt_min / 2;
+		//
+		if(rc->loss > RC_LOSS_DECREASE || queuing > threshold) {
+			// decrease at most once per round-trip
+			int guard = rc->rtt > 200 ? rc->rtt : 200;
+			if(tvdiff_us(&now, &rc->last_decrease) > guard * 1000LL) {
+				if(rc->loss > RC_LOSS_DECREASE) {
+					rate *= 1.0 - 0.5 * rc->loss / 256.0;
+				} else {
+					rate *= RC_DELAY_BACKOFF;
+				}
+				rc->last_decrease = now;
+			}
+		} else if(rc->loss > RC_LOSS_HOLD || queuing > threshold / 2) {
+			// hold
+		} else {
+			rate *= 1.0 + RC_INCREASE_RATE * dt;
+		}
+	}
+	// the receiver's own estimate is an upper bound
+	if(fb->remb > 0 && rate > fb->remb)
+		rate = (double) fb->remb;
+	//
+	if(rate < rc->minrate)
+		rate = rc->minrate;
+	if(rate > rc->maxrate)
+		rate = rc->maxrate;
+	rc->bitrate = (int) rate;
+	return rc->bitrate;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __RATECONTROL_H__
+#define __RATECONTROL_H__
+
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+
+#include "ga-common.h"
+#include "rtcp.h"
+
+// a loss- and delay-based bandwidth estimator driven by RTCP feedback
+struct ratecontrol {
+	int bitrate;		// current estimate, in bps; 0 - disabled
+	int minrate, maxrate;	// bounds, in bps
+	int rtt_min;		// baseline round-trip time, in ms; -1 - unknown
+	int rtt;		// last round-trip time, in ms; -1 - unknown
+	int loss;		// last fraction lost, x/256
+	struct timeval rtt_min_tv;	// when the baseline was taken
+	struct timeval last_update;
+	struct timeval last_decrease;
+};
+
+EXPORT void ratecontrol_init(struct ratecontrol *rc, int startrate, int minrate, int maxrate);
+EXPORT int ratecontrol_update(struct ratecontrol *rc, const struct rtcp_feedback *fb);
+
+#endif
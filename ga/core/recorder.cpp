@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <errno.h>
+#include <sys/time.h>
+#endif
+
+#include "vsource.h"
+#include "encoder-common.h"
+#include "rtspserver.h"
+#include "recorder.h"
+
+#include "ga-common.h"
+#include "ga-avcodec.h"
+
+// acquired from ffmpeg source code
+extern "C" {
+int ffio_set_buf_size(AVIOContext *s, int buf_size);
+}
+
+#define	RECORDER_IOBUF		(1024*1024)	/* bytes, written to the file at once */
+#define	RECORDER_IDLE		3	/* seconds without packets, before a file ends */
+#define	RECORDER_RETRY		10	/* seconds, after a file cannot be created */
+#define	RECORDER_FRAGMENT	"1000000"	/* us, fragment duration of MP4 files */
+#define	RECORDER_CHANNEL_MAX	(IMAGE_SOURCE_CHANNEL_MAX+1)	/* video channels, then audio */
+
+struct recorder_packet {
+	struct recorder_packet *next;
+	int channel;
+	int key;
+	int gap;		// packets of the channel were dropped before this one
+	int64_t pts;		// in us
+	int size;
+	uint8_t data[1];
+};
+
+static struct RTSPConf *recconf = NULL;
+static AVRational rec_timebase = { 1, 1000000 };	// of queued packets
+
+// the queue, filled by encoder threads
+static pthread_mutex_t recmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reccond = PTHREAD_COND_INITIALIZER;
+static struct recorder_packet *qhead = NULL, *qtail = NULL;
+static int qbytes = 0;		// queued, or being written
+static int qgap[RECORDER_CHANNEL_MAX];
+// statistics, guarded by recmutex
+static char recname[1024] = "";
+static unsigned long long npackets = 0, nbytes = 0, ndropped = 0;
+static unsigned int nfiles = 0;
+
+// the current file, used only by the writer thread
+static AVFormatContext *recfmt = NULL;
+static int recstream[RECORDER_CHANNEL_MAX];	// stream index in the file, -1 - none
+static int waitkey[RECORDER_CHANNEL_MAX];	// video resumes at a keyframe
+static int64_t lastdts[RECORDER_CHANNEL_MAX];
+static int64_t origin;		// in us, pts of the first keyframe of the file
+static int64_t duration;	// in us
+static int keypending = 0;	// a keyframe for the next file has been requested
+static struct timeval retry_tv;
+
+static void
+recorder_close() {
+	if(recfmt == NULL)
+		return;
+	av_write_trailer(recfmt);
+	if((recfmt->oformat->flags & AVFMT_NOFILE) == 0)
+		avio_close(recfmt->pb);
+	ga_error("recorder: %s closed, %.1f seconds.\n", recfmt->filename, duration / 1000000.0);
+	avformat_free_context(recfmt);
+	recfmt = NULL;
+	return;
+}
+
+// create a file from the pattern, with a stream per channel.  the video of
+// other channels starts at their next keyframe.
+static int
+recorder_open(int64_t pts) {
+	AVFormatContext *fmt;
+	AVCodecContext *codec;
+	AVStream *st;
+	AVDictionary *opts = NULL;
+	char name[sizeof(recname)];
+	time_t t = time(NULL);
+	int i;
+	//
+	if(strftime(name, sizeof(name), recconf->record_file, localtime(&t)) == 0) {
+		ga_error("recorder: bad file name pattern %s.\n", recconf->record_file);
+		return -1;
+	}
+	if((fmt = ga_format_init(name)) == NULL) {
+		ga_error("recorder: cannot create %s.\n", name);
+		return -1;
+	}
+	// large writes, rather than one per few packets
+	if(fmt->pb != NULL)
+		ffio_set_buf_size(fmt->pb, RECORDER_IOBUF);
+	for(i = 0; i < video_source_channels()+1 && i < RECORDER_CHANNEL_MAX; i++) {
+		recstream[i] = -1;
+		if((codec = rtsp_codec_parameters(i)) == NULL)
+			continue;
+		if((st = avformat_new_stream(fmt, NULL)) == NULL
+		|| rtsp_codec_copy(i, 0, st->codec) < 0) {
+			ga_error("recorder: cannot create stream %d.\n", i);
+			goto error;
+		}
+		st->codec->codec_tag = 0;
+		if(fmt->oformat->flags & AVFMT_GLOBALHEADER)
+			st->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+		recstream[i] = st->index;
+		waitkey[i] = i < video_source_channels() && i > 0;
+		lastdts[i] = AV_NOPTS_VALUE;
+	}
+	// fragmented MP4: readable up to the last fragment if the server dies
+	if(strcmp(fmt->oformat->name, "mp4") == 0 || strcmp(fmt->oformat->name, "mov") == 0) {
+		av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov", 0);
+		av_dict_set(&opts, "frag_duration", RECORDER_FRAGMENT, 0);
+	}
+	if(avformat_write_header(fmt, &opts) < 0) {
+		ga_error("recorder: cannot write the header of %s.\n", name);
+		av_dict_free(&opts);
+		goto error;
+	}
+	av_dict_free(&opts);
+	for(i = 1; i < video_source_channels(); i++)
+		encoder_keyframe_request(i, 0);
+	recfmt = fmt;
+	origin = pts;
+	duration = 0;
+	pthread_mutex_lock(&recmutex);
+	strncpy(recname, name, sizeof(recname));
+	recname[sizeof(recname)-1] = '\0';
+	nfiles++;
+	pthread_mutex_unlock(&recmutex);
+	ga_error("recorder: recording to %s (%s).\n", name, fmt->oformat->name);
+	return 0;
+error:
+	if((fmt->oformat->flags & AVFMT_NOFILE) == 0)
+		avio_close(fmt->pb);
+	avformat_free_context(fmt);
+	return -1;
+}
+
+// returns 1 if the packet is written to the file, or 0 otherwise
+static int
+recorder_packet_write(struct recorder_packet *p) {
+	struct timeval now;
+	AVStream *st;
+	AVPacket pkt;
+	int ch = p->channel;
+	int video = ch < video_source_channels();
+	//
+	if(p->gap && video) {
+		waitkey[ch] = 1;
+		encoder_keyframe_request(ch, 0);
+	}
+	// files start at a keyframe of the first video channel
+	if(ch == 0 && p->key && (recfmt == NULL || keypending)) {
+		gettimeofday(&now, NULL);
+		recorder_close();
+		keypending = 0;
+		if(tvdiff_us(&now, &retry_tv) < 0)
+			return 0;
+		if(recorder_open(p->pts) < 0) {
+			retry_tv = now;
+			retry_tv.tv_sec += RECORDER_RETRY;
+			return 0;
+		}
+	}
+	if(recfmt == NULL) {
+		if(keypending == 0) {
+			encoder_keyframe_request(0, 0);
+			keypending = 1;
+		}
+		return 0;
+	}
+	if(recstream[ch] < 0)
+		return 0;
+	if(waitkey[ch]) {
+		if(p->key == 0)
+			return 0;
+		waitkey[ch] = 0;
+	}
+	if(p->pts - origin > duration)
+		duration = p->pts - origin;
+	if(recconf->record_segment > 0 && keypending == 0
+	&& duration >= recconf->record_segment * 1000000LL) {
+		encoder_keyframe_request(0, 0);
+		keypending = 1;
+	}
+	st = recfmt->streams[recstream[ch]];
+	av_init_packet(&pkt);
+	pkt.data = p->data;
+	pkt.size = p->size;
+	pkt.stream_index = recstream[ch];
+	pkt.pts = pkt.dts = av_rescale_q(p->pts - origin, rec_timebase, st->time_base);
+	if(p->key)
+		pkt.flags |= AV_PKT_FLAG_KEY;
+	// e.g., audio before the first keyframe
+	if(pkt.dts < 0 || (lastdts[ch] != (int64_t) AV_NOPTS_VALUE && pkt.dts <= lastdts[ch]))
+		return 0;
+	lastdts[ch] = pkt.dts;
+	if(av_interleaved_write_frame(recfmt, &pkt) < 0) {
+		ga_error("recorder: write to %s failed.\n", recfmt->filename);
+		recorder_close();
+		return 0;
+	}
+	return 1;
+}
+
+static void *
+recorder_thread(void *arg) {
+	struct recorder_packet *list, *p;
+	struct timeval now, last;
+	struct timespec abstime;
+	int written;
+	//
+	ga_error("recorder: started (tid %ld).\n", ga_gettid());
+	gettimeofday(&last, NULL);
+	while(true) {
+		pthread_mutex_lock(&recmutex);
+		if(qhead == NULL) {
+			gettimeofday(&now, NULL);
+			abstime.tv_sec = now.tv_sec + 1;
+			abstime.tv_nsec = now.tv_usec * 1000;
+			pthread_cond_timedwait(&reccond, &recmutex, &abstime);
+		}
+		list = qhead;
+		qhead = qtail = NULL;
+		pthread_mutex_unlock(&recmutex);
+		gettimeofday(&now, NULL);
+		if(list == NULL) {
+			// encoders stopped, or lingering without clients
+			if(recfmt != NULL && tvdiff_us(&now, &last) > RECORDER_IDLE * 1000000LL)
+				recorder_close();
+			continue;
+		}
+		last = now;
+		while((p = list) != NULL) {
+			list = p->next;
+			written = recorder_packet_write(p);
+			pthread_mutex_lock(&recmutex);
+			qbytes -= p->size;
+			if(written) {
+				npackets++;
+				nbytes += p->size;
+			}
+			pthread_mutex_unlock(&recmutex);
+			free(p);
+		}
+	}
+	return NULL;
+}
+
+int
+recorder_init(struct RTSPConf *conf) {
+	pthread_t thread;
+	//
+	if(conf->record_file == NULL)
+		return 0;
+	if(pthread_create(&thread, NULL, recorder_thread, NULL) != 0) {
+		ga_error("recorder: cannot create the writer thread.\n");
+		return -1;
+	}
+	pthread_detach(thread);
+	recconf = conf;
+	return 0;
+}
+
+// queue a copy of a packet, in the time base of the encoder.  never waits:
+// the packet is dropped if the writer is behind by record-queue bytes.
+// returns 0 on success, or -1 if the packet is dropped.
+int
+recorder_write(int channelId, AVPacket *pkt, int64_t encoderPts) {
+	struct recorder_packet *p;
+	AVCodecContext *codec;
+	//
+	if(recconf == NULL || channelId < 0 || channelId >= RECORDER_CHANNEL_MAX)
+		return 0;
+	if(encoderPts == (int64_t) AV_NOPTS_VALUE
+	|| (codec = rtsp_codec_parameters(channelId)) == NULL)
+		return -1;
+	pthread_mutex_lock(&recmutex);
+	if(qbytes + pkt->size > recconf->record_queue) {
+		qgap[channelId] = 1;
+		ndropped++;
+		pthread_mutex_unlock(&recmutex);
+		return -1;
+	}
+	qbytes += pkt->size;
+	pthread_mutex_unlock(&recmutex);
+	// copied without the lock
+	if((p = (struct recorder_packet*) malloc(sizeof(struct recorder_packet) + pkt->size)) != NULL) {
+		p->next = NULL;
+		p->channel = channelId;
+		p->key = (pkt->flags & AV_PKT_FLAG_KEY) ? 1 : 0;
+		p->pts = av_rescale_q(encoderPts, codec->time_base, rec_timebase);
+		p->size = pkt->size;
+		memcpy(p->data, pkt->data, pkt->size);
+	}
+	pthread_mutex_lock(&recmutex);
+	if(p == NULL) {
+		qbytes -= pkt->size;
+		qgap[channelId] = 1;
+		ndropped++;
+		pthread_mutex_unlock(&recmutex);
+		return -1;
+	}
+	p->gap = qgap[channelId];
+	qgap[channelId] = 0;
+	if(qtail == NULL) {
+		qhead = qtail = p;
+	} else {
+		qtail->next = p;
+		qtail = p;
+	}
+	pthread_cond_signal(&reccond);
+	pthread_mutex_unlock(&recmutex);
+	return 0;
+}
+
+// for the encoder control socket
+int
+recorder_report(char *buf, int buflen) {
+	int len;
+	//
+	if(recconf == NULL)
+		return 0;
+	pthread_mutex_lock(&recmutex);
+	len = snprintf(buf, buflen,
+		"recorder: file=%s files=%u packets=%llu bytes=%llu dropped=%llu queued=%d bytes\n",
+		recname[0] ? recname : "-", nfiles, npackets, nbytes, ndropped, qbytes);
+	pthread_mutex_unlock(&recmutex);
+	return len < buflen ? len : buflen;
+}
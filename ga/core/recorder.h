@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include "ga-common.h"
+#include "ga-avcodec.h"
+#include "rtspconf.h"
+
+// a tee of the encoded streams into files.  packets delivered to clients
+// are copied to a queue, and remuxed by a writer thread; the encoders never
+// wait for the disk, packets are dropped instead, and video resumes at the
+// next keyframe.  files are rotated at keyframes every record-segment
+// seconds.
+
+EXPORT int recorder_init(struct RTSPConf *conf);
+EXPORT int recorder_write(int channelId, AVPacket *pkt, int64_t encoderPts);
+EXPORT int recorder_report(char *buf, int buflen);
+
+#endif
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "rtcp.h"
+
+#define	RTCP_RB16(p)	((((unsigned) (p)[0]) << 8) | (p)[1])
+#define	RTCP_RB24(p)	((((unsigned) (p)[0]) << 16) | (((unsigned) (p)[1]) << 8) | (p)[2])
+#define	RTCP_RB32(p)	((((unsigned) (p)[0]) << 24) | (((unsigned) (p)[1]) << 16) \
+			| (((unsigned) (p)[2]) << 8) | (p)[3])
+
+// seconds between 1900 (NTP epoch) and 1970 (UNIX epoch)
+#define	NTP_UNIX_OFFSET	2208988800U
+
+static void
+rtcp_parse_report_block(const unsigned char *p, struct rtcp_report_block *rb) {
+	rb->ssrc = RTCP_RB32(p);
+	rb->fraction_lost = p[4];
+	rb->cumulative_lost = RTCP_RB24(p+5);
+	if(rb->cumulative_lost & 0x800000)	// signed 24-bit
+		rb->cumulative_lost -= 0x1000000;
+	rb->highest_seq = RTCP_RB32(p+8);
+	rb->jitter = RTCP_RB32(p+12);
+	rb->lsr = RTCP_RB32(p+16);
+	rb->dlsr = RTCP_RB32(p+20);
+	return;
+}
+
+static void
+rtcp_add_nack(struct rtcp_feedback *fb, unsigned short seq) {
+	if(fb->nnack < RTCP_NACK_MAX)
+		fb->nack[fb->nnack++] = seq;
+	return;
+}
+
+// parse a compound RTCP packet.
+// returns 0 on success, or -1 if the packet is malformed.
+int
+rtcp_parse(const unsigned char *buf, int buflen, struct rtcp_feedback *fb) {
+	const unsigned char *p = buf, *end = buf + buflen;
+	int version, count, pt, len;
+	//
+	bzero(fb, sizeof(struct rtcp_feedback));
+	while(end - p >= 4) {
+		version = p[0] >> 6;
+		count = p[0] & 0x1f;
+		pt = p[1];
+		len = (RTCP_RB16(p+2) + 1) * 4;
+		if(version != 2 || len > end - p) {
+			return -1;
+		}
+		switch(pt) {
+		case RTCP_PT_SR:
+		case RTCP_PT_RR:
+			if(len < 8)
+				return -1;
+			fb->sender_ssrc = RTCP_RB32(p+4);
+			do {
+				// SR carries 20 bytes of sender info
+				int off = (pt == RTCP_PT_SR) ? 28 : 8;
+				if(count > 0 && off + 24 <= len && fb->has_report == 0) {
+					rtcp_parse_report_block(p+off, &fb->report);
+					fb->has_report = 1;
+				}
+			} while(0);
+			break;
+		case RTCP_PT_RTPFB:
+			if(len < 12)
+				return -1;
+			fb->sender_ssrc = RTCP_RB32(p+4);
+			if(count == RTCP_RTPFB_NACK) {
+				const unsigned char *fci;
+				for(fci = p+12; fci + 4 <= p + len; fci += 4) {
+					unsigned short pid = RTCP_RB16(fci);
+					unsigned short blp = RTCP_RB16(fci+2);
+					int i;
+					rtcp_add_nack(fb, pid);
+					for(i = 0; i < 16; i++) {
+						if(blp & (1<<i))
+							rtcp_add_nack(fb, pid+i+1);
+					}
+				}
+			}
+			break;
+		case RTCP_PT_PSFB:
+			if(len < 12)
+				return -1;
+			fb->sender_ssrc = RTCP_RB32(p+4);
+			if(count == RTCP_PSFB_PLI) {
+				fb->pli++;
+			} else if(count == RTCP_PSFB_FIR) {
+				fb->fir++;
+			} else if(count == RTCP_PSFB_AFB && len >= 20
+			&& memcmp(p+12, "REMB", 4) == 0) {
+				// num-ssrc(8), exp(6), mantissa(18)
+				int exp = p[17] >> 2;
+				long long mantissa = ((p[17] & 0x03) << 16) | (p[18] << 8) | p[19];
+				fb->remb = mantissa << exp;
+			}
+			break;
+		default:
+			// SDES, BYE, APP, ...: ignored
+			break;
+		}
+		p += len;
+	}
+	return 0;
+}
+
+static void
+rtcp_wb16(unsigned char *p, unsigned int v) {
+	p[0] = (v >> 8) & 0x0ff;
+	p[1] = v & 0x0ff;
+	return;
+}
+
+static void
+rtcp_wb32(unsigned char *p, unsigned int v) {
+	rtcp_wb16(p, v >> 16);
+	rtcp_wb16(p+2, v);
+	return;
+}
+
+// build a generic NACK for lost packets, seq in increasing order.
+// returns the packet length, or -1 if buf is too small.
+int
+rtcp_build_nack(unsigned char *buf, int buflen, unsigned int sender_ssrc, unsigned int media_ssrc, const unsigned short *seq, int nseq) {
+	int i, len = 12;
+	//
+	if(nseq <= 0 || buflen < 16)
+		return -1;
+	for(i = 0; i < nseq; ) {
+		unsigned short pid = seq[i++];
+		unsigned short blp = 0;
+		// following losses within 16 packets go to the bitmask
+		while(i < nseq && (unsigned short) (seq[i] - pid - 1) < 16) {
+			blp |= 1 << (unsigned short) (seq[i] - pid - 1);
+			i++;
+		}
+		if(len + 4 > buflen)
+			return -1;
+		rtcp_wb16(buf+len, pid);
+		rtcp_wb16(buf+len+2, blp);
+		len += 4;
+	}
+	buf[0] = 0x80 | RTCP_RTPFB_NACK;
+	buf[1] = RTCP_PT_RTPFB;
+	rtcp_wb16(buf+2, len/4 - 1);
+	rtcp_wb32(buf+4, sender_ssrc);
+	rtcp_wb32(buf+8, media_ssrc);
+	return len;
+}
+
+// build a picture loss indication.
+// returns the packet length, or -1 if buf is too small.
+int
+rtcp_build_pli(unsigned char *buf, int buflen, unsigned int sender_ssrc, unsigned int media_ssrc) {
+	if(buflen < 12)
+		return -1;
+	buf[0] = 0x80 | RTCP_PSFB_PLI;
+	buf[1] = RTCP_PT_PSFB;
+	rtcp_wb16(buf+2, 2);
+	rtcp_wb32(buf+4, sender_ssrc);
+	rtcp_wb32(buf+8, media_ssrc);
+	return 12;
+}
+
+// build a sender report, followed by an SDES with the CNAME if one is given.
+// returns the length of the compound packet, or -1 if buf is too small.
+int
+rtcp_build_sr(unsigned char *buf, int buflen, unsigned int ssrc, const struct timeval *ntp, unsigned int rtpts, unsigned int packets, unsigned int octets, const char *cname) {
+	int len = 28, namelen, sdeslen;
+	//
+	if(buflen < len)
+		return -1;
+	buf[0] = 0x80;
+	buf[1] = RTCP_PT_SR;
+	rtcp_wb16(buf+2, len/4 - 1);
+	rtcp_wb32(buf+4, ssrc);
+	rtcp_wb32(buf+8, (unsigned int) ntp->tv_sec + NTP_UNIX_OFFSET);
+	rtcp_wb32(buf+12, (unsigned int) (((long long) ntp->tv_usec << 32) / 1000000));
+	rtcp_wb32(buf+16, rtpts);
+	rtcp_wb32(buf+20, packets);
+	rtcp_wb32(buf+24, octets);
+	if(cname == NULL || *cname == '\0')
+		return len;
+	// header, ssrc, the item, and at least one null octet, 32-bit aligned
+	if((namelen = strlen(cname)) > 255)
+		namelen = 255;
+	sdeslen = (8 + 2 + namelen + 1 + 3) & ~3;
+	if(len + sdeslen > buflen)
+		return -1;
+	bzero(buf+len, sdeslen);
+	buf[len] = 0x81;
+	buf[len+1] = RTCP_PT_SDES;
+	rtcp_wb16(buf+len+2, sdeslen/4 - 1);
+	rtcp_wb32(buf+len+4, ssrc);
+	buf[len+8] = 1;		// CNAME
+	buf[len+9] = namelen;
+	memcpy(buf+len+10, cname, namelen);
+	return len + sdeslen;
+}
+
+unsigned int
+rtcp_ntp_middle32(const struct timeval *tv) {
+	unsigned int sec = (unsigned int) tv->tv_sec + NTP_UNIX_OFFSET;
+	unsigned int frac = (unsigned int) (((long long) tv->tv_usec << 16) / 1000000);
+	return (sec << 16) | (frac & 0x0ffff);
+}
+
+// round-trip time from a report block (RFC 3550, section 6.4.1).
+// returns -1 if the receiver has not seen a sender report yet.
+int
+rtcp_rtt_ms(const struct rtcp_report_block *rb, const struct timeval *now) {
+	unsigned int rtt;
+	if(rb->lsr == 0)
+		return -1;
+	rtt = rtcp_ntp_middle32(now) - rb->lsr - rb->dlsr;
+	if(rtt & 0x80000000)	// clock skew, should not happen
+		return 0;
+	return (int) (((long long) rtt * 1000) >> 16);
+}
+
+void
+rtcp_stats_init(struct rtcp_stats *st, int clockrate) {
+	bzero(st, sizeof(struct rtcp_stats));
+	st->clockrate = clockrate;
+	st->rtt = -1;
+	return;
+}
+
+// count an RTP packet sent.  without the capture clock, the first packet
+// of each new frame maps its timestamp to the wall clock; RTCP packets are
+// not counted.
+void
+rtcp_stats_sent(struct rtcp_stats *st, const unsigned char *pkt, int pktlen, const struct timeval *now) {
+	int hdrlen;
+	unsigned int ts;
+	//
+	if(pktlen < 12 || (pkt[0] >> 6) != 2)
+		return;
+	if(pkt[1] >= 192 && pkt[1] <= 223)	// RTCP (RFC 5761)
+		return;
+	hdrlen = 12 + 4 * (pkt[0] & 0x0f);
+	if((pkt[0] & 0x10) && hdrlen + 4 <= pktlen)	// header extension
+		hdrlen += 4 + 4 * RTCP_RB16(pkt+hdrlen+2);
+	if(hdrlen > pktlen)
+		return;
+	ts = RTCP_RB32(pkt+4);
+	if(st->captured == 0 && (st->packets == 0 || (int) (ts - st->rtpts) > 0)) {
+		st->rtpts = ts;
+		st->rtpts_tv = *now;
+	}
+	st->ssrc = RTCP_RB32(pkt+8);
+	st->packets++;
+	st->octets += pktlen - hdrlen;
+	return;
+}
+
+// map the timestamp of an RTP packet to the capture time of its frame, so
+// that the sender reports of all streams share the clock of the sources.
+// returns -1 if the packet is not RTP, or 0 otherwise.
+int
+rtcp_stats_captured(struct rtcp_stats *st, const unsigned char *pkt, int pktlen, const struct timeval *captured) {
+	unsigned int ts;
+	//
+	if(pktlen < 12 || (pkt[0] >> 6) != 2)
+		return -1;
+	if(pkt[1] >= 192 && pkt[1] <= 223)	// RTCP (RFC 5761)
+		return -1;
+	ts = RTCP_RB32(pkt+4);
+	if(st->captured == 0 || (int) (ts - st->rtpts) > 0) {
+		st->rtpts = ts;
+		st->rtpts_tv = *captured;
+		st->captured = 1;
+	}
+	return 0;
+}
+
+// build a sender report for what has been sent: the timestamp of the last
+// frame, advanced by the time since it was captured (or sent).
+// returns the packet length, or -1 if there is nothing to report.
+int
+rtcp_stats_build_sr(struct rtcp_stats *st, unsigned char *buf, int buflen, const char *cname, const struct timeval *now) {
+	unsigned int rtpts;
+	int len;
+	//
+	if(st->packets == 0 || st->clockrate <= 0)
+		return -1;
+	rtpts = st->rtpts + (unsigned int) (tvdiff_us((struct timeval*) now, &st->rtpts_tv)
+			* st->clockrate / 1000000);
+	if((len = rtcp_build_sr(buf, buflen, st->ssrc, now, rtpts,
+			st->packets, st->octets, cname)) < 0)
+		return -1;
+	st->srcount++;
+	st->sr_tv = *now;
+	return len;
+}
+
+// keep a receiver report about the stream.
+// returns -1 if the report is about another source, or 0 otherwise.
+int
+rtcp_stats_received(struct rtcp_stats *st, const struct rtcp_report_block *rb, const struct timeval *now) {
+	if(st->ssrc != 0 && rb->ssrc != st->ssrc)
+		return -1;
+	st->report = *rb;
+	st->rr_tv = *now;
+	st->rrcount++;
+	st->rtt = rtcp_rtt_ms(rb, now);
+	return 0;
+}
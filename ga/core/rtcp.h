@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __RTCP_H__
+#define __RTCP_H__
+
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+
+#include "ga-common.h"
+
+// RTCP packet types
+#define	RTCP_PT_SR	200
+#define	RTCP_PT_RR	201
+#define	RTCP_PT_SDES	202
+#define	RTCP_PT_BYE	203
+#define	RTCP_PT_APP	204
+#define	RTCP_PT_RTPFB	205	// transport layer feedback (RFC 4585)
+#define	RTCP_PT_PSFB	206	// payload-specific feedback (RFC 4585)
+
+// feedback message types (FMT)
+#define	RTCP_RTPFB_NACK	1	// generic NACK
+#define	RTCP_PSFB_PLI	1	// picture loss indication
+#define	RTCP_PSFB_FIR	4	// full intra request (RFC 5104)
+#define	RTCP_PSFB_AFB	15	// application layer feedback, e.g., REMB
+
+#define	RTCP_NACK_MAX	128
+
+struct rtcp_report_block {
+	unsigned int ssrc;
+	int fraction_lost;		// fixed point, x/256
+	int cumulative_lost;
+	unsigned int highest_seq;	// extended highest sequence number received
+	unsigned int jitter;		// in RTP timestamp units
+	unsigned int lsr;		// middle 32 bits of the last SR NTP timestamp
+	unsigned int dlsr;		// in 1/65536 seconds
+};
+
+struct rtcp_feedback {
+	unsigned int sender_ssrc;
+	int has_report;
+	struct rtcp_report_block report;	// the first report block
+	int pli;			// number of PLI messages
+	int fir;			// number of FIR messages
+	long long remb;			// receiver estimated max bitrate, 0 - none
+	int nnack;
+	unsigned short nack[RTCP_NACK_MAX];	// sequence numbers of lost packets
+};
+
+// a sender's view of a stream: the RTP packets sent, for sender reports,
+// and the latest receiver report about them
+struct rtcp_stats {
+	unsigned int ssrc;		// 0 - nothing sent yet
+	int clockrate;			// RTP timestamp units per second
+	unsigned int packets;
+	unsigned int octets;		// payload octets
+	unsigned int rtpts;		// timestamp of the last frame sent
+	struct timeval rtpts_tv;	// when it was captured, or its first packet sent
+	int captured;			// rtpts_tv is from the capture clock
+	unsigned int srcount;
+	struct timeval sr_tv;		// the last sender report
+	unsigned int rrcount;		// 0 - no report yet
+	struct timeval rr_tv;
+	struct rtcp_report_block report;
+	int rtt;			// in ms; -1 - unknown
+};
+
+EXPORT int rtcp_parse(const unsigned char *buf, int buflen, struct rtcp_feedback *fb);
+EXPORT int rtcp_build_nack(unsigned char *buf, int buflen, unsigned int sender_ssrc, unsigned int media_ssrc, const unsigned short *seq, int nseq);
+EXPORT int rtcp_build_pli(unsigned char *buf, int buflen, unsigned int sender_ssrc, unsigned int media_ssrc);
+EXPORT int rtcp_build_sr(unsigned char *buf, int buflen, unsigned int ssrc, const struct timeval *ntp, unsigned int rtpts, unsigned int packets, unsigned int octets, const char *cname);
+EXPORT unsigned int rtcp_ntp_middle32(const struct timeval *tv);
+EXPORT int rtcp_rtt_ms(const struct rtcp_report_block *rb, const struct timeval *now);
+EXPORT void rtcp_stats_init(struct rtcp_stats *st, int clockrate);
+EXPORT void rtcp_stats_sent(struct rtcp_stats *st, const unsigned char *pkt, int pktlen, const struct timeval *now);
+EXPORT int rtcp_stats_captured(struct rtcp_stats *st, const unsigned char *pkt, int pktlen, const struct timeval *captured);
+EXPORT int rtcp_stats_build_sr(struct rtcp_stats *st, unsigned char *buf, int buflen, const char *cname, const struct timeval *now);
+EXPORT int rtcp_stats_received(struct rtcp_stats *st, const struct rtcp_report_block *rb, const struct timeval *now);
+
+#endif
@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rtp-fec.h"
+
+#define	RTP_HEADER_SIZE		12
+#define	RTP_FEC_PAYLOAD_MAX	2048	// larger packets are not protected
+#define	RTP_FEC_HISTORY		256	// packets kept by a receiver
+
+#define	FEC_RB16(p)	((((unsigned) (p)[0]) << 8) | (p)[1])
+#define	FEC_RB32(p)	((((unsigned) (p)[0]) << 24) | (((unsigned) (p)[1]) << 16) \
+			| (((unsigned) (p)[2]) << 8) | (p)[3])
+
+struct rtp_fec_encoder {
+	pthread_mutex_t mutex;
+	int pt;
+	int group;		// media packets per FEC packet
+	unsigned short fecseq;
+	// the group being protected
+	int count;
+	unsigned short base;	// sequence number of the first packet
+	unsigned char bits[2];	// P, X, CC, M, and PT
+	unsigned int ts;
+	unsigned short length;
+	int maxlen;
+	unsigned int lastts;
+	unsigned int ssrc;
+	uint8_t payload[RTP_FEC_PAYLOAD_MAX];
+	uint8_t fec[RTP_HEADER_SIZE + RTP_FEC_OVERHEAD + RTP_FEC_PAYLOAD_MAX];
+	struct rtp_fec_stats stats;
+};
+
+struct rtp_fec_slot {
+	int pktlen;		// 0 - empty
+	unsigned short seq;
+	uint8_t pkt[RTP_HEADER_SIZE + RTP_FEC_PAYLOAD_MAX];
+};
+
+struct rtp_fec_decoder {
+	int pt;
+	struct rtp_fec_slot *slots;
+	uint8_t payload[RTP_FEC_PAYLOAD_MAX];
+	struct rtp_fec_stats stats;
+};
+
+static void
+fec_wb16(uint8_t *p, unsigned int v) {
+	p[0] = (v >> 8) & 0x0ff;
+	p[1] = v & 0x0ff;
+	return;
+}
+
+static void
+fec_wb32(uint8_t *p, unsigned int v) {
+	fec_wb16(p, v >> 16);
+	fec_wb16(p+2, v);
+	return;
+}
+
+static int
+fec_is_media(const uint8_t *pkt, int pktlen) {
+	if(pktlen < RTP_HEADER_SIZE || (pkt[0] >> 6) != 2)
+		return 0;
+	// RTCP packet types (200-206) share the second byte
+	if(pkt[1] >= 192 && pkt[1] <= 223)
+		return 0;
+	return 1;
+}
+
+static int
+fec_clamp_group(int group) {
+	if(group <= 0)
+		return 0;
+	if(group < RTP_FEC_GROUP_MIN)
+		return RTP_FEC_GROUP_MIN;
+	if(group > RTP_FEC_GROUP_MAX)
+		return RTP_FEC_GROUP_MAX;
+	return group;
+}
+
+// group: media packets per FEC packet, 0 - no FEC packets are generated
+struct rtp_fec_encoder *
+rtp_fec_encoder_create(int payload_type, int group) {
+	struct rtp_fec_encoder *e;
+	if((e = (struct rtp_fec_encoder*) malloc(sizeof(struct rtp_fec_encoder))) == NULL)
+		return NULL;
+	bzero(e, sizeof(struct rtp_fec_encoder));
+	e->pt = payload_type & 0x7f;
+	e->group = fec_clamp_group(group);
+	e->fecseq = rand() & 0x0ffff;
+	pthread_mutex_init(&e->mutex, NULL);
+	return e;
+}
+
+void
+rtp_fec_encoder_destroy(struct rtp_fec_encoder *e) {
+	if(e == NULL)
+		return;
+	pthread_mutex_destroy(&e->mutex);
+	free(e);
+	return;
+}
+
+int
+rtp_fec_encoder_group(struct rtp_fec_encoder *e) {
+	return e->group;
+}
+
+void
+rtp_fec_encoder_set_group(struct rtp_fec_encoder *e, int group) {
+	pthread_mutex_lock(&e->mutex);
+	e->group = fec_clamp_group(group);
+	pthread_mutex_unlock(&e->mutex);
+	return;
+}
+
+// adapt the group size to the fraction lost (x/256) of a receiver report.
+// the report reflects losses left after recovery, so the protection is
+// raised at once on a loss, and lowered one step per loss-free report.
+// returns the new group size.
+int
+rtp_fec_encoder_adapt(struct rtp_fec_encoder *e, int fraction_lost) {
+	int group, target;
+	pthread_mutex_lock(&e->mutex);
+	group = e->group;
+	if(fraction_lost > 0) {
+		// about one FEC packet per two expected losses
+		target = fec_clamp_group(128 / fraction_lost);
+		if(target < group)
+			group = target;
+	} else if(group < RTP_FEC_GROUP_MAX) {
+		group++;
+	}
+	e->group = group;
+	pthread_mutex_unlock(&e->mutex);
+	return group;
+}
+
+// add an outgoing media packet to the current group.  a group is closed
+// when it is full, or at the end of a frame once it is half full, so the
+// parity of a frame does not wait for the next frame.
+// returns the length of the FEC packet (in *fec, valid until the next
+// call) if the group is closed, or 0 otherwise.
+int
+rtp_fec_encode(struct rtp_fec_encoder *e, const uint8_t *pkt, int pktlen, const uint8_t **fec) {
+	unsigned short seq, mask;
+	int i, len, ret = 0;
+	uint8_t *p;
+	//
+	if(fec_is_media(pkt, pktlen) == 0)
+		return 0;
+	len = pktlen - RTP_HEADER_SIZE;
+	seq = FEC_RB16(pkt+2);
+	pthread_mutex_lock(&e->mutex);
+	e->stats.media_packets++;
+	e->stats.media_bytes += pktlen;
+	if(e->group <= 0 || len > RTP_FEC_PAYLOAD_MAX) {
+		e->count = 0;
+		goto quit;
+	}
+	if(e->count > 0 && seq != (unsigned short) (e->base + e->count))
+		e->count = 0;
+	if(e->count == 0) {
+		e->base = seq;
+		e->bits[0] = e->bits[1] = 0;
+		e->ts = 0;
+		e->length = 0;
+		e->maxlen = 0;
+	}
+	e->bits[0] ^= pkt[0];
+	e->bits[1] ^= pkt[1];
+	e->ts ^= FEC_RB32(pkt+4);
+	e->length ^= len;
+	if(len > e->maxlen) {
+		bzero(e->payload + e->maxlen, len - e->maxlen);
+		e->maxlen = len;
+	}
+	for(i = 0; i < len; i++)
+		e->payload[i] ^= pkt[RTP_HEADER_SIZE+i];
+	e->lastts = FEC_RB32(pkt+4);
+	e->ssrc = FEC_RB32(pkt+8);
+	e->count++;
+	if(e->count < e->group
+	&& ((pkt[1] & 0x80) == 0 || e->count * 2 < e->group))
+		goto quit;
+	// RTP header
+	p = e->fec;
+	p[0] = 0x80;
+	p[1] = e->pt;
+	fec_wb16(p+2, e->fecseq++);
+	fec_wb32(p+4, e->lastts);
+	fec_wb32(p+8, e->ssrc);
+	// FEC header: E=0, L=0 (16-bit mask), recovery fields
+	p += RTP_HEADER_SIZE;
+	p[0] = e->bits[0] & 0x3f;
+	p[1] = e->bits[1];
+	fec_wb16(p+2, e->base);
+	fec_wb32(p+4, e->ts);
+	fec_wb16(p+8, e->length);
+	// level 0 header: protection length and mask
+	for(mask = 0, i = 0; i < e->count; i++)
+		mask |= 0x8000 >> i;
+	fec_wb16(p+10, e->maxlen);
+	fec_wb16(p+12, mask);
+	bcopy(e->payload, p+RTP_FEC_OVERHEAD, e->maxlen);
+	ret = RTP_HEADER_SIZE + RTP_FEC_OVERHEAD + e->maxlen;
+	e->stats.fec_packets++;
+	e->stats.fec_bytes += ret;
+	e->count = 0;
+	*fec = e->fec;
+quit:
+	pthread_mutex_unlock(&e->mutex);
+	return ret;
+}
+
+void
+rtp_fec_encoder_get_stats(struct rtp_fec_encoder *e, struct rtp_fec_stats *stats) {
+	pthread_mutex_lock(&e->mutex);
+	bcopy(&e->stats, stats, sizeof(struct rtp_fec_stats));
+	pthread_mutex_unlock(&e->mutex);
+	return;
+}
+
+struct rtp_fec_decoder *
+rtp_fec_decoder_create(int payload_type) {
+	struct rtp_fec_decoder *d;
+	if((d = (struct rtp_fec_decoder*) malloc(sizeof(struct rtp_fec_decoder))) == NULL)
+		return NULL;
+	bzero(d, sizeof(struct rtp_fec_decoder));
+	if((d->slots = (struct rtp_fec_slot*) malloc(RTP_FEC_HISTORY * sizeof(struct rtp_fec_slot))) == NULL) {
+		free(d);
+		return NULL;
+	}
+	bzero(d->slots, RTP_FEC_HISTORY * sizeof(struct rtp_fec_slot));
+	d->pt = payload_type & 0x7f;
+	return d;
+}
+
+void
+rtp_fec_decoder_destroy(struct rtp_fec_decoder *d) {
+	if(d == NULL)
+		return;
+	free(d->slots);
+	free(d);
+	return;
+}
+
+static void
+fec_keep(struct rtp_fec_decoder *d, const uint8_t *pkt, int pktlen) {
+	unsigned short seq = FEC_RB16(pkt+2);
+	struct rtp_fec_slot *slot = &d->slots[seq % RTP_FEC_HISTORY];
+	if(pktlen > (int) sizeof(slot->pkt)) {
+		slot->pktlen = 0;
+		return;
+	}
+	slot->seq = seq;
+	slot->pktlen = pktlen;
+	bcopy(pkt, slot->pkt, pktlen);
+	return;
+}
+
+// process an incoming RTP packet.  media packets are kept for recovery.
+// a FEC packet protecting exactly one missing packet is replaced, in
+// place, by the recovered packet: it is never longer than the FEC packet.
+// returns 1 if a packet is recovered, 0 for media packets, or -1 for
+// other FEC packets, which should be dropped.
+int
+rtp_fec_decode(struct rtp_fec_decoder *d, uint8_t *pkt, unsigned int *pktlen) {
+	struct rtp_fec_slot *slot;
+	const uint8_t *h;
+	unsigned short base, mask, seq = 0;
+	unsigned int ts, length, protlen;
+	unsigned char bits[2];
+	int i, j, nmissing = 0;
+	//
+	if(fec_is_media(pkt, *pktlen) == 0)
+		return 0;
+	if((pkt[1] & 0x7f) != d->pt) {
+		d->stats.media_packets++;
+		d->stats.media_bytes += *pktlen;
+		fec_keep(d, pkt, *pktlen);
+		return 0;
+	}
+	d->stats.fec_packets++;
+	d->stats.fec_bytes += *pktlen;
+	if(*pktlen < RTP_HEADER_SIZE + RTP_FEC_OVERHEAD)
+		return -1;
+	h = pkt + RTP_HEADER_SIZE;
+	base = FEC_RB16(h+2);
+	protlen = FEC_RB16(h+10);
+	mask = FEC_RB16(h+12);
+	if(protlen > RTP_FEC_PAYLOAD_MAX
+	|| protlen > *pktlen - RTP_HEADER_SIZE - RTP_FEC_OVERHEAD)
+		return -1;
+	for(i = 0; i < 16; i++) {
+		unsigned short s = base + i;
+		if((mask & (0x8000 >> i)) == 0)
+			continue;
+		slot = &d->slots[s % RTP_FEC_HISTORY];
+		if(slot->pktlen == 0 || slot->seq != s) {
+			seq = s;
+			nmissing++;
+		}
+	}
+	if(nmissing != 1) {
+		if(nmissing > 1)
+			d->stats.unrecoverable++;
+		return -1;
+	}
+	// XOR the FEC packet with the packets received
+	bits[0] = h[0];
+	bits[1] = h[1];
+	ts = FEC_RB32(h+4);
+	length = FEC_RB16(h+8);
+	bcopy(h+RTP_FEC_OVERHEAD, d->payload, protlen);
+	for(i = 0; i < 16; i++) {
+		unsigned short s = base + i;
+		int len;
+		if((mask & (0x8000 >> i)) == 0 || s == seq)
+			continue;
+		slot = &d->slots[s % RTP_FEC_HISTORY];
+		len = slot->pktlen - RTP_HEADER_SIZE;
+		bits[0] ^= slot->pkt[0];
+		bits[1] ^= slot->pkt[1];
+		ts ^= FEC_RB32(slot->pkt+4);
+		length ^= len;
+		if(len > (int) protlen)
+			len = protlen;
+		for(j = 0; j < len; j++)
+			d->payload[j] ^= slot->pkt[RTP_HEADER_SIZE+j];
+	}
+	if(length > protlen)
+		return -1;
+	// rebuild the packet over the FEC packet, keeping the SSRC
+	pkt[0] = 0x80 | (bits[0] & 0x3f);
+	pkt[1] = bits[1];
+	fec_wb16(pkt+2, seq);
+	fec_wb32(pkt+4, ts);
+	memmove(pkt+RTP_HEADER_SIZE, d->payload, length);
+	*pktlen = RTP_HEADER_SIZE + length;
+	fec_keep(d, pkt, *pktlen);
+	d->stats.recovered++;
+	return 1;
+}
+
+void
+rtp_fec_decoder_get_stats(struct rtp_fec_decoder *d, struct rtp_fec_stats *stats) {
+	bcopy(&d->stats, stats, sizeof(struct rtp_fec_stats));
+	return;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __RTP_FEC_H__
+#define __RTP_FEC_H__
+
+#include <stdint.h>
+
+#include "ga-common.h"
+
+// XOR parity over groups of consecutive RTP packets, in the packet
+// format of ULPFEC (RFC 5109) with a single protection level.  FEC
+// packets are sent in the media stream with their own payload type and
+// sequence numbers, so receivers not aware of them simply drop them.
+
+#define	RTP_FEC_OVERHEAD	14	// FEC and level headers, added to the largest packet
+#define	RTP_FEC_GROUP_MIN	2
+#define	RTP_FEC_GROUP_MAX	16	// limited by the 16-bit mask
+
+struct rtp_fec_stats {
+	unsigned long long media_bytes;
+	unsigned long long fec_bytes;
+	unsigned int media_packets;
+	unsigned int fec_packets;
+	unsigned int recovered;		// receiver only
+	unsigned int unrecoverable;	// receiver only, more than one loss in a group
+};
+
+// sender
+EXPORT struct rtp_fec_encoder * rtp_fec_encoder_create(int payload_type, int group);
+EXPORT void rtp_fec_encoder_destroy(struct rtp_fec_encoder *e);
+EXPORT int rtp_fec_encoder_group(struct rtp_fec_encoder *e);
+EXPORT void rtp_fec_encoder_set_group(struct rtp_fec_encoder *e, int group);
+EXPORT int rtp_fec_encoder_adapt(struct rtp_fec_encoder *e, int fraction_lost);
+EXPORT int rtp_fec_encode(struct rtp_fec_encoder *e, const uint8_t *pkt, int pktlen, const uint8_t **fec);
+EXPORT void rtp_fec_encoder_get_stats(struct rtp_fec_encoder *e, struct rtp_fec_stats *stats);
+// receiver
+EXPORT struct rtp_fec_decoder * rtp_fec_decoder_create(int payload_type);
+EXPORT void rtp_fec_decoder_destroy(struct rtp_fec_decoder *d);
+EXPORT int rtp_fec_decode(struct rtp_fec_decoder *d, uint8_t *pkt, unsigned int *pktlen);
+EXPORT void rtp_fec_decoder_get_stats(struct rtp_fec_decoder *d, struct rtp_fec_stats *stats);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+
+#include "ffmpeg/rtp.h"
+#include "rtp-history.h"
+
+#define	RTP_HEADER_SIZE	12
+
+struct rtp_history_slot {
+	int pktlen;		// 0 - empty
+	unsigned short seq;
+	struct timeval sent;
+	uint8_t *pkt;
+};
+
+struct rtp_history {
+	pthread_mutex_t mutex;
+	int npackets;
+	int maxpktsize;
+	struct rtp_history_slot *slots;
+	uint8_t *data;
+	struct rtp_history_stats stats;
+};
+
+struct rtp_history *
+rtp_history_create(int npackets, int maxpktsize) {
+	struct rtp_history *h;
+	int i;
+	//
+	if(npackets <= 0 || maxpktsize <= RTP_HEADER_SIZE)
+		return NULL;
+	if((h = (struct rtp_history*) malloc(sizeof(struct rtp_history))) == NULL)
+		return NULL;
+	bzero(h, sizeof(struct rtp_history));
+	h->slots = (struct rtp_history_slot*) malloc(npackets * sizeof(struct rtp_history_slot));
+	h->data = (uint8_t*) malloc(npackets * maxpktsize);
+	if(h->slots == NULL || h->data == NULL) {
+		if(h->slots)	free(h->slots);
+		if(h->data)	free(h->data);
+		free(h);
+		return NULL;
+	}
+	bzero(h->slots, npackets * sizeof(struct rtp_history_slot));
+	for(i = 0; i < npackets; i++)
+		h->slots[i].pkt = h->data + i * maxpktsize;
+	h->npackets = npackets;
+	h->maxpktsize = maxpktsize;
+	pthread_mutex_init(&h->mutex, NULL);
+	return h;
+}
+
+void
+rtp_history_destroy(struct rtp_history *h) {
+	if(h == NULL)
+		return;
+	pthread_mutex_destroy(&h->mutex);
+	free(h->slots);
+	free(h->data);
+	free(h);
+	return;
+}
+
+// keep a copy of an outgoing RTP packet, replacing the packet sent
+// npackets sequence numbers earlier.  RTCP and oversized packets are ignored.
+void
+rtp_history_put(struct rtp_history *h, const uint8_t *pkt, int pktlen) {
+	struct rtp_history_slot *slot;
+	unsigned short seq;
+	//
+	if(h == NULL || pktlen < RTP_HEADER_SIZE || pktlen > h->maxpktsize)
+		return;
+	if((pkt[0] >> 6) != 2 || RTP_PT_IS_RTCP(pkt[1]))
+		return;
+	seq = (pkt[2] << 8) | pkt[3];
+	pthread_mutex_lock(&h->mutex);
+	slot = &h->slots[seq % h->npackets];
+	slot->seq = seq;
+	slot->pktlen = pktlen;
+	gettimeofday(&slot->sent, NULL);
+	bcopy(pkt, slot->pkt, pktlen);
+	pthread_mutex_unlock(&h->mutex);
+	return;
+}
+
+// copy the packet of sequence number seq into buf, if it has been sent
+// less than maxage microseconds ago.
+// returns the packet length, 0 if the packet has expired, or -1 if it
+// is not in the history.
+int
+rtp_history_get(struct rtp_history *h, unsigned short seq, int maxage, uint8_t *buf, int buflen) {
+	struct rtp_history_slot *slot;
+	struct timeval now;
+	int ret = -1;
+	//
+	if(h == NULL)
+		return -1;
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&h->mutex);
+	h->stats.requested++;
+	slot = &h->slots[seq % h->npackets];
+	if(slot->pktlen == 0 || slot->seq != seq || slot->pktlen > buflen) {
+		h->stats.unavailable++;
+	} else if(tvdiff_us(&now, &slot->sent) > maxage) {
+		h->stats.expired++;
+		ret = 0;
+	} else {
+		bcopy(slot->pkt, buf, slot->pktlen);
+		h->stats.resent++;
+		ret = slot->pktlen;
+	}
+	pthread_mutex_unlock(&h->mutex);
+	return ret;
+}
+
+void
+rtp_history_get_stats(struct rtp_history *h, struct rtp_history_stats *stats) {
+	pthread_mutex_lock(&h->mutex);
+	bcopy(&h->stats, stats, sizeof(struct rtp_history_stats));
+	pthread_mutex_unlock(&h->mutex);
+	return;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __RTP_HISTORY_H__
+#define __RTP_HISTORY_H__
+
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+
+#include <stdint.h>
+#include "ga-common.h"
+
+// a fixed-size ring of recently sent RTP packets, indexed by sequence
+// number, for retransmission on generic NACKs (RFC 4585)
+
+struct rtp_history_stats {
+	unsigned int requested;		// sequence numbers NACKed
+	unsigned int resent;
+	unsigned int expired;		// too late to be played out
+	unsigned int unavailable;	// overwritten or never sent
+};
+
+EXPORT struct rtp_history * rtp_history_create(int npackets, int maxpktsize);
+EXPORT void rtp_history_destroy(struct rtp_history *h);
+EXPORT void rtp_history_put(struct rtp_history *h, const uint8_t *pkt, int pktlen);
+EXPORT int rtp_history_get(struct rtp_history *h, unsigned short seq, int maxage, uint8_t *buf, int buflen);
+EXPORT void rtp_history_get_stats(struct rtp_history *h, struct rtp_history_stats *stats);
+
+#endif
@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include <list>
+
+#include "rtspconf.h"
+#include "rtspserver.h"
+#include "rtsp-io.h"
+
+using namespace std;
+
+#ifdef __linux__
+
+#define	RTSP_IO_EVENTS		256	/* epoll events handled per wakeup */
+#define	RTSP_IO_WAIT_MAX	1000	/* ms */
+
+struct rtsp_conn;
+
+// what an epoll event refers to: the connection or one of its RTCP sockets
+struct rtsp_ioevent {
+	struct rtsp_conn *conn;
+	int streamid;		// -1 for the RTSP connection
+};
+
+struct rtsp_conn {
+	RTSPContext *ctx;	// NULL once closed
+	int out;		// waiting for the connection to be writable
+	int watched[RTSP_CHANNEL_MAX];	// RTCP sockets in the epoll set
+	struct rtsp_ioevent ev[RTSP_CHANNEL_MAX+1];
+};
+
+struct rtsp_iothread {
+	int id;
+	int epfd;
+	int wakefd[2];		// wakes the thread for new connections
+	pthread_mutex_t mutex;	// guards incoming and nconns
+	list<int> incoming;	// accepted sockets not yet served
+	int nconns;
+	list<struct rtsp_conn*> conns;
+	list<struct rtsp_conn*> closed;	// freed after the current events
+	// the earliest timer of all connections
+	int timer_set;
+	struct timeval next_timer;
+};
+
+static pthread_mutex_t iomutex = PTHREAD_MUTEX_INITIALIZER;
+static struct rtsp_iothread *iothreads = NULL;
+static int niothreads = 0;
+
+static void
+rtsp_io_schedule(struct rtsp_iothread *t, struct timeval *now, long long wait) {
+	struct timeval tv;
+	if(wait < 0)
+		return;
+	tv.tv_sec = now->tv_sec + (now->tv_usec + wait) / 1000000;
+	tv.tv_usec = (now->tv_usec + wait) % 1000000;
+	if(t->timer_set == 0 || tvdiff_us(&tv, &t->next_timer) < 0) {
+		t->next_timer = tv;
+		t->timer_set = 1;
+	}
+	return;
+}
+
+static void
+rtsp_io_close(struct rtsp_iothread *t, struct rtsp_conn *conn) {
+	int i;
+	RTSPContext *ctx = conn->ctx;
+	//
+	if(ctx == NULL)
+		return;
+	epoll_ctl(t->epfd, EPOLL_CTL_DEL, ctx->fd, NULL);
+	for(i = 0; i < RTSP_CHANNEL_MAX; i++) {
+		if(conn->watched[i] >= 0)
+			epoll_ctl(t->epfd, EPOLL_CTL_DEL, conn->watched[i], NULL);
+	}
+	rtsp_session_close(ctx);
+	conn->ctx = NULL;
+	t->conns.remove(conn);
+	t->closed.push_back(conn);
+	pthread_mutex_lock(&t->mutex);
+	t->nconns--;
+	pthread_mutex_unlock(&t->mutex);
+	return;
+}
+
+// RTCP sockets come and go with SETUP and TEARDOWN
+static void
+rtsp_io_sync(struct rtsp_iothread *t, struct rtsp_conn *conn) {
+	struct epoll_event ev;
+	int i;
+	//
+	for(i = 0; i < RTSP_CHANNEL_MAX; i++) {
+		if(conn->ctx->rtcp_fd[i] == conn->watched[i])
+			continue;
+		if(conn->watched[i] >= 0)
+			epoll_ctl(t->epfd, EPOLL_CTL_DEL, conn->watched[i], NULL);
+		conn->watched[i] = conn->ctx->rtcp_fd[i];
+		if(conn->watched[i] < 0)
+			continue;
+		bzero(&ev, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = &conn->ev[i+1];
+		if(epoll_ctl(t->epfd, EPOLL_CTL_ADD, conn->watched[i], &ev) < 0) {
+			ga_error("rtsp-io: cannot watch RTCP of stream %d: %s\n",
+				i, strerror(errno));
+			conn->watched[i] = -1;
+		}
+	}
+	return;
+}
+
+// replies that did not fit in the socket buffer are written once writable
+static void
+rtsp_io_output(struct rtsp_iothread *t, struct rtsp_conn *conn) {
+	struct epoll_event ev;
+	int out;
+	//
+	if((out = rtsp_session_want_output(conn->ctx)) == conn->out)
+		return;
+	bzero(&ev, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | (out ? EPOLLOUT : 0);
+	ev.data.ptr = &conn->ev[0];
+	if(epoll_ctl(t->epfd, EPOLL_CTL_MOD, conn->ctx->fd, &ev) < 0) {
+		ga_error("rtsp-io: cannot watch the connection: %s\n", strerror(errno));
+		return;
+	}
+	conn->out = out;
+	return;
+}
+
+static void
+rtsp_io_accept(struct rtsp_iothread *t) {
+	list<int> incoming;
+	struct epoll_event ev;
+	struct rtsp_conn *conn;
+	char buf[64];
+	int i, s;
+	//
+	while(read(t->wakefd[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&t->mutex);
+	incoming.swap(t->incoming);
+	pthread_mutex_unlock(&t->mutex);
+	//
+	while(!incoming.empty()) {
+		s = incoming.front();
+		incoming.pop_front();
+		conn = (struct rtsp_conn*) malloc(sizeof(struct rtsp_conn));
+		if(conn == NULL || (conn->ctx = rtsp_session_open(s)) == NULL) {
+			if(conn != NULL)
+				free(conn);
+			close(s);
+			goto failed;
+		}
+		// writes of this thread never block
+		conn->ctx->iotid = ga_gettid();
+		conn->out = 0;
+		for(i = 0; i < RTSP_CHANNEL_MAX; i++) {
+			conn->watched[i] = -1;
+			conn->ev[i+1].conn = conn;
+			conn->ev[i+1].streamid = i;
+		}
+		conn->ev[0].conn = conn;
+		conn->ev[0].streamid = -1;
+		bzero(&ev, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = &conn->ev[0];
+		if(epoll_ctl(t->epfd, EPOLL_CTL_ADD, s, &ev) < 0) {
+			ga_error("rtsp-io: cannot watch the connection: %s\n", strerror(errno));
+			rtsp_session_close(conn->ctx);
+			free(conn);
+			goto failed;
+		}
+		t->conns.push_back(conn);
+		continue;
+failed:
+		pthread_mutex_lock(&t->mutex);
+		t->nconns--;
+		pthread_mutex_unlock(&t->mutex);
+	}
+	return;
+}
+
+static void *
+rtsp_io_thread(void *arg) {
+	struct rtsp_iothread *t = (struct rtsp_iothread*) arg;
+	struct epoll_event events[RTSP_IO_EVENTS];
+	list<struct rtsp_conn*>::iterator li;
+	struct timeval now;
+	long long wait;
+	int i, n, timeout;
+	//
+	ga_error("rtsp-io: thread %d started (tid %ld).\n", t->id, ga_gettid());
+	while(true) {
+		timeout = RTSP_IO_WAIT_MAX;
+		if(t->timer_set) {
+			gettimeofday(&now, NULL);
+			wait = tvdiff_us(&t->next_timer, &now);
+			if(wait < 0)
+				wait = 0;
+			if(wait < RTSP_IO_WAIT_MAX * 1000LL)
+				timeout = (int) ((wait + 999) / 1000);
+		}
+		if((n = epoll_wait(t->epfd, events, RTSP_IO_EVENTS, timeout)) < 0) {
+			if(errno == EINTR)
+				continue;
+			ga_error("rtsp-io: epoll_wait failed: %s\n", strerror(errno));
+			break;
+		}
+		for(i = 0; i < n; i++) {
+			struct rtsp_ioevent *ev = (struct rtsp_ioevent*) events[i].data.ptr;
+			struct rtsp_conn *conn;
+			//
+			if(ev == NULL) {
+				rtsp_io_accept(t);
+				continue;
+			}
+			if((conn = ev->conn)->ctx == NULL)
+				continue;
+			if(ev->streamid >= 0) {
+				rtsp_session_rtcp(conn->ctx, ev->streamid);
+			} else {
+				if((events[i].events & EPOLLOUT)
+				&& rtsp_session_output(conn->ctx) < 0) {
+					rtsp_io_close(t, conn);
+					continue;
+				}
+				if((events[i].events & ~EPOLLOUT)
+				&& rtsp_session_input(conn->ctx) < 0) {
+					rtsp_io_close(t, conn);
+					continue;
+				}
+				rtsp_io_sync(t, conn);
+			}
+			gettimeofday(&now, NULL);
+			if(rtsp_session_timer(conn->ctx, &wait) < 0) {
+				rtsp_io_close(t, conn);
+				continue;
+			}
+			rtsp_io_schedule(t, &now, wait);
+			rtsp_io_output(t, conn);
+		}
+		// connections are freed only after their pending events
+		while(!t->closed.empty()) {
+			free(t->closed.front());
+			t->closed.pop_front();
+		}
+		// timers due
+		if(t->timer_set == 0)
+			continue;
+		gettimeofday(&now, NULL);
+		if(tvdiff_us(&now, &t->next_timer) < 0)
+			continue;
+		t->timer_set = 0;
+		for(li = t->conns.begin(); li != t->conns.end(); ) {
+			struct rtsp_conn *conn = *li++;
+			if(rtsp_session_timer(conn->ctx, &wait) < 0) {
+				rtsp_io_close(t, conn);
+				continue;
+			}
+			rtsp_io_schedule(t, &now, wait);
+			rtsp_io_output(t, conn);
+		}
+		while(!t->closed.empty()) {
+			free(t->closed.front());
+			t->closed.pop_front();
+		}
+	}
+	ga_error("rtsp-io: thread %d terminated.\n", t->id);
+	return NULL;
+}
+
+int
+rtsp_io_init(int nthreads) {
+	struct epoll_event ev;
+	pthread_t thread;
+	int i;
+	//
+	if(nthreads <= 0)
+		return -1;
+	if(nthreads > RTSP_IO_THREADS_MAX)
+		nthreads = RTSP_IO_THREADS_MAX;
+	pthread_mutex_lock(&iomutex);
+	if(iothreads != NULL) {
+		pthread_mutex_unlock(&iomutex);
+		return 0;
+	}
+	iothreads = new struct rtsp_iothread[nthreads];
+	for(i = 0; i < nthreads; i++) {
+		struct rtsp_iothread *t = &iothreads[i];
+		t->id = i;
+		t->nconns = 0;
+		t->timer_set = 0;
+		pthread_mutex_init(&t->mutex, NULL);
+		if((t->epfd = epoll_create(RTSP_IO_EVENTS)) < 0) {
+			ga_error("rtsp-io: epoll_create failed: %s\n", strerror(errno));
+			goto error;
+		}
+		if(pipe(t->wakefd) < 0) {
+			ga_error("rtsp-io: pipe failed: %s\n", strerror(errno));
+			close(t->epfd);
+			goto error;
+		}
+		fcntl(t->wakefd[0], F_SETFL, fcntl(t->wakefd[0], F_GETFL) | O_NONBLOCK);
+		fcntl(t->wakefd[1], F_SETFL, fcntl(t->wakefd[1], F_GETFL) | O_NONBLOCK);
+		bzero(&ev, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if(epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->wakefd[0], &ev) < 0
+		|| pthread_create(&thread, NULL, rtsp_io_thread, t) != 0) {
+			ga_error("rtsp-io: cannot start thread %d.\n", i);
+			close(t->wakefd[0]);
+			close(t->wakefd[1]);
+			close(t->epfd);
+			goto error;
+		}
+		pthread_detach(thread);
+		niothreads++;
+	}
+	pthread_mutex_unlock(&iomutex);
+	ga_error("rtsp-io: %d I/O threads serving RTSP connections.\n", nthreads);
+	return 0;
+error:
+	// threads already started keep serving
+	if(niothreads > 0) {
+		pthread_mutex_unlock(&iomutex);
+		ga_error("rtsp-io: %d I/O threads serving RTSP connections.\n", niothreads);
+		return 0;
+	}
+	delete[] iothreads;
+	iothreads = NULL;
+	pthread_mutex_unlock(&iomutex);
+	return -1;
+}
+
+int
+rtsp_io_add(int s) {
+	struct rtsp_iothread *t = NULL;
+	int i, least = -1;
+	char c = 0;
+	//
+	if(niothreads <= 0)
+		return -1;
+	// the least loaded thread
+	for(i = 0; i < niothreads; i++) {
+		int n;
+		pthread_mutex_lock(&iothreads[i].mutex);
+		n = iothreads[i].nconns;
+		pthread_mutex_unlock(&iothreads[i].mutex);
+		if(least < 0 || n < least) {
+			least = n;
+			t = &iothreads[i];
+		}
+	}
+	pthread_mutex_lock(&t->mutex);
+	t->incoming.push_back(s);
+	t->nconns++;
+	pthread_mutex_unlock(&t->mutex);
+	if(write(t->wakefd[1], &c, 1) < 0 && errno != EAGAIN) {
+		ga_error("rtsp-io: cannot wake thread %d: %s\n", t->id, strerror(errno));
+	}
+	return 0;
+}
+
+#else	/* ! __linux__ */
+
+int
+rtsp_io_init(int nthreads) {
+	ga_error("rtsp-io: not supported on this platform.\n");
+	return -1;
+}
+
+#ifdef WIN32
+int
+rtsp_io_add(SOCKET s) {
+#else
+int
+rtsp_io_add(int s) {
+#endif
+	return -1;
+}
+
+#endif	/* __linux__ */
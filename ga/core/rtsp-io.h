@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __RTSP_IO_H__
+#define __RTSP_IO_H__
+
+#include "ga-common.h"
+
+// RTSP connections served by a few epoll threads instead of one thread
+// per connection.  a connection stays with the thread it is assigned to;
+// its control messages, RTCP over UDP, and timers are handled there.
+
+#define	RTSP_IO_THREADS_MAX	64
+
+EXPORT int rtsp_io_init(int nthreads);
+#ifdef WIN32
+EXPORT int rtsp_io_add(SOCKET s);
+#else
+EXPORT int rtsp_io_add(int s);
+#endif
+
+#endif
@@ -18,9 +18,11 @@
 
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #ifndef WIN32
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #endif
 
 #include "rtspconf.h"
@@ -28,6 +30,8 @@
 #include "ga-common.h"
 #include "ga-conf.h"
 #include "ga-avcodec.h"
+#include "rtp-fec.h"
+#include "ioengine.h"
 
 using namespace std;
 
@@ -36,14 +40,32 @@ using namespace std;
 #define	RTSP_DEF_DISPLAY	":0"
 #define	RTSP_DEF_SERVERPORT	554
 #define	RTSP_DEF_PROTO		IPPROTO_UDP
+#define	RTSP_DEF_SESSION_TIMEOUT	60	/* seconds */
 
 #define	RTSP_DEF_CONTROL_ENABLED	0
 #define	RTSP_DEF_CONTROL_PORT		555
 #define	RTSP_DEF_CONTROL_PROTO		IPPROTO_TCP
 #define	RTSP_DEF_SEND_MOUSE_MOTION	0
 
+#define	RTSP_DEF_ENCODER_LINGER		0	/* ms */
+#define	RTSP_DEF_ENCODER_WORKERS	0	/* one thread per encoder */
+#define	RTSP_DEF_GOVERNOR_BUDGET	70	/* percent of the frame interval */
+#define	RTSP_DEF_PACING_RATE		150	/* percent of the target bitrate */
+#define	RTSP_DEF_NACK_MAX_AGE		100	/* ms */
+#define	RTSP_DEF_MCAST_PORT		20000
+#define	RTSP_DEF_MCAST_TTL		1
+#define	RTSP_DEF_RECORD_QUEUE		16384	/* KB */
+#define	RTSP_DEF_SHM_SIZE		32768	/* KB */
+
 #define	RTSP_DEF_VIDEO_CODEC	CODEC_ID_H264
 #define	RTSP_DEF_VIDEO_FPS	24
+#define	RTSP_DEF_VIDEO_KEYFRAME_MIN_INTERVAL	1000	/* ms */
+#define	RTSP_DEF_VIDEO_BITRATE	4000000
+#define	RTSP_DEF_VIDEO_BITRATE_MIN	300000
+#define	RTSP_DEF_VIDEO_BITRATE_MAX	8000000
+#define	RTSP_DEF_PROBE_RATE	20000	/* kbps */
+#define	RTSP_DEF_PROBE_PACKETS	32
+#define	RTSP_DEF_PROBE_TIMEOUT	300	/* ms */
 
 #define	RTSP_DEF_AUDIO_CODEC	CODEC_ID_MP3
 #define	RTSP_DEF_AUDIO_BITRATE	128000
@@ -63,10 +85,34 @@ rtspconf_global() {
 	return &globalConf;
 }
 
+// release what a previous parse allocated, e.g., in a session worker
+// parsing again its rewritten configuration
+static void
+rtspconf_free(struct RTSPConf *conf) {
+	int i;
+	//
+	free(conf->servername);
+	free(conf->encoder_control);
+	free(conf->record_file);
+	free(conf->shm_name);
+	free(conf->mcast_group);
+	free(conf->mcast_iface);
+	for(i = 0; i < RTSPCONF_CODECNAME_SIZE+1; i++) {
+		free(conf->video_encoder_name[i]);
+		free(conf->video_decoder_name[i]);
+		free(conf->audio_encoder_name[i]);
+		free(conf->audio_decoder_name[i]);
+	}
+	delete conf->vso;
+	return;
+}
+
 static int
 rtspconf_init(struct RTSPConf *conf) {
 	if(conf == NULL)
 		return -1;
+	if(conf->initialized)
+		rtspconf_free(conf);
 	memset(conf, 0, sizeof(struct RTSPConf));
 	conf->initialized = 1;
 	strncpy(conf->object, RTSP_DEF_OBJECT, RTSPCONF_OBJECT_SIZE);
@@ -74,13 +120,34 @@ rtspconf_init(struct RTSPConf *conf) {
 	strncpy(conf->display, RTSP_DEF_DISPLAY, RTSPCONF_DISPLAY_SIZE);
 	conf->serverport = RTSP_DEF_SERVERPORT;
 	conf->proto = RTSP_DEF_PROTO;
+	conf->session_timeout = RTSP_DEF_SESSION_TIMEOUT;
 	// controller
 	conf->ctrlenable = RTSP_DEF_CONTROL_ENABLED;
 	conf->ctrlport = RTSP_DEF_CONTROL_PORT;
 	conf->ctrlproto = RTSP_DEF_CONTROL_PROTO;
 	conf->sendmousemotion = RTSP_DEF_SEND_MOUSE_MOTION;
 	//
+	conf->encoder_linger = RTSP_DEF_ENCODER_LINGER;
+	conf->encoder_workers = RTSP_DEF_ENCODER_WORKERS;
+	conf->governor_budget = RTSP_DEF_GOVERNOR_BUDGET;
+	conf->pacing_rate = RTSP_DEF_PACING_RATE;
+	conf->dscp_video = -1;
+	conf->dscp_audio = -1;
+	conf->nack_max_age = RTSP_DEF_NACK_MAX_AGE;
+	conf->mcast_port = RTSP_DEF_MCAST_PORT;
+	conf->mcast_ttl = RTSP_DEF_MCAST_TTL;
+	conf->record_queue = RTSP_DEF_RECORD_QUEUE * 1024;
+	conf->shm_size = RTSP_DEF_SHM_SIZE * 1024;
+	//
 	conf->video_fps = RTSP_DEF_VIDEO_FPS;
+	conf->video_keyframe_min_interval = RTSP_DEF_VIDEO_KEYFRAME_MIN_INTERVAL;
+	conf->video_bitrate = RTSP_DEF_VIDEO_BITRATE;
+	conf->video_bitrate_min = RTSP_DEF_VIDEO_BITRATE_MIN;
+	conf->video_bitrate_max = RTSP_DEF_VIDEO_BITRATE_MAX;
+	conf->probe_rate = RTSP_DEF_PROBE_RATE;
+	conf->probe_packets = RTSP_DEF_PROBE_PACKETS;
+	conf->probe_timeout = RTSP_DEF_PROBE_TIMEOUT;
+	conf->video_tiers = 1;
 	conf->audio_bitrate = RTSP_DEF_AUDIO_BITRATE;
 	conf->audio_samplerate = RTSP_DEF_AUDIO_SAMPLERATE;
 	conf->audio_channels = RTSP_DEF_AUDIO_CHANNELS;
@@ -123,6 +190,62 @@ rtspconf_load_codec(const char *key, const char *value,
 	return 0;
 }
 
+// read a DSCP (0-63); the value is unchanged if the key is not set
+static int
+rtspconf_read_dscp(const char *key, int *dscp) {
+	char buf[64];
+	int v;
+	if(ga_conf_readv(key, buf, sizeof(buf)) == NULL)
+		return 0;
+	v = ga_conf_readint(key);
+	if(v < 0 || v > 63) {
+		ga_error("# RTSP[config]: %s out-of-range %d (valid: 0-63)\n", key, v);
+		return -1;
+	}
+	*dscp = v;
+	ga_error("# RTSP[config]: %s = %d\n", key, v);
+	return 0;
+}
+
+// simulcast tiers: a comma-separated list of <width>x<height>@<kbps>,
+// in decreasing order of bitrate, added after the full-resolution tier
+static int
+rtspconf_parse_tiers(struct RTSPConf *conf, const char *spec) {
+	const char *p = spec;
+	int w, h, kbps, n;
+	//
+	conf->video_tiers = 1;
+	while(*p != '\0') {
+		while(*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+		if(*p == '\0')
+			break;
+		if(sscanf(p, "%dx%d@%d%n", &w, &h, &kbps, &n) != 3
+		|| w <= 0 || h <= 0 || kbps <= 0
+		|| (w & 1) != 0 || (h & 1) != 0) {
+			ga_error("# RTSP[config]: invalid simulcast tier '%s' (valid: <even-width>x<even-height>@<kbps>)\n", p);
+			return -1;
+		}
+		if(conf->video_tiers >= RTSPCONF_TIER_MAX) {
+			ga_error("# RTSP[config]: too many simulcast tiers (max %d)\n", RTSPCONF_TIER_MAX-1);
+			return -1;
+		}
+		if(conf->video_tiers > 1
+		&& 1000 * kbps >= conf->video_tier_bitrate[conf->video_tiers-1]) {
+			ga_error("# RTSP[config]: simulcast tiers must be in decreasing order of bitrate\n");
+			return -1;
+		}
+		conf->video_tier_width[conf->video_tiers] = w;
+		conf->video_tier_height[conf->video_tiers] = h;
+		conf->video_tier_bitrate[conf->video_tiers] = 1000 * kbps;
+		ga_error("# RTSP[config]: simulcast tier %d: %dx%d @ %d kbps\n",
+			conf->video_tiers, w, h, kbps);
+		conf->video_tiers++;
+		p += n;
+	}
+	return 0;
+}
+
 int
 rtspconf_parse(struct RTSPConf *conf) {
 	char *ptr, buf[1024];
@@ -165,6 +288,48 @@ rtspconf_parse(struct RTSPConf *conf) {
 		ga_error("# RTSP[config]: using 'tcp' for RTP flows.\n");
 	}
 	//
+	if(ga_conf_readv("rtsp-io-threads", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("rtsp-io-threads");
+		if(v < 0) {
+			ga_error("# RTSP[config]: rtsp-io-threads out-of-range %d (valid: >= 0)\n", v);
+			return -1;
+		}
+		conf->io_threads = v;
+	}
+	if(ga_conf_readv("rtsp-session-timeout", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("rtsp-session-timeout");
+		if(v < 0) {
+			ga_error("# RTSP[config]: rtsp-session-timeout out-of-range %d (valid: >= 0)\n", v);
+			return -1;
+		}
+		conf->session_timeout = v;
+	}
+	ga_error("# RTSP[config]: %s, session timeout = %d s\n",
+		conf->io_threads > 0 ? "connections served by I/O threads" : "one thread per connection",
+		conf->session_timeout);
+	if((ptr = ga_conf_readv("io-engine", buf, sizeof(buf))) != NULL) {
+		if(strcmp(ptr, "uring") == 0) {
+			conf->io_engine = IOENGINE_URING;
+		} else if(strcmp(ptr, "syscall") == 0) {
+			conf->io_engine = IOENGINE_SYSCALL;
+		} else {
+			ga_error("# RTSP[config]: unknown io-engine '%s' (valid: syscall, uring)\n", ptr);
+			return -1;
+		}
+	}
+	if(ga_conf_readv("tcp-zerocopy", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("tcp-zerocopy");
+		if(v < 0) {
+			ga_error("# RTSP[config]: tcp-zerocopy out-of-range %d (valid: >= 0)\n", v);
+			return -1;
+		}
+		conf->zerocopy_min = v;
+	}
+	if(conf->zerocopy_min > 0) {
+		ga_error("# RTSP[config]: MSG_ZEROCOPY for RTSP/TCP messages of %d bytes or more\n",
+			conf->zerocopy_min);
+	}
+	//
 	conf->ctrlenable = ga_conf_readbool("control-enabled", 0);
 	//
 	if(conf->ctrlenable != 0) {
@@ -188,6 +353,91 @@ rtspconf_parse(struct RTSPConf *conf) {
 		//
 		conf->sendmousemotion  = ga_conf_readbool("control-send-mouse-motion", 1);
 	}
+	//
+	if(ga_conf_readv("encoder-linger", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("encoder-linger");
+		if(v < 0) {
+			ga_error("# RTSP[config]: encoder-linger out-of-range %d (valid: >= 0)\n", v);
+			return -1;
+		}
+		conf->encoder_linger = v;
+	}
+	ga_error("# RTSP[config]: encoder-linger = %d ms\n", conf->encoder_linger);
+	//
+	if((ptr = ga_conf_readv("encoder-workers", buf, sizeof(buf))) != NULL) {
+		if(strcmp(ptr, "auto") == 0) {
+			v = ga_cpu_count();
+		} else {
+			v = ga_conf_readint("encoder-workers");
+		}
+		if(v < 0) {
+			ga_error("# RTSP[config]: encoder-workers out-of-range %d (valid: >= 0, or auto)\n", v);
+			return -1;
+		}
+		conf->encoder_workers = v;
+	}
+	if(conf->encoder_workers > 0) {
+		ga_error("# RTSP[config]: encoder-workers = %d\n", conf->encoder_workers);
+	}
+	//
+	conf->governor_enable = ga_conf_readbool("encoder-governor", 0);
+	if(conf->governor_enable) {
+		if(ga_conf_readv("encoder-governor-budget", buf, sizeof(buf)) != NULL) {
+			v = ga_conf_readint("encoder-governor-budget");
+			if(v <= 0 || v > 100) {
+				ga_error("# RTSP[config]: encoder-governor-budget out-of-range %d (valid: 1-100)\n", v);
+				return -1;
+			}
+			conf->governor_budget = v;
+		}
+		ga_error("# RTSP[config]: encoder governor enabled, budget = %d%% of the frame interval\n",
+			conf->governor_budget);
+	}
+	//
+	if((ptr = ga_conf_readv("encoder-control", buf, sizeof(buf))) != NULL) {
+		conf->encoder_control = strdup(ptr);
+		ga_error("# RTSP[config]: encoder control socket = %s\n", conf->encoder_control);
+	}
+	//
+	if((ptr = ga_conf_readv("record-file", buf, sizeof(buf))) != NULL) {
+		conf->record_file = strdup(ptr);
+	}
+	if(ga_conf_readv("record-segment", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("record-segment");
+		if(v < 0) {
+			ga_error("# RTSP[config]: record-segment out-of-range %d (valid: >= 0)\n", v);
+			return -1;
+		}
+		conf->record_segment = v;
+	}
+	if(ga_conf_readv("record-queue", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("record-queue");
+		if(v <= 0) {
+			ga_error("# RTSP[config]: record-queue out-of-range %d (valid: > 0)\n", v);
+			return -1;
+		}
+		conf->record_queue = v * 1024;
+	}
+	if(conf->record_file != NULL) {
+		ga_error("# RTSP[config]: record to %s, %d s per file, queue = %d KB\n",
+			conf->record_file, conf->record_segment, conf->record_queue / 1024);
+	}
+	//
+	if((ptr = ga_conf_readv("shm-publish", buf, sizeof(buf))) != NULL) {
+		conf->shm_name = strdup(ptr);
+	}
+	if(ga_conf_readv("shm-publish-size", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("shm-publish-size");
+		if(v < 1024 || v > 1024*1024) {
+			ga_error("# RTSP[config]: shm-publish-size out-of-range %d (valid: 1024-1048576)\n", v);
+			return -1;
+		}
+		conf->shm_size = v * 1024;
+	}
+	if(conf->shm_name != NULL) {
+		ga_error("# RTSP[config]: publish packets to shared memory %s, %d KB\n",
+			conf->shm_name, conf->shm_size / 1024);
+	}
 	// video-encoder, audio-encoder, video-decoder, and audio-decoder
 	if((ptr = ga_conf_readv("video-encoder", buf, sizeof(buf))) != NULL) {
 		if(rtspconf_load_codec("video-encoder", ptr,
@@ -232,6 +482,154 @@ rtspconf_parse(struct RTSPConf *conf) {
 		conf->video_renderer_software = 0;
 	}
 	//
+	if(ga_conf_readv("video-keyframe-min-interval", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("video-keyframe-min-interval");
+		if(v < 0) {
+			ga_error("# RTSP[config]: video-keyframe-min-interval out-of-range %d (valid: >= 0)\n", v);
+			return -1;
+		}
+		conf->video_keyframe_min_interval = v;
+	}
+	ga_error("# RTSP[config]: video-keyframe-min-interval = %d ms\n",
+		conf->video_keyframe_min_interval);
+	//
+	if(ga_conf_readv("video-frame-cap", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("video-frame-cap");
+		if(v < 0) {
+			ga_error("# RTSP[config]: video-frame-cap out-of-range %d (valid: >= 0)\n", v);
+			return -1;
+		}
+		conf->video_frame_cap = v;
+	}
+	if(conf->video_frame_cap > 0) {
+		ga_error("# RTSP[config]: video-frame-cap = %d times the average frame size\n",
+			conf->video_frame_cap);
+	}
+	//
+	conf->pacing = ga_conf_readbool("pacing", 0);
+	if(ga_conf_readv("pacing-rate", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("pacing-rate");
+		if(v < 100) {
+			ga_error("# RTSP[config]: pacing-rate out-of-range %d (valid: >= 100)\n", v);
+			return -1;
+		}
+		conf->pacing_rate = v;
+	}
+	ga_error("# RTSP[config]: pacing = %s, at %d%% of the target bitrate\n",
+		conf->pacing ? "on" : "off (per session)", conf->pacing_rate);
+	//
+	if(rtspconf_read_dscp("dscp-video", &conf->dscp_video) < 0
+	|| rtspconf_read_dscp("dscp-audio", &conf->dscp_audio) < 0)
+		return -1;
+	//
+	if(ga_conf_readv("nack-history", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("nack-history");
+		if(v < 0 || v > 65536) {
+			ga_error("# RTSP[config]: nack-history out-of-range %d (valid: 0-65536)\n", v);
+			return -1;
+		}
+		conf->nack_history = v;
+	}
+	if(ga_conf_readv("nack-max-age", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("nack-max-age");
+		if(v <= 0) {
+			ga_error("# RTSP[config]: nack-max-age out-of-range %d (valid: > 0)\n", v);
+			return -1;
+		}
+		conf->nack_max_age = v;
+	}
+	if(conf->nack_history > 0) {
+		ga_error("# RTSP[config]: retransmission on NACK, %d packets per stream, max-age = %d ms\n",
+			conf->nack_history, conf->nack_max_age);
+	}
+	//
+	conf->fec = ga_conf_readbool("fec", 0);
+	if(ga_conf_readv("fec-group", buf, sizeof(buf)) != NULL
+	&& strcmp(buf, "auto") != 0) {
+		v = ga_conf_readint("fec-group");
+		if(v < RTP_FEC_GROUP_MIN || v > RTP_FEC_GROUP_MAX) {
+			ga_error("# RTSP[config]: fec-group out-of-range %d (valid: auto, %d-%d)\n",
+				v, RTP_FEC_GROUP_MIN, RTP_FEC_GROUP_MAX);
+			return -1;
+		}
+		conf->fec_group = v;
+	}
+	if(conf->fec) {
+		if(conf->fec_group > 0) {
+			ga_error("# RTSP[config]: fec enabled, one parity packet per %d packets\n",
+				conf->fec_group);
+		} else {
+			ga_error("# RTSP[config]: fec enabled, groups adapted to loss\n");
+		}
+	}
+	//
+	if((ptr = ga_conf_readv("multicast-group", buf, sizeof(buf))) != NULL) {
+		if(!IN_MULTICAST(ntohl(inet_addr(ptr)))) {
+			ga_error("# RTSP[config]: multicast-group %s is not an IPv4 multicast address\n", ptr);
+			return -1;
+		}
+		conf->mcast_group = strdup(ptr);
+	}
+	if(ga_conf_readv("multicast-port", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("multicast-port");
+		if(v <= 0 || v >= 65535 || (v & 0x01)) {
+			ga_error("# RTSP[config]: multicast-port out-of-range %d (valid: an even port)\n", v);
+			return -1;
+		}
+		conf->mcast_port = v;
+	}
+	if(ga_conf_readv("multicast-ttl", buf, sizeof(buf)) != NULL) {
+		v = ga_conf_readint("multicast-ttl");
+		if(v <= 0 || v > 255) {
+			ga_error("# RTSP[config]: multicast-ttl out-of-range %d (valid: 1-255)\n", v);
+			return -1;
+		}
+		conf->mcast_ttl = v;
+	}
+	if((ptr = ga_conf_readv("multicast-interface", buf, sizeof(buf))) != NULL) {
+		conf->mcast_iface = strdup(ptr);
+	}
+	if(conf->mcast_group != NULL) {
+		ga_error("# RTSP[config]: multicast to %s:%d, ttl = %d, interface = %s\n",
+			conf->mcast_group, conf->mcast_port, conf->mcast_ttl,
+			conf->mcast_iface ? conf->mcast_iface : "routed");
+	}
+	//
+	conf->congestion_control = ga_conf_readbool("congestion-control", 0);
+	if(conf->congestion_control) {
+		if(ga_conf_readv("video-bitrate-min", buf, sizeof(buf)) != NULL)
+			conf->video_bitrate_min = 1000 * ga_conf_readint("video-bitrate-min");
+		if(ga_conf_readv("video-bitrate-max", buf, sizeof(buf)) != NULL)
+			conf->video_bitrate_max = 1000 * ga_conf_readint("video-bitrate-max");
+		if(conf->video_bitrate_min <= 0
+		|| conf->video_bitrate_max < conf->video_bitrate_min) {
+			ga_error("# RTSP[config]: invalid video bitrate bounds (%d-%d kbps)\n",
+				conf->video_bitrate_min/1000, conf->video_bitrate_max/1000);
+			return -1;
+		}
+		ga_error("# RTSP[config]: congestion control enabled, video bitrate %d-%d kbps\n",
+			conf->video_bitrate_min/1000, conf->video_bitrate_max/1000);
+		//
+		conf->probe_enable = ga_conf_readbool("bandwidth-probe", 0);
+	}
+	if(conf->probe_enable) {
+		if(ga_conf_readv("bandwidth-probe-rate", buf, sizeof(buf)) != NULL)
+			conf->probe_rate = ga_conf_readint("bandwidth-probe-rate");
+		if(ga_conf_readv("bandwidth-probe-packets", buf, sizeof(buf)) != NULL)
+			conf->probe_packets = ga_conf_readint("bandwidth-probe-packets");
+		if(ga_conf_readv("bandwidth-probe-timeout", buf, sizeof(buf)) != NULL)
+			conf->probe_timeout = ga_conf_readint("bandwidth-probe-timeout");
+		if(conf->probe_rate <= 0
+		|| conf->probe_packets < 2 || conf->probe_packets > 1024
+		|| conf->probe_timeout <= 0 || conf->probe_timeout > 10000) {
+			ga_error("# RTSP[config]: invalid bandwidth probe (rate=%d kbps, packets=%d (valid: 2-1024), timeout=%d ms (valid: 1-10000))\n",
+				conf->probe_rate, conf->probe_packets, conf->probe_timeout);
+			return -1;
+		}
+		ga_error("# RTSP[config]: bandwidth probe enabled, %d packets @ %d kbps, timeout %d ms\n",
+			conf->probe_packets, conf->probe_rate, conf->probe_timeout);
+	}
+	//
 	v = ga_conf_readint("audio-bitrate");
 	if(v <= 0 || v > 1024000) {
 		ga_error("# RTSP[config]: audio-bitrate out-of-range %d (valid: 1-1024000)\n", v);
@@ -288,6 +686,11 @@ rtspconf_parse(struct RTSPConf *conf) {
 		ga_error("# RTSP[config]: unsupported audio codec channel layout '%s'\n", ptr);
 		return -1;
 	}
+	//
+	if((ptr = ga_conf_readv("simulcast-tiers", buf, sizeof(buf))) != NULL) {
+		if(rtspconf_parse_tiers(conf, ptr) < 0)
+			return -1;
+	}
 	// LAST: video-specific parameters
 	if(ga_conf_mapsize("video-specific") > 0) {
 		//
@@ -302,10 +705,19 @@ rtspconf_parse(struct RTSPConf *conf) {
 				continue;
 			conf->vso->push_back(ptr);
 			conf->vso->push_back(val);
+			if(strcmp(ptr, "b") == 0)
+				conf->video_bitrate = strtol(val, NULL, 0);
 			ga_error("# RTSP[config]: video specific option: %s = %s\n",
 				ptr, val);
 		}
 	}
+	// tier 0 is the full-resolution stream
+	conf->video_tier_bitrate[0] = conf->video_bitrate;
+	if(conf->video_tiers > 1 && conf->video_tier_bitrate[1] >= conf->video_bitrate) {
+		ga_error("# RTSP[config]: simulcast tiers must be below the video bitrate (%d kbps)\n",
+			conf->video_bitrate/1000);
+		return -1;
+	}
 	return 0;
 }
 
@@ -37,6 +37,18 @@ extern "C" {
 #define	RTSPCONF_DISPLAY_SIZE	16
 #define	RTSPCONF_PROTO_SIZE	8
 #define	RTSPCONF_CODECNAME_SIZE	8
+#define	RTSPCONF_TIER_MAX	3
+
+// startup bandwidth probing: probe packets carry the signature,
+// and the client reports its measurement with the SET_PARAMETER name
+#define	RTSP_PROBE_SIGNATURE	"GAPROBE"
+#define	RTSP_PROBE_PARAMETER	"x-ga-probe"
+// simulcast: SET_PARAMETER name to pin a tier (-1: automatic)
+#define	RTSP_TIER_PARAMETER	"x-ga-tier"
+// SET_PARAMETER name to switch pacing of a session (0 or 1)
+#define	RTSP_PACING_PARAMETER	"x-ga-pacing"
+// payload type of FEC packets in RTP/UDP video streams
+#define	RTSP_FEC_PAYLOAD_TYPE	127
 
 struct RTSPConf {
 	int initialized;
@@ -46,11 +58,29 @@ struct RTSPConf {
 	char *servername;
 	int serverport;
 	char proto;		// transport layer tcp = 6; udp = 17
+	int io_threads;		// RTSP connections served with epoll, 0 - one thread per connection
+	int session_timeout;	// in seconds, for sessions not playing; 0 - no timeout
+	int io_engine;		// sends RTP/UDP batches with IOENGINE_*, see ioengine.h
+	int zerocopy_min;	// in bytes, RTSP/TCP messages sent with MSG_ZEROCOPY; 0 - disabled
 	// for controller
 	int ctrlenable;
 	int ctrlport;
 	char ctrlproto;		// transport layer tcp = 6; udp = 17
 	int sendmousemotion;
+	// for shared encoders
+	int encoder_linger;	// in ms, keep encoders warm after the last client left
+	int encoder_workers;	// size of the shared encoding pool, 0 - one thread per encoder
+	// adapt encoder speed settings to the encoding time
+	int governor_enable;
+	int governor_budget;	// in percent of the frame interval
+	char *encoder_control;	// path to the encoder control socket, NULL - disabled
+	// recording of the encoded streams, see recorder.h
+	char *record_file;	// strftime() pattern of file names, NULL - disabled
+	int record_segment;	// in seconds per file, 0 - no rotation
+	int record_queue;	// in bytes waiting for the disk, packets are dropped above
+	// shared-memory packet ring for local readers, see shm-publish.h
+	char *shm_name;		// of the POSIX shared memory object, NULL - disabled
+	int shm_size;		// in bytes of packet data
 	//
 	char *video_encoder_name[RTSPCONF_CODECNAME_SIZE+1];
 	AVCodec *video_encoder_codec;
@@ -58,6 +88,41 @@ struct RTSPConf {
 	AVCodec *video_decoder_codec;
 	int video_fps;
 	int video_renderer_software;	// 0 - use HW renderer, otherwise SW
+	int video_keyframe_min_interval;	// in ms, for on-demand keyframes
+	int video_frame_cap;	// max frame size, in multiples of the average; 0 - unlimited
+	int video_bitrate;	// in bps, from video-specific[b]
+	// rate control driven by RTCP feedback
+	int congestion_control;
+	// spread video packets over the frame interval
+	int pacing;		// default for new sessions
+	int pacing_rate;	// in percent of the target bitrate
+	// DSCP of RTP/UDP streams, -1 - unmarked
+	int dscp_video;
+	int dscp_audio;
+	// retransmission of RTP/UDP video packets on generic NACKs
+	int nack_history;	// in packets per stream, 0 - disabled
+	int nack_max_age;	// in ms, older packets are not resent
+	// XOR parity packets in RTP/UDP video streams
+	int fec;
+	int fec_group;		// media packets per FEC packet, 0 - adapted to loss
+	// multicast RTP, shared by all viewers of <object>/multicast
+	char *mcast_group;	// IPv4 group address, NULL - multicast disabled
+	int mcast_port;		// RTP port of stream 0, a stream takes two ports
+	int mcast_ttl;
+	char *mcast_iface;	// address of the sending interface, NULL - routed
+	int video_bitrate_min;	// in bps
+	int video_bitrate_max;	// in bps
+	// startup bandwidth probing, requires congestion control
+	int probe_enable;
+	int probe_rate;		// in kbps
+	int probe_packets;
+	int probe_timeout;	// in ms, upper bound of the added startup delay
+	// simulcast: tier 0 is the full-resolution stream at video_bitrate,
+	// higher tiers are downscaled from it
+	int video_tiers;	// number of encoder tiers, 1 - simulcast disabled
+	int video_tier_width[RTSPCONF_TIER_MAX];
+	int video_tier_height[RTSPCONF_TIER_MAX];
+	int video_tier_bitrate[RTSPCONF_TIER_MAX];	// in bps
 	//
 	char *audio_encoder_name[RTSPCONF_CODECNAME_SIZE+1];
 	AVCodec *audio_encoder_codec;
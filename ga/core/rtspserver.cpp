@@ -33,6 +33,10 @@
 #include <sys/time.h>
 #include <arpa/inet.h>
 #endif	/* ifndef WIN32 */
+#ifdef __linux__
+#include <errno.h>
+#include <linux/errqueue.h>
+#endif
 
 #include "vsource.h"
 #include "asource.h"
@@ -41,6 +45,10 @@
 //#include "encoder-audio.h"
 #include "server.h"
 #include "rtspserver.h"
+#include "pacer.h"
+#include "rtp-history.h"
+#include "rtp-fec.h"
+#include "ioengine.h"
 
 #include "ga-common.h"
 #include "ga-avcodec.h"
@@ -53,9 +61,38 @@
 
 #define	RTSP_STREAM_FORMAT	"streamid=%d"
 #define	RTSP_STREAM_FORMAT_MAXLEN	64
+#define	RTSP_MCAST_SUFFIX	"/multicast"	/* <object>/multicast is sent to the group */
 
 static struct RTSPConf *rtspconf = NULL;
 
+// all sessions, and the multicast sender, for statistics
+static pthread_mutex_t sessionmutex = PTHREAD_MUTEX_INITIALIZER;
+static RTSPContext *sessions = NULL;
+static char rtcp_cname[128] = "";
+
+static void
+rtsp_session_add(RTSPContext *ctx) {
+	pthread_mutex_lock(&sessionmutex);
+	ctx->next = sessions;
+	sessions = ctx;
+	pthread_mutex_unlock(&sessionmutex);
+	return;
+}
+
+static void
+rtsp_session_remove(RTSPContext *ctx) {
+	RTSPContext **pp;
+	pthread_mutex_lock(&sessionmutex);
+	for(pp = &sessions; *pp != NULL; pp = &(*pp)->next) {
+		if(*pp == ctx) {
+			*pp = ctx->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sessionmutex);
+	return;
+}
+
 void
 rtsp_cleanup(RTSPContext *rtsp, int retcode) {
 	rtsp->state = SERVER_STATE_TEARDOWN;
@@ -67,9 +104,303 @@ rtsp_cleanup(RTSPContext *rtsp, int retcode) {
 	return;
 }
 
+#define	RTSP_TX_VIDEO_QUEUE_MAX	(1024*1024)	/* bytes, video producers wait above */
+#define	RTSP_TX_AUDIO_QUEUE_MAX	(64*1024)	/* bytes, the oldest audio and RTCP are dropped above */
+#define	RTSP_FEC_GROUP_INIT	8	/* packets, before the first receiver report */
+#define	RTSP_UDP_BATCH		128	/* RTP/UDP packets per send, with parity packets within IOENGINE_BATCH_MAX */
+#define	RTSP_RBUF_INIT		4096	/* bytes, read buffer of a connection */
+#define	RTSP_RBUF_MAX		65536	/* bytes, the longest message accepted */
+#define	RTSP_SR_INTERVAL	1000000	/* us, between sender reports of a stream */
+#define	RTSP_SR_RETRY		100000	/* us, until a stream has sent its first packet */
+#ifdef MSG_DONTWAIT
+#define	RTSP_RECV_FLAGS		MSG_DONTWAIT
+#else
+#define	RTSP_RECV_FLAGS		0	/* called only when readable */
+#endif
+
+// MSG_ZEROCOPY (Linux 4.14): large messages are sent from their buffers,
+// which are kept until the kernel reports it no longer references them
+#if defined __linux__ && defined SO_ZEROCOPY && defined MSG_ZEROCOPY && defined SO_EE_ORIGIN_ZEROCOPY
+#define	RTSP_HAVE_ZEROCOPY
+#define	RTSP_ZEROCOPY_PROBE	64	/* sends, before giving up if all are copied */
+#define	RTSP_ZEROCOPY_LINGER	500000	/* us, waiting for completions at close */
+#define	RTSP_ZEROCOPY_POLL	10000	/* us */
+#endif
+
+#ifndef SHUT_RDWR
+#define	SHUT_RDWR		SD_BOTH
+#endif
+
+struct rtsp_txpacket {
+	struct rtsp_txpacket *next;
+	int len;
+	int sent;		// bytes written, of a message in txpartial
+	unsigned int zcid;	// the last MSG_ZEROCOPY send of the message
+	uint8_t data[1];
+};
+
+#ifdef RTSP_HAVE_ZEROCOPY
+// send a message with MSG_ZEROCOPY, and plain copies if the kernel is out
+// of memory for notifications.  *pending is set if the buffer must be kept.
+// returns the number of bytes sent, or -1 on error.
+static int
+rtsp_send_zerocopy(RTSPContext *ctx, struct rtsp_txpacket *pkt, int *pending) {
+	int ret, sent = 0, flags = MSG_ZEROCOPY;
+	//
+	*pending = 0;
+	while(sent < pkt->len) {
+		if((ret = send(ctx->fd, pkt->data + sent, pkt->len - sent, flags)) < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == ENOBUFS && flags != 0) {
+				flags = 0;
+				continue;
+			}
+			return -1;
+		}
+		if(flags != 0) {
+			pkt->zcid = ctx->zcnext++;
+			*pending = 1;
+		}
+		sent += ret;
+	}
+	return sent;
+}
+
+// read completion notifications, and free the messages the kernel has
+// released.  TCP completes sends in order, so the ids done are a prefix.
+// must be called with rtsp_writer_mutex locked.
+static void
+rtsp_zerocopy_reap(RTSPContext *ctx) {
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *ee;
+	struct rtsp_txpacket *pkt;
+	unsigned int n;
+	//
+	while(true) {
+		bzero(&msg, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(ctx->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		for(cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+			&& !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			ee = (struct sock_extended_err*) CMSG_DATA(cm);
+			if(ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			n = ee->ee_data - ee->ee_info + 1;
+			if(ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				ctx->zccopied += n;
+			else
+				ctx->zcdirect += n;
+			if((int) (ee->ee_data + 1 - ctx->zcdone) > 0)
+				ctx->zcdone = ee->ee_data + 1;
+		}
+	}
+	while((pkt = ctx->zchead) != NULL && (int) (pkt->zcid - ctx->zcdone) < 0) {
+		if((ctx->zchead = pkt->next) == NULL)
+			ctx->zctail = NULL;
+		free(pkt);
+	}
+	// the kernel copies anyway, e.g., on loopback or without scatter-gather
+	if(ctx->zerocopy && ctx->zcdirect == 0 && ctx->zccopied >= RTSP_ZEROCOPY_PROBE) {
+		ctx->zerocopy = 0;
+		ga_error("zerocopy: all sends copied by the kernel (session %s), disabled.\n",
+			ctx->session_id ? ctx->session_id : "-");
+	}
+	return;
+}
+#endif	/* RTSP_HAVE_ZEROCOPY */
+
+// write queued messages, highest priority first, until the queues up to
+// priority 'lowest' are empty.  with nonblock, writing stops when the
+// socket buffer is full: the message in progress is kept in txpartial, and
+// txwantout is set until the rest has been written.
+// must be called with rtsp_writer_mutex locked, and txwriting set.
+static void
+rtsp_tx_drain(RTSPContext *ctx, int lowest, int nonblock) {
+	struct rtsp_txpacket *pkt;
+	int prio, len, wlen, blocked;
+	//
+	while(true) {
+		// a message partly written goes first, it cannot be interleaved
+		if((pkt = ctx->txpartial) != NULL) {
+			ctx->txpartial = NULL;
+		} else {
+			for(prio = 0; prio <= lowest; prio++) {
+				if(ctx->txhead[prio] != NULL)
+					break;
+			}
+			if(prio > lowest)
+				break;
+			pkt = ctx->txhead[prio];
+			if((ctx->txhead[prio] = pkt->next) == NULL)
+				ctx->txtail[prio] = NULL;
+			ctx->txbytes[prio] -= pkt->len;
+		}
+		// others may queue (higher priority) messages meanwhile
+		pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+		len = pkt->len - pkt->sent;
+		blocked = 0;
+#ifdef RTSP_HAVE_ZEROCOPY
+		if(ctx->txfailed == 0 && ctx->zerocopy && nonblock == 0
+		&& pkt->sent == 0 && len >= rtspconf->zerocopy_min) {
+			int pending;
+			wlen = rtsp_send_zerocopy(ctx, pkt, &pending);
+			pthread_mutex_lock(&ctx->rtsp_writer_mutex);
+			if(pending) {
+				pkt->next = NULL;
+				if(ctx->zctail == NULL) {
+					ctx->zchead = ctx->zctail = pkt;
+				} else {
+					ctx->zctail->next = pkt;
+					ctx->zctail = pkt;
+				}
+				ctx->zcbytes += len;
+				pkt = NULL;
+			}
+			rtsp_zerocopy_reap(ctx);
+			pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+		} else
+#endif
+		if(ctx->txfailed) {
+			wlen = len;
+#ifdef MSG_DONTWAIT
+		} else if(nonblock) {
+			wlen = send(ctx->fd, pkt->data + pkt->sent, len, MSG_DONTWAIT);
+			if(wlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				wlen = 0;
+			blocked = wlen >= 0 && wlen < len;
+#endif
+		} else {
+			wlen = write(ctx->fd, pkt->data + pkt->sent, len);
+		}
+		if(blocked) {
+			pkt->sent += wlen;
+		} else if(pkt != NULL) {
+			free(pkt);
+		}
+		pthread_mutex_lock(&ctx->rtsp_writer_mutex);
+		if(blocked) {
+			ctx->txpartial = pkt;
+			ctx->txwantout = 1;
+			pthread_cond_broadcast(&ctx->rtsp_writer_cond);
+			return;
+		}
+		if(wlen != len) {
+			ctx->txfailed = 1;
+		}
+		pthread_cond_broadcast(&ctx->rtsp_writer_cond);
+	}
+	ctx->txwantout = 0;
+	return;
+}
+
+static struct rtsp_txpacket *
+rtsp_tx_alloc(int len) {
+	struct rtsp_txpacket *pkt;
+	//
+	if((pkt = (struct rtsp_txpacket*) malloc(sizeof(*pkt) + len)) == NULL)
+		return NULL;
+	pkt->next = NULL;
+	pkt->len = len;
+	pkt->sent = 0;
+	pkt->zcid = 0;
+	return pkt;
+}
+
+// queue a message, and write it (along with others queued) unless another
+// thread is already writing.  the RTSP thread only writes control messages,
+// media left in the queues goes out with the next media message.
+// an event loop thread never blocks: it writes what the socket takes, and
+// the rest when the connection is writable, see rtsp_session_output().
+// returns 0 on success, or -1 on error.
+static int
+rtsp_tx_queue(RTSPContext *ctx, int prio, struct rtsp_txpacket *pkt) {
+	int ret, nonblock;
+	//
+	nonblock = ctx->iotid != 0 && prio != RTSP_TX_VIDEO && ctx->iotid == ga_gettid();
+	pthread_mutex_lock(&ctx->rtsp_writer_mutex);
+	// video producers are held back if the connection cannot keep up
+	while(prio == RTSP_TX_VIDEO && ctx->txwriting && ctx->txfailed == 0
+	&& ctx->txbytes[prio] > RTSP_TX_VIDEO_QUEUE_MAX) {
+		pthread_cond_wait(&ctx->rtsp_writer_cond, &ctx->rtsp_writer_mutex);
+	}
+	// audio and RTCP are never held back: stale ones are dropped instead
+	while(prio == RTSP_TX_AUDIO && ctx->txhead[prio] != NULL
+	&& ctx->txbytes[prio] + pkt->len > RTSP_TX_AUDIO_QUEUE_MAX) {
+		struct rtsp_txpacket *old = ctx->txhead[prio];
+		if((ctx->txhead[prio] = old->next) == NULL)
+			ctx->txtail[prio] = NULL;
+		ctx->txbytes[prio] -= old->len;
+		free(old);
+		if(ctx->txdropped++ == 0) {
+			ga_error("rtsp: audio queue full (session %s), dropping the oldest messages.\n",
+				ctx->session_id ? ctx->session_id : "-");
+		}
+	}
+	if(ctx->txtail[prio] == NULL) {
+		ctx->txhead[prio] = ctx->txtail[prio] = pkt;
+	} else {
+		ctx->txtail[prio]->next = pkt;
+		ctx->txtail[prio] = pkt;
+	}
+	ctx->txbytes[prio] += pkt->len;
+	if(ctx->txwriting == 0) {
+		ctx->txwriting = 1;
+		if(nonblock)
+			rtsp_tx_drain(ctx, prio, 1);
+		else
+			rtsp_tx_drain(ctx, prio == RTSP_TX_CONTROL ? RTSP_TX_CONTROL : RTSP_TX_PRIO_MAX-1, 0);
+		ctx->txwriting = 0;
+	}
+	ret = ctx->txfailed ? -1 : 0;
+	pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+	return ret;
+}
+
+static int
+rtsp_tx(RTSPContext *ctx, int prio, const void *header, int hlen, const void *buf, int buflen) {
+	struct rtsp_txpacket *pkt;
+	//
+	if((pkt = rtsp_tx_alloc(hlen + buflen)) == NULL)
+		return -1;
+	if(hlen > 0)
+		memcpy(pkt->data, header, hlen);
+	memcpy(pkt->data + hlen, buf, buflen);
+	return rtsp_tx_queue(ctx, prio, pkt);
+}
+
+// replies are composed in a buffer, and queued by rtsp_reply_flush()
 static int
 rtsp_write(RTSPContext *ctx, const void *buf, size_t count) {
-	return write(ctx->fd, buf, count);
+	char *newbuf;
+	int newsize;
+	//
+	if(ctx->replylen + (int) count > ctx->replysize) {
+		newsize = ctx->replylen + count + 1024;
+		if((newbuf = (char*) realloc(ctx->replybuf, newsize)) == NULL)
+			return -1;
+		ctx->replybuf = newbuf;
+		ctx->replysize = newsize;
+	}
+	memcpy(ctx->replybuf + ctx->replylen, buf, count);
+	ctx->replylen += count;
+	return count;
+}
+
+static int
+rtsp_reply_flush(RTSPContext *ctx) {
+	int ret = 0;
+	if(ctx->replylen > 0) {
+		ret = rtsp_tx(ctx, RTSP_TX_CONTROL, NULL, 0, ctx->replybuf, ctx->replylen);
+		ctx->replylen = 0;
+	}
+	return ret;
 }
 
 static int
@@ -84,10 +415,178 @@ rtsp_printf(RTSPContext *ctx, const char *fmt, ...) {
 	return rtsp_write(ctx, buf, buflen);
 }
 
+// send RTP (and RTCP) packets to a UDP stream as a single batch of the I/O
+// engine, with a parity packet after each FEC group.
+// n <= RTSP_UDP_BATCH.  returns 0 on success, or -1 on error.
+static int
+rtsp_write_udp(RTSPContext *ctx, int streamid, const uint8_t **pkts, const int *lens, int n) {
+	struct ioengine_msg msgs[RTSP_UDP_BATCH + RTSP_UDP_BATCH/RTP_FEC_GROUP_MIN + 1];
+	uint8_t *fecbuf = NULL;
+	const uint8_t *fec;
+	int i, m = 0, nfec = 0, feclen, fecslot, rtcp;
+	//
+	if(ctx->rtp[streamid] == NULL)
+		return -1;
+	if(ctx->udp_fd[streamid][0] < 0) {
+		// no sockets from the rtp protocol: it sends RTCP to the RTCP port by itself
+		for(i = 0; i < n; i++) {
+			rtp_history_put(ctx->history[streamid], pkts[i], lens[i]);
+			if(ffurl_write(ctx->rtp[streamid], pkts[i], lens[i]) < 0)
+				return -1;
+			if(ctx->fec[streamid] != NULL) {
+				feclen = rtp_fec_encode(ctx->fec[streamid], pkts[i], lens[i], &fec);
+				if(feclen > 0 && ffurl_write(ctx->rtp[streamid], fec, feclen) < 0)
+					return -1;
+			}
+		}
+		return 0;
+	}
+	// parity packets are built in place by the encoder: keep copies
+	fecslot = ctx->max_packet_size[streamid] + RTP_FEC_OVERHEAD;
+	if(ctx->fec[streamid] != NULL
+	&& (fecbuf = (uint8_t*) malloc((n/RTP_FEC_GROUP_MIN + 1) * fecslot)) == NULL)
+		return -1;
+	for(i = 0; i < n; i++) {
+		rtp_history_put(ctx->history[streamid], pkts[i], lens[i]);
+		rtcp = (lens[i] >= 2 && RTP_PT_IS_RTCP(pkts[i][1])) ? 1 : 0;
+		msgs[m].fd = ctx->udp_fd[streamid][rtcp];
+		msgs[m].buf = pkts[i];
+		msgs[m].len = lens[i];
+		msgs[m].addr = (struct sockaddr*) &ctx->udp_addr[streamid][rtcp];
+		msgs[m].addrlen = sizeof(struct sockaddr_in);
+		m++;
+		if(fecbuf == NULL)
+			continue;
+		feclen = rtp_fec_encode(ctx->fec[streamid], pkts[i], lens[i], &fec);
+		if(feclen <= 0 || feclen > fecslot)
+			continue;
+		memcpy(fecbuf + nfec * fecslot, fec, feclen);
+		msgs[m] = msgs[m-1];
+		msgs[m].fd = ctx->udp_fd[streamid][0];
+		msgs[m].buf = fecbuf + nfec * fecslot;
+		msgs[m].len = feclen;
+		msgs[m].addr = (struct sockaddr*) &ctx->udp_addr[streamid][0];
+		m++;
+		nfec++;
+	}
+	i = ioengine_send(msgs, m);
+	if(fecbuf != NULL)
+		free(fecbuf);
+	return i == m ? 0 : -1;
+}
+
+// send a single RTP (or RTCP) packet interleaved on RTSP/TCP.
+// returns 0 on success, or -1 on error.
+static int
+rtsp_write_interleaved(RTSPContext *ctx, int streamid, const uint8_t *pkt, int pktlen) {
+	char header[4];
+	int prio;
+	//
+	prio = streamid < video_source_channels() ? RTSP_TX_VIDEO : RTSP_TX_AUDIO;
+	header[0] = '$';
+	header[1] = (streamid<<1) & 0x0ff;
+	// RTCP (e.g., sender reports) goes to the odd channel
+	if(pktlen >= 2 && RTP_PT_IS_RTCP(pkt[1])) {
+		header[1] |= 0x01;
+		prio = RTSP_TX_AUDIO;
+	}
+	header[2] = pktlen>>8;
+	header[3] = pktlen & 0x0ff;
+	return rtsp_tx(ctx, prio, header, 4, pkt, pktlen);
+}
+
+// send RTP (or RTCP) packets of a stream: interleaved on RTSP/TCP, or to
+// the RTP URL in batches.
+// returns 0 on success, or -1 on error.
 int
-rtsp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
+rtsp_write_packets(RTSPContext *ctx, int streamid, const uint8_t **pkts, const int *lens, int n) {
+	struct timeval now;
+	int i, k;
+	//
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&ctx->rtcp_mutex);
+	for(i = 0; i < n; i++)
+		rtcp_stats_sent(&ctx->rtcpstats[streamid], pkts[i], lens[i], &now);
+	pthread_mutex_unlock(&ctx->rtcp_mutex);
+	if(ctx->lower_transport[streamid] == RTSP_LOWER_TRANSPORT_UDP) {
+		for(i = 0; i < n; i += k) {
+			k = n - i < RTSP_UDP_BATCH ? n - i : RTSP_UDP_BATCH;
+			if(rtsp_write_udp(ctx, streamid, pkts + i, lens + i, k) < 0)
+				return -1;
+		}
+		return 0;
+	}
+#ifdef RTSP_HAVE_ZEROCOPY
+	// the RTP packets of a video frame are written as one message, large
+	// enough for MSG_ZEROCOPY; RTCP keeps its own priority
+	if(ctx->zerocopy && n > 1 && streamid < video_source_channels()) {
+		struct rtsp_txpacket *msg;
+		uint8_t *p;
+		int total = 0;
+		for(i = 0; i < n; i++) {
+			if(lens[i] >= 2 && RTP_PT_IS_RTCP(pkts[i][1])) {
+				if(rtsp_write_interleaved(ctx, streamid, pkts[i], lens[i]) < 0)
+					return -1;
+				continue;
+			}
+			total += 4 + lens[i];
+		}
+		if(total == 0)
+			return 0;
+		if((msg = rtsp_tx_alloc(total)) == NULL)
+			return -1;
+		for(i = 0, p = msg->data; i < n; i++) {
+			if(lens[i] >= 2 && RTP_PT_IS_RTCP(pkts[i][1]))
+				continue;
+			p[0] = '$';
+			p[1] = (streamid<<1) & 0x0ff;
+			p[2] = lens[i]>>8;
+			p[3] = lens[i] & 0x0ff;
+			memcpy(p + 4, pkts[i], lens[i]);
+			p += 4 + lens[i];
+		}
+		return rtsp_tx_queue(ctx, RTSP_TX_VIDEO, msg);
+	}
+#endif
+	for(i = 0; i < n; i++) {
+		if(rtsp_write_interleaved(ctx, streamid, pkts[i], lens[i]) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+// send a single RTP (or RTCP) packet.
+// returns 0 on success, or -1 on error.
+int
+rtsp_write_packet(RTSPContext *ctx, int streamid, const uint8_t *pkt, int pktlen) {
+	return rtsp_write_packets(ctx, streamid, &pkt, &pktlen, 1);
+}
+
+// returns the number of bytes sent.
+// a frame in a dynamic packet buffer (see rtsp_write_bindata()) has been
+// captured at 'captured': sender reports of the stream are anchored there.
+void
+rtsp_write_captured(RTSPContext *ctx, int streamid, const uint8_t *buf, int buflen, const struct timeval *captured) {
 	int i, pktlen;
-	char header[4];
+	//
+	pthread_mutex_lock(&ctx->rtcp_mutex);
+	for(i = 0; i + 4 <= buflen; i += 4 + pktlen) {
+		pktlen = (buf[i] << 24) | (buf[i+1] << 16) | (buf[i+2] << 8) | buf[i+3];
+		if(i + 4 + pktlen > buflen)
+			break;
+		// the muxer may have put an RTCP packet first
+		if(rtcp_stats_captured(&ctx->rtcpstats[streamid], &buf[i+4], pktlen, captured) == 0)
+			break;
+	}
+	pthread_mutex_unlock(&ctx->rtcp_mutex);
+	return;
+}
+
+int
+rtsp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
+	const uint8_t *pkts[RTSP_UDP_BATCH];
+	int lens[RTSP_UDP_BATCH];
+	int i, n = 0, pktlen, batch = 0;
 	//
 	if(buflen < 4) {
 		return buflen;
@@ -95,8 +594,9 @@ rtsp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
 	// XXX: buffer is the reuslt from avio_open_dyn_buf.
 	// Multiple RTP packets can be placed in a single buffer.
 	// Format == 4-bytes (big-endian) packet size + packet-data
+	// the packets of a frame are sent together, RTSP_UDP_BATCH at a time
 	i = 0;
-	while(i < buflen) {
+	while(i + 4 <= buflen) {
 		pktlen  = (buf[i+0] << 24);
 		pktlen += (buf[i+1] << 16);
 		pktlen += (buf[i+2] << 8);
@@ -105,43 +605,114 @@ rtsp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
 			i += 4;
 			continue;
 		}
-		//
-		header[0] = '$';
-		header[1] = (streamid<<1) & 0x0ff;
-		header[2] = pktlen>>8;
-		header[3] = pktlen & 0x0ff;
-		pthread_mutex_lock(&ctx->rtsp_writer_mutex);
-		if(rtsp_write(ctx, header, 4) != 4) {
-			pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
-			return i;
-		}
-		if(rtsp_write(ctx, &buf[i+4], pktlen) != pktlen) {
-			return i;
+		if(i + 4 + pktlen > buflen)
+			break;
+		if(n == RTSP_UDP_BATCH) {
+			if(rtsp_write_packets(ctx, streamid, pkts, lens, n) < 0)
+				return batch;
+			n = 0;
+			batch = i;
 		}
-		pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+		pkts[n] = &buf[i+4];
+		lens[n] = pktlen;
+		n++;
 		//
 		i += (4+pktlen);
 	}
+	if(n > 0 && rtsp_write_packets(ctx, streamid, pkts, lens, n) < 0)
+		return batch;
 	return i;
 }
 
+// read what is available on the RTSP connection, without blocking.
+// the buffer starts small, and grows up to RTSP_RBUF_MAX for long messages.
+// returns the number of bytes read, 0 if none, or -1 on error or EOF.
 static int
 rtsp_read_internal(RTSPContext *ctx) {
-	int rlen;
-	if((rlen = read(ctx->fd, 
+	char *newbuf;
+	int rlen, newsize;
+	// initialize if necessary
+	if(ctx->rbuffer == NULL) {
+		if((ctx->rbuffer = (char*) malloc(RTSP_RBUF_INIT)) == NULL)
+			return -1;
+		ctx->rbufsize = RTSP_RBUF_INIT;
+		ctx->rbufhead = ctx->rbuftail = 0;
+	}
+	if(ctx->rbuftail == ctx->rbufsize) {
+		if(ctx->rbufhead > 0) {
+			bcopy(ctx->rbuffer + ctx->rbufhead, ctx->rbuffer, ctx->rbuftail - ctx->rbufhead);
+			ctx->rbuftail -= ctx->rbufhead;
+			ctx->rbufhead = 0;
+		} else if(ctx->rbufsize < RTSP_RBUF_MAX) {
+			newsize = ctx->rbufsize * 2;
+			if(newsize > RTSP_RBUF_MAX)
+				newsize = RTSP_RBUF_MAX;
+			if((newbuf = (char*) realloc(ctx->rbuffer, newsize)) == NULL)
+				return -1;
+			ctx->rbuffer = newbuf;
+			ctx->rbufsize = newsize;
+		} else {
+			ga_error("Buffer full: Extremely long message encountered?\n");
+			return -1;
+		}
+	}
+	if((rlen = recv(ctx->fd,
 		ctx->rbuffer + ctx->rbuftail,
-		ctx->rbufsize - ctx->rbuftail)) <= 0) {
+		ctx->rbufsize - ctx->rbuftail, RTSP_RECV_FLAGS)) < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
 		return -1;
 	}
+	if(rlen == 0)
+		return -1;
 	ctx->rbuftail += rlen;
-	return ctx->rbuftail - ctx->rbufhead;
+	return rlen;
+}
+
+// check for a complete message in the read buffer: an interleaved binary
+// packet, or a request with its headers and body.
+// returns 1 if there is one, 0 if more data is needed, or -1 if the
+// message can never fit in the buffer.
+static int
+rtsp_message_ready(RTSPContext *ctx) {
+	const char *p, *end, *line, *hdrend = NULL;
+	int avail = ctx->rbuftail - ctx->rbufhead;
+	long clen = 0;
+	//
+	if(avail <= 0)
+		return 0;
+	p = ctx->rbuffer + ctx->rbufhead;
+	end = ctx->rbuffer + ctx->rbuftail;
+	if(*p == '$') {
+		if(avail < 4)
+			return 0;
+		return 4 + ((((unsigned char) p[2]) << 8) | (unsigned char) p[3]) <= avail ? 1 : 0;
+	}
+	// headers end with an empty line
+	for(line = p; line < end; ) {
+		const char *eol = (const char*) memchr(line, '\n', end - line);
+		if(eol == NULL)
+			break;
+		if(line != p && (eol == line || (eol == line+1 && *line == '\r'))) {
+			hdrend = eol + 1;
+			break;
+		}
+		if(eol - line > 15 && strncasecmp(line, "Content-Length:", 15) == 0)
+			clen = strtol(line+15, NULL, 10);
+		line = eol + 1;
+	}
+	if(hdrend == NULL)
+		return avail >= RTSP_RBUF_MAX ? -1 : 0;
+	if(clen < 0 || (hdrend - p) + clen > RTSP_RBUF_MAX)
+		return -1;
+	return (hdrend - p) + clen <= avail ? 1 : 0;
 }
 
+// the following read from a complete message in the buffer.
 static int
 rtsp_read_text(RTSPContext *ctx, char *buf, size_t count) {
 	int i;
 	size_t textlen;
-again:
 	for(i = ctx->rbufhead; i < ctx->rbuftail; i++) {
 		if(ctx->rbuffer[i] == '\n') {
 			textlen = i - ctx->rbufhead + 1;
@@ -157,20 +728,6 @@ again:
 			return textlen;
 		}
 	}
-	// buffer full?
-	if(ctx->rbuftail - ctx->rbufhead == ctx->rbufsize) {
-		ga_error("Buffer full: Extremely long text data encountered?\n");
-		return -1;
-	}
-	// did not found '\n', read more
-	bcopy(ctx->rbuffer + ctx->rbufhead, ctx->rbuffer, ctx->rbuftail - ctx->rbufhead);
-	ctx->rbuftail = ctx->rbuftail - ctx->rbufhead;
-	ctx->rbufhead = 0;
-	//
-	if(rtsp_read_internal(ctx) < 0)
-		return -1;
-	goto again;
-	// unreachable, but to meet compiler's requirement
 	return -1;
 }
 
@@ -178,53 +735,42 @@ static int
 rtsp_read_binary(RTSPContext *ctx, char *buf, size_t count) {
 	int reqlength;
 	if(ctx->rbuftail - ctx->rbufhead < 4)
-		goto readmore;
-again:
+		return -1;
 	reqlength = (unsigned char) ctx->rbuffer[ctx->rbufhead+2];
 	reqlength <<= 8;
 	reqlength += (unsigned char) ctx->rbuffer[ctx->rbufhead+3];
-	// data is ready
-	if(4+reqlength <= ctx->rbuftail - ctx->rbufhead) {
+	if(4+reqlength > ctx->rbuftail - ctx->rbufhead)
+		return -1;
+	if((size_t) (4+reqlength) > count) {
+		// too long for the caller: return only the framing
+		bcopy(ctx->rbuffer + ctx->rbufhead, buf, 4);
+		ctx->rbufhead += (4+reqlength);
+		reqlength = 0;
+	} else {
 		bcopy(ctx->rbuffer + ctx->rbufhead, buf, 4+reqlength);
 		ctx->rbufhead += (4+reqlength);
-		if(ctx->rbufhead == ctx->rbuftail)
-			ctx->rbufhead = ctx->rbuftail = 0;
-		return 4+reqlength;
 	}
-	// second trail?
-	if(ctx->rbuftail - ctx->rbufhead == ctx->rbufsize) {
-		ga_error("Buffer full: Extremely long binary data encountered?\n");
-		return -1;
-	}
-readmore:
-	bcopy(ctx->rbuffer + ctx->rbufhead, ctx->rbuffer, ctx->rbuftail - ctx->rbufhead);
-	ctx->rbuftail = ctx->rbuftail - ctx->rbufhead;
-	ctx->rbufhead = 0;
-	//
-	if(rtsp_read_internal(ctx) < 0)
+	if(ctx->rbufhead == ctx->rbuftail)
+		ctx->rbufhead = ctx->rbuftail = 0;
+	return 4+reqlength;
+}
+
+// read exactly 'count' bytes of a message body
+static int
+rtsp_read_body(RTSPContext *ctx, char *buf, size_t count) {
+	if((size_t) (ctx->rbuftail - ctx->rbufhead) < count)
 		return -1;
-	goto again;
-	// unreachable, but to meet compiler's requirement
-	return -1;
+	bcopy(ctx->rbuffer + ctx->rbufhead, buf, count);
+	ctx->rbufhead += count;
+	if(ctx->rbufhead == ctx->rbuftail)
+		ctx->rbufhead = ctx->rbuftail = 0;
+	return count;
 }
 
 static int
 rtsp_getnext(RTSPContext *ctx, char *buf, size_t count) {
-	// initialize if necessary
-	if(ctx->rbuffer == NULL) {
-		ctx->rbufsize = 65536;
-		if((ctx->rbuffer = (char*) malloc(ctx->rbufsize)) == NULL) {
-			ctx->rbufsize = 0;
-			return -1;
-		}
-		ctx->rbufhead = 0;
-		ctx->rbuftail = 0;
-	}
-	// buffer is empty, force read
-	if(ctx->rbuftail == ctx->rbufhead) {
-		if(rtsp_read_internal(ctx) < 0)
-			return -1;
-	}
+	if(ctx->rbuftail == ctx->rbufhead)
+		return -1;
 	// buffer is not empty
 	if(ctx->rbuffer[ctx->rbufhead] != '$') {
 		// text data
@@ -234,66 +780,6 @@ rtsp_getnext(RTSPContext *ctx, char *buf, size_t count) {
 	return rtsp_read_binary(ctx, buf, count);
 }
 
-static int
-per_client_init(RTSPContext *ctx) {
-	int i;
-	AVOutputFormat *fmt;
-	//
-	if((fmt = av_guess_format("rtp", NULL, NULL)) == NULL) {
-		ga_error("RTP not supported.\n");
-		return -1;
-	}
-	if((ctx->sdp_fmtctx = avformat_alloc_context()) == NULL) {
-		ga_error("create avformat context failed.\n");
-		return -1;
-	}
-	ctx->sdp_fmtctx->oformat = fmt;
-	// video stream
-	for(i = 0; i < video_source_channels(); i++) {
-		if((ctx->sdp_vstream[i] = ga_avformat_new_stream(
-			ctx->sdp_fmtctx,
-			i, rtspconf->video_encoder_codec)) == NULL) {
-			//
-			ga_error("cannot create new video stream (%d:%d)\n",
-				i, rtspconf->video_encoder_codec->id);
-			return -1;
-		}
-		if((ctx->sdp_vencoder[i] = ga_avcodec_vencoder_init(
-			ctx->sdp_vstream[i]->codec,
-			rtspconf->video_encoder_codec,
-			video_source_width(i), video_source_height(i),
-			rtspconf->video_fps,
-			rtspconf->vso)) == NULL) {
-			//
-			ga_error("cannot init video encoder\n");
-			return -1;
-		}
-	}
-	// audio stream
-#ifdef ENABLE_AUDIO
-	if((ctx->sdp_astream = ga_avformat_new_stream(
-			ctx->sdp_fmtctx,
-			video_source_channels(),
-			rtspconf->audio_encoder_codec)) == NULL) {
-		ga_error("cannot create new audio stream (%d)\n",
-			rtspconf->audio_encoder_codec->id);
-		return -1;
-	}
-	if((ctx->sdp_aencoder = ga_avcodec_aencoder_init(
-			ctx->sdp_astream->codec,
-			rtspconf->audio_encoder_codec,
-			rtspconf->audio_bitrate,
-			rtspconf->audio_samplerate,
-			rtspconf->audio_channels,
-			rtspconf->audio_codec_format,
-			rtspconf->audio_codec_channel_layout)) == NULL) {
-		ga_error("cannot init audio encoder\n");
-		return -1;
-	}
-#endif
-	return 0;
-}
-
 static void
 close_av(AVFormatContext *fctx, AVStream *st, AVCodecContext *cctx, enum RTSPLowerTransport transport) {
 	unsigned i;
@@ -315,13 +801,13 @@ close_av(AVFormatContext *fctx, AVStream *st, AVCodecContext *cctx, enum RTSPLow
 			} else {
 				cctx = NULL;
 			}
+			if(fctx->streams[i]->codec)
+				av_freep(&fctx->streams[i]->codec->extradata);
 			av_freep(&fctx->streams[i]->codec);
 			if(st == fctx->streams[i])
 				st = NULL;
 			av_freep(&fctx->streams[i]);
 		}
-		if(transport==RTSP_LOWER_TRANSPORT_UDP && fctx->pb)
-			avio_close(fctx->pb);
 		av_free(fctx);
 	}
 	if(cctx != NULL)
@@ -331,30 +817,374 @@ close_av(AVFormatContext *fctx, AVStream *st, AVCodecContext *cctx, enum RTSPLow
 	return;
 }
 
-static void
-per_client_deinit(RTSPContext *ctx) {
-	int i;
-	for(i = 0; i < video_source_channels()+1; i++) {
-		close_av(ctx->fmtctx[i], ctx->stream[i], ctx->encoder[i], ctx->lower_transport[i]);
-	}
-	//close_av(ctx->fmtctx[0], ctx->stream[0], ctx->encoder[0], ctx->lower_transport[0]);
-	//close_av(ctx->fmtctx[1], ctx->stream[1], ctx->encoder[1], ctx->lower_transport[1]);
+// the SDP, and the codec parameters of the RTP muxers, shared by all sessions.
+// they are first taken from encoders opened with the same parameters as the
+// shared encoders, which do not run before the first PLAY, and are then
+// refreshed from the headers of the live encoders, see rtsp_codec_refresh().
+static pthread_mutex_t sdp_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char sdp_cache[4096];
+static int sdp_length = -1;
+static char sdp_mcast_cache[4096];	// for <object>/multicast
+static int sdp_mcast_length = -1;
+static AVCodecContext *sdp_codec[IMAGE_SOURCE_CHANNEL_MAX+1][RTSPCONF_TIER_MAX];	// video channels, then audio
+static unsigned int sdp_version[IMAGE_SOURCE_CHANNEL_MAX+1];	// bumped on changes of tier 0
+
+// ffmpeg leaves out the control attributes when ports are given
+static int
+sdp_add_control(const char *sdp, char *buf, int bufsize) {
+	const char *p, *eol;
+	int len = 0, media = -1;
 	//
-	close_av(ctx->sdp_fmtctx, NULL, NULL, RTSP_LOWER_TRANSPORT_UDP);
+	buf[0] = '\0';
+	for(p = sdp; *p != '\0'; p = eol) {
+		if((eol = strchr(p, '\n')) == NULL)
+			eol = p + strlen(p);
+		else
+			eol++;
+		if(strncmp(p, "m=", 2) == 0 && media >= 0)
+			len += snprintf(buf+len, bufsize-len, "a=control:" RTSP_STREAM_FORMAT "\r\n", media);
+		if(strncmp(p, "m=", 2) == 0)
+			media++;
+		if(len >= bufsize || eol - p >= bufsize - len)
+			return -1;
+		bcopy(p, buf+len, eol - p);
+		len += eol - p;
+		buf[len] = '\0';
+	}
+	if(media >= 0)
+		len += snprintf(buf+len, bufsize-len, "a=control:" RTSP_STREAM_FORMAT "\r\n", media);
+	return len < bufsize ? len : -1;
+}
+
+// (re)build the SDP from the cached codec parameters; sdp_mutex must be held
+static int
+sdp_build_locked() {
+	int i, ret = -1;
+	AVOutputFormat *fmt;
+	AVFormatContext *fmtctx = NULL;
+	AVStream *st;
+	char sdp[sizeof(sdp_cache)] = "";
+	char mcast[sizeof(sdp_mcast_cache)] = "";
+	int mcastlen = -1;
 	//
-	if(ctx->rbuffer) {
-		free(ctx->rbuffer);
+	if((fmt = av_guess_format("rtp", NULL, NULL)) == NULL
+	|| (fmtctx = avformat_alloc_context()) == NULL) {
+		ga_error("cannot create RTP context for the SDP.\n");
+		goto quit;
+	}
+	fmtctx->oformat = fmt;
+	for(i = 0; i < IMAGE_SOURCE_CHANNEL_MAX+1 && sdp_codec[i][0] != NULL; i++) {
+		if((st = avformat_new_stream(fmtctx, NULL)) == NULL
+		|| avcodec_copy_context(st->codec, sdp_codec[i][0]) < 0) {
+			ga_error("cannot copy codec parameters of stream %d\n", i);
+			goto quit;
+		}
+		st->id = i;
 	}
-	ctx->rbufsize = 0;
-	ctx->rbufhead = ctx->rbuftail = 0;
 	//
-	return;
+	av_dict_set(&fmtctx->metadata, "title", rtspconf->title, 0);
+	snprintf(fmtctx->filename, sizeof(fmtctx->filename), "rtp://0.0.0.0");
+	if(av_sdp_create(&fmtctx, 1, sdp, sizeof(sdp)) < 0) {
+		ga_error("cannot create SDP.\n");
+		goto quit;
+	}
+	// the same with the group address and ports
+	if(rtspconf->mcast_group != NULL) {
+		char buf[sizeof(sdp_mcast_cache)] = "";
+		snprintf(fmtctx->filename, sizeof(fmtctx->filename), "rtp://%s:%d?ttl=%d",
+			rtspconf->mcast_group, rtspconf->mcast_port, rtspconf->mcast_ttl);
+		av_sdp_create(&fmtctx, 1, buf, sizeof(buf));
+		mcastlen = sdp_add_control(buf, mcast, sizeof(mcast));
+	}
+	bcopy(sdp, sdp_cache, sizeof(sdp_cache));
+	sdp_length = strlen(sdp_cache);
+	bcopy(mcast, sdp_mcast_cache, sizeof(sdp_mcast_cache));
+	sdp_mcast_length = mcastlen;
+	ret = 0;
+quit:
+	close_av(fmtctx, NULL, NULL, RTSP_LOWER_TRANSPORT_UDP);
+	return ret;
 }
 
 static void
-rtsp_reply_header(RTSPContext *c, enum RTSPStatusCode error_number) {
-	const char *str;
-	time_t ti;
+sdp_codec_free(AVCodecContext **c) {
+	if(*c == NULL)
+		return;
+	av_freep(&(*c)->extradata);
+	av_freep(c);
+}
+
+static int
+rtsp_sdp_init() {
+	int i, tier, ret = -1;
+	AVOutputFormat *fmt;
+	AVFormatContext *fmtctx = NULL;
+	AVStream *st;
+	struct timeval tv1, tv2;
+	//
+	pthread_mutex_lock(&sdp_mutex);
+	if(sdp_length >= 0) {
+		pthread_mutex_unlock(&sdp_mutex);
+		return 0;
+	}
+	gettimeofday(&tv1, NULL);
+	if((fmt = av_guess_format("rtp", NULL, NULL)) == NULL) {
+		ga_error("RTP not supported.\n");
+		goto quit;
+	}
+	if((fmtctx = avformat_alloc_context()) == NULL) {
+		ga_error("create avformat context failed.\n");
+		goto quit;
+	}
+	fmtctx->oformat = fmt;
+	// video stream
+	for(i = 0; i < video_source_channels(); i++) {
+		if((st = ga_avformat_new_stream(
+			fmtctx,
+			i, rtspconf->video_encoder_codec)) == NULL) {
+			//
+			ga_error("cannot create new video stream (%d:%d)\n",
+				i, rtspconf->video_encoder_codec->id);
+			goto quit;
+		}
+		if(ga_avcodec_vencoder_init(
+			st->codec,
+			rtspconf->video_encoder_codec,
+			video_source_width(i), video_source_height(i),
+			rtspconf->video_fps,
+			rtspconf->vso) == NULL) {
+			//
+			ga_error("cannot init video encoder\n");
+			st->codec = NULL;	// freed on failure
+			goto quit;
+		}
+	}
+	// audio stream
+#ifdef ENABLE_AUDIO
+	if((st = ga_avformat_new_stream(
+			fmtctx,
+			video_source_channels(),
+			rtspconf->audio_encoder_codec)) == NULL) {
+		ga_error("cannot create new audio stream (%d)\n",
+			rtspconf->audio_encoder_codec->id);
+		goto quit;
+	}
+	if(ga_avcodec_aencoder_init(
+			st->codec,
+			rtspconf->audio_encoder_codec,
+			rtspconf->audio_bitrate,
+			rtspconf->audio_samplerate,
+			rtspconf->audio_channels,
+			rtspconf->audio_codec_format,
+			rtspconf->audio_codec_channel_layout) == NULL) {
+		ga_error("cannot init audio encoder\n");
+		st->codec = NULL;	// freed on failure
+		goto quit;
+	}
+#endif
+	// keep only the parameters, e.g., extradata for the RTP muxers.
+	// the lower tiers start with the parameters of tier 0 at their own
+	// resolution, until their encoders have been opened.
+	for(i = 0; i < (int) fmtctx->nb_streams; i++) {
+		int tiers = i < video_source_channels() && rtspconf->video_tiers > 1 ? rtspconf->video_tiers : 1;
+		for(tier = 0; tier < tiers && tier < RTSPCONF_TIER_MAX; tier++) {
+			AVCodecContext *c;
+			if((c = sdp_codec[i][tier] = avcodec_alloc_context3(NULL)) == NULL
+			|| avcodec_copy_context(c, fmtctx->streams[i]->codec) < 0) {
+				ga_error("cannot copy codec parameters of stream %d\n", i);
+				goto quit;
+			}
+			// owned by the encoder being closed
+			c->coded_frame = NULL;
+			if(tier > 0) {
+				c->width = rtspconf->video_tier_width[tier];
+				c->height = rtspconf->video_tier_height[tier];
+			}
+		}
+	}
+	if(sdp_build_locked() < 0)
+		goto quit;
+	ret = 0;
+	gettimeofday(&tv2, NULL);
+	ga_error("SDP prepared (%d bytes) in %.3f ms.\n",
+		sdp_length, 0.001 * tvdiff_us(&tv2, &tv1));
+quit:
+	close_av(fmtctx, NULL, NULL, RTSP_LOWER_TRANSPORT_UDP);
+	if(ret < 0) {
+		sdp_length = -1;
+		for(i = 0; i < IMAGE_SOURCE_CHANNEL_MAX+1; i++)
+			for(tier = 0; tier < RTSPCONF_TIER_MAX; tier++)
+				sdp_codec_free(&sdp_codec[i][tier]);
+	}
+	pthread_mutex_unlock(&sdp_mutex);
+	return ret;
+}
+
+// codec parameters of a stream, e.g., for the recorder; NULL if not available.
+// the context stays valid, but its extradata may be replaced at any time:
+// use rtsp_codec_copy() for anything but the fixed fields, e.g., time_base.
+AVCodecContext *
+rtsp_codec_parameters(int streamid) {
+	if(streamid < 0 || streamid > IMAGE_SOURCE_CHANNEL_MAX)
+		return NULL;
+	if(rtsp_sdp_init() < 0)
+		return NULL;
+	return sdp_codec[streamid][0];
+}
+
+// copy the current codec parameters of a stream (and tier) into dst
+int
+rtsp_codec_copy(int streamid, int tier, AVCodecContext *dst) {
+	int ret = -1;
+	if(streamid < 0 || streamid > IMAGE_SOURCE_CHANNEL_MAX
+	|| tier < 0 || tier >= RTSPCONF_TIER_MAX)
+		return -1;
+	if(rtsp_sdp_init() < 0)
+		return -1;
+	pthread_mutex_lock(&sdp_mutex);
+	if(sdp_codec[streamid][tier] != NULL)
+		ret = avcodec_copy_context(dst, sdp_codec[streamid][tier]);
+	else if(sdp_codec[streamid][0] != NULL)
+		ret = avcodec_copy_context(dst, sdp_codec[streamid][0]);
+	pthread_mutex_unlock(&sdp_mutex);
+	return ret < 0 ? -1 : 0;
+}
+
+// changes whenever the parameters of tier 0 of a stream change
+unsigned int
+rtsp_codec_version(int streamid) {
+	unsigned int v;
+	if(streamid < 0 || streamid > IMAGE_SOURCE_CHANNEL_MAX)
+		return 0;
+	pthread_mutex_lock(&sdp_mutex);
+	v = sdp_version[streamid];
+	pthread_mutex_unlock(&sdp_mutex);
+	return v;
+}
+
+// the encoder of a stream (and tier) has been (re)opened: take its headers,
+// e.g., H.264 SPS/PPS with start codes, as the extradata for the muxers and
+// the SDP.  new sessions and recordings see the parameters actually in use.
+void
+rtsp_codec_refresh(int streamid, int tier, const unsigned char *extradata, int size, int width, int height) {
+	AVCodecContext *c;
+	unsigned char *buf;
+	//
+	if(streamid < 0 || streamid > IMAGE_SOURCE_CHANNEL_MAX
+	|| tier < 0 || tier >= RTSPCONF_TIER_MAX
+	|| extradata == NULL || size <= 0)
+		return;
+	if(rtsp_sdp_init() < 0)
+		return;
+	pthread_mutex_lock(&sdp_mutex);
+	if((c = sdp_codec[streamid][tier]) == NULL)
+		goto quit;
+	if(c->extradata != NULL && c->extradata_size == size
+	&& memcmp(c->extradata, extradata, size) == 0
+	&& (width <= 0 || (c->width == width && c->height == height)))
+		goto quit;	// unchanged
+	if((buf = (unsigned char*) av_mallocz(size + FF_INPUT_BUFFER_PADDING_SIZE)) == NULL)
+		goto quit;
+	bcopy(extradata, buf, size);
+	av_free(c->extradata);
+	c->extradata = buf;
+	c->extradata_size = size;
+	if(width > 0 && height > 0) {
+		c->width = width;
+		c->height = height;
+	}
+	if(tier == 0) {
+		sdp_version[streamid]++;
+		if(sdp_build_locked() < 0)
+			ga_error("rtsp: cannot rebuild the SDP, keeping the previous one.\n");
+	}
+	ga_error("rtsp: codec parameters of stream %d tier %d refreshed (%dx%d, %d bytes).\n",
+		streamid, tier, c->width, c->height, size);
+quit:
+	pthread_mutex_unlock(&sdp_mutex);
+	return;
+}
+
+static void
+per_client_deinit(RTSPContext *ctx) {
+	int i;
+	// no more packets from the pacer
+	if(ctx->pacer != NULL) {
+		pacer_destroy(ctx->pacer);
+		ctx->pacer = NULL;
+	}
+	for(i = 0; i < video_source_channels()+1; i++) {
+		if(ctx->rtcpstats[i].packets > 0) {
+			struct rtcp_stats *st = &ctx->rtcpstats[i];
+			ga_error("rtcp: stream %d: %u packets, %u bytes, %u sender reports, %u receiver reports, %d lost\n",
+				i, st->packets, st->octets, st->srcount, st->rrcount,
+				st->report.cumulative_lost);
+		}
+		if(ctx->history[i] != NULL) {
+			struct rtp_history_stats st;
+			rtp_history_get_stats(ctx->history[i], &st);
+			ga_error("rtx: stream %d: %u nacked, %u resent, %u expired, %u unavailable\n",
+				i, st.requested, st.resent, st.expired, st.unavailable);
+			rtp_history_destroy(ctx->history[i]);
+			ctx->history[i] = NULL;
+		}
+		if(ctx->fec[i] != NULL) {
+			struct rtp_fec_stats st;
+			rtp_fec_encoder_get_stats(ctx->fec[i], &st);
+			ga_error("fec: stream %d: %u parity packets for %u packets, overhead %.1f%% (%llu bytes), group %d\n",
+				i, st.fec_packets, st.media_packets,
+				st.media_bytes > 0 ? 100.0 * st.fec_bytes / st.media_bytes : 0.0,
+				st.fec_bytes, rtp_fec_encoder_group(ctx->fec[i]));
+			rtp_fec_encoder_destroy(ctx->fec[i]);
+			ctx->fec[i] = NULL;
+		}
+		// the stream and its codec parameters are freed with the muxer
+		close_av(ctx->fmtctx[i], NULL, NULL, ctx->lower_transport[i]);
+		ctx->fmtctx[i] = NULL;
+		ctx->stream[i] = NULL;
+		if(ctx->rtp[i] != NULL)
+			ffurl_close(ctx->rtp[i]);
+		ctx->rtp[i] = NULL;
+	}
+	//
+	if(ctx->rbuffer) {
+		free(ctx->rbuffer);
+	}
+	// messages never written
+	if(ctx->txpartial != NULL) {
+		free(ctx->txpartial);
+		ctx->txpartial = NULL;
+	}
+	ctx->txwantout = 0;
+	for(i = 0; i < RTSP_TX_PRIO_MAX; i++) {
+		struct rtsp_txpacket *pkt;
+		while((pkt = ctx->txhead[i]) != NULL) {
+			ctx->txhead[i] = pkt->next;
+			free(pkt);
+		}
+		ctx->txtail[i] = NULL;
+		ctx->txbytes[i] = 0;
+	}
+	if(ctx->txdropped > 0) {
+		ga_error("rtsp: session %s, %u audio/RTCP messages dropped from a full queue.\n",
+			ctx->session_id ? ctx->session_id : "-", ctx->txdropped);
+		ctx->txdropped = 0;
+	}
+	if(ctx->replybuf) {
+		free(ctx->replybuf);
+		ctx->replybuf = NULL;
+	}
+	ctx->replylen = ctx->replysize = 0;
+	ctx->rbufsize = 0;
+	ctx->rbufhead = ctx->rbuftail = 0;
+	//
+	return;
+}
+
+static void
+rtsp_reply_header(RTSPContext *c, enum RTSPStatusCode error_number) {
+	const char *str;
+	time_t ti;
 	struct tm rtm;
 	char buf2[32];
 
@@ -415,12 +1245,22 @@ rtsp_reply_error(RTSPContext *c, enum RTSPStatusCode error_number) {
 }
 
 static int
-prepare_sdp_description(RTSPContext *ctx, char *buf, int bufsize) {
-	buf[0] = '\0';
-	av_dict_set(&ctx->sdp_fmtctx->metadata, "title", rtspconf->title, 0);
-	snprintf(ctx->sdp_fmtctx->filename, sizeof(ctx->sdp_fmtctx->filename), "rtp://0.0.0.0");
-	av_sdp_create(&ctx->sdp_fmtctx, 1, buf, bufsize);
-	return strlen(buf);
+prepare_sdp_description(RTSPContext *ctx, char *buf, int bufsize, int multicast) {
+	int len = -1;
+	if(rtsp_sdp_init() < 0)
+		return -1;
+	pthread_mutex_lock(&sdp_mutex);
+	if(multicast) {
+		if(sdp_mcast_length >= 0 && sdp_mcast_length < bufsize) {
+			bcopy(sdp_mcast_cache, buf, sdp_mcast_length+1);
+			len = sdp_mcast_length;
+		}
+	} else if(sdp_length < bufsize) {
+		bcopy(sdp_cache, buf, sdp_length+1);
+		len = sdp_length;
+	}
+	pthread_mutex_unlock(&sdp_mutex);
+	return len;
 }
 
 static void
@@ -433,17 +1273,23 @@ rtsp_cmd_describe(RTSPContext *ctx, const char *url) {
 #endif
 	char path[4096];
 	char content[4096];
-	int content_length;
+	int content_length, multicast;
 	//
 	av_url_split(NULL, 0, NULL, 0, NULL, 0, NULL, path, sizeof(path), url);
-	if(strcmp(path, rtspconf->object) != 0) {
+	if(strcmp(path, rtspconf->object) == 0) {
+		multicast = 0;
+	} else if(rtspconf->mcast_group != NULL
+	&& strncmp(path, rtspconf->object, strlen(rtspconf->object)) == 0
+	&& strcmp(path+strlen(rtspconf->object), RTSP_MCAST_SUFFIX) == 0) {
+		multicast = 1;
+	} else {
 		rtsp_reply_error(ctx, RTSP_STATUS_SERVICE);
 		return;
 	}
 	//
 	addrlen = sizeof(myaddr);
 	getsockname(ctx->fd, (struct sockaddr*) &myaddr, &addrlen);
-	content_length = prepare_sdp_description(ctx, content, sizeof(content));
+	content_length = prepare_sdp_description(ctx, content, sizeof(content), multicast);
 	if(content_length < 0) {
 		rtsp_reply_error(ctx, RTSP_STATUS_INTERNAL);
 		return;
@@ -464,7 +1310,7 @@ rtsp_cmd_options(RTSPContext *c, const char *url) {
 	rtsp_printf(c, "RTSP/1.0 %d %s\r\n", RTSP_STATUS_OK, "OK");
 	rtsp_printf(c, "CSeq: %d\r\n", c->seq);
 	//rtsp_printf(c, "Public: %s\r\n", "OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE");
-	rtsp_printf(c, "Public: %s\r\n", "OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY");
+	rtsp_printf(c, "Public: %s\r\n", "OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY, SET_PARAMETER");
 	rtsp_printf(c, "\r\n");
 	return;
 }
@@ -486,7 +1332,7 @@ rtp_new_av_stream(RTSPContext *ctx, struct sockaddr_in *sin, int streamid, enum
 	AVOutputFormat *fmt = NULL;
 	AVFormatContext *fmtctx = NULL;
 	AVStream *stream = NULL;
-	AVCodecContext *encoder = NULL;
+	AVDictionary *opts = NULL;
 	uint8_t *dummybuf = NULL;
 	//
 	if(streamid > IMAGE_SOURCE_CHANNEL_MAX) {
@@ -513,72 +1359,426 @@ rtp_new_av_stream(RTSPContext *ctx, struct sockaddr_in *sin, int streamid, enum
 		return -1;
 	}
 	fmtctx->oformat = fmt;
+	// packets of both transports are muxed into a dynamic packet buffer,
+	// and then sent (or paced) by rtsp_write_bindata()
 	if(ctx->lower_transport[streamid] == RTSP_LOWER_TRANSPORT_UDP) {
 		snprintf(fmtctx->filename, sizeof(fmtctx->filename),
 			"rtp://%s:%d", inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
-		if(avio_open(&fmtctx->pb, fmtctx->filename, AVIO_FLAG_WRITE) < 0) {
+		if(IN_MULTICAST(ntohl(sin->sin_addr.s_addr))) {
+			snprintf(fmtctx->filename + strlen(fmtctx->filename),
+				sizeof(fmtctx->filename) - strlen(fmtctx->filename),
+				"?ttl=%d", rtspconf->mcast_ttl);
+		}
+		if(ffurl_open(&ctx->rtp[streamid], fmtctx->filename, AVIO_FLAG_WRITE, NULL, NULL) < 0) {
 			ga_error("cannot open URL: %s\n", fmtctx->filename);
 			return -1;
 		}
+		// the rtp protocol sends RTCP to the next port
+		ctx->udp_fd[streamid][0] = ctx->udp_fd[streamid][1] = -1;
+		do {
+			int *fds = NULL, nfds = 0;
+			if(ffurl_get_multi_file_handle(ctx->rtp[streamid], &fds, &nfds) == 0
+			&& nfds >= 2) {
+				ctx->udp_fd[streamid][0] = fds[0];
+				ctx->udp_fd[streamid][1] = fds[1];
+				ctx->udp_addr[streamid][0] = ctx->udp_addr[streamid][1] = *sin;
+				ctx->udp_addr[streamid][1].sin_port = htons(ntohs(sin->sin_port) + 1);
+			}
+			av_free(fds);
+		} while(0);
+		ctx->max_packet_size[streamid] = ctx->rtp[streamid]->max_packet_size;
+		// parity packets are larger than the largest packet they protect
+		if(rtspconf->fec && streamid < video_source_channels())
+			ctx->max_packet_size[streamid] -= RTP_FEC_OVERHEAD;
 		ga_error("RTP/UDP: URL opened [%d]: %s, max_packet_size=%d\n",
-			streamid, fmtctx->filename, fmtctx->pb->max_packet_size);
+			streamid, fmtctx->filename, ctx->max_packet_size[streamid]);
 	} else if(ctx->lower_transport[streamid] == RTSP_LOWER_TRANSPORT_TCP) {
-		// XXX: should we use avio_open_dyn_buf(&fmtctx->pb)?
-		if(ffio_open_dyn_packet_buf(&fmtctx->pb, RTSP_TCP_MAX_PACKET_SIZE) < 0) {
-			ga_error("cannot open dynamic packet buffer\n");
-			return -1;
-		}
-		ga_error("RTP/TCP: Dynamic buffer opened, max_packet_size=%d.\n",
-			fmtctx->pb->max_packet_size);
+		ctx->max_packet_size[streamid] = RTSP_TCP_MAX_PACKET_SIZE;
+	}
+	if(ffio_open_dyn_packet_buf(&fmtctx->pb, ctx->max_packet_size[streamid]) < 0) {
+		ga_error("cannot open dynamic packet buffer\n");
+		return -1;
 	}
+	ga_error("RTP: dynamic buffer opened, max_packet_size=%d.\n",
+		fmtctx->pb->max_packet_size);
 	fmtctx->pb->seekable = 0;
 	//
-	if((stream = ga_avformat_new_stream(fmtctx, 0,
-			codecid == rtspconf->video_encoder_codec->id ?
-				rtspconf->video_encoder_codec : rtspconf->audio_encoder_codec)) == NULL) {
+	// no encoder: the muxer needs only the codec parameters
+	if((stream = avformat_new_stream(fmtctx, NULL)) == NULL
+	|| rtsp_codec_copy(streamid,
+		streamid < video_source_channels() ? ctx->tier[streamid] : 0,
+		stream->codec) < 0) {
 		ga_error("Cannot create new stream (%d)\n", codecid);
 		return -1;
 	}
-//#ifndef SHARE_ENCODER
-	if(codecid == rtspconf->video_encoder_codec->id) {
-		encoder = ga_avcodec_vencoder_init(
-				stream->codec,
-				rtspconf->video_encoder_codec,
-				video_source_width(streamid),
-				video_source_height(streamid),
-				rtspconf->video_fps,
-				rtspconf->vso);
-	} else if(codecid == rtspconf->audio_encoder_codec->id) {
-		encoder = ga_avcodec_aencoder_init(
-				stream->codec,
-				rtspconf->audio_encoder_codec,
-				rtspconf->audio_bitrate,
-				rtspconf->audio_samplerate,
-				rtspconf->audio_channels,
-				rtspconf->audio_codec_format,
-				rtspconf->audio_codec_channel_layout);
-	}
-	if(encoder == NULL) {
-		ga_error("Cannot init encoder\n");
-		return -1;
-	}
-//#endif	/* SHARE_ENCODER */
+	stream->id = 0;
 	//
-	ctx->encoder[streamid] = encoder;
 	ctx->stream[streamid] = stream;
 	ctx->fmtctx[streamid] = fmtctx;
-	// write header
-	if(avformat_write_header(ctx->fmtctx[streamid], NULL) < 0) {
+	// write header.  sender reports are ours, see rtsp_send_reports()
+	av_dict_set(&opts, "rtpflags", "skip_rtcp", 0);
+	if(avformat_write_header(ctx->fmtctx[streamid], &opts) < 0) {
 		ga_error("Cannot write stream id %d.\n", streamid);
+		av_dict_free(&opts);
+		return -1;
+	}
+	av_dict_free(&opts);
+	// the muxer sets the RTP clock of the stream
+	pthread_mutex_lock(&ctx->rtcp_mutex);
+	rtcp_stats_init(&ctx->rtcpstats[streamid],
+		stream->time_base.num > 0 ? stream->time_base.den / stream->time_base.num : 0);
+	pthread_mutex_unlock(&ctx->rtcp_mutex);
+	avio_close_dyn_buf(ctx->fmtctx[streamid]->pb, &dummybuf);
+	ctx->fmtctx[streamid]->pb = NULL;
+	av_free(dummybuf);
+	//
+	return 0;
+}
+
+// mark RTP and RTCP packets of a UDP stream with a DSCP, and on Linux
+// with the matching socket priority (the class selector, 0-7)
+static void
+rtp_set_dscp(RTSPContext *ctx, int streamid, int dscp) {
+	int *fds = NULL, nfds = 0, i, tos;
+	//
+	if(dscp < 0 || ctx->rtp[streamid] == NULL)
+		return;
+	if(ffurl_get_multi_file_handle(ctx->rtp[streamid], &fds, &nfds) != 0)
+		return;
+	tos = dscp << 2;
+	for(i = 0; i < nfds; i++) {
+		if(setsockopt(fds[i], IPPROTO_IP, IP_TOS, (const char*) &tos, sizeof(tos)) < 0) {
+			ga_error("RTP/UDP: set DSCP %d failed (stream %d).\n", dscp, streamid);
+		}
+#ifdef SO_PRIORITY
+		do {
+			int prio = dscp >> 3;
+			if(setsockopt(fds[i], SOL_SOCKET, SO_PRIORITY, &prio, sizeof(prio)) < 0) {
+				ga_error("RTP/UDP: set priority %d failed (stream %d).\n", prio, streamid);
+			}
+		} while(0);
+#endif
+	}
+	av_free(fds);
+	ga_error("RTP/UDP: stream %d marked with DSCP %d.\n", streamid, dscp);
+	return;
+}
+
+// multicast: a single sender, registered with the encoders like a session
+// while any viewer plays, sends each stream once to the configured group.
+// viewers of <object>/multicast hold no RTP state of their own.
+#define	RTSP_MCAST_RECEIVER_MAX	256
+#define	RTSP_MCAST_RECEIVER_TIMEOUT	30	/* seconds without a report */
+#define	RTSP_MCAST_REPORT_INTERVAL	10	/* seconds */
+
+// the latest receiver report of a viewer, for statistics only
+struct mcast_receiver {
+	unsigned int ssrc;	// 0 - unused
+	int streamid;
+	struct sockaddr_in addr;
+	struct timeval last;
+	struct rtcp_report_block report;
+};
+
+static pthread_mutex_t mcast_mutex = PTHREAD_MUTEX_INITIALIZER;
+static RTSPContext *mcast_sender = NULL;
+static int mcast_viewers = 0;		// sessions playing multicast streams
+static struct mcast_receiver mcast_receivers[RTSP_MCAST_RECEIVER_MAX];
+
+static void rtsp_picture_loss(RTSPContext *ctx, int streamid, const struct rtcp_feedback *fb);
+static long long rtsp_send_reports(RTSPContext *ctx, struct timeval *now);
+
+static void
+mcast_set_interface(RTSPContext *ctx, int streamid) {
+	int *fds = NULL, nfds = 0, i;
+	struct in_addr iface;
+	unsigned char loop = 1;
+	//
+	if(ffurl_get_multi_file_handle(ctx->rtp[streamid], &fds, &nfds) != 0)
+		return;
+	iface.s_addr = rtspconf->mcast_iface ? inet_addr(rtspconf->mcast_iface) : htonl(INADDR_ANY);
+	for(i = 0; i < nfds; i++) {
+		if(rtspconf->mcast_iface != NULL
+		&& setsockopt(fds[i], IPPROTO_IP, IP_MULTICAST_IF, (const char*) &iface, sizeof(iface)) < 0) {
+			ga_error("mcast: set interface %s failed (stream %d).\n",
+				rtspconf->mcast_iface, streamid);
+		}
+		// viewers on this host, e.g., on the loopback interface
+		setsockopt(fds[i], IPPROTO_IP, IP_MULTICAST_LOOP, (const char*) &loop, sizeof(loop));
+	}
+	av_free(fds);
+	return;
+}
+
+// receiver reports are sent to the group, on the RTCP port
+static int
+mcast_open_rtcp(int streamid) {
+	struct sockaddr_in sin;
+	struct ip_mreq mreq;
+	int s, val = 1;
+	//
+	if((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+		return -1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*) &val, sizeof(val));
+	bzero(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	sin.sin_port = htons(rtspconf->mcast_port + 2*streamid + 1);
+	if(bind(s, (struct sockaddr*) &sin, sizeof(sin)) < 0) {
+		ga_error("mcast: cannot bind RTCP port %d: %s\n",
+			rtspconf->mcast_port + 2*streamid + 1, strerror(errno));
+		close(s);
 		return -1;
 	}
-	if(ctx->lower_transport[streamid] == RTSP_LOWER_TRANSPORT_TCP) {
-		int rlen;
-		rlen = avio_close_dyn_buf(ctx->fmtctx[streamid]->pb, &dummybuf);
-		av_free(dummybuf);
+	bzero(&mreq, sizeof(mreq));
+	mreq.imr_multiaddr.s_addr = inet_addr(rtspconf->mcast_group);
+	mreq.imr_interface.s_addr = rtspconf->mcast_iface ? inet_addr(rtspconf->mcast_iface) : htonl(INADDR_ANY);
+	if(setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*) &mreq, sizeof(mreq)) < 0) {
+		ga_error("mcast: cannot join %s: %s\n", rtspconf->mcast_group, strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+static void
+mcast_receiver_report(int streamid, const struct sockaddr_in *from, const struct rtcp_feedback *fb, const struct timeval *now) {
+	struct mcast_receiver *r, *slot = NULL;
+	int i;
+	//
+	for(i = 0; i < RTSP_MCAST_RECEIVER_MAX; i++) {
+		r = &mcast_receivers[i];
+		if(r->ssrc == fb->sender_ssrc && r->streamid == streamid) {
+			slot = r;
+			break;
+		}
+		if(slot == NULL && r->ssrc == 0)
+			slot = r;
+	}
+	if(slot == NULL)
+		return;
+	if(slot->ssrc == 0) {
+		ga_error("mcast: stream %d: new receiver %08x at %s:%d\n",
+			streamid, fb->sender_ssrc,
+			inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+	}
+	slot->ssrc = fb->sender_ssrc;
+	slot->streamid = streamid;
+	slot->addr = *from;
+	slot->last = *now;
+	slot->report = fb->report;
+	return;
+}
+
+static void
+mcast_receiver_summary(const struct timeval *now) {
+	int i, streamid, n, lossmax;
+	long long losssum;
+	unsigned int jittermax;
+	struct mcast_receiver *r;
+	//
+	for(streamid = 0; streamid < RTSP_CHANNEL_MAX; streamid++) {
+		n = lossmax = 0;
+		losssum = 0;
+		jittermax = 0;
+		for(i = 0; i < RTSP_MCAST_RECEIVER_MAX; i++) {
+			r = &mcast_receivers[i];
+			if(r->ssrc == 0 || r->streamid != streamid)
+				continue;
+			if(tvdiff_us((struct timeval*) now, &r->last) > RTSP_MCAST_RECEIVER_TIMEOUT * 1000000LL) {
+				ga_error("mcast: stream %d: receiver %08x at %s left.\n",
+					streamid, r->ssrc, inet_ntoa(r->addr.sin_addr));
+				r->ssrc = 0;
+				continue;
+			}
+			n++;
+			losssum += r->report.fraction_lost;
+			if(r->report.fraction_lost > lossmax)
+				lossmax = r->report.fraction_lost;
+			if(r->report.jitter > jittermax)
+				jittermax = r->report.jitter;
+		}
+		if(n == 0)
+			continue;
+		ga_error("mcast: stream %d: %d receivers, loss avg %.1f%% max %.1f%%, jitter max %u\n",
+			streamid, n, 100.0 * losssum / n / 256, 100.0 * lossmax / 256, jittermax);
+	}
+	return;
+}
+
+// feedback of all viewers.  PLI and FIR request keyframes, and reports
+// are kept for statistics; NACKs are not served, there is no history.
+static void *
+mcast_rtcp_thread(void *arg) {
+	unsigned char buf[2048];
+	struct timeval now, lastsummary;
+	struct sockaddr_in from;
+#ifdef WIN32
+	int fromlen;
+#else
+	socklen_t fromlen;
+#endif
+	struct rtcp_feedback fb;
+	int i, rlen;
+	//
+	gettimeofday(&lastsummary, NULL);
+	while(true) {
+		fd_set rfds;
+		struct timeval timeout;
+		int maxfd = -1;
+		//
+		FD_ZERO(&rfds);
+		pthread_mutex_lock(&mcast_mutex);
+		for(i = 0; i < RTSP_CHANNEL_MAX; i++) {
+			if(mcast_sender->rtcp_fd[i] < 0)
+				continue;
+			FD_SET(mcast_sender->rtcp_fd[i], &rfds);
+			if(mcast_sender->rtcp_fd[i] > maxfd)
+				maxfd = mcast_sender->rtcp_fd[i];
+		}
+		pthread_mutex_unlock(&mcast_mutex);
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		if(select(maxfd+1, &rfds, NULL, NULL, &timeout) < 0) {
+			if(errno == EINTR)
+				continue;
+			ga_error("mcast: select() failed: %s\n", strerror(errno));
+			break;
+		}
+		gettimeofday(&now, NULL);
+		for(i = 0; i < RTSP_CHANNEL_MAX; i++) {
+			if(mcast_sender->rtcp_fd[i] < 0 || !FD_ISSET(mcast_sender->rtcp_fd[i], &rfds))
+				continue;
+			fromlen = sizeof(from);
+			if((rlen = recvfrom(mcast_sender->rtcp_fd[i], (char*) buf, sizeof(buf), 0,
+					(struct sockaddr*) &from, &fromlen)) <= 0)
+				continue;
+			// our own sender reports, looped back
+			if(rlen < 2 || buf[1] == RTCP_PT_SR)
+				continue;
+			if(rtcp_parse(buf, rlen, &fb) < 0)
+				continue;
+			if(fb.pli > 0 || fb.fir > 0)
+				rtsp_picture_loss(mcast_sender, i, &fb);
+			if(fb.has_report)
+				mcast_receiver_report(i, &from, &fb, &now);
+		}
+		rtsp_send_reports(mcast_sender, &now);
+		if(tvdiff_us(&now, &lastsummary) >= RTSP_MCAST_REPORT_INTERVAL * 1000000LL) {
+			mcast_receiver_summary(&now);
+			lastsummary = now;
+		}
 	}
+	return NULL;
+}
+
+// a viewer sets up a multicast stream: the sender opens it on first use,
+// and keeps it for later viewers
+static int
+mcast_setup(RTSPContext *ctx, int streamid) {
+	struct sockaddr_in group;
+	pthread_t thread;
+	int i;
 	//
+	if(ctx->multicast[streamid] || ctx->fmtctx[streamid] != NULL) {
+		ga_error("duplicated setup to an existing stream (%d)\n", streamid);
+		return -1;
+	}
+	pthread_mutex_lock(&mcast_mutex);
+	if(mcast_sender == NULL) {
+		RTSPContext *s;
+		if((s = (RTSPContext*) malloc(sizeof(RTSPContext))) == NULL)
+			goto error;
+		bzero(s, sizeof(RTSPContext));
+		for(i = 0; i < RTSP_CHANNEL_MAX; i++) {
+			s->rtcp_fd[i] = -1;
+			s->udp_fd[i][0] = s->udp_fd[i][1] = -1;
+		}
+		s->fd = -1;
+		s->state = SERVER_STATE_READY;
+		s->session_id = strdup("multicast");
+		pthread_mutex_init(&s->rtsp_writer_mutex, NULL);
+		pthread_cond_init(&s->rtsp_writer_cond, NULL);
+		pthread_mutex_init(&s->rtcp_mutex, NULL);
+		if(pthread_create(&thread, NULL, mcast_rtcp_thread, NULL) != 0) {
+			ga_error("mcast: cannot create the RTCP thread.\n");
+			free(s->session_id);
+			free(s);
+			goto error;
+		}
+		pthread_detach(thread);
+		mcast_sender = s;
+		rtsp_session_add(s);
+	}
+	if(mcast_sender->fmtctx[streamid] == NULL) {
+		bzero(&group, sizeof(group));
+		group.sin_family = AF_INET;
+		group.sin_addr.s_addr = inet_addr(rtspconf->mcast_group);
+		group.sin_port = htons(rtspconf->mcast_port + 2*streamid);
+		mcast_sender->lower_transport[streamid] = RTSP_LOWER_TRANSPORT_UDP;
+		if(rtp_new_av_stream(mcast_sender, &group, streamid,
+				streamid == video_source_channels() ?
+					rtspconf->audio_encoder_codec->id : rtspconf->video_encoder_codec->id) < 0) {
+			ga_error("mcast: cannot open stream %d.\n", streamid);
+			goto error;
+		}
+		mcast_set_interface(mcast_sender, streamid);
+		rtp_set_dscp(mcast_sender, streamid, streamid < video_source_channels() ?
+			rtspconf->dscp_video : rtspconf->dscp_audio);
+		mcast_sender->rtcp_fd[streamid] = mcast_open_rtcp(streamid);
+		ga_error("mcast: stream %d sent to %s:%d, ttl %d.\n",
+			streamid, rtspconf->mcast_group,
+			rtspconf->mcast_port + 2*streamid, rtspconf->mcast_ttl);
+	}
+	pthread_mutex_unlock(&mcast_mutex);
+	ctx->multicast[streamid] = 1;
 	return 0;
+error:
+	pthread_mutex_unlock(&mcast_mutex);
+	return -1;
+}
+
+// the group is sent while any viewer plays
+static int
+mcast_play(RTSPContext *ctx) {
+	int i, err = 0;
+	//
+	for(i = 0; i < RTSP_CHANNEL_MAX; i++) {
+		if(ctx->multicast[i])
+			break;
+	}
+	if(i == RTSP_CHANNEL_MAX || ctx->mcast_playing)
+		return 0;
+	pthread_mutex_lock(&mcast_mutex);
+	if(mcast_viewers == 0) {
+		mcast_sender->state = SERVER_STATE_PLAYING;
+		if(encoder_register_client(mcast_sender) < 0) {
+			mcast_sender->state = SERVER_STATE_READY;
+			err = -1;
+		}
+	}
+	if(err == 0) {
+		ctx->mcast_playing = 1;
+		mcast_viewers++;
+		ga_error("mcast: %d viewers playing.\n", mcast_viewers);
+	}
+	pthread_mutex_unlock(&mcast_mutex);
+	return err;
+}
+
+static void
+mcast_stop(RTSPContext *ctx) {
+	if(ctx->mcast_playing == 0)
+		return;
+	pthread_mutex_lock(&mcast_mutex);
+	ctx->mcast_playing = 0;
+	if(--mcast_viewers == 0) {
+		mcast_sender->state = SERVER_STATE_READY;
+		encoder_unregister_client(mcast_sender);
+	}
+	ga_error("mcast: %d viewers playing.\n", mcast_viewers);
+	pthread_mutex_unlock(&mcast_mutex);
+	return;
 }
 
 static void
@@ -594,7 +1794,7 @@ rtsp_cmd_setup(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 	char path[4096];
 	char channelname[IMAGE_SOURCE_CHANNEL_MAX+1][RTSP_STREAM_FORMAT_MAXLEN];
 	int baselen = strlen(rtspconf->object);
-	int streamid;
+	int streamid, tier = -1;
 	int rtp_port, rtcp_port;
 	enum RTSPStatusCode errcode;
 	//
@@ -608,11 +1808,22 @@ rtsp_cmd_setup(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 		rtsp_reply_error(ctx, RTSP_STATUS_AGGREGATE);
 		return;
 	}
+	// streams of <object>/multicast are <object>/multicast/streamid=N
+	if(strncmp(path+baselen, RTSP_MCAST_SUFFIX "/", strlen(RTSP_MCAST_SUFFIX)+1) == 0)
+		baselen += strlen(RTSP_MCAST_SUFFIX);
 	for(i = 0; i < IMAGE_SOURCE_CHANNEL_MAX+1; i++) {
-		if(strcmp(path+baselen+1, channelname[i]) == 0) {
-			streamid = i;
-			break;
+		const char *suffix = path+baselen+1;
+		int len = strlen(channelname[i]);
+		if(strncmp(suffix, channelname[i], len) != 0)
+			continue;
+		// an optional '?tier=N' picks a simulcast tier
+		if(suffix[len] == '?' && strncmp(suffix+len+1, "tier=", 5) == 0) {
+			tier = strtol(suffix+len+6, NULL, 10);
+		} else if(suffix[len] != '\0') {
+			continue;
 		}
+		streamid = i;
+		break;
 	}
 	if(i == IMAGE_SOURCE_CHANNEL_MAX+1) {
 		// not found
@@ -631,7 +1842,10 @@ rtsp_cmd_setup(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 		if(h->session_id[0] == '\0') {
 			snprintf(h->session_id, sizeof(h->session_id), "%04x%04x",
 				rand()%0x0ffff, rand()%0x0ffff);
+			// read by rtsp_stats_report()
+			pthread_mutex_lock(&sessionmutex);
 			ctx->session_id = strdup(h->session_id);
+			pthread_mutex_unlock(&sessionmutex);
 			ga_error("New session created (id = %s)\n", ctx->session_id);
 		}
 	}
@@ -642,8 +1856,11 @@ rtsp_cmd_setup(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 		errcode = RTSP_STATUS_SESSION;
 		goto error_setup;
 	}
-	// find supported transport
-	if((th = find_transport(h, RTSP_LOWER_TRANSPORT_UDP)) == NULL) {
+	// find supported transport, multicast if the viewer asks for it
+	th = NULL;
+	if(rtspconf->mcast_group != NULL)
+		th = find_transport(h, RTSP_LOWER_TRANSPORT_UDP_MULTICAST);
+	if(th == NULL && (th = find_transport(h, RTSP_LOWER_TRANSPORT_UDP)) == NULL) {
 		th = find_transport(h, RTSP_LOWER_TRANSPORT_TCP);
 	}
 	if(th == NULL) {
@@ -670,21 +1887,69 @@ rtsp_cmd_setup(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 	}
 	//
 	ctx->lower_transport[streamid] = th->lower_transport;
-	if(rtp_new_av_stream(ctx, &destaddr, streamid,
+	if(th->lower_transport == RTSP_LOWER_TRANSPORT_UDP_MULTICAST) {
+		// nothing per session: packets come from the group sender
+		if(mcast_setup(ctx, streamid) < 0) {
+			ga_error("Join multicast stream %d failed.\n", streamid);
+			errcode = RTSP_STATUS_TRANSPORT;
+			goto error_setup;
+		}
+	} else if(rtp_new_av_stream(ctx, &destaddr, streamid,
 			streamid == video_source_channels()/*rtspconf->audio_id*/ ?
 				rtspconf->audio_encoder_codec->id : rtspconf->video_encoder_codec->id) < 0) {
 		ga_error("Create AV stream %d failed.\n", streamid);
 		errcode = RTSP_STATUS_TRANSPORT;
 		goto error_setup;
 	}
+	if(th->lower_transport == RTSP_LOWER_TRANSPORT_UDP) {
+		rtp_set_dscp(ctx, streamid, streamid < video_source_channels() ?
+			rtspconf->dscp_video : rtspconf->dscp_audio);
+		// keep sent video packets for retransmission
+		if(streamid < video_source_channels() && rtspconf->nack_history > 0) {
+			ctx->history[streamid] = rtp_history_create(
+				rtspconf->nack_history, ctx->max_packet_size[streamid]);
+			if(ctx->history[streamid] == NULL) {
+				ga_error("rtx: cannot create packet history for stream %d.\n", streamid);
+			}
+		}
+		if(streamid < video_source_channels() && rtspconf->fec) {
+			ctx->fec[streamid] = rtp_fec_encoder_create(RTSP_FEC_PAYLOAD_TYPE,
+				rtspconf->fec_group > 0 ? rtspconf->fec_group : RTSP_FEC_GROUP_INIT);
+			if(ctx->fec[streamid] == NULL) {
+				ga_error("fec: cannot create encoder for stream %d.\n", streamid);
+			}
+		}
+	}
+	// RTCP feedback for video streams, multicast feedback goes to the group
+	if(streamid < video_source_channels()
+	&& th->lower_transport != RTSP_LOWER_TRANSPORT_UDP_MULTICAST) {
+		if(rtspconf->congestion_control) {
+			ratecontrol_init(&ctx->ratectl[streamid],
+				rtspconf->video_bitrate,
+				rtspconf->video_bitrate_min,
+				rtspconf->video_bitrate_max);
+		}
+		if(tier >= 0)
+			ctx->tier_pinned = 1;
+		encoder_tier_init(ctx, streamid, tier);
+		if(th->lower_transport == RTSP_LOWER_TRANSPORT_UDP) {
+			int *fds = NULL, nfds = 0;
+			if(ffurl_get_multi_file_handle(
+				ctx->rtp[streamid],
+				&fds, &nfds) == 0 && nfds >= 2) {
+				ctx->rtcp_fd[streamid] = fds[1];
+			}
+			av_free(fds);
+		}
+	}
 	//
 	ctx->state = SERVER_STATE_READY;
 	rtsp_reply_header(ctx, RTSP_STATUS_OK);
 	rtsp_printf(ctx, "Session: %s\r\n", ctx->session_id);
 	switch(th->lower_transport) {
 	case RTSP_LOWER_TRANSPORT_UDP:
-		rtp_port = ff_rtp_get_local_rtp_port((URLContext*) ctx->fmtctx[streamid]->pb->opaque);
-		rtcp_port = ff_rtp_get_local_rtcp_port((URLContext*) ctx->fmtctx[streamid]->pb->opaque);
+		rtp_port = ff_rtp_get_local_rtp_port(ctx->rtp[streamid]);
+		rtcp_port = ff_rtp_get_local_rtcp_port(ctx->rtp[streamid]);
 		ga_error("RTP/UDP: client=%d-%d; server=%d-%d\n",
 		       th->client_port_min, th->client_port_max,
 		       rtp_port, rtcp_port);
@@ -692,6 +1957,16 @@ rtsp_cmd_setup(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 		       th->client_port_min, th->client_port_max,
 		       rtp_port, rtcp_port);
 		break;
+	case RTSP_LOWER_TRANSPORT_UDP_MULTICAST:
+		ga_error("RTP/UDP: multicast=%s:%d-%d\n", rtspconf->mcast_group,
+			rtspconf->mcast_port + 2*streamid,
+			rtspconf->mcast_port + 2*streamid + 1);
+		rtsp_printf(ctx, "Transport: RTP/AVP;multicast;destination=%s;port=%d-%d;ttl=%d\r\n",
+			rtspconf->mcast_group,
+			rtspconf->mcast_port + 2*streamid,
+			rtspconf->mcast_port + 2*streamid + 1,
+			rtspconf->mcast_ttl);
+		break;
 	case RTSP_LOWER_TRANSPORT_TCP:
 		ga_error("RTP/TCP: interleaved=%d-%d\n",
 			streamid*2, streamid*2+1);
@@ -706,11 +1981,10 @@ rtsp_cmd_setup(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 	return;
 error_setup:
 	if(ctx->session_id != NULL) {
+		pthread_mutex_lock(&sessionmutex);
 		free(ctx->session_id);
 		ctx->session_id = NULL;
-	}
-	if(ctx->encoder[streamid] != NULL) {
-		ctx->encoder[streamid] = NULL;
+		pthread_mutex_unlock(&sessionmutex);
 	}
 	if(ctx->stream[streamid] != NULL) {
 		ctx->stream[streamid] = NULL;
@@ -722,51 +1996,219 @@ error_setup:
 	rtsp_reply_error(ctx, errcode);
 	return;
 }
-static void
-rtsp_cmd_play(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
-	char path[4096];
-	//
-	av_url_split(NULL, 0, NULL, 0, NULL, 0, NULL, path, sizeof(path), url);
-	if(strncmp(path, rtspconf->object, strlen(rtspconf->object)) != 0) {
-		rtsp_reply_error(ctx, RTSP_STATUS_SESSION);
-		return;
-	}
-	if(strcmp(ctx->session_id, h->session_id) != 0) {
-		rtsp_reply_error(ctx, RTSP_STATUS_SESSION);
-		return;
-	}
-	//
-	if(ctx->state != SERVER_STATE_READY
-	&& ctx->state != SERVER_STATE_PAUSE) {
-		rtsp_reply_error(ctx, RTSP_STATUS_STATE);
-		return;
-	}
-	// create threads
+// start (or resume) delivering encoded frames to a client
+static int
+rtsp_start_stream(RTSPContext *ctx) {
+	int i;
 #ifndef SHARE_ENCODER
 	if(pthread_create(&ctx->vthread, NULL, vencoder_thread, ctx) != 0) {
 		ga_error("cannot create video thread\n");
-		rtsp_reply_error(ctx, RTSP_STATUS_INTERNAL);
-		return;
+		return -1;
 	}
 #ifdef ENABLE_AUDIO
 	if(pthread_create(&ctx->athread, NULL, aencoder_thread, ctx) != 0) {
 		ga_error("cannot create audio thread\n");
-		rtsp_reply_error(ctx, RTSP_STATUS_INTERNAL);
-		return;
+		return -1;
 	}
 #endif	/* ENABLE_AUDIO */
 #else
+	if(ctx->pacing && ctx->pacer == NULL) {
+		ctx->pacer = pacer_create(ctx, 1);
+	}
 	if(encoder_register_client(ctx) < 0) {
 		ga_error("cannot register encoder client.\n");
-		rtsp_reply_error(ctx, RTSP_STATUS_INTERNAL);
-		return;
+		return -1;
 	}
 #endif	/* SHARE_ENCODER */
+	if(mcast_play(ctx) < 0) {
+		ga_error("cannot start the multicast sender.\n");
+		return -1;
+	}
+	// a joining (or resuming) client needs a decodable picture asap
+	for(i = 0; i < video_source_channels(); i++) {
+		if(ctx->fmtctx[i] == NULL && ctx->multicast[i] == 0)
+			continue;
+		ctx->ttff_pending[i] = 1;
+		encoder_keyframe_request(i, ctx->tier[i]);
+	}
+	return 0;
+}
+
+#define	RTSP_PROBE_PACKET_SIZE	1000	/* bytes, fits in a single RTP packet */
+#define	RTSP_PROBE_BURST	4	/* packets sent back-to-back */
+
+static int
+rtsp_probe_stream(RTSPContext *ctx, int streamid) {
+	return ctx->fmtctx[streamid] != NULL
+		&& ctx->lower_transport[streamid] == RTSP_LOWER_TRANSPORT_UDP
+		&& ctx->ratectl[streamid].bitrate > 0;
+}
+
+// send the next burst of the probe train, and schedule the one after it,
+// or the deadline of the feedback once the train is complete
+static void
+rtsp_probe_burst(RTSPContext *ctx, struct timeval *now) {
+	unsigned char probe[RTSP_PROBE_PACKET_SIZE];
+	AVPacket pkt;
+	long long gap, next;
+	int i, j;
+	//
+	for(j = ctx->probe_sent; j < rtspconf->probe_packets
+			&& j < ctx->probe_sent + RTSP_PROBE_BURST; j++) {
+		// start code, filler data NAL, signature, 0xff padding, stop bit
+		memset(probe, 0xff, sizeof(probe));
+		probe[0] = probe[1] = probe[2] = 0;
+		probe[3] = 1;
+		probe[4] = 0x0c;
+		snprintf((char*) probe+5, sizeof(probe)-6, "%s %d/%d",
+			RTSP_PROBE_SIGNATURE, j, rtspconf->probe_packets);
+		probe[sizeof(probe)-1] = 0x80;
+		for(i = 0; i < video_source_channels(); i++) {
+			if(rtsp_probe_stream(ctx, i) == 0)
+				continue;
+			av_init_packet(&pkt);
+			pkt.data = probe;
+			pkt.size = sizeof(probe);
+			pkt.pts = 0;
+			encoder_send_packet("probe", ctx, i, &pkt, AV_NOPTS_VALUE);
+		}
+	}
+	ctx->probe_sent = j;
+	if(ctx->probe_sent >= rtspconf->probe_packets) {
+		ga_error("probe: %d packets sent in %.3f ms.\n",
+			rtspconf->probe_packets,
+			0.001 * tvdiff_us(now, &ctx->probe_start));
+		next = rtspconf->probe_timeout * 1000LL;
+		ctx->probe_deadline = *now;
+	} else {
+		// time to send one burst at the probing rate, in us
+		gap = 8000LL * RTSP_PROBE_PACKET_SIZE * RTSP_PROBE_BURST / rtspconf->probe_rate;
+		next = gap * (ctx->probe_sent / RTSP_PROBE_BURST);
+		ctx->probe_deadline = ctx->probe_start;
+		// late: keep the rate from now on
+		if(next <= tvdiff_us(now, &ctx->probe_start)) {
+			next = gap;
+			ctx->probe_deadline = *now;
+		}
+	}
+	next += ctx->probe_deadline.tv_usec;
+	ctx->probe_deadline.tv_sec += next / 1000000;
+	ctx->probe_deadline.tv_usec = next % 1000000;
+	return;
+}
+
+// start a paced train of H.264 filler NAL units on each video stream.
+// the client times their arrival and reports the rate with SET_PARAMETER.
+// the first burst is sent now, the others from rtsp_session_timer(), so
+// that the thread serving the connection never sleeps.
+// returns the number of probed streams.
+static int
+rtsp_probe_send(RTSPContext *ctx) {
+	int i, probed = 0;
+	//
+	if(rtspconf->video_encoder_codec->id != CODEC_ID_H264)
+		return 0;
+	for(i = 0; i < video_source_channels(); i++) {
+		if(rtsp_probe_stream(ctx, i))
+			probed++;
+	}
+	if(probed == 0)
+		return 0;
+	ga_error("probe: %d packets on %d stream(s).\n", rtspconf->probe_packets, probed);
+	gettimeofday(&ctx->probe_start, NULL);
+	ctx->probe_sent = 0;
+	ctx->probe_pending = 1;
+	rtsp_probe_burst(ctx, &ctx->probe_start);
+	return probed;
+}
+
+// seed rate control with the measured bandwidth (kbps <= 0: no feedback),
+// and start streaming.
+static void
+rtsp_probe_finish(RTSPContext *ctx, int kbps, int received, int total) {
+	long long rate;
+	int i;
 	//
+	ctx->probe_pending = 0;
+	if(kbps > 0) {
+		// 80% of the measured rate leaves room for audio and headers
+		rate = 800LL * kbps;
+		if(total > 0 && received < total)
+			rate = rate * received / total;
+		if(rate > rtspconf->video_bitrate_max)
+			rate = rtspconf->video_bitrate_max;
+		for(i = 0; i < video_source_channels(); i++) {
+			if(ctx->ratectl[i].bitrate <= 0)
+				continue;
+			ratecontrol_init(&ctx->ratectl[i], (int) rate,
+				rtspconf->video_bitrate_min,
+				rtspconf->video_bitrate_max);
+			if(ctx->tier_pinned == 0)
+				encoder_tier_init(ctx, i, -1);
+		}
+		ga_error("probe: client measured %d kbps (%d/%d packets), start at %d kbps.\n",
+			kbps, received, total, (int) (rate / 1000));
+	} else {
+		ga_error("probe: no feedback in %d ms, start at %d kbps.\n",
+			rtspconf->probe_timeout, rtspconf->video_bitrate / 1000);
+	}
+	if(rtsp_start_stream(ctx) < 0) {
+		// PLAY has been answered, drop the connection instead
+		ctx->state = SERVER_STATE_TEARDOWN;
+		return;
+	}
+#ifdef SHARE_ENCODER
+	if(kbps > 0) {
+		for(i = 0; i < video_source_channels(); i++) {
+			if(ctx->ratectl[i].bitrate > 0)
+				encoder_ratecontrol_update(i);
+		}
+	}
+#endif
+	return;
+}
+
+static void
+rtsp_cmd_play(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
+	char path[4096];
+	int oldstate, probe;
+	//
+	av_url_split(NULL, 0, NULL, 0, NULL, 0, NULL, path, sizeof(path), url);
+	if(strncmp(path, rtspconf->object, strlen(rtspconf->object)) != 0) {
+		rtsp_reply_error(ctx, RTSP_STATUS_SESSION);
+		return;
+	}
+	if(strcmp(ctx->session_id, h->session_id) != 0) {
+		rtsp_reply_error(ctx, RTSP_STATUS_SESSION);
+		return;
+	}
+	//
+	if(ctx->state != SERVER_STATE_READY
+	&& ctx->state != SERVER_STATE_PAUSE) {
+		rtsp_reply_error(ctx, RTSP_STATUS_STATE);
+		return;
+	}
+	// a new session probes the path first, streaming starts afterwards
+	gettimeofday(&ctx->play_tv, NULL);
+	probe = rtspconf->probe_enable && ctx->state == SERVER_STATE_READY;
+	// set before starting, so that no early (key) frame is skipped
+	oldstate = ctx->state;
 	ctx->state = SERVER_STATE_PLAYING;
+	if(probe == 0 && rtsp_start_stream(ctx) < 0) {
+		ctx->state = oldstate;
+		rtsp_reply_error(ctx, RTSP_STATUS_INTERNAL);
+		return;
+	}
+	//
 	rtsp_reply_header(ctx, RTSP_STATUS_OK);
 	rtsp_printf(ctx, "Session: %s\r\n", ctx->session_id);
 	rtsp_printf(ctx, "\r\n");
+	rtsp_reply_flush(ctx);
+	//
+	if(probe && rtsp_probe_send(ctx) == 0) {
+		// nothing to probe, e.g., RTP over TCP
+		rtsp_probe_finish(ctx, 0, 0, 0);
+	}
 	return;
 }
 
@@ -790,6 +2232,7 @@ rtsp_cmd_pause(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 	}
 	//
 	ctx->state = SERVER_STATE_PAUSE;
+	mcast_stop(ctx);
 	rtsp_reply_header(ctx, RTSP_STATUS_OK);
 	rtsp_printf(ctx, "Session: %s\r\n", ctx->session_id);
 	rtsp_printf(ctx, "\r\n");
@@ -817,41 +2260,212 @@ rtsp_cmd_teardown(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 	return;
 }
 
-struct RTCPHeader {
-	unsigned char vps;	// version, padding, RC/SC
-#define	RTCP_Version(hdr)	(((hdr)->vps) >> 6)
-#define	RTCP_Padding(hdr)	((((hdr)->vps) >> 5) & 0x01)
-#define	RTCP_RC(hdr)		(((hdr)->vps) & 0x1f)
-#define	RTCP_SC(hdr)		RTCP_RC(hdr)
-	unsigned char pt;
-	unsigned short length;
+static void
+rtsp_cmd_set_parameter(RTSPContext *ctx, const char *url, RTSPMessageHeader *h, const char *body) {
+	const char *p;
+	int i, kbps = 0, received = 0, total = 0;
+	//
+	if(ctx->session_id == NULL
+	|| strcmp(ctx->session_id, h->session_id) != 0) {
+		rtsp_reply_error(ctx, RTSP_STATUS_SESSION);
+		return;
+	}
+	rtsp_reply_header(ctx, RTSP_STATUS_OK);
+	rtsp_printf(ctx, "Session: %s\r\n", ctx->session_id);
+	rtsp_printf(ctx, "\r\n");
+	// simulcast tier: "<tier>", or -1 for automatic selection
+	if((p = strstr(body, RTSP_TIER_PARAMETER ":")) != NULL) {
+		int tier = strtol(p + strlen(RTSP_TIER_PARAMETER ":"), NULL, 10);
+		ctx->tier_pinned = tier >= 0 ? 1 : 0;
+		for(i = 0; i < video_source_channels(); i++) {
+			if(ctx->fmtctx[i] == NULL)
+				continue;
+			if(ctx->state == SERVER_STATE_PLAYING && ctx->probe_pending == 0)
+				encoder_tier_switch(ctx, i, tier);
+			else
+				encoder_tier_init(ctx, i, tier);
+		}
+	}
+	// pacing: "0" or "1", before or while playing
+	if((p = strstr(body, RTSP_PACING_PARAMETER ":")) != NULL) {
+		ctx->pacing = strtol(p + strlen(RTSP_PACING_PARAMETER ":"), NULL, 10) != 0 ? 1 : 0;
+		if(ctx->pacer != NULL) {
+			pacer_enable(ctx->pacer, ctx->pacing);
+		} else if(ctx->pacing && ctx->state == SERVER_STATE_PLAYING && ctx->probe_pending == 0) {
+			ctx->pacer = pacer_create(ctx, 1);
+		}
+	}
+	// probe report: "<kbps> <received>/<total>"; late reports are ignored
+	if((p = strstr(body, RTSP_PROBE_PARAMETER ":")) != NULL && ctx->probe_pending) {
+		p += strlen(RTSP_PROBE_PARAMETER ":");
+		if(sscanf(p, "%d %d/%d", &kbps, &received, &total) < 1)
+			kbps = 0;
+		rtsp_probe_finish(ctx, kbps, received, total);
+	}
+	return;
 }
-#ifdef WIN32
-;
-#else
-__attribute__ ((__packed__));
-#endif
 
-static int
-handle_rtcp(RTSPContext *ctx, const char *buf, size_t buflen) {
-#if 0
-	int reqlength;
-	struct RTCPHeader *rtcp;
-	char msg[64] = "", *ptr = msg;
+// resend the packets of a generic NACK that can still be played out: a
+// packet is useful if it arrives within nack-max-age after it was first sent
+static void
+rtsp_retransmit(RTSPContext *ctx, int streamid, const struct rtcp_feedback *fb) {
+	uint8_t *pkt;
+	int i, pktlen, maxage;
 	//
-	reqlength = (unsigned char) buf[2];
-	reqlength <<= 8;
-	reqlength += (unsigned char) buf[3];
-	rtcp = (struct RTCPHeader*) (buf+4);
+	if(ctx->history[streamid] == NULL)
+		return;
+	if((pkt = (uint8_t*) malloc(ctx->max_packet_size[streamid])) == NULL)
+		return;
+	maxage = rtspconf->nack_max_age * 1000;
+	if(ctx->ratectl[streamid].rtt > 0)
+		maxage -= ctx->ratectl[streamid].rtt * 500;	// one-way delay
+	for(i = 0; i < fb->nnack; i++) {
+		pktlen = rtp_history_get(ctx->history[streamid], fb->nack[i],
+				maxage, pkt, ctx->max_packet_size[streamid]);
+		if(pktlen <= 0)
+			continue;
+		// not through rtsp_write_packet(): the history keeps the first send time
+		if(ffurl_write(ctx->rtp[streamid], pkt, pktlen) < 0)
+			break;
+	}
+	free(pkt);
+	return;
+}
+
+// picture loss (PLI) or a full intra request (FIR): request a keyframe,
+// at most once per video-keyframe-min-interval for each session
+static void
+rtsp_picture_loss(RTSPContext *ctx, int streamid, const struct rtcp_feedback *fb) {
+	struct timeval now;
+	//
+	if(streamid >= video_source_channels() || ctx->state != SERVER_STATE_PLAYING)
+		return;
+	gettimeofday(&now, NULL);
+	if(ctx->pli_tv[streamid].tv_sec != 0
+	&& tvdiff_us(&now, &ctx->pli_tv[streamid]) < 1000LL * rtspconf->video_keyframe_min_interval)
+		return;
+	ctx->pli_tv[streamid] = now;
+	encoder_keyframe_request(streamid, ctx->tier[streamid]);
+	ga_error("rtcp: stream %d: %s, keyframe requested.\n",
+		streamid, fb->fir > 0 ? "FIR" : "PLI");
+	return;
+}
+
+// send the sender reports due: the NTP time and RTP timestamp of now, and
+// what has been sent.  returns the time to the next report, in
+// microseconds, or -1 if the session is not playing.
+static long long
+rtsp_send_reports(RTSPContext *ctx, struct timeval *now) {
+	unsigned char buf[256];
+	long long left, wait = -1;
+	int i, len;
+	//
+	if(ctx->state != SERVER_STATE_PLAYING)
+		return -1;
+	for(i = 0; i < RTSP_CHANNEL_MAX; i++) {
+		if(ctx->fmtctx[i] == NULL)
+			continue;
+		len = -1;
+		pthread_mutex_lock(&ctx->rtcp_mutex);
+		if((left = RTSP_SR_INTERVAL - tvdiff_us(now, &ctx->rtcpstats[i].sr_tv)) <= 0) {
+			len = rtcp_stats_build_sr(&ctx->rtcpstats[i], buf, sizeof(buf), rtcp_cname, now);
+			left = len > 0 ? RTSP_SR_INTERVAL : RTSP_SR_RETRY;
+		}
+		pthread_mutex_unlock(&ctx->rtcp_mutex);
+		if(len > 0)
+			rtsp_write_packet(ctx, i, buf, len);
+		if(wait < 0 || left < wait)
+			wait = left;
+	}
+	return wait;
+}
+
+// one line per stream of each session, for the encoder control socket
+int
+rtsp_stats_report(char *buf, int buflen) {
+	RTSPContext *ctx;
+	struct rtcp_stats st;
+	struct timeval now;
+	char rr[128];
+	int i, len = 0;
+	//
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&sessionmutex);
+	for(ctx = sessions; ctx != NULL && len < buflen; ctx = ctx->next) {
+		for(i = 0; i < RTSP_CHANNEL_MAX && len < buflen; i++) {
+			if(ctx->fmtctx[i] == NULL)
+				continue;
+			pthread_mutex_lock(&ctx->rtcp_mutex);
+			st = ctx->rtcpstats[i];
+			pthread_mutex_unlock(&ctx->rtcp_mutex);
+			if(st.rrcount == 0) {
+				snprintf(rr, sizeof(rr), "rr=0");
+			} else {
+				snprintf(rr, sizeof(rr),
+					"rr=%u loss=%.1f%% lost=%d jitter=%.1f ms rtt=%d ms age=%lld ms",
+					st.rrcount, 100.0 * st.report.fraction_lost / 256,
+					st.report.cumulative_lost,
+					st.clockrate > 0 ? 1000.0 * st.report.jitter / st.clockrate : 0.0,
+					st.rtt, tvdiff_us(&now, &st.rr_tv) / 1000);
+			}
+			len += snprintf(buf + len, buflen - len,
+				"session %s stream %d: ssrc=%08x sent=%u packets/%u bytes sr=%u %s\n",
+				ctx->session_id ? ctx->session_id : "-", i,
+				st.ssrc, st.packets, st.octets, st.srcount, rr);
+		}
+	}
+	pthread_mutex_unlock(&sessionmutex);
+	return len < buflen ? len : buflen;
+}
+
+static int
+handle_rtcp(RTSPContext *ctx, int streamid, const unsigned char *buf, int buflen) {
+	struct rtcp_feedback fb;
+	struct ratecontrol *rc;
 	//
-	ga_error("TCP feedback for stream %d received (%d bytes): ver=%d; sc=%d; pt=%d; length=%d\n",
-		buf[1], reqlength,
-		RTCP_Version(rtcp), RTCP_SC(rtcp), rtcp->pt, ntohs(rtcp->length));
-	for(int i = 0; i < 16; i++, ptr += 3) {
-		snprintf(ptr, sizeof(msg)-(ptr-msg),
-			"%2.2x ", (unsigned char) buf[i]);
+	if(streamid < 0 || streamid >= RTSP_CHANNEL_MAX)
+		return -1;
+	if(rtcp_parse(buf, buflen, &fb) < 0) {
+		ga_error("rtcp: malformed packet for stream %d (%d bytes).\n",
+			streamid, buflen);
+		return -1;
 	}
-	ga_error("HEX: %s\n", msg);
+	if(fb.has_report) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		pthread_mutex_lock(&ctx->rtcp_mutex);
+		rtcp_stats_received(&ctx->rtcpstats[streamid], &fb.report, &now);
+		pthread_mutex_unlock(&ctx->rtcp_mutex);
+	}
+	if(fb.nnack > 0)
+		rtsp_retransmit(ctx, streamid, &fb);
+	if(fb.pli > 0 || fb.fir > 0)
+		rtsp_picture_loss(ctx, streamid, &fb);
+	// more parity on residual losses, less while there are none
+	if(fb.has_report && ctx->fec[streamid] != NULL && rtspconf->fec_group <= 0) {
+		int group = rtp_fec_encoder_group(ctx->fec[streamid]);
+		if(rtp_fec_encoder_adapt(ctx->fec[streamid], fb.report.fraction_lost) != group) {
+			ga_error("fec: stream %d: loss=%.1f%%, one parity packet per %d packets\n",
+				streamid, 100.0 * fb.report.fraction_lost / 256,
+				rtp_fec_encoder_group(ctx->fec[streamid]));
+		}
+	}
+	rc = &ctx->ratectl[streamid];
+	if(rc->bitrate <= 0)
+		return 0;
+	if(fb.has_report == 0 && fb.remb <= 0)
+		return 0;
+	ratecontrol_update(rc, &fb);
+	if(fb.has_report) {
+		ga_error("rtcp: stream %d: loss=%.1f%%, jitter=%u, rtt=%d ms (min %d), estimate=%d kbps\n",
+			streamid, 100.0 * rc->loss / 256, fb.report.jitter,
+			rc->rtt, rc->rtt_min, rc->bitrate/1000);
+	}
+#ifdef SHARE_ENCODER
+	encoder_ratecontrol_update(streamid);
+	if(rtspconf->video_tiers > 1 && ctx->tier_pinned == 0
+	&& ctx->state == SERVER_STATE_PLAYING && ctx->probe_pending == 0)
+		encoder_tier_switch(ctx, streamid, -1);
 #endif
 	return 0;
 }
@@ -883,23 +2497,141 @@ get_word(char *buf, int buf_size, const char **pp) {
 	*pp = p;
 }
 
-void*
-rtspserver(void *arg) {
+// handle a complete message in the read buffer.
+// returns -1 if the connection has to be closed, or 0 otherwise.
+static int
+rtsp_handle_message(RTSPContext *ctx) {
+	const char *p;
+	char buf[8192], body[4096];
+	char cmd[32], url[1024], protocol[32];
+	int rlen;
+	RTSPMessageHeader header1, *header = &header1;
+	//
+	if((rlen = rtsp_getnext(ctx, buf, sizeof(buf))) < 0) {
+		return -1;
+	}
+	// Interleaved binary data? odd channels are RTCP
+	if(buf[0] == '$') {
+		if(rlen > 4 && (buf[1] & 0x01)) {
+			handle_rtcp(ctx, ((unsigned char) buf[1])>>1,
+				(unsigned char*) buf+4, rlen-4);
+		}
+		return 0;
+	}
+	gettimeofday(&ctx->last_activity, NULL);
+	// REQUEST line
+	ga_error("%s", buf);
+	p = buf;
+	get_word(cmd, sizeof(cmd), &p);
+	get_word(url, sizeof(url), &p);
+	get_word(protocol, sizeof(protocol), &p);
+	// check protocol
+	if(strcmp(protocol, "RTSP/1.0") != 0) {
+		rtsp_reply_error(ctx, RTSP_STATUS_VERSION);
+		return -1;
+	}
+	// read headers
+	bzero(header, sizeof(*header));
+	do {
+		int myseq = -1;
+		char mysession[sizeof(header->session_id)] = "";
+		if((rlen = rtsp_getnext(ctx, buf, sizeof(buf))) < 0)
+			return -1;
+		if(buf[0]=='\n' || (buf[0]=='\r' && buf[1]=='\n'))
+			break;
+#if 0
+		ga_error("HEADER: %s", buf);
+#endif
+		// Special handling to CSeq & Session header
+		// ff_rtsp_parse_line cannot handle CSeq & Session properly on Windows
+		// any more?
+		if(strncasecmp("CSeq: ", buf, 6) == 0) {
+			myseq = strtol(buf+6, NULL, 10);
+		}
+		if(strncasecmp("Session: ", buf, 9) == 0) {
+			strcpy(mysession, buf+9);
+		}
+		//
+		ff_rtsp_parse_line(header, buf, NULL, NULL);
+		//
+		if(myseq > 0 && header->seq <= 0) {
+			ga_error("WARNING: CSeq fixes applied (%d->%d).\n",
+				header->seq, myseq);
+			header->seq = myseq;
+		}
+		if(mysession[0] != '\0' && header->session_id[0]=='\0') {
+			unsigned i;
+			for(i = 0; i < sizeof(header->session_id)-1; i++) {
+				if(mysession[i] == '\0'
+				|| isspace(mysession[i])
+				|| mysession[i] == ';')
+					break;
+				header->session_id[i] = mysession[i];
+			}
+			header->session_id[i+1] = '\0';
+			ga_error("WARNING: Session fixes applied (%s)\n",
+				header->session_id);
+		}
+	} while(1);
+	// special handle to session_id
+	if(header->session_id != NULL) {
+		char *p = header->session_id;
+		while(*p != '\0') {
+			if(*p == '\r' || *p == '\n') {
+				*p = '\0';
+				break;
+			}
+			p++;
+		}
+	}
+	// message body
+	body[0] = '\0';
+	if(header->content_length > 0) {
+		if(header->content_length >= (int) sizeof(body)) {
+			ga_error("Message body too long (%d bytes).\n",
+				header->content_length);
+			return -1;
+		}
+		if(rtsp_read_body(ctx, body, header->content_length) < 0)
+			return -1;
+		body[header->content_length] = '\0';
+	}
+	// handle commands
+	ctx->seq = header->seq;
+	if (!strcmp(cmd, "DESCRIBE"))
+		rtsp_cmd_describe(ctx, url);
+	else if (!strcmp(cmd, "OPTIONS"))
+		rtsp_cmd_options(ctx, url);
+	else if (!strcmp(cmd, "SETUP"))
+		rtsp_cmd_setup(ctx, url, header);
+	else if (!strcmp(cmd, "PLAY"))
+		rtsp_cmd_play(ctx, url, header);
+	else if (!strcmp(cmd, "PAUSE"))
+		rtsp_cmd_pause(ctx, url, header);
+	else if (!strcmp(cmd, "TEARDOWN"))
+		rtsp_cmd_teardown(ctx, url, header);
+	else if (!strcmp(cmd, "SET_PARAMETER"))
+		rtsp_cmd_set_parameter(ctx, url, header, body);
+	else
+		rtsp_reply_error(ctx, RTSP_STATUS_METHOD);
+	rtsp_reply_flush(ctx);
+	if(ctx->state == SERVER_STATE_TEARDOWN) {
+		return -1;
+	}
+	return 0;
+}
+
+RTSPContext *
 #ifdef WIN32
-	SOCKET s = *((SOCKET*) arg);
+rtsp_session_open(SOCKET s) {
 	int sinlen = sizeof(struct sockaddr_in);
 #else
-	int s = *((int*) arg);
+rtsp_session_open(int s) {
 	socklen_t sinlen = sizeof(struct sockaddr_in);
 #endif
-	const char *p;
-	char buf[8192];
-	char cmd[32], url[1024], protocol[32];
-	int rlen;
 	struct sockaddr_in sin;
-	RTSPContext ctx;
-	RTSPMessageHeader header1, *header = &header1;
-	int thread_ret;
+	RTSPContext *ctx;
+	int i;
 	// image info
 	int iwidth = video_source_width(0);
 	int iheight = video_source_height(0);
@@ -908,47 +2640,55 @@ rtspserver(void *arg) {
 	sinlen = sizeof(sin);
 	getpeername(s, (struct sockaddr*) &sin, &sinlen);
 	//
-	bzero(&ctx, sizeof(ctx));
-	if(per_client_init(&ctx) < 0) {
-		ga_error("server initialization failed.\n");
+	if((ctx = (RTSPContext*) malloc(sizeof(RTSPContext))) == NULL) {
+		ga_error("server initialization failed: %s.\n", strerror(errno));
 		return NULL;
 	}
-	ctx.state = SERVER_STATE_IDLE;
+	bzero(ctx, sizeof(RTSPContext));
+	for(i = 0; i < RTSP_CHANNEL_MAX; i++) {
+		ctx->rtcp_fd[i] = -1;
+		ctx->udp_fd[i][0] = ctx->udp_fd[i][1] = -1;
+	}
+	ctx->pacing = rtspconf->pacing;
+	// the SDP contexts are created on DESCRIBE
+	ctx->state = SERVER_STATE_IDLE;
 	// XXX: hasVideo is used to sync audio/video
 	// This value is increased by 1 for each captured frame until it is gerater than zero
 	// when this value is greater than zero, audio encoding then starts ...
-	//ctx.hasVideo = -(rtspconf->video_fps>>1);	// for slow encoders?
-	ctx.hasVideo = 0;	// with 'zerolatency'
-	pthread_mutex_init(&ctx.rtsp_writer_mutex, NULL);
+	//ctx->hasVideo = -(rtspconf->video_fps>>1);	// for slow encoders?
+	ctx->hasVideo = 0;	// with 'zerolatency'
+	pthread_mutex_init(&ctx->rtsp_writer_mutex, NULL);
+	pthread_cond_init(&ctx->rtsp_writer_cond, NULL);
+	pthread_mutex_init(&ctx->rtcp_mutex, NULL);
 #if 0
-	ctx.audioparam.channels = rtspconf->audio_channels;
-	ctx.audioparam.samplerate = rtspconf->audio_samplerate;
+	ctx->audioparam.channels = rtspconf->audio_channels;
+	ctx->audioparam.samplerate = rtspconf->audio_samplerate;
 	if(rtspconf->audio_device_format == AV_SAMPLE_FMT_S16) {
 #ifdef WIN32
 #else
-		ctx.audioparam.format = SND_PCM_FORMAT_S16_LE;
+		ctx->audioparam.format = SND_PCM_FORMAT_S16_LE;
 #endif
-		ctx.audioparam.bits_per_sample = 16;
+		ctx->audioparam.bits_per_sample = 16;
 	}
 	//
 	ga_error("INFO: image: %dx%d; audio: %d ch 16-bit pcm @ %dHz\n",
 			iwidth, iheight,
-			ctx.audioparam.channels,
-			ctx.audioparam.samplerate);
+			ctx->audioparam.channels,
+			ctx->audioparam.samplerate);
 #endif
 	//
 #if 0
 #ifdef WIN32
-	if(ga_wasapi_init(&ctx.audioparam) < 0) {
+	if(ga_wasapi_init(&ctx->audioparam) < 0) {
 		ga_error("cannot init wasapi.\n");
 		return NULL;
 	}
 #else
-	if((ctx.audioparam.handle = ga_alsa_init(&ctx.audioparam.sndlog)) == NULL) {
+	if((ctx->audioparam.handle = ga_alsa_init(&ctx->audioparam.sndlog)) == NULL) {
 		ga_error("cannot init alsa.\n");
 		return NULL;
 	}
-	if(ga_alsa_set_param(&ctx.audioparam) < 0) {
+	if(ga_alsa_set_param(&ctx->audioparam) < 0) {
 		ga_error("cannot set alsa parameter\n");
 		return NULL;
 	}
@@ -959,135 +2699,378 @@ rtspserver(void *arg) {
 		ga_gettid(),
 		inet_ntoa(sin.sin_addr), htons(sin.sin_port));
 	//
-	ctx.fd = s;
+	ctx->fd = s;
+	gettimeofday(&ctx->last_activity, NULL);
+	if(rtcp_cname[0] == '\0') {
+		char host[64];
+		if(gethostname(host, sizeof(host)) < 0)
+			strcpy(host, "localhost");
+		host[sizeof(host)-1] = '\0';
+		snprintf(rtcp_cname, sizeof(rtcp_cname), "ga@%s", host);
+	}
+	rtsp_session_add(ctx);
 	//
-	do {
-		fd_set rfds;
-		FD_ZERO(&rfds);
-		FD_SET(ctx.fd, &rfds);
-		if(select(ctx.fd+1, &rfds, NULL, NULL, NULL) <=0) {
-			ga_error("select() failed: %s\n", strerror(errno));
-			goto quit;
+	if(rtspconf->zerocopy_min > 0) {
+#ifdef RTSP_HAVE_ZEROCOPY
+		int on = 1;
+		if(setsockopt(s, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) {
+			ctx->zerocopy = 1;
+		} else {
+			ga_error("zerocopy: not supported (%s), copy messages.\n", strerror(errno));
 		}
-		// read commands
-		if((rlen = rtsp_getnext(&ctx, buf, sizeof(buf))) < 0) {
-			goto quit;
+#else
+		ga_error("zerocopy: not supported on this platform, copy messages.\n");
+#endif
+	}
+	//
+	return ctx;
+}
+
+// read from the RTSP connection and handle all complete messages.
+// returns -1 if the session has to be closed, or 0 otherwise.
+int
+rtsp_session_input(RTSPContext *ctx) {
+	int ready;
+	//
+#ifdef RTSP_HAVE_ZEROCOPY
+	// completions wake up readers like data
+	if(ctx->zcnext != ctx->zcdone) {
+		pthread_mutex_lock(&ctx->rtsp_writer_mutex);
+		rtsp_zerocopy_reap(ctx);
+		pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+	}
+#endif
+	if(rtsp_read_internal(ctx) < 0)
+		return -1;
+	while((ready = rtsp_message_ready(ctx)) > 0) {
+		if(rtsp_handle_message(ctx) < 0)
+			return -1;
+	}
+	if(ready < 0) {
+		ga_error("Buffer full: Extremely long message encountered?\n");
+		return -1;
+	}
+	return 0;
+}
+
+// continue writing when the connection is writable again.
+// returns -1 if the session has to be closed, or 0 otherwise.
+int
+rtsp_session_output(RTSPContext *ctx) {
+	int ret;
+	//
+	pthread_mutex_lock(&ctx->rtsp_writer_mutex);
+	if(ctx->txwriting == 0) {
+		ctx->txwriting = 1;
+		rtsp_tx_drain(ctx, RTSP_TX_AUDIO, 1);
+		ctx->txwriting = 0;
+	} else {
+		// the thread writing sends the rest
+		ctx->txwantout = 0;
+	}
+	ret = ctx->txfailed ? -1 : 0;
+	pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+	return ret;
+}
+
+// returns 1 if rtsp_session_output() should be called once writable
+int
+rtsp_session_want_output(RTSPContext *ctx) {
+	int ret;
+	//
+	pthread_mutex_lock(&ctx->rtsp_writer_mutex);
+	ret = ctx->txwantout;
+	pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+	return ret;
+}
+
+// handle RTCP over UDP of a stream
+int
+rtsp_session_rtcp(RTSPContext *ctx, int streamid) {
+	unsigned char buf[2048];
+	int rlen;
+	//
+	if(streamid < 0 || streamid >= RTSP_CHANNEL_MAX || ctx->rtcp_fd[streamid] < 0)
+		return -1;
+	while((rlen = recv(ctx->rtcp_fd[streamid], (char*) buf, sizeof(buf), RTSP_RECV_FLAGS)) > 0) {
+		handle_rtcp(ctx, streamid, buf, rlen);
+#ifndef MSG_DONTWAIT
+		break;
+#endif
+	}
+	return 0;
+}
+
+// run timers of a session: probe bursts and deadline, sender reports, and the
+// session timeout.
+// 'wait' receives the time to the next timer, in microseconds, or -1 if
+// there is none. returns -1 if the session has to be closed.
+int
+rtsp_session_timer(RTSPContext *ctx, long long *wait) {
+	struct timeval now;
+	long long left;
+	//
+	*wait = -1;
+	gettimeofday(&now, NULL);
+	if(ctx->probe_pending && ctx->probe_sent < rtspconf->probe_packets
+	&& tvdiff_us(&ctx->probe_deadline, &now) <= 0) {
+		rtsp_probe_burst(ctx, &now);
+	}
+	if(ctx->probe_pending) {
+		if((left = tvdiff_us(&ctx->probe_deadline, &now)) <= 0) {
+			rtsp_probe_finish(ctx, 0, 0, 0);
+			if(ctx->state == SERVER_STATE_TEARDOWN)
+				return -1;
+		} else {
+			*wait = left;
 		}
-		// Interleaved binary data?
-		if(buf[0] == '$') {
-			handle_rtcp(&ctx, buf, rlen);
-			continue;
+	}
+	if((left = rtsp_send_reports(ctx, &now)) >= 0 && (*wait < 0 || left < *wait))
+		*wait = left;
+	// playing sessions are kept alive by the media
+	if(rtspconf->session_timeout > 0 && ctx->state != SERVER_STATE_PLAYING) {
+		left = rtspconf->session_timeout * 1000000LL
+			- tvdiff_us(&now, &ctx->last_activity);
+		if(left <= 0) {
+			ga_error("RTSP session timed out (%d seconds idle).\n",
+				rtspconf->session_timeout);
+			return -1;
 		}
-		// REQUEST line
-		ga_error("%s", buf);
-		p = buf;
-		get_word(cmd, sizeof(cmd), &p);
-		get_word(url, sizeof(url), &p);
-		get_word(protocol, sizeof(protocol), &p);
-		// check protocol
-		if(strcmp(protocol, "RTSP/1.0") != 0) {
-			rtsp_reply_error(&ctx, RTSP_STATUS_VERSION);
-			goto quit;
+		if(*wait < 0 || left < *wait)
+			*wait = left;
+	}
+	return 0;
+}
+
+// close the connection and free a session, after per_client_deinit()
+static void
+rtsp_session_free(RTSPContext *ctx) {
+#ifdef RTSP_HAVE_ZEROCOPY
+	if(ctx->zcnext > 0) {
+		// a peer too slow to acknowledge the rest gets its connection
+		// reset, which purges the sends
+		if(ctx->zchead != NULL) {
+			struct linger lg;
+			lg.l_onoff = 1;
+			lg.l_linger = 0;
+			setsockopt(ctx->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+			ga_error("zerocopy: session %s, %u sends not completed, connection reset.\n",
+				ctx->session_id ? ctx->session_id : "-",
+				ctx->zcnext - ctx->zcdone);
 		}
-		// read headers
-		bzero(header, sizeof(*header));
-		do {
-			int myseq = -1;
-			char mysession[sizeof(header->session_id)] = "";
-			if((rlen = rtsp_getnext(&ctx, buf, sizeof(buf))) < 0)
-				goto quit;
-			if(buf[0]=='\n' || (buf[0]=='\r' && buf[1]=='\n'))
-				break;
-#if 0
-			ga_error("HEADER: %s", buf);
+		ga_error("zerocopy: session %s, %u sends, %lld bytes, %u copied by the kernel.\n",
+			ctx->session_id ? ctx->session_id : "-",
+			ctx->zcnext, ctx->zcbytes, ctx->zccopied);
+	}
 #endif
-			// Special handling to CSeq & Session header
-			// ff_rtsp_parse_line cannot handle CSeq & Session properly on Windows
-			// any more?
-			if(strncasecmp("CSeq: ", buf, 6) == 0) {
-				myseq = strtol(buf+6, NULL, 10);
-			}
-			if(strncasecmp("Session: ", buf, 9) == 0) {
-				strcpy(mysession, buf+9);
-			}
-			//
-			ff_rtsp_parse_line(header, buf, NULL, NULL);
-			//
-			if(myseq > 0 && header->seq <= 0) {
-				ga_error("WARNING: CSeq fixes applied (%d->%d).\n",
-					header->seq, myseq);
-				header->seq = myseq;
-			}
-			if(mysession[0] != '\0' && header->session_id[0]=='\0') {
-				unsigned i;
-				for(i = 0; i < sizeof(header->session_id)-1; i++) {
-					if(mysession[i] == '\0'
-					|| isspace(mysession[i])
-					|| mysession[i] == ';')
-						break;
-					header->session_id[i] = mysession[i];
-				}
-				header->session_id[i+1] = '\0';
-				ga_error("WARNING: Session fixes applied (%s)\n",
-					header->session_id);
-			}
-		} while(1);
-		// special handle to session_id
-		if(header->session_id != NULL) {
-			char *p = header->session_id;
-			while(*p != '\0') {
-				if(*p == '\r' || *p == '\n') {
-					*p = '\0';
-					break;
-				}
-				p++;
-			}
+	close(ctx->fd);
+#ifdef RTSP_HAVE_ZEROCOPY
+	// released by the reset, if not completed
+	while(ctx->zchead != NULL) {
+		struct rtsp_txpacket *pkt = ctx->zchead;
+		ctx->zchead = pkt->next;
+		free(pkt);
+	}
+	ctx->zctail = NULL;
+#endif
+	pthread_cond_destroy(&ctx->rtsp_writer_cond);
+	pthread_mutex_destroy(&ctx->rtsp_writer_mutex);
+	pthread_mutex_destroy(&ctx->rtcp_mutex);
+	//ga_error("RTSP client thread terminated (%d/%d clients left).\n",
+	//	video_source_client_count(), audio_source_client_count());
+	ga_error("RTSP session closed.\n");
+	free(ctx);
+	return;
+}
+
+#ifdef RTSP_HAVE_ZEROCOPY
+// messages still referenced by the kernel must outlive their sends, and
+// their completions are read before the descriptor is closed.  closed
+// sessions waiting for completions are left to a reaper thread, so that
+// closing never stalls the thread serving other connections.
+struct rtsp_zclinger {
+	RTSPContext *ctx;
+	struct timeval start;
+	struct rtsp_zclinger *next;
+};
+
+static pthread_mutex_t zclingermutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zclingercond = PTHREAD_COND_INITIALIZER;
+static struct rtsp_zclinger *zclingers = NULL;
+static int zcreaper = 0;	// the reaper is running
+
+static void *
+rtsp_zerocopy_reaper(void *arg) {
+	struct rtsp_zclinger *l, **pl;
+	struct timeval now;
+	//
+	pthread_mutex_lock(&zclingermutex);
+	while(true) {
+		if(zclingers == NULL) {
+			pthread_cond_wait(&zclingercond, &zclingermutex);
+			continue;
 		}
-		// handle commands
-		ctx.seq = header->seq;
-		if (!strcmp(cmd, "DESCRIBE"))
-			rtsp_cmd_describe(&ctx, url);
-		else if (!strcmp(cmd, "OPTIONS"))
-			rtsp_cmd_options(&ctx, url);
-		else if (!strcmp(cmd, "SETUP"))
-			rtsp_cmd_setup(&ctx, url, header);
-		else if (!strcmp(cmd, "PLAY"))
-			rtsp_cmd_play(&ctx, url, header);
-		else if (!strcmp(cmd, "PAUSE"))
-			rtsp_cmd_pause(&ctx, url, header);
-		else if (!strcmp(cmd, "TEARDOWN"))
-			rtsp_cmd_teardown(&ctx, url, header);
-		else
-			rtsp_reply_error(&ctx, RTSP_STATUS_METHOD);
-		if(ctx.state == SERVER_STATE_TEARDOWN) {
-			break;
+		gettimeofday(&now, NULL);
+		for(pl = &zclingers; (l = *pl) != NULL; ) {
+			pthread_mutex_lock(&l->ctx->rtsp_writer_mutex);
+			rtsp_zerocopy_reap(l->ctx);
+			pthread_mutex_unlock(&l->ctx->rtsp_writer_mutex);
+			if(l->ctx->zchead != NULL
+			&& tvdiff_us(&now, &l->start) < RTSP_ZEROCOPY_LINGER) {
+				pl = &l->next;
+				continue;
+			}
+			*pl = l->next;
+			rtsp_session_free(l->ctx);
+			free(l);
 		}
-	} while(1);
-quit:
-	ctx.state = SERVER_STATE_TEARDOWN;
+		pthread_mutex_unlock(&zclingermutex);
+		usleep(RTSP_ZEROCOPY_POLL);
+		pthread_mutex_lock(&zclingermutex);
+	}
+	pthread_mutex_unlock(&zclingermutex);
+	return NULL;
+}
+
+// returns 0 if the session is left to the reaper, or -1 if it can be freed
+static int
+rtsp_zerocopy_linger(RTSPContext *ctx) {
+	struct rtsp_zclinger *l;
+	pthread_t t;
 	//
-	close(ctx.fd);
+	if(ctx->zcnext == 0)
+		return -1;
+	pthread_mutex_lock(&ctx->rtsp_writer_mutex);
+	rtsp_zerocopy_reap(ctx);
+	pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+	if(ctx->zchead == NULL)
+		return -1;
+	if((l = (struct rtsp_zclinger*) malloc(sizeof(*l))) == NULL)
+		return -1;
+	l->ctx = ctx;
+	gettimeofday(&l->start, NULL);
+	pthread_mutex_lock(&zclingermutex);
+	if(zcreaper == 0) {
+		if(pthread_create(&t, NULL, rtsp_zerocopy_reaper, NULL) != 0) {
+			pthread_mutex_unlock(&zclingermutex);
+			free(l);
+			return -1;	// reset at once
+		}
+		pthread_detach(t);
+		zcreaper = 1;
+	}
+	l->next = zclingers;
+	zclingers = l;
+	pthread_cond_signal(&zclingercond);
+	pthread_mutex_unlock(&zclingermutex);
+	return 0;
+}
+#endif
+
+void
+rtsp_session_close(RTSPContext *ctx) {
+#ifndef	SHARE_ENCODER
+	int thread_ret;
+#endif
+	ctx->state = SERVER_STATE_TEARDOWN;
+	rtsp_session_remove(ctx);
+#ifdef RTSP_HAVE_ZEROCOPY
+	// messages sent from now on are copied
+	pthread_mutex_lock(&ctx->rtsp_writer_mutex);
+	ctx->zerocopy = 0;
+	pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+#endif
+	rtsp_reply_flush(ctx);
+	// writers blocked on the connection fail, but the descriptor is
+	// not reused until nothing can write to it anymore
+	shutdown(ctx->fd, SHUT_RDWR);
+	mcast_stop(ctx);
 #ifdef	SHARE_ENCODER
-	encoder_unregister_client(&ctx);
+	encoder_unregister_client(ctx);
 #else
 	ga_error("connection closed, checking for worker threads...\n");
 #if 0
 	//
-	if(ctx.vthreadId != 0) {
-		video_source_notify_one(ctx.vthreadId);
+	if(ctx->vthreadId != 0) {
+		video_source_notify_one(ctx->vthreadId);
 	}
 #endif
-	pthread_join(ctx.vthread, (void**) &thread_ret);
+	pthread_join(ctx->vthread, (void**) &thread_ret);
 #ifdef	ENABLE_AUDIO
-	pthread_join(ctx.athread, (void**) &thread_ret);
+	pthread_join(ctx->athread, (void**) &thread_ret);
 #endif	/* ENABLE_AUDIO */
 #endif	/* SHARE_ENCODER */
 	//
-	per_client_deinit(&ctx);
-	//ga_error("RTSP client thread terminated (%d/%d clients left).\n",
-	//	video_source_client_count(), audio_source_client_count());
+	// the pacer is stopped here
+	per_client_deinit(ctx);
+#ifdef RTSP_HAVE_ZEROCOPY
+	if(rtsp_zerocopy_linger(ctx) == 0)
+		return;	// freed by the reaper
+#endif
+	rtsp_session_free(ctx);
+	return;
+}
+
+// serve a connection in its own thread
+void*
+rtspserver(void *arg) {
+#ifdef WIN32
+	SOCKET s = *((SOCKET*) arg);
+#else
+	int s = *((int*) arg);
+#endif
+	RTSPContext *ctx;
+	int i;
+	//
+	if((ctx = rtsp_session_open(s)) == NULL) {
+		close(s);
+		return NULL;
+	}
+	//
+	do {
+		fd_set rfds;
+		struct timeval timeout;
+		long long wait;
+		int maxfd = ctx->fd, nready;
+		//
+		if(rtsp_session_timer(ctx, &wait) < 0)
+			break;
+		FD_ZERO(&rfds);
+		FD_SET(ctx->fd, &rfds);
+		for(i = 0; i < RTSP_CHANNEL_MAX; i++) {
+			if(ctx->rtcp_fd[i] < 0)
+				continue;
+			FD_SET(ctx->rtcp_fd[i], &rfds);
+			if(ctx->rtcp_fd[i] > maxfd)
+				maxfd = ctx->rtcp_fd[i];
+		}
+		// wait no longer than the next timer
+		if(wait >= 0) {
+			timeout.tv_sec = wait / 1000000;
+			timeout.tv_usec = wait % 1000000;
+		}
+		if((nready = select(maxfd+1, &rfds, NULL, NULL,
+				wait >= 0 ? &timeout : NULL)) < 0) {
+			ga_error("select() failed: %s\n", strerror(errno));
+			break;
+		}
+		if(nready == 0)
+			continue;
+		// RTCP over UDP
+		for(i = 0; i < RTSP_CHANNEL_MAX; i++) {
+			if(ctx->rtcp_fd[i] < 0 || !FD_ISSET(ctx->rtcp_fd[i], &rfds))
+				continue;
+			rtsp_session_rtcp(ctx, i);
+		}
+		// read commands
+		if(FD_ISSET(ctx->fd, &rfds)) {
+			if(rtsp_session_input(ctx) < 0)
+				break;
+		}
+	} while(1);
+	//
+	rtsp_session_close(ctx);
 	ga_error("RTSP client thread terminated.\n");
 	//
 	return NULL;
 }
-
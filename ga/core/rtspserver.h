@@ -24,6 +24,9 @@
 #include "vsource.h"
 #include "ga-common.h"
 #include "ga-avcodec.h"
+#include "ratecontrol.h"
+
+struct pacer;
 
 // acquired from ffmpeg source code
 #ifdef __cplusplus
@@ -38,6 +41,16 @@ int ffio_open_dyn_packet_buf(AVIOContext **, int);
 
 #define	RTSP_CHANNEL_MAX	8
 
+// transmit priorities on the RTSP connection, from the highest
+enum RTSPTxPriority {
+	RTSP_TX_CONTROL = 0,	// RTSP replies
+	RTSP_TX_AUDIO,		// audio RTP, and RTCP of all streams
+	RTSP_TX_VIDEO,
+	RTSP_TX_PRIO_MAX
+};
+
+struct rtsp_txpacket;
+
 enum RTSPServerState {
 	SERVER_STATE_IDLE = 0,
 	SERVER_STATE_READY,
@@ -66,26 +79,97 @@ struct RTSPContext {
 	int rbufhead;
 	int rbuftail;
 	int rbufsize;
-	// for creating SDP
-	AVFormatContext *sdp_fmtctx;
-	AVStream *sdp_vstream[IMAGE_SOURCE_CHANNEL_MAX];
-	AVStream *sdp_astream;
-	AVCodecContext *sdp_vencoder[IMAGE_SOURCE_CHANNEL_MAX];
-	AVCodecContext *sdp_aencoder;
-	// for real audio/video encoding
+	struct timeval last_activity;	// the last request, for session timeouts
+	// RTP muxers, with codec parameters shared by all sessions
 	int seq;
 	char *session_id;
 	enum RTSPLowerTransport lower_transport[RTSP_CHANNEL_MAX];
 	AVFormatContext *fmtctx[RTSP_CHANNEL_MAX];
 	AVStream *stream[RTSP_CHANNEL_MAX];
-	AVCodecContext *encoder[RTSP_CHANNEL_MAX];
+	// time-to-first-frame: measured from PLAY to the first keyframe sent
+	struct timeval play_tv;
+	int ttff_pending[RTSP_CHANNEL_MAX];
+	// the last keyframe requested by PLI or FIR
+	struct timeval pli_tv[RTSP_CHANNEL_MAX];
 	// streaming
 	URLContext *rtp[RTSP_CHANNEL_MAX];	// RTP over UDP
-	pthread_mutex_t rtsp_writer_mutex;	// RTP over RTSP/TCP
+	int max_packet_size[RTSP_CHANNEL_MAX];
+	int rtcp_fd[RTSP_CHANNEL_MAX];		// RTCP over UDP, -1 if not available
+	// sockets (RTP, RTCP) of ctx->rtp and their destinations, for batched
+	// sends of the I/O engine; -1 if not available
+	int udp_fd[RTSP_CHANNEL_MAX][2];
+	struct sockaddr_in udp_addr[RTSP_CHANNEL_MAX][2];
+	struct ratecontrol ratectl[RTSP_CHANNEL_MAX];
+	// RTCP: packets sent, sender reports and receiver reports of each stream
+	pthread_mutex_t rtcp_mutex;
+	struct rtcp_stats rtcpstats[RTSP_CHANNEL_MAX];
+	struct rtp_history *history[RTSP_CHANNEL_MAX];	// sent packets, resent on NACKs
+	struct rtp_fec_encoder *fec[RTSP_CHANNEL_MAX];	// parity packets, NULL - no FEC
+	// multicast: streams received from the group, see mcast_setup()
+	int multicast[RTSP_CHANNEL_MAX];
+	int mcast_playing;	// counted as a viewer playing the group
+	// simulcast: the tier a stream receives, switched at a keyframe of tier_next
+	int tier[RTSP_CHANNEL_MAX];
+	int tier_next[RTSP_CHANNEL_MAX];
+	int tier_pinned;	// chosen by the client, no automatic switching
+	// startup bandwidth probing: streaming starts on feedback or deadline
+	int probe_pending;
+	int probe_sent;		// packets of the train sent, in bursts from the timer
+	struct timeval probe_start;
+	struct timeval probe_deadline;	// of the next burst, then of the feedback
+	// pacing of video packets, created when streaming starts
+	int pacing;		// requested for this session
+	struct pacer *pacer;
+	// transmit scheduler of the RTSP connection: queued messages are written
+	// in strict priority order, so audio preempts video at packet boundaries
+	pthread_mutex_t rtsp_writer_mutex;	// guards the queues
+	pthread_cond_t rtsp_writer_cond;	// a message has been written
+	struct rtsp_txpacket *txhead[RTSP_TX_PRIO_MAX];
+	struct rtsp_txpacket *txtail[RTSP_TX_PRIO_MAX];
+	int txbytes[RTSP_TX_PRIO_MAX];
+	int txwriting;		// a thread is writing queued messages
+	int txfailed;
+	struct rtsp_txpacket *txpartial;	// partly written by a non-blocking write
+	int txwantout;		// a non-blocking write stopped on a full socket buffer
+	long iotid;		// the event loop thread serving the connection, or 0
+	unsigned int txdropped;	// audio and RTCP messages dropped from a full queue
+	// MSG_ZEROCOPY: messages sent, kept until the kernel releases them
+	int zerocopy;		// enabled on the connection
+	struct rtsp_txpacket *zchead, *zctail;
+	unsigned int zcnext;	// id of the next zerocopy send
+	unsigned int zcdone;	// ids below are completed
+	unsigned int zcdirect, zccopied;	// completions, and those copied anyway
+	long long zcbytes;
+	// the RTSP reply being composed, queued as a whole
+	char *replybuf;
+	int replylen;
+	int replysize;
+	// all sessions, for statistics
+	struct RTSPContext *next;
 };
 
 EXPORT void rtsp_cleanup(RTSPContext *rtsp, int retcode);
+EXPORT int rtsp_write_packet(RTSPContext *ctx, int streamid, const uint8_t *pkt, int pktlen);
+EXPORT int rtsp_write_packets(RTSPContext *ctx, int streamid, const uint8_t **pkts, const int *lens, int n);
 EXPORT int rtsp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen);
+EXPORT void rtsp_write_captured(RTSPContext *ctx, int streamid, const uint8_t *buf, int buflen, const struct timeval *captured);
+EXPORT int rtsp_stats_report(char *buf, int buflen);
+EXPORT AVCodecContext * rtsp_codec_parameters(int streamid);
+EXPORT int rtsp_codec_copy(int streamid, int tier, AVCodecContext *dst);
+EXPORT unsigned int rtsp_codec_version(int streamid);
+EXPORT void rtsp_codec_refresh(int streamid, int tier, const unsigned char *extradata, int size, int width, int height);
 EXPORT void* rtspserver(void *arg);
+// connections served by an event loop, see rtsp-io.cpp
+#ifdef WIN32
+EXPORT RTSPContext * rtsp_session_open(SOCKET s);
+#else
+EXPORT RTSPContext * rtsp_session_open(int s);
+#endif
+EXPORT int rtsp_session_input(RTSPContext *ctx);
+EXPORT int rtsp_session_output(RTSPContext *ctx);
+EXPORT int rtsp_session_want_output(RTSPContext *ctx);
+EXPORT int rtsp_session_rtcp(RTSPContext *ctx, int streamid);
+EXPORT int rtsp_session_timer(RTSPContext *ctx, long long *wait);
+EXPORT void rtsp_session_close(RTSPContext *ctx);
 
 #endif
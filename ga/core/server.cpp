@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <pthread.h>
 #ifndef WIN32
+#include <errno.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <sys/syscall.h>
@@ -33,6 +34,10 @@
 #include "rtspconf.h"
 #include "server.h"
 #include "rtspserver.h"
+#include "rtsp-io.h"
+#include "ioengine.h"
+#include "recorder.h"
+#include "shm-publish.h"
 
 void *
 rtspserver_main(void *arg) {
@@ -45,6 +50,18 @@ rtspserver_main(void *arg) {
 #endif
 	struct sockaddr_in sin, csin;
 	struct RTSPConf *conf = rtspconf_global();
+	int evloop = 0;
+	//
+	ioengine_init(conf->io_engine);
+	recorder_init(conf);
+	shm_publish_init(conf);
+	if(conf->io_threads > 0) {
+		if(rtsp_io_init(conf->io_threads) == 0) {
+			evloop = 1;
+		} else {
+			ga_error("RTSP I/O threads not available, one thread per connection.\n");
+		}
+	}
 	//
 	if((s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
 		perror("socket");
@@ -80,6 +97,16 @@ rtspserver_main(void *arg) {
 		csinlen = sizeof(csin);
 		bzero(&csin, sizeof(csin));
 		if((cs = accept(s, (struct sockaddr*) &csin, &csinlen)) < 0) {
+#ifndef WIN32
+			// out of descriptors, or an aborted connection
+			if(errno == EINTR || errno == ECONNABORTED
+			|| errno == EMFILE || errno == ENFILE) {
+				perror("accept");
+				if(errno == EMFILE || errno == ENFILE)
+					usleep(100000);
+				continue;
+			}
+#endif
 			perror("accept");
 			return (void *) -1;
 		}
@@ -93,6 +120,13 @@ rtspserver_main(void *arg) {
 			}
 		} while(0);
 		//
+		if(evloop) {
+			if(rtsp_io_add(cs) < 0) {
+				close(cs);
+				ga_error("cannot serve the connection.\n");
+			}
+			continue;
+		}
 		if(pthread_create(&thread, NULL, rtspserver, &cs) != 0) {
 			close(cs);
 			ga_error("cannot create service thread.\n");
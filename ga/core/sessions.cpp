@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef WIN32
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "ga-common.h"
+#include "ga-conf.h"
+#include "rtspconf.h"
+#include "sessions.h"
+
+#define	SESSIONS_ACCOUNT_INTERVAL	10	/* seconds */
+#define	SESSIONS_RETRY_DELAY		10	/* seconds, for sessions failing at start */
+
+struct session {
+	pid_t pid;		// of the worker, 0 - not running
+	time_t started;
+	time_t retry;		// do not restart before
+	unsigned restarts;
+	char display[64];
+	int port;
+	// accounting
+	unsigned long long cputicks;
+	double cpu;		// in percent of a processor
+	long rss;		// in KB
+};
+
+struct spare {
+	pid_t pid;
+	int fd;			// assignments are written here
+};
+
+static int nsessions = 0;
+static int nspares = 1;
+static int sessionid = -1;
+static struct session sessions[SESSIONS_MAX];
+static struct spare spares[SESSIONS_SPARE_MAX];
+static int portstep = 10;
+
+int
+sessions_configured() {
+	char buf[64];
+	int v;
+	//
+	if(ga_conf_readv("sessions", buf, sizeof(buf)) == NULL)
+		return 0;
+	v = ga_conf_readint("sessions");
+	if(v < 0 || v > SESSIONS_MAX) {
+		ga_error("# sessions[config]: sessions out-of-range %d (valid: 0-%d)\n",
+			v, SESSIONS_MAX);
+		return -1;
+	}
+	return v;
+}
+
+int
+sessions_id() {
+	return sessionid;
+}
+
+#ifndef WIN32
+// name of a per-session resource: -<id> goes before the extension of the
+// last path component, e.g., /tmp/ga-encoder.sock -> /tmp/ga-encoder-1.sock
+static void
+session_rename(const char *key, int id) {
+	char value[1024], renamed[1100];
+	char *slash, *dot;
+	//
+	if(ga_conf_readv(key, value, sizeof(value)) == NULL)
+		return;
+	slash = strrchr(value, '/');
+	dot = strrchr(slash ? slash : value, '.');
+	if(dot != NULL && dot != (slash ? slash + 1 : value)) {
+		*dot = '\0';
+		snprintf(renamed, sizeof(renamed), "%s-%d.%s", value, id, dot + 1);
+	} else {
+		snprintf(renamed, sizeof(renamed), "%s-%d", value, id);
+	}
+	ga_conf_writev(key, renamed);
+	return;
+}
+
+// port of a session, from the port parsed by the host, i.e., the default
+// if the key is not set
+static void
+session_port(const char *key, int port, int id) {
+	char value[32];
+	//
+	snprintf(value, sizeof(value), "%d", port + id * portstep);
+	ga_conf_writev(key, value);
+	return;
+}
+
+// rewrite the configuration of a worker for its session
+static void
+session_configure(int id) {
+	struct RTSPConf *conf = rtspconf_global();
+	char value[64];
+	int ncpu;
+	//
+	ga_conf_writev("display", sessions[id].display);
+	setenv("DISPLAY", sessions[id].display, 1);
+	session_port("server-port", conf->serverport, id);
+	session_port("control-port", conf->ctrlport, id);
+	session_port("multicast-port", conf->mcast_port, id);
+	session_rename("logfile", id);
+	session_rename("encoder-control", id);
+	session_rename("record-file", id);
+	session_rename("shm-publish", id);
+	session_rename("video-pipeline-shm", id);
+	// the processors are shared by all sessions
+	if(ga_conf_readv("encoder-workers", value, sizeof(value)) != NULL
+	&& strcmp(value, "auto") == 0) {
+		ncpu = ga_cpu_count() / nsessions;
+		snprintf(value, sizeof(value), "%d", ncpu > 0 ? ncpu : 1);
+		ga_conf_writev("encoder-workers", value);
+	}
+	sessionid = id;
+	return;
+}
+
+static int
+spare_fork(sigset_t *oldmask) {
+	struct spare *sp = NULL;
+	pid_t host = getpid();
+	int i, fds[2], id;
+	//
+	for(i = 0; i < SESSIONS_SPARE_MAX; i++) {
+		if(spares[i].pid == 0) {
+			sp = &spares[i];
+			break;
+		}
+	}
+	if(sp == NULL || pipe(fds) < 0)
+		return -1;
+	if((sp->pid = fork()) < 0) {
+		ga_error("sessions: fork failed: %s\n", strerror(errno));
+		sp->pid = 0;
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if(sp->pid > 0) {
+		close(fds[0]);
+		sp->fd = fds[1];
+		return 0;
+	}
+	// a spare worker: wait for a session
+	close(fds[1]);
+	for(i = 0; i < SESSIONS_SPARE_MAX; i++) {
+		if(spares[i].pid != 0 && &spares[i] != sp)
+			close(spares[i].fd);
+	}
+#ifdef __linux__
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	sigprocmask(SIG_SETMASK, oldmask, NULL);
+	if(getppid() != host)
+		exit(0);
+	if(read(fds[0], &id, sizeof(id)) != sizeof(id) || id < 0 || id >= nsessions)
+		exit(0);
+	close(fds[0]);
+	session_configure(id);
+	return 1;
+}
+
+// hand a session to a spare worker, forking one if none is left
+static int
+session_start(int id, sigset_t *oldmask) {
+	int i, ret;
+	//
+	for(i = 0; i < SESSIONS_SPARE_MAX; i++) {
+		if(spares[i].pid != 0)
+			break;
+	}
+	if(i == SESSIONS_SPARE_MAX) {
+		if((ret = spare_fork(oldmask)) != 0)
+			return ret;
+		for(i = 0; spares[i].pid == 0; i++)
+			;
+	}
+	if(write(spares[i].fd, &id, sizeof(id)) != sizeof(id)) {
+		ga_error("sessions: cannot start session %d on worker %d.\n", id, spares[i].pid);
+		close(spares[i].fd);
+		kill(spares[i].pid, SIGTERM);
+		spares[i].pid = 0;
+		return -1;
+	}
+	close(spares[i].fd);
+	sessions[id].pid = spares[i].pid;
+	sessions[id].started = time(NULL);
+	spares[i].pid = 0;
+	ga_error("sessions: session %d (display %s, port %d) started, pid %d.\n",
+		id, sessions[id].display, sessions[id].port, sessions[id].pid);
+	return 0;
+}
+
+static void
+session_exited(pid_t pid, int status) {
+	time_t now = time(NULL);
+	int i;
+	//
+	for(i = 0; i < SESSIONS_SPARE_MAX; i++) {
+		if(spares[i].pid == pid) {
+			close(spares[i].fd);
+			spares[i].pid = 0;
+			ga_error("sessions: spare worker %d exited.\n", pid);
+			return;
+		}
+	}
+	for(i = 0; i < nsessions; i++) {
+		if(sessions[i].pid != pid)
+			continue;
+		if(WIFSIGNALED(status)) {
+			ga_error("sessions: session %d (pid %d) killed by signal %d.\n",
+				i, pid, WTERMSIG(status));
+		} else {
+			ga_error("sessions: session %d (pid %d) exited with %d.\n",
+				i, pid, WEXITSTATUS(status));
+		}
+		sessions[i].pid = 0;
+		sessions[i].restarts++;
+		sessions[i].cputicks = 0;
+		// failing at start, e.g., its display is not up: retry later
+		if(now - sessions[i].started < SESSIONS_RETRY_DELAY)
+			sessions[i].retry = now + SESSIONS_RETRY_DELAY;
+		return;
+	}
+	return;
+}
+
+static void
+sessions_account(double interval) {
+#ifdef __linux__
+	static long ticks = 0, pagekb = 0;
+	double cpu = 0;
+	long rss = 0;
+	int i, running = 0;
+	//
+	if(ticks == 0) {
+		ticks = sysconf(_SC_CLK_TCK);
+		pagekb = sysconf(_SC_PAGESIZE) / 1024;
+	}
+	for(i = 0; i < nsessions; i++) {
+		struct session *s = &sessions[i];
+		unsigned long long utime, stime;
+		long pages;
+		char path[64], buf[1024], *p;
+		FILE *fp;
+		//
+		if(s->pid == 0)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/stat", s->pid);
+		if((fp = fopen(path, "rt")) == NULL)
+			continue;
+		p = fgets(buf, sizeof(buf), fp);
+		fclose(fp);
+		// skip pid and (comm), then 11 fields to utime and stime
+		if(p == NULL || (p = strrchr(buf, ')')) == NULL
+		|| sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+				&utime, &stime) != 2)
+			continue;
+		if(s->cputicks > 0 && interval > 0)
+			s->cpu = 100.0 * (utime + stime - s->cputicks) / ticks / interval;
+		s->cputicks = utime + stime;
+		snprintf(path, sizeof(path), "/proc/%d/statm", s->pid);
+		if((fp = fopen(path, "rt")) != NULL) {
+			if(fscanf(fp, "%*s %ld", &pages) == 1)
+				s->rss = pages * pagekb;
+			fclose(fp);
+		}
+		ga_error("sessions: session %d (display %s, port %d) pid %d: cpu %.1f%% rss %ld MB restarts %u\n",
+			i, s->display, s->port, s->pid, s->cpu, s->rss / 1024, s->restarts);
+		cpu += s->cpu;
+		rss += s->rss;
+		running++;
+	}
+	ga_error("sessions: %d of %d running: cpu %.1f%% rss %ld MB\n",
+		running, nsessions, cpu, rss / 1024);
+#endif
+	return;
+}
+
+static void
+sessions_stop() {
+	int i;
+	//
+	for(i = 0; i < nsessions; i++) {
+		if(sessions[i].pid != 0)
+			kill(sessions[i].pid, SIGTERM);
+	}
+	for(i = 0; i < SESSIONS_SPARE_MAX; i++) {
+		if(spares[i].pid != 0)
+			kill(spares[i].pid, SIGTERM);
+	}
+	while(wait(NULL) > 0)
+		;
+	return;
+}
+
+int
+sessions_run() {
+	char buf[64], format[64] = ":%d";
+	sigset_t mask, oldmask;
+	struct timespec to;
+	siginfo_t info;
+	time_t now, accounted;
+	int i, n, base = 1, sig, ret, serverport;
+	pid_t pid;
+	int status;
+	//
+	if((nsessions = sessions_configured()) <= 0)
+		return -1;
+	ga_conf_readv("session-display", format, sizeof(format));
+	if(ga_conf_readv("session-display-base", buf, sizeof(buf)) != NULL)
+		base = ga_conf_readint("session-display-base");
+	if(ga_conf_readv("session-port-step", buf, sizeof(buf)) != NULL)
+		portstep = ga_conf_readint("session-port-step");
+	if(ga_conf_readv("session-spare", buf, sizeof(buf)) != NULL)
+		nspares = ga_conf_readint("session-spare");
+	if(portstep < 1 || nspares < 0 || nspares > SESSIONS_SPARE_MAX) {
+		ga_error("# sessions[config]: invalid session-port-step %d or session-spare %d (valid: 0-%d)\n",
+			portstep, nspares, SESSIONS_SPARE_MAX);
+		return -1;
+	}
+	serverport = rtspconf_global()->serverport;
+	for(i = 0; i < nsessions; i++) {
+		snprintf(sessions[i].display, sizeof(sessions[i].display), format, base + i);
+		sessions[i].port = serverport + i * portstep;
+	}
+	ga_error("# sessions[config]: %d sessions on displays %s (from %d), ports %d+%d, %d spare\n",
+		nsessions, format, base, serverport, portstep, nspares);
+	// child exits and termination are handled synchronously
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	accounted = time(NULL);
+	while(true) {
+		now = time(NULL);
+		for(i = 0; i < nsessions; i++) {
+			if(sessions[i].pid != 0 || sessions[i].retry > now)
+				continue;
+			if((ret = session_start(i, &oldmask)) > 0)
+				return 1;	// in the worker
+		}
+		for(i = n = 0; i < SESSIONS_SPARE_MAX; i++) {
+			if(spares[i].pid != 0)
+				n++;
+		}
+		for(; n < nspares; n++) {
+			if((ret = spare_fork(&oldmask)) > 0)
+				return 1;	// a spare just assigned
+			if(ret < 0)
+				break;
+		}
+		if(now - accounted >= SESSIONS_ACCOUNT_INTERVAL) {
+			sessions_account(now - accounted);
+			accounted = now;
+		}
+		to.tv_sec = 1;
+		to.tv_nsec = 0;
+		if((sig = sigtimedwait(&mask, &info, &to)) < 0)
+			continue;
+		if(sig != SIGCHLD) {
+			ga_error("sessions: terminated by signal %d.\n", sig);
+			sessions_stop();
+			exit(0);
+		}
+		while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+			session_exited(pid, status);
+	}
+	return -1;
+}
+#else
+int
+sessions_run() {
+	ga_error("sessions: not supported on this platform.\n");
+	return -1;
+}
+#endif
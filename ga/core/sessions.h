@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __SESSIONS_H__
+#define __SESSIONS_H__
+
+#include "ga-common.h"
+
+// hosting several desktops: with 'sessions = N', the process becomes a
+// session host that forks one worker per session, after everything the
+// sessions share (codecs, modules) has been loaded.  a worker serves one
+// desktop: its configuration is rewritten with the display, ports, and
+// names of its session.  spare workers are kept forked, so a session that
+// fails is restarted without loading the codecs and modules again.  a spare
+// does not know its display before it is assigned: capture and encoders
+// are still opened by the worker, after the assignment.
+
+#define	SESSIONS_MAX		64
+#define	SESSIONS_SPARE_MAX	8
+
+EXPORT int sessions_configured();
+// returns 1 in a session worker, or -1 on errors.  the host does not return.
+EXPORT int sessions_run();
+// the session served by this process, -1 - not a session worker
+EXPORT int sessions_id();
+
+#endif
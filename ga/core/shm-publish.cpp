@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#endif
+#ifdef __linux__
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "vsource.h"
+#include "encoder-common.h"
+#include "rtspserver.h"
+#include "shm-publish.h"
+
+#include "ga-common.h"
+
+#define	SHM_PUBLISH_ENTRIES	4096	/* packets in the ring */
+#define	SHM_PUBLISH_POLL	1	/* seconds, between checks for readers gone */
+
+static struct RTSPConf *shmconf = NULL;
+static AVRational shm_timebase = { 1, 1000000 };	// of published packets
+
+// the ring; packets are written under shmmutex, readers take no locks
+static pthread_mutex_t shmmutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ga_shm_header *shm = NULL;
+static struct ga_shm_entry *shmentry = NULL;
+static uint8_t *shmdata = NULL;
+static uint32_t shmkeyreq = 0;		// keyframe requests served
+static unsigned int shmversion[GA_SHM_STREAM_MAX];	// of the codec parameters described
+static unsigned long long npublished = 0, nbytes = 0, ndropped = 0;
+
+// readers attached: the encoders run for them as for a playing client
+static volatile int shmreaders = 0;
+static RTSPContext *shmclient = NULL;
+
+#ifndef WIN32
+static void
+shm_futex_wake(volatile uint32_t *addr) {
+#ifdef __linux__
+	syscall(__NR_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+	return;
+}
+
+static void
+shm_futex_wait(volatile uint32_t *addr, uint32_t val, int ms) {
+#ifdef __linux__
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	syscall(__NR_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+	if(*addr == val)
+		usleep(ms * 1000);
+#endif
+	return;
+}
+
+static int
+shm_client_start() {
+	RTSPContext *ctx;
+	//
+	if((ctx = (RTSPContext*) malloc(sizeof(RTSPContext))) == NULL)
+		return -1;
+	// no muxers: encoder_send_packet() skips it
+	bzero(ctx, sizeof(RTSPContext));
+	ctx->fd = -1;
+	ctx->state = SERVER_STATE_PLAYING;
+	ctx->session_id = strdup("shm");
+	if(encoder_register_client(ctx) < 0) {
+		ga_error("shm: cannot start the encoders.\n");
+		free(ctx->session_id);
+		free(ctx);
+		return -1;
+	}
+	shmclient = ctx;
+	return 0;
+}
+
+static void
+shm_client_stop() {
+	if(shmclient == NULL)
+		return;
+	shmclient->state = SERVER_STATE_TEARDOWN;
+	encoder_unregister_client(shmclient);
+	free(shmclient->session_id);
+	free(shmclient);
+	shmclient = NULL;
+	return;
+}
+
+// counts readers, and frees the slots of those that died attached
+static void *
+shm_publish_thread(void *arg) {
+	uint32_t attach, pid;
+	int i, n;
+	//
+	ga_error("shm: publisher started (tid %ld).\n", ga_gettid());
+	while(true) {
+		attach = shm->attach;
+		for(i = n = 0; i < GA_SHM_READER_MAX; i++) {
+			if((pid = shm->readers[i].pid) == 0)
+				continue;
+			if(kill((pid_t) pid, 0) < 0 && errno == ESRCH) {
+				if(__sync_bool_compare_and_swap(&shm->readers[i].pid, pid, 0))
+					ga_error("shm: reader %u is gone.\n", pid);
+				continue;
+			}
+			n++;
+		}
+		if(n != shmreaders) {
+			ga_error("shm: %d readers attached.\n", n);
+			shmreaders = n;
+			if(n > 0 && shmclient == NULL) {
+				shm_client_start();
+			} else if(n == 0) {
+				shm_client_stop();
+			}
+		}
+		shm_futex_wait(&shm->attach, attach, SHM_PUBLISH_POLL * 1000);
+	}
+	return NULL;
+}
+
+static uint64_t
+shm_power_of_2(uint64_t v) {
+	uint64_t p = 4096;
+	while(p < v)
+		p <<= 1;
+	return p;
+}
+#endif	/* ifndef WIN32 */
+
+// create the object, replacing one left by a previous run
+int
+shm_publish_init(struct RTSPConf *conf) {
+#ifdef WIN32
+	if(conf->shm_name != NULL)
+		ga_error("shm: shared memory publishing is not supported.\n");
+	return -1;
+#else
+	pthread_t thread;
+	uint64_t hdrsize, entsize, datasize, size;
+	void *addr;
+	int fd;
+	//
+	if(conf->shm_name == NULL)
+		return 0;
+	hdrsize = shm_power_of_2(sizeof(struct ga_shm_header));
+	entsize = shm_power_of_2(SHM_PUBLISH_ENTRIES * sizeof(struct ga_shm_entry));
+	datasize = shm_power_of_2(conf->shm_size);
+	size = hdrsize + entsize + datasize;
+	shm_unlink(conf->shm_name);
+	if((fd = shm_open(conf->shm_name, O_CREAT | O_EXCL | O_RDWR, 0600)) < 0) {
+		ga_error("shm: cannot create %s: %s.\n", conf->shm_name, strerror(errno));
+		return -1;
+	}
+	if(ftruncate(fd, size) < 0
+	|| (addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		ga_error("shm: cannot map %s: %s.\n", conf->shm_name, strerror(errno));
+		close(fd);
+		shm_unlink(conf->shm_name);
+		return -1;
+	}
+	close(fd);
+	// a new object is zero-filled; readers wait for the magic
+	shm = (struct ga_shm_header*) addr;
+	shmentry = (struct ga_shm_entry*) ((uint8_t*) addr + hdrsize);
+	shmdata = (uint8_t*) addr + hdrsize + entsize;
+	shm->version = GA_SHM_VERSION;
+	shm->pid = getpid();
+	shm->nstreams = video_source_channels() + 1;
+	shm->entry_offset = hdrsize;
+	shm->nentries = SHM_PUBLISH_ENTRIES;
+	shm->data_offset = hdrsize + entsize;
+	shm->data_size = datasize;
+	__sync_synchronize();
+	shm->magic = GA_SHM_MAGIC;
+	shmconf = conf;
+	if(pthread_create(&thread, NULL, shm_publish_thread, NULL) != 0) {
+		ga_error("shm: cannot create the publisher thread.\n");
+		shmconf = NULL;
+		return -1;
+	}
+	pthread_detach(thread);
+	ga_error("shm: publishing to %s, %llu KB of packet data, %d packets.\n",
+		conf->shm_name, datasize / 1024, SHM_PUBLISH_ENTRIES);
+	return 0;
+#endif
+}
+
+// returns 1 if readers are attached
+int
+shm_publish_active() {
+	return shmreaders > 0;
+}
+
+#ifndef WIN32
+// codec parameters of a stream, before its first packet, and again before
+// the first packet after they have changed, e.g., the encoder was re-opened
+static void
+shm_describe(int channelId) {
+	struct ga_shm_stream *st = &shm->streams[channelId];
+	AVCodecContext *codec;
+	//
+	if((codec = avcodec_alloc_context3(NULL)) == NULL)
+		return;
+	shmversion[channelId] = rtsp_codec_version(channelId);
+	if(rtsp_codec_copy(channelId, 0, codec) < 0) {
+		av_free(codec);
+		return;
+	}
+	st->type = 0;
+	__sync_synchronize();
+	if(channelId < video_source_channels()) {
+		st->width = codec->width;
+		st->height = codec->height;
+	} else {
+		st->samplerate = codec->sample_rate;
+		st->channels = codec->channels;
+	}
+	st->codec_id = codec->codec_id;
+	st->extradata_size = 0;
+	if(codec->extradata != NULL && codec->extradata_size <= GA_SHM_EXTRADATA_MAX) {
+		memcpy(st->extradata, codec->extradata, codec->extradata_size);
+		st->extradata_size = codec->extradata_size;
+	}
+	__sync_synchronize();
+	st->type = channelId < video_source_channels() ? GA_SHM_VIDEO : GA_SHM_AUDIO;
+	av_freep(&codec->extradata);
+	av_free(codec);
+	return;
+}
+#endif
+
+// copy a packet, in the time base of the encoder, into the ring.  never
+// waits for readers.  returns 0 on success, or -1 if it is not published.
+int
+shm_publish_write(int channelId, AVPacket *pkt, int64_t encoderPts) {
+#ifdef WIN32
+	return -1;
+#else
+	struct ga_shm_entry *e;
+	AVCodecContext *codec;
+	uint64_t seq, pos, off, first;
+	uint32_t keyreq;
+	int i;
+	//
+	if(shmconf == NULL || shmreaders == 0)
+		return 0;
+	if(channelId < 0 || channelId >= GA_SHM_STREAM_MAX
+	|| encoderPts == (int64_t) AV_NOPTS_VALUE
+	|| (codec = rtsp_codec_parameters(channelId)) == NULL)
+		return -1;
+	pthread_mutex_lock(&shmmutex);
+	// a packet larger than a quarter of the ring would overrun every reader
+	if((uint64_t) pkt->size > shm->data_size / 4) {
+		ndropped++;
+		pthread_mutex_unlock(&shmmutex);
+		return -1;
+	}
+	if(shm->streams[channelId].type == 0
+	|| shmversion[channelId] != rtsp_codec_version(channelId))
+		shm_describe(channelId);
+	seq = shm->write_seq;
+	pos = shm->write_pos;
+	e = &shmentry[seq & (shm->nentries - 1)];
+	e->seq = GA_SHM_SEQ_BUSY;
+	__sync_synchronize();
+	shm->write_pos = pos + pkt->size;
+	__sync_synchronize();
+	off = pos & (shm->data_size - 1);
+	first = shm->data_size - off < (uint64_t) pkt->size ? shm->data_size - off : pkt->size;
+	memcpy(shmdata + off, pkt->data, first);
+	memcpy(shmdata, pkt->data + first, pkt->size - first);
+	e->pos = pos;
+	e->pts = av_rescale_q(encoderPts, codec->time_base, shm_timebase);
+	e->size = pkt->size;
+	e->stream = channelId;
+	e->flags = (pkt->flags & AV_PKT_FLAG_KEY) ? GA_SHM_FLAG_KEY : 0;
+	__sync_synchronize();
+	e->seq = seq;
+	shm->write_seq = seq + 1;
+	__sync_fetch_and_add(&shm->notify, 1);
+	if(shm->waiters > 0)
+		shm_futex_wake(&shm->notify);
+	npublished++;
+	nbytes += pkt->size;
+	// readers joining, or overrun, start at a keyframe
+	keyreq = shm->keyreq;
+	if(keyreq == shmkeyreq)
+		keyreq = 0;
+	else
+		shmkeyreq = keyreq;
+	pthread_mutex_unlock(&shmmutex);
+	if(keyreq != 0) {
+		for(i = 0; i < video_source_channels(); i++)
+			encoder_keyframe_request(i, 0);
+	}
+	return 0;
+#endif
+}
+
+// for the encoder control socket
+int
+shm_publish_report(char *buf, int buflen) {
+	int len;
+	//
+	if(shmconf == NULL)
+		return 0;
+	pthread_mutex_lock(&shmmutex);
+	len = snprintf(buf, buflen,
+		"shm %s: readers=%d packets=%llu bytes=%llu dropped=%llu\n",
+		shmconf->shm_name, shmreaders, npublished, nbytes, ndropped);
+	pthread_mutex_unlock(&shmmutex);
+	return len < buflen ? len : buflen;
+}
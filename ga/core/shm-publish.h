@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __SHM_PUBLISH_H__
+#define __SHM_PUBLISH_H__
+
+#include "ga-common.h"
+#include "ga-avcodec.h"
+#include "rtspconf.h"
+#include "ga-shm.h"
+
+// publishes the encoded streams (video tier 0, and audio) to local readers
+// in a shared-memory ring, see ga-shm.h.  encoders run while readers are
+// attached, as for a playing client.
+
+EXPORT int shm_publish_init(struct RTSPConf *conf);
+EXPORT int shm_publish_active();
+EXPORT int shm_publish_write(int channelId, AVPacket *pkt, int64_t encoderPts);
+EXPORT int shm_publish_report(char *buf, int buflen);
+
+#endif
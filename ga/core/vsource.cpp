@@ -27,6 +27,8 @@
 #include "ga-common.h"
 
 #define	POOLSIZE			8
+// frames in a shared pool: the image follows the frame header in its slot
+#define	SHM_FRAME_HEADER		((sizeof(struct vsource_frame) + 63) & ~63)
 
 // golbal image structure
 static int gChannels;
@@ -34,6 +36,7 @@ static int gWidth[IMAGE_SOURCE_CHANNEL_MAX];
 static int gHeight[IMAGE_SOURCE_CHANNEL_MAX];
 static int gStride[IMAGE_SOURCE_CHANNEL_MAX];
 static pipeline *gPipe[IMAGE_SOURCE_CHANNEL_MAX];
+static char *gShmFormat = NULL;		// shared-memory pool name, e.g., /ga-image-%d
 
 struct vsource_frame *
 vsource_frame_init(struct vsource_frame *frame, int width, int height, int stride) {
@@ -54,10 +57,39 @@ vsource_frame_init(struct vsource_frame *frame, int width, int height, int strid
 	return frame;
 }
 
+// imgbuf of a frame in a shared pool is at 'alignment' bytes from the
+// frame, and is rebuilt by each process that acquires the frame
+static void
+vsource_frame_fixup(void *ptr) {
+	struct vsource_frame *frame = (struct vsource_frame*) ptr;
+	frame->imgbuf_internal = (unsigned char*) frame;
+	frame->imgbuf = frame->imgbuf_internal + frame->alignment;
+	return;
+}
+
+static struct vsource_frame *
+vsource_frame_init_shm(struct vsource_frame *frame, int width, int height, int stride) {
+	int i;
+	//
+	bzero(frame, sizeof(struct vsource_frame));
+	//
+	for(i = 0; i < MAX_STRIDE; i++) {
+		frame->linesize[i] = stride;
+	}
+	frame->stride = stride;
+	frame->imgbufsize = height * stride;
+	frame->alignment = SHM_FRAME_HEADER;
+	vsource_frame_fixup(frame);
+	bzero(frame->imgbuf, frame->imgbufsize);
+	return frame;
+}
+
 void
 vsource_frame_release(struct vsource_frame *frame) {
 	if(frame == NULL)
 		return;
+	if(frame->imgbuf_internal == (unsigned char*) frame)
+		return;
 	if(frame->imgbuf != NULL)
 		free(frame->imgbuf);
 	return;
@@ -117,23 +149,36 @@ video_source_setup_ex(const char *pipeformat, struct vsource_config *config, int
 			ga_error("image source: init pipeline failed.\n");
 			return -1;
 		}
-		if(gPipe[idx]->alloc_privdata(sizeof(struct vsource_config)) == NULL) {
-			ga_error("image source: cannot allocate private data.\n");
+		// create data pool for the pipe: private data of a shared pool
+		// lives in the pool, so the pool comes first
+		if(gShmFormat != NULL) {
+			char shmname[64];
+			snprintf(shmname, sizeof(shmname), gShmFormat, idx);
+			data = gPipe[idx]->datapool_init_shm(shmname, POOLSIZE,
+				SHM_FRAME_HEADER + height * stride, vsource_frame_fixup);
+		} else {
+			data = gPipe[idx]->datapool_init(POOLSIZE, sizeof(struct vsource_frame));
+		}
+		if(data == NULL) {
+			ga_error("image source: cannot allocate data pool.\n");
 			delete gPipe[idx];
 			gPipe[idx] = NULL;
 			return -1;
 		}
-		config[idx].id = idx;
-		gPipe[idx]->set_privdata(&config[idx], sizeof(struct vsource_config));
-		// create data pool for the pipe
-		if((data = gPipe[idx]->datapool_init(POOLSIZE, sizeof(struct vsource_frame))) == NULL) {
-			ga_error("image source: cannot allocate data pool.\n");
+		if(gPipe[idx]->alloc_privdata(sizeof(struct vsource_config)) == NULL) {
+			ga_error("image source: cannot allocate private data.\n");
 			delete gPipe[idx];
 			gPipe[idx] = NULL;
 			return -1;
 		}
+		config[idx].id = idx;
+		gPipe[idx]->set_privdata(&config[idx], sizeof(struct vsource_config));
 		// per frame init
 		for(; data != NULL; data = data->next) {
+			if(gPipe[idx]->shared()) {
+				vsource_frame_init_shm((struct vsource_frame*) data->ptr, width, height, stride);
+				continue;
+			}
 			if(vsource_frame_init((struct vsource_frame*) data->ptr, width, height, stride) == NULL) {
 				ga_error("image source: init frame failed.\n");
 				return -1;
@@ -153,6 +198,68 @@ video_source_setup_ex(const char *pipeformat, struct vsource_config *config, int
 	return 0;
 }
 
+// frames of the sources set up afterwards go to shared-memory pools, for
+// encoders in another process.  NULL - in-process pools.
+void
+video_source_shm(const char *shmformat) {
+	if(gShmFormat != NULL)
+		free(gShmFormat);
+	gShmFormat = shmformat ? strdup(shmformat) : NULL;
+	return;
+}
+
+// the encoder side: registers the shared pools of a capture process under
+// the pipe names, and waits for channel 0 if the capture is not yet up.
+// returns the number of channels.
+int
+video_source_attach(const char *pipeformat, const char *shmformat) {
+	int idx, warned = 0;
+	//
+	for(idx = 0; idx < IMAGE_SOURCE_CHANNEL_MAX; idx++) {
+		struct vsource_config *config;
+		char pipename[64], shmname[64];
+		//
+		snprintf(shmname, sizeof(shmname), shmformat, idx);
+		if((gPipe[idx] = new pipeline()) == NULL) {
+			ga_error("image source: init pipeline failed.\n");
+			return -1;
+		}
+		while(gPipe[idx]->datapool_attach_shm(shmname, vsource_frame_fixup) < 0) {
+			if(idx > 0 || errno != ENOENT) {
+				delete gPipe[idx];
+				gPipe[idx] = NULL;
+				goto attached;
+			}
+			if(warned++ == 0)
+				ga_error("image source: waiting for the capture process (%s) ...\n", shmname);
+#ifdef WIN32
+			Sleep(1000);
+#else
+			sleep(1);
+#endif
+		}
+		config = (struct vsource_config*) gPipe[idx]->get_privdata();
+		if(config == NULL || gPipe[idx]->get_privdata_size() != sizeof(struct vsource_config)) {
+			ga_error("image source: no source configuration in '%s'.\n", shmname);
+			delete gPipe[idx];
+			gPipe[idx] = NULL;
+			return -1;
+		}
+		gWidth[idx] = config->width;
+		gHeight[idx] = config->height;
+		gStride[idx] = config->stride;
+		snprintf(pipename, sizeof(pipename), pipeformat, idx);
+		if(pipeline::do_register(pipename, gPipe[idx]) < 0) {
+			ga_error("image source: register pipeline failed (%s)\n",
+					pipename);
+			return -1;
+		}
+	}
+attached:
+	gChannels = idx;
+	return idx;
+}
+
 int
 video_source_setup(const char *pipeformat, int channel_id, int width, int height, int stride) {
 	vsource_config config;
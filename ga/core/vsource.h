@@ -50,6 +50,7 @@ struct vsource_config {
 	int width;
 	int height;
 	int stride;
+	int tier;	// simulcast tier, 0 - full resolution
 	// do not touch - filled by video_source_setup functions
 	int id;		// image source id
 };
@@ -65,5 +66,8 @@ EXPORT const char *video_source_pipename(int channel);
 
 EXPORT int video_source_setup_ex(const char *pipeformat, struct vsource_config *config, int nConfig);
 EXPORT int video_source_setup(const char *pipeformat, int channel_id, int width, int height, int stride);
+// capture and encoding in separate processes
+EXPORT void video_source_shm(const char *shmformat);
+EXPORT int video_source_attach(const char *pipeformat, const char *shmformat);
 
 #endif
@@ -180,7 +180,19 @@ aencoder_threadproc(void *arg) {
 	QueryPerformanceFrequency(&freq);
 #endif
 	//
-	while(encoder_running() > 0) {
+	while(true) {
+		// no clients: stay initialized until the linger period expires
+		if(encoder_running() == 0) {
+			// do not buffer audio while lingering
+			audio_source_client_unregister(ga_gettid());
+			if(encoder_linger_wait() == 0)
+				break;
+			audio_source_buffer_purge(ab);
+			audio_source_client_register(ga_gettid(), ab);
+			nsamples = 0;
+			samplebytes = 0;
+			ga_error("audio encoder: resumed (tid=%ld).\n", ga_gettid());
+		}
 		// read audio frames
 		r = audio_source_buffer_read(ab, samples + samplebytes, maxsamples - nsamples);
 		if(r <= 0) {
@@ -17,11 +17,14 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "vsource.h"
 #include "server.h"
 #include "rtspserver.h"
 #include "encoder-common.h"
+#include "encoder-sched.h"
+#include "governor.h"
 
 #include "ga-common.h"
 #include "ga-avcodec.h"
@@ -29,103 +32,625 @@
 
 #include "pipeline.h"
 
+using namespace std;
+
+#define	VENCODER_REINIT_AFTER	10	// seconds at a speed tier before its preset is applied
+
 MODULE EXPORT void * vencoder_threadproc(void *arg);
 
 static struct RTSPConf *rtspconf = NULL;
 
-void *
-vencoder_threadproc(void *arg) {
-	// arg is pointer to source pipe
-	// image info
-	int iid;
+// set (or add) a video-specific option
+static void
+vencoder_setopt(vector<string> *vso, const char *key, const char *value) {
+	unsigned i;
+	for(i = 0; i+1 < vso->size(); i += 2) {
+		if((*vso)[i] == key) {
+			(*vso)[i+1] = value;
+			return;
+		}
+	}
+	vso->push_back(key);
+	vso->push_back(value);
+	return;
+}
+
+// returns the value of a video-specific option, or NULL if not set
+static const char *
+vencoder_getopt(vector<string> *vso, const char *key) {
+	unsigned i;
+	for(i = 0; i+1 < vso->size(); i += 2) {
+		if((*vso)[i] == key)
+			return (*vso)[i+1].c_str();
+	}
+	return NULL;
+}
+
+// set options of a governor speed tier
+static void
+vencoder_speed_options(vector<string> *vso, int level) {
+	const struct governor_tier *t = governor_get_tier(level);
+	char buf[16];
+	vencoder_setopt(vso, "preset", t->preset);
+	snprintf(buf, sizeof(buf), "%d", t->subme);
+	vencoder_setopt(vso, "subq", buf);
+	vencoder_setopt(vso, "me_method", t->me);
+	snprintf(buf, sizeof(buf), "%d", t->refs);
+	vencoder_setopt(vso, "refs", buf);
+	snprintf(buf, sizeof(buf), "%d", t->slices);
+	vencoder_setopt(vso, "slices", buf);
+	return;
+}
+
+// update encoder options for the given bitrate, VBV size (0: unchanged), and preset
+static void
+vencoder_reconf_options(vector<string> *vso, int bitrate, int bufsize, const char *preset) {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%d", bitrate);
+	vencoder_setopt(vso, "b", buf);
+	if(bufsize > 0) {
+		// VBV takes effect only with a max rate
+		vencoder_setopt(vso, "maxrate", buf);
+		snprintf(buf, sizeof(buf), "%d", bufsize);
+		vencoder_setopt(vso, "bufsize", buf);
+	}
+	if(preset[0] != '\0') {
+		vencoder_setopt(vso, "preset", preset);
+	}
+	return;
+}
+
+// apply bitrate, VBV, and preset changes.
+// returns 0 if applied in place, 1 if the encoder has been re-initialized,
+// or -1 if the re-initialization failed (the current encoder is kept).
+static int
+vencoder_reconfigure(AVCodecContext **encoder, vector<string> *vso,
+		int width, int height, const struct encoder_reconf *reconf) {
+	AVCodecContext *newenc;
+	vector<string> saved = *vso;
+	int bitrate = (*encoder)->bit_rate;
+	int bufsize = (*encoder)->rc_buffer_size;
+	bool inplace = false;
+	//
+	if(reconf->bitrateKbps <= 0 && reconf->bufsize <= 0 && reconf->preset[0] == '\0')
+		return 0;
+	if(reconf->bitrateKbps > 0)
+		bitrate = reconf->bitrateKbps * 1000;
+	if(reconf->bufsize > 0)
+		bufsize = reconf->bufsize * 1000;
+	vencoder_reconf_options(vso, bitrate, bufsize, reconf->preset);
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55,0,100)
+	// libx264 reconfigures rate control in place on the next frame
+	if(reconf->preset[0] == '\0' && strcmp((*encoder)->codec->name, "libx264") == 0)
+		inplace = true;
+#endif
+	if(inplace) {
+		(*encoder)->bit_rate = bitrate;
+		if(bufsize > 0) {
+			(*encoder)->rc_buffer_size = bufsize;
+			(*encoder)->rc_max_rate = bitrate;
+		}
+		ga_error("video encoder: reconfigured in place (bitrate=%d, bufsize=%d).\n",
+			bitrate, bufsize);
+		return 0;
+	}
+	// otherwise, re-initialize the encoder
+	if((newenc = ga_avcodec_vencoder_init(NULL,
+			rtspconf->video_encoder_codec,
+			width, height,
+			rtspconf->video_fps, vso)) == NULL) {
+		ga_error("video encoder: reconfiguration failed, keep the current encoder.\n");
+		*vso = saved;
+		return -1;
+	}
+	ga_avcodec_close(*encoder);
+	av_free(*encoder);
+	*encoder = newenc;
+	ga_error("video encoder: re-initialized (bitrate=%d, bufsize=%d, preset=%s).\n",
+		bitrate, bufsize,
+		reconf->preset[0] != '\0' ? reconf->preset : "unchanged");
+	return 1;
+}
+
+// per-encoder state, shared by the dedicated thread and the worker pool
+struct vencoder_state {
+	pipeline *pipe;
 	int iwidth;
 	int iheight;
 	int rtp_id;
-	struct pooldata *data = NULL;
-	struct vsource_frame *frame = NULL;
-	pipeline *pipe = (pipeline*) arg;
-	//
-	unsigned char *src[] = { NULL, NULL, NULL, NULL };
-	int srcstride[] = { 0, 0, 0, 0 };
-	//
-	struct SwsContext *swsctx = NULL;
-	AVCodecContext *encoder = NULL;
+	int tier;
+	struct SwsContext *swsctx;
+	AVCodecContext *encoder;
+	vector<string> *vso;
+	// runtime reconfiguration
+	int outfps, fpsacc;
+	bool forceKey;
+	int openlevel;		// speed tier the encoder was opened with
+	int settled;		// frames encoded since the last tier switch
+	bool described;		// headers published since the encoder was (re)opened
 	//
-	AVFrame *pic_in = NULL;
-	unsigned char *pic_in_buf = NULL;
+	AVFrame *pic_in;
+	unsigned char *pic_in_buf;
 	int pic_in_size;
-	unsigned char *nalbuf = NULL, *nalbuf_a = NULL;
-	int nalbuf_size = 0, nalign = 0;
-	long long basePts = -1LL, newpts = 0LL, pts = -1LL, ptsSync = 0LL;
-	pthread_mutex_t condMutex = PTHREAD_MUTEX_INITIALIZER;
-	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-	//
-	int video_written = 0;
+	unsigned char *nalbuf, *nalbuf_a;
+	int nalbuf_size;
+	long long basePts, newpts, pts, ptsSync;
+	long long ptsoffset;	// frames re-encoded: the encoder sees pts + ptsoffset
+	// encode-time governor
+	bool governed;
+	struct governor gov;
+	long long encode_avg;	// smoothed encoding time, in us
+	int frames;
+	// frame size cap
+	bool capvbv;		// the VBV is sized by the cap
+	unsigned int sizehist[ENCODER_SIZE_BUCKETS];
+	unsigned int capped;
+	unsigned int reencoded;
 	//
-	if(pipe == NULL) {
-		ga_error("video encoder: NULL pipeline specified.\n");
-		goto video_quit;
+	int video_written;
+};
+
+// VBV buffer (in bits) that holds frames up to the cap
+static int
+vencoder_cap_bufsize(int bitrate, int fps) {
+	return (int) ((long long) rtspconf->video_frame_cap * bitrate / fps);
+}
+
+static void
+vencoder_close(struct vencoder_state *st) {
+	if(st->frames > 0) {
+		ga_error("video encoder: channel %d tier %d frame sizes (x average) <1/2:%u <1:%u <2:%u <4:%u <8:%u more:%u, %u over the cap, %u keyframes re-encoded.\n",
+			st->rtp_id, st->tier,
+			st->sizehist[0], st->sizehist[1], st->sizehist[2],
+			st->sizehist[3], st->sizehist[4], st->sizehist[5],
+			st->capped, st->reencoded);
 	}
+	if(st->pic_in_buf)	av_free(st->pic_in_buf);
+	if(st->pic_in)		av_free(st->pic_in);
+	if(st->nalbuf)		free(st->nalbuf);
+	if(st->swsctx)		sws_freeContext(st->swsctx);
+	if(st->encoder)		ga_avcodec_close(st->encoder);
+	if(st->vso)		delete st->vso;
+	delete st;
+	return;
+}
+
+static struct vencoder_state *
+vencoder_open(pipeline *pipe) {
+	struct vencoder_state *st;
+	struct encoder_reconf reconf;
+	int iid, nalign = 0;
+	//
+	st = new vencoder_state;
+	bzero(st, sizeof(*st));
+	st->pipe = pipe;
+	st->basePts = -1LL;
+	st->pts = -1LL;
 	//
 	rtspconf = rtspconf_global();
 	// init variables
 	iid = ((struct vsource_config*) pipe->get_privdata())->id;
-	iwidth = video_source_width(iid);
-	iheight = video_source_height(iid);
-	rtp_id = ((struct vsource_config*) pipe->get_privdata())->rtp_id;
-	ga_error("video encoder: image source from '%s' (%dx%d) via channel %d.\n",
-		pipe->name(), iwidth, iheight, rtp_id);
+	st->iwidth = video_source_width(iid);
+	st->iheight = video_source_height(iid);
+	st->rtp_id = ((struct vsource_config*) pipe->get_privdata())->rtp_id;
+	// simulcast tiers come downscaled
+	st->tier = ((struct vsource_config*) pipe->get_privdata())->tier;
+	if(st->tier > 0) {
+		st->iwidth = ((struct vsource_config*) pipe->get_privdata())->width;
+		st->iheight = ((struct vsource_config*) pipe->get_privdata())->height;
+	}
+	ga_error("video encoder: image source from '%s' (%dx%d) via channel %d, tier %d.\n",
+		pipe->name(), st->iwidth, st->iheight, st->rtp_id, st->tier);
 	//
 #ifdef __APPLE__
-	swsctx = ga_swscale_init(PIX_FMT_RGBA, iwidth, iheight, iwidth, iheight);
+	st->swsctx = ga_swscale_init(PIX_FMT_RGBA, st->iwidth, st->iheight, st->iwidth, st->iheight);
 #else
-	swsctx = ga_swscale_init(PIX_FMT_BGRA, iwidth, iheight, iwidth, iheight);
+	st->swsctx = ga_swscale_init(PIX_FMT_BGRA, st->iwidth, st->iheight, st->iwidth, st->iheight);
 #endif
-	if(swsctx == NULL) {
+	if(st->swsctx == NULL) {
 		ga_error("video encoder: cannot initialize swsscale.\n");
-		goto video_quit;
+		goto open_failed;
+	}
+	// a private copy of options, which can be changed at runtime
+	st->vso = new vector<string>(*rtspconf->vso);
+	st->outfps = rtspconf->video_fps;
+	// the worker pool already spreads encoders over the processors
+	if(encoder_sched_workers() > 0) {
+		vencoder_setopt(st->vso, "threads", "1");
+	}
+	if(st->tier > 0) {
+		vencoder_reconf_options(st->vso, rtspconf->video_tier_bitrate[st->tier], 0, "");
+	}
+	// a request queued before start-up, e.g., a probed bitrate, applies to the first frame
+	// simulcast tiers keep their configured bitrates
+	if(st->tier == 0 && encoder_reconf_fetch(st->rtp_id, &reconf) > 0) {
+		if(reconf.framerate > 0) {
+			st->outfps = reconf.framerate < rtspconf->video_fps ?
+				reconf.framerate : rtspconf->video_fps;
+		}
+		vencoder_reconf_options(st->vso,
+			reconf.bitrateKbps > 0 ? reconf.bitrateKbps * 1000 : rtspconf->video_bitrate,
+			reconf.bufsize * 1000, reconf.preset);
+	}
+	// the governor starts from the configured preset, if it is a speed tier
+	if(rtspconf->governor_enable) {
+		int level = governor_find(vencoder_getopt(st->vso, "preset"));
+		if(level < 0)
+			level = 0;
+		vencoder_speed_options(st->vso, level);
+		governor_init(&st->gov, rtspconf->video_fps, rtspconf->governor_budget, level);
+		st->openlevel = level;
+		st->governed = true;
 	}
-	encoder = ga_avcodec_vencoder_init(
+	// with a cap, the rate control raises QP before a frame overflows the VBV
+	if(rtspconf->video_frame_cap > 0 && vencoder_getopt(st->vso, "bufsize") == NULL) {
+		const char *b = vencoder_getopt(st->vso, "b");
+		int bitrate = b != NULL ? strtol(b, NULL, 0) : rtspconf->video_bitrate;
+		vencoder_reconf_options(st->vso, bitrate,
+			vencoder_cap_bufsize(bitrate, st->outfps), "");
+		st->capvbv = true;
+	}
+	st->encoder = ga_avcodec_vencoder_init(
 			NULL,
 			rtspconf->video_encoder_codec,
-			iwidth, iheight,
+			st->iwidth, st->iheight,
 			rtspconf->video_fps,
-			rtspconf->vso);
-	if(encoder == NULL) {
+			st->vso);
+	if(st->encoder == NULL) {
 		ga_error("video encoder: cannot initialized the encoder.\n");
-		goto video_quit;
+		goto open_failed;
 	}
 	//
-	nalbuf_size = 100000+12 * iwidth * iheight;
-	if(ga_malloc(nalbuf_size, (void**) &nalbuf, &nalign) < 0) {
+	st->nalbuf_size = 100000+12 * st->iwidth * st->iheight;
+	if(ga_malloc(st->nalbuf_size, (void**) &st->nalbuf, &nalign) < 0) {
 		ga_error("video encoder: buffer allocation failed, terminated.\n");
-		goto video_quit;
+		goto open_failed;
 	}
-	nalbuf_a = nalbuf + nalign;
+	st->nalbuf_a = st->nalbuf + nalign;
 	//
-	if((pic_in = avcodec_alloc_frame()) == NULL) {
+	if((st->pic_in = avcodec_alloc_frame()) == NULL) {
 		ga_error("video encoder: picture allocation failed, terminated.\n");
-		goto video_quit;
+		goto open_failed;
 	}
-	pic_in_size = avpicture_get_size(PIX_FMT_YUV420P, iwidth, iheight);
-	if((pic_in_buf = (unsigned char*) av_malloc(pic_in_size)) == NULL) {
+	st->pic_in_size = avpicture_get_size(PIX_FMT_YUV420P, st->iwidth, st->iheight);
+	if((st->pic_in_buf = (unsigned char*) av_malloc(st->pic_in_size)) == NULL) {
 		ga_error("video encoder: picture buffer allocation failed, terminated.\n");
-		goto video_quit;
+		goto open_failed;
 	}
-	avpicture_fill((AVPicture*) pic_in, pic_in_buf,
-			PIX_FMT_YUV420P, iwidth, iheight);
-	//ga_error("video encoder: linesize = %d|%d|%d\n", pic_in->linesize[0], pic_in->linesize[1], pic_in->linesize[2]);
-	// start encoding
-	ga_error("video encoding started: tid=%ld %dx%d@%dfps, nalbuf_size=%d, pic_in_size=%d.\n",
-		ga_gettid(),
-		iwidth, iheight, rtspconf->video_fps,
-		nalbuf_size, pic_in_size);
+	avpicture_fill((AVPicture*) st->pic_in, st->pic_in_buf,
+			PIX_FMT_YUV420P, st->iwidth, st->iheight);
+	//ga_error("video encoder: linesize = %d|%d|%d\n", st->pic_in->linesize[0], st->pic_in->linesize[1], st->pic_in->linesize[2]);
+	return st;
+open_failed:
+	vencoder_close(st);
+	return NULL;
+}
+
+// re-initialize the encoder with the options of a governor speed tier
+static int
+vencoder_set_preset(struct vencoder_state *st, int level) {
+	struct encoder_reconf reconf;
+	vector<string> saved = *st->vso;
+	//
+	vencoder_speed_options(st->vso, level);
+	bzero(&reconf, sizeof(reconf));
+	strncpy(reconf.preset, governor_get_tier(level)->preset, ENCODER_PRESET_MAXLEN);
+	reconf.preset[ENCODER_PRESET_MAXLEN-1] = '\0';
+	if(vencoder_reconfigure(&st->encoder, st->vso, st->iwidth, st->iheight, &reconf) < 0) {
+		*st->vso = saved;
+		return -1;
+	}
+	st->openlevel = level;
+	st->forceKey = true;
+	st->described = false;
+	return 0;
+}
+
+// switch to a governor speed tier.  the encoder is over its budget when the
+// governor asks for a faster tier: it is re-initialized at once.  a slower
+// tier is applied once it has settled, see vencoder_encode(), so that a
+// governor going back and forth does not force a keyframe at every step.
+static int
+vencoder_set_speed(struct vencoder_state *st, int level) {
+	st->settled = 0;
+	if(level >= st->openlevel)
+		return 0;
+	return vencoder_set_preset(st, level);
+}
+
+// average frame size, in bytes, at the current bitrate and output frame rate
+static int
+vencoder_frame_budget(struct vencoder_state *st) {
+	return st->encoder->bit_rate / 8 / st->outfps;
+}
+
+// add a frame to the size histogram
+static void
+vencoder_size_account(struct vencoder_state *st, int size, int framecap) {
+	int i, budget = vencoder_frame_budget(st);
+	long long limit = budget / 2;
+	//
+	if(budget <= 0)
+		return;
+	for(i = 0; i < ENCODER_SIZE_BUCKETS-1; i++, limit *= 2) {
+		if(size < limit)
+			break;
+	}
+	st->sizehist[i]++;
+	if(framecap > 0 && size > framecap) {
+		st->capped++;
+	}
+	return;
+}
+
+// free unused side-data
+static void
+vencoder_free_side_data(AVPacket *pkt) {
+	if(pkt->side_data_elems > 0) {
+		int i;
+		for (i = 0; i < pkt->side_data_elems; i++)
+			av_free(pkt->side_data[i].data);
+		av_freep(&pkt->side_data);
+		pkt->side_data_elems = 0;
+	}
+	return;
+}
+
+// publish statistics of the encoder
+static void
+vencoder_stats(struct vencoder_state *st) {
+	struct encoder_stats stats;
+	const char *preset = vencoder_getopt(st->vso, "preset");
+	//
+	bzero(&stats, sizeof(stats));
+	stats.speed = st->governed ? st->gov.level : -1;
+	if(preset != NULL) {
+		strncpy(stats.preset, preset, ENCODER_PRESET_MAXLEN);
+		stats.preset[ENCODER_PRESET_MAXLEN-1] = '\0';
+	}
+	stats.encode_us = (int) st->encode_avg;
+	stats.budget_us = st->governed ? (int) st->gov.budget : 0;
+	memcpy(stats.sizehist, st->sizehist, sizeof(stats.sizehist));
+	stats.capped = st->capped;
+	stats.reencoded = st->reencoded;
+	encoder_stats_update(st->rtp_id, st->tier, &stats);
+	return;
+}
+
+// encode one frame, and release it.  returns -1 if the encoder must terminate
+static int
+vencoder_encode(void *arg, struct pooldata *data) {
+	struct vencoder_state *st = (struct vencoder_state*) arg;
+	struct vsource_frame *frame = (struct vsource_frame*) data->ptr;
+	struct encoder_reconf reconf;
+	unsigned char *src[] = { NULL, NULL, NULL, NULL };
+	int srcstride[] = { 0, 0, 0, 0 };
+	AVPacket pkt;
+	unsigned char headers[1024];
+	int got_packet = 0;
+	int level, framecap, n;
+	bool reencoded = false;
+	struct timeval tv1, tv2;
+	long long encode_us;
+	// simulcast: no need to encode a tier nobody receives
+	if(rtspconf->video_tiers > 1 && encoder_tier_active(st->rtp_id, st->tier) == 0) {
+		st->pipe->release_data(data);
+		return 0;
+	}
+	// handle pts
+	if(st->basePts == -1LL) {
+		st->basePts = frame->imgpts;
+		st->ptsSync = encoder_pts_sync(rtspconf->video_fps);
+		st->newpts = st->ptsSync;
+	} else {
+		st->newpts = st->ptsSync + frame->imgpts - st->basePts;
+	}
+	// apply pending reconfiguration between frames
+	if(st->tier == 0 && encoder_reconf_fetch(st->rtp_id, &reconf) > 0) {
+		if(reconf.framerate > 0) {
+			st->outfps = reconf.framerate < rtspconf->video_fps ?
+				reconf.framerate : rtspconf->video_fps;
+			st->fpsacc = 0;
+			ga_error("video encoder: output frame rate = %d fps.\n", st->outfps);
+		}
+		// a preset set by hand restarts the governor from there
+		if(st->governed && reconf.preset[0] != '\0') {
+			int level = governor_find(reconf.preset);
+			if(level < 0) {
+				st->governed = false;
+				ga_error("video encoder: preset '%s' is not a speed tier, governor disabled.\n",
+					reconf.preset);
+			} else {
+				vencoder_speed_options(st->vso, level);
+				governor_init(&st->gov, rtspconf->video_fps, rtspconf->governor_budget, level);
+				st->openlevel = level;
+				st->settled = 0;
+			}
+		}
+		// keep the VBV in line with the cap
+		if(st->capvbv && reconf.bitrateKbps > 0 && reconf.bufsize <= 0) {
+			reconf.bufsize = vencoder_cap_bufsize(reconf.bitrateKbps, st->outfps);
+			if(reconf.bufsize <= 0)
+				reconf.bufsize = 1;
+		}
+		if(vencoder_reconfigure(&st->encoder, st->vso, st->iwidth, st->iheight, &reconf) > 0) {
+			// the switch point must be decodable
+			st->forceKey = true;
+			st->described = false;
+		}
+	}
+	// reduce frame rate by dropping frames evenly
+	if(st->outfps < rtspconf->video_fps) {
+		st->fpsacc += st->outfps;
+		if(st->fpsacc < rtspconf->video_fps) {
+			st->pipe->release_data(data);
+			return 0;
+		}
+		st->fpsacc -= rtspconf->video_fps;
+	}
+	// scale image
+	if(frame->imgtype == rgba) {
+		src[0] = frame->imgbuf;
+		src[1] = NULL;
+		srcstride[0] = frame->stride;
+		srcstride[1] = 0;
+		sws_scale(st->swsctx, src, srcstride, 0, st->iheight,
+			st->pic_in->data, st->pic_in->linesize);
+	} else if(frame->imgtype == yuv420p) {
+		// assume format is equivalent
+		if(st->pic_in->linesize[0] == frame->linesize[0]
+		&& st->pic_in->linesize[1] == frame->linesize[1]
+		&& st->pic_in->linesize[2] == frame->linesize[2]) {
+			bcopy(frame->imgbuf, st->pic_in_buf, st->pic_in_size);
+		} else {
+			ga_error("video encoder: YUV mode failed - mismatched linesize(s) (src:%d,%d,%d; dst:%d,%d,%d)\n",
+				frame->linesize[0], frame->linesize[1], frame->linesize[2],
+				st->pic_in->linesize[0], st->pic_in->linesize[1], st->pic_in->linesize[2]);
+			st->pipe->release_data(data);
+			return -1;
+		}
+	}
+	st->pipe->release_data(data);
+	// pts must be monotonically increasing
+	if(st->newpts > st->pts) {
+		st->pts = st->newpts;
+	} else {
+		st->pts++;
+	}
+	// encode
+	st->pic_in->pts = st->pts + st->ptsoffset;
+	if(st->forceKey) {
+		st->forceKey = false;
+		st->pic_in->pict_type = AV_PICTURE_TYPE_I;
+	} else if(encoder_keyframe_check(st->rtp_id, st->tier)) {
+		st->pic_in->pict_type = AV_PICTURE_TYPE_I;
+		ga_error("video encoder: keyframe requested (pts=%lld).\n", st->pts);
+	} else {
+		st->pic_in->pict_type = AV_PICTURE_TYPE_NONE;
+	}
+	framecap = rtspconf->video_frame_cap * vencoder_frame_budget(st);
+	gettimeofday(&tv1, NULL);
+	while(true) {
+		av_init_packet(&pkt);
+		pkt.data = st->nalbuf_a;
+		pkt.size = st->nalbuf_size;
+		if(avcodec_encode_video2(st->encoder, &pkt, st->pic_in, &got_packet) < 0) {
+			ga_error("video encoder: encode failed, terminated.\n");
+			return -1;
+		}
+		if(got_packet == 0 || framecap <= 0 || pkt.size <= framecap
+		|| encoder_packet_idr(st->encoder->codec_id, &pkt) == 0
+		|| pkt.pts != st->pic_in->pts || reencoded)
+			break;
+		// a keyframe references nothing, so it can be dropped and encoded
+		// again: the rate control, with its VBV drained, picks a higher QP
+		ga_error("video encoder: keyframe of %d bytes over the cap (%d bytes), re-encoding.\n",
+			pkt.size, framecap);
+		vencoder_free_side_data(&pkt);
+		reencoded = true;
+		st->reencoded++;
+		// the encoder wants increasing pts, the stream keeps the original
+		st->pic_in->pts = st->pts + ++st->ptsoffset;
+		st->pic_in->pict_type = AV_PICTURE_TYPE_I;
+	}
+	gettimeofday(&tv2, NULL);
+	encode_us = tvdiff_us(&tv2, &tv1);
+	st->encode_avg = st->frames == 0 ? encode_us : (7 * st->encode_avg + encode_us) / 8;
+	if(++st->frames % rtspconf->video_fps == 0) {
+		vencoder_stats(st);
+	}
+	if(got_packet) {
+		if(pkt.pts == (int64_t) AV_NOPTS_VALUE) {
+			pkt.pts = st->pts;
+		} else {
+			pkt.pts -= st->ptsoffset;
+		}
+		if(pkt.dts != (int64_t) AV_NOPTS_VALUE)
+			pkt.dts -= st->ptsoffset;
+		vencoder_size_account(st, pkt.size, framecap);
+		pkt.stream_index = 0;
+		// the parameters in use, for new sessions, the recorder, and the SDP
+		if(st->described == false
+		&& (n = encoder_packet_headers(st->encoder->codec_id, &pkt, headers, sizeof(headers))) > 0) {
+			rtsp_codec_refresh(st->rtp_id, st->tier, headers, n, st->iwidth, st->iheight);
+			st->described = true;
+		}
+		// send the packet
+		if(encoder_send_packet_tier("video-encoder",
+			st->rtp_id/*rtspconf->video_id*/, st->tier, &pkt,
+			pkt.pts) < 0) {
+			return -1;
+		}
+		vencoder_free_side_data(&pkt);
+		//
+		if(st->video_written == 0) {
+			st->video_written = 1;
+			ga_error("first video frame written (pts=%lld)\n", st->pts);
+		}
+	}
+	// the new speed tier applies from the next frame
+	if(st->governed && (level = governor_update(&st->gov, encode_us)) >= 0) {
+		ga_error("video encoder: channel %d tier %d, %lld us per frame (budget %lld us), speed tier -> %d (%s).\n",
+			st->rtp_id, st->tier, st->encode_avg, st->gov.budget,
+			level, governor_get_tier(level)->preset);
+		if(vencoder_set_speed(st, level) < 0) {
+			st->governed = false;
+			ga_error("video encoder: speed tier switch failed, governor disabled.\n");
+		}
+		vencoder_stats(st);
+	} else if(st->governed && st->gov.level != st->openlevel
+	&& ++st->settled >= rtspconf->video_fps * VENCODER_REINIT_AFTER) {
+		// the slower tier has settled: re-initialize with its options
+		ga_error("video encoder: channel %d tier %d, speed tier %d settled, preset -> %s.\n",
+			st->rtp_id, st->tier, st->gov.level,
+			governor_get_tier(st->gov.level)->preset);
+		if(vencoder_set_preset(st, st->gov.level) < 0) {
+			st->governed = false;
+			ga_error("video encoder: speed tier switch failed, governor disabled.\n");
+		}
+	}
+	return 0;
+}
+
+// with a worker pool, this thread only owns the encoder: frames are encoded by the pool
+static void
+vencoder_run_pooled(struct vencoder_state *st) {
+	struct encoder_sched_job *job;
+	//
+	if((job = encoder_sched_attach(st->pipe, rtspconf->video_fps, vencoder_encode, st)) == NULL) {
+		ga_error("video encoder: cannot attach to the worker pool.\n");
+		return;
+	}
+	// no clients: stay initialized until the linger period expires
+	while(encoder_sched_wait(job) == 0 && encoder_linger_wait() != 0) {
+		// drop frames captured before lingering
+		encoder_sched_flush(job);
+		ga_error("video encoder: resumed (tid=%ld).\n", ga_gettid());
+	}
+	encoder_sched_detach(job);
+	return;
+}
+
+static void
+vencoder_run(struct vencoder_state *st) {
+	struct pooldata *data = NULL;
+	pipeline *pipe = st->pipe;
+	pthread_mutex_t condMutex = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 	//
 	pipe->client_register(ga_gettid(), &cond);
 	//
-	while(encoder_running() > 0) {
-		AVPacket pkt;
-		int got_packet = 0;
+	while(true) {
+		// no clients: stay initialized until the linger period expires
+		if(encoder_running() == 0) {
+			if(encoder_linger_wait() == 0)
+				break;
+			// drop frames captured before lingering
+			while((data = pipe->load_data()) != NULL) {
+				pipe->release_data(data);
+			}
+			ga_error("video encoder: resumed (tid=%ld).\n", ga_gettid());
+		}
 		// wait for notification
 		data = pipe->load_data();
 		if(data == NULL) {
@@ -147,94 +672,42 @@ vencoder_threadproc(void *arg) {
 				continue;
 			}
 		}
-		frame = (struct vsource_frame*) data->ptr;
-		// handle pts
-		if(basePts == -1LL) {
-			basePts = frame->imgpts;
-			ptsSync = encoder_pts_sync(rtspconf->video_fps);
-			newpts = ptsSync;
-		} else {
-			newpts = ptsSync + frame->imgpts - basePts;
-		}
-		// scale image
-		if(frame->imgtype == rgba) {
-			src[0] = frame->imgbuf;
-			src[1] = NULL;
-			srcstride[0] = frame->stride;
-			srcstride[1] = 0;
-			sws_scale(swsctx, src, srcstride, 0, iheight,
-				pic_in->data, pic_in->linesize);
-		} else if(frame->imgtype == yuv420p) {
-			// assume format is equivalent
-			if(pic_in->linesize[0] == frame->linesize[0]
-			&& pic_in->linesize[1] == frame->linesize[1]
-			&& pic_in->linesize[2] == frame->linesize[2]) {
-				bcopy(frame->imgbuf, pic_in_buf, pic_in_size);
-			} else {
-				ga_error("video encoder: YUV mode failed - mismatched linesize(s) (src:%d,%d,%d; dst:%d,%d,%d)\n",
-					frame->linesize[0], frame->linesize[1], frame->linesize[2],
-					pic_in->linesize[0], pic_in->linesize[1], pic_in->linesize[2]);
-				pipe->release_data(data);
-				goto video_quit;
-			}
-		}
-		pipe->release_data(data);
-		// pts must be monotonically increasing
-		if(newpts > pts) {
-			pts = newpts;
-		} else {
-			pts++;
-		}
-		// encode
-		pic_in->pts = pts;
-		av_init_packet(&pkt);
-		pkt.data = nalbuf_a;
-		pkt.size = nalbuf_size;
-		if(avcodec_encode_video2(encoder, &pkt, pic_in, &got_packet) < 0) {
-			ga_error("video encoder: encode failed, terminated.\n");
-			goto video_quit;
-		}
-		if(got_packet) {
-			if(pkt.pts == (int64_t) AV_NOPTS_VALUE) {
-				pkt.pts = pts;
-			}
-			pkt.stream_index = 0;
-			// send the packet
-			if(encoder_send_packet_all("video-encoder",
-				rtp_id/*rtspconf->video_id*/, &pkt,
-				pkt.pts) < 0) {
-				goto video_quit;
-			}
-			// free unused side-data
-			if(pkt.side_data_elems > 0) {
-				int i;
-				for (i = 0; i < pkt.side_data_elems; i++)
-					av_free(pkt.side_data[i].data);
-				av_freep(&pkt.side_data);
-				pkt.side_data_elems = 0;
-			}
-			//
-			if(video_written == 0) {
-				video_written = 1;
-				ga_error("first video frame written (pts=%lld)\n", pts);
-			}
-		}
+		if(vencoder_encode(st, data) < 0)
+			break;
 	}
 	//
-video_quit:
-	if(pipe) {
-		pipe->client_unregister(ga_gettid());
-		pipe = NULL;
+	pipe->client_unregister(ga_gettid());
+	return;
+}
+
+void *
+vencoder_threadproc(void *arg) {
+	// arg is pointer to source pipe
+	pipeline *pipe = (pipeline*) arg;
+	struct vencoder_state *st;
+	//
+	if(pipe == NULL) {
+		ga_error("video encoder: NULL pipeline specified.\n");
+		goto video_quit;
 	}
+	if((st = vencoder_open(pipe)) == NULL) {
+		goto video_quit;
+	}
+	// start encoding
+	ga_error("video encoding started: tid=%ld %dx%d@%dfps, nalbuf_size=%d, pic_in_size=%d.\n",
+		ga_gettid(),
+		st->iwidth, st->iheight, rtspconf->video_fps,
+		st->nalbuf_size, st->pic_in_size);
 	//
-	if(pic_in_buf)	av_free(pic_in_buf);
-	if(pic_in)	av_free(pic_in);
-	if(nalbuf)	free(nalbuf);
-	if(swsctx)	sws_freeContext(swsctx);
-	if(encoder)	ga_avcodec_close(encoder);
+	if(encoder_sched_workers() > 0) {
+		vencoder_run_pooled(st);
+	} else {
+		vencoder_run(st);
+	}
+	vencoder_close(st);
 	//
+video_quit:
 	ga_error("video encoder: thread terminated (tid=%ld).\n", ga_gettid());
 	//
 	return NULL;
 }
-
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <map>
+
+#include "vsource.h"
+#include "rtspconf.h"
+#include "encoder-common.h"
+
+#include "ga-common.h"
+#include "ga-avcodec.h"
+
+#include "pipeline.h"
+#include "filter-downscale.h"
+
+#define	POOLSIZE	8
+
+using namespace std;
+static pthread_mutex_t initMutex = PTHREAD_MUTEX_INITIALIZER;
+static map<void*,bool> initialized;
+
+int
+filter_downscale_init(void *arg) {
+	const char **filterpipe = (const char **) arg;
+	pipeline *srcpipe = pipeline::lookup(filterpipe[0]);
+	pipeline *pipe = NULL;
+	struct pooldata *data = NULL;
+	struct RTSPConf *rtspconf = rtspconf_global();
+	struct vsource_config config;
+	int tier, width, height;
+	//
+	map<void*,bool>::iterator mi;
+	pthread_mutex_lock(&initMutex);
+	if((mi = initialized.find(arg)) != initialized.end()) {
+		if(mi->second != false) {
+			// has been initialized
+			pthread_mutex_unlock(&initMutex);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&initMutex);
+	//
+	if(srcpipe == NULL) {
+		ga_error("downscale filter: init - NULL pipeline specified (%s).\n", filterpipe[0]);
+		goto init_failed;
+	}
+	if(srcpipe->get_privdata_size() != sizeof(struct vsource_config)) {
+		ga_error("downscale filter: init - pipeline '%s' is not an image pipeline.\n", filterpipe[0]);
+		goto init_failed;
+	}
+	//
+	for(tier = 1; filterpipe[tier] != NULL; tier++) {
+		if(tier >= rtspconf->video_tiers) {
+			ga_error("downscale filter: tier %d is not configured.\n", tier);
+			goto init_failed;
+		}
+		width = rtspconf->video_tier_width[tier];
+		height = rtspconf->video_tier_height[tier];
+		//
+		if((pipe = new pipeline()) == NULL) {
+			ga_error("downscale filter: init pipeline failed.\n");
+			goto init_failed;
+		}
+		// same source, smaller pictures
+		bcopy(srcpipe->get_privdata(), &config, sizeof(config));
+		config.width = width;
+		config.height = height;
+		config.stride = width;
+		config.tier = tier;
+		if(pipe->alloc_privdata(sizeof(config)) == NULL) {
+			ga_error("downscale filter: cannot allocate privdata.\n");
+			goto init_failed;
+		}
+		pipe->set_privdata(&config, sizeof(config));
+		//
+		if((data = pipe->datapool_init(POOLSIZE, sizeof(struct vsource_frame))) == NULL) {
+			ga_error("downscale filter: cannot allocate data pool.\n");
+			goto init_failed;
+		}
+		// per frame init: room for a YUV420P picture
+		for(; data != NULL; data = data->next) {
+			if(vsource_frame_init((struct vsource_frame*) data->ptr, width, height*3/2, width) == NULL) {
+				ga_error("downscale filter: init frame failed.\n");
+				goto init_failed;
+			}
+		}
+		//
+		if(pipeline::do_register(filterpipe[tier], pipe) < 0) {
+			ga_error("downscale filter: register pipeline failed (%s).\n", filterpipe[tier]);
+			goto init_failed;
+		}
+		pipe = NULL;
+	}
+	//
+	pthread_mutex_lock(&initMutex);
+	initialized[arg] = true;
+	pthread_mutex_unlock(&initMutex);
+	//
+	return 0;
+init_failed:
+	if(pipe) {
+		delete pipe;
+	}
+	return -1;
+}
+
+// planes of a YUV420P frame
+static void
+yuv420p_planes(struct vsource_frame *frame, int height, unsigned char **planes, int *linesize) {
+	planes[0] = frame->imgbuf;
+	planes[1] = planes[0] + height * frame->linesize[0];
+	planes[2] = planes[1] + (height>>1) * frame->linesize[1];
+	planes[3] = NULL;
+	linesize[0] = frame->linesize[0];
+	linesize[1] = frame->linesize[1];
+	linesize[2] = frame->linesize[2];
+	linesize[3] = 0;
+	return;
+}
+
+void *
+filter_downscale_threadproc(void *arg) {
+	// arg is pointer to source pipe
+	const char **filterpipe = (const char **) arg;
+	pipeline *srcpipe = pipeline::lookup(filterpipe[0]);
+	pipeline *dstpipe[RTSPCONF_TIER_MAX];
+	struct pooldata *srcdata = NULL;
+	struct pooldata *dstdata[RTSPCONF_TIER_MAX];
+	struct vsource_frame *srcframe = NULL;
+	struct vsource_frame *dstframe = NULL;
+	struct RTSPConf *rtspconf = rtspconf_global();
+	// tier 0 is the source
+	int width[RTSPCONF_TIER_MAX];
+	int height[RTSPCONF_TIER_MAX];
+	struct SwsContext *swsctx[RTSPCONF_TIER_MAX];
+	int tiers, last, i, channel;
+	//
+	unsigned char *src[] = { NULL, NULL, NULL, NULL };
+	unsigned char *dst[] = { NULL, NULL, NULL, NULL };
+	int srcstride[] = { 0, 0, 0, 0 };
+	int dststride[] = { 0, 0, 0, 0 };
+	//
+	pthread_mutex_t condMutex = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	//
+	bzero(dstpipe, sizeof(dstpipe));
+	bzero(swsctx, sizeof(swsctx));
+	if(srcpipe == NULL) {
+		ga_error("downscale filter: NULL pipeline specified.\n");
+		goto filter_quit;
+	}
+	i = ((struct vsource_config*) srcpipe->get_privdata())->id;
+	channel = ((struct vsource_config*) srcpipe->get_privdata())->rtp_id;
+	width[0] = video_source_width(i);
+	height[0] = video_source_height(i);
+	// each tier is scaled from the previous (larger) one
+	for(tiers = 1; filterpipe[tiers] != NULL && tiers < rtspconf->video_tiers; tiers++) {
+		if((dstpipe[tiers] = pipeline::lookup(filterpipe[tiers])) == NULL) {
+			ga_error("downscale filter: cannot find pipeline '%s'\n", filterpipe[tiers]);
+			goto filter_quit;
+		}
+		width[tiers] = rtspconf->video_tier_width[tiers];
+		height[tiers] = rtspconf->video_tier_height[tiers];
+		if((swsctx[tiers] = sws_getContext(
+				width[tiers-1], height[tiers-1], PIX_FMT_YUV420P,
+				width[tiers], height[tiers], PIX_FMT_YUV420P,
+				SWS_FAST_BILINEAR, NULL, NULL, NULL)) == NULL) {
+			ga_error("downscale filter: cannot initialize swsscale (tier %d).\n", tiers);
+			goto filter_quit;
+		}
+		ga_error("downscale filter: pipe from '%s' to '%s' (%dx%d -> %dx%d)\n",
+			srcpipe->name(), dstpipe[tiers]->name(),
+			width[tiers-1], height[tiers-1], width[tiers], height[tiers]);
+	}
+	//
+	srcpipe->client_register(ga_gettid(), &cond);
+	// start filtering
+	ga_error("downscale filter started: tid=%ld, %d tier(s).\n", ga_gettid(), tiers-1);
+	//
+	while(true) {
+		// wait for notification
+		srcdata = srcpipe->load_data();
+		if(srcdata == NULL) {
+			srcpipe->wait(&cond, &condMutex);
+			srcdata = srcpipe->load_data();
+			if(srcdata == NULL) {
+				ga_error("downscale filter: unexpected NULL frame received (from '%s', data=%d, buf=%d).\n",
+					srcpipe->name(), srcpipe->data_count(), srcpipe->buf_count());
+				continue;
+			}
+		}
+		srcframe = (struct vsource_frame*) srcdata->ptr;
+		if(srcframe->imgtype != yuv420p) {
+			ga_error("downscale filter: YUV420P source required, terminated.\n");
+			srcpipe->release_data(srcdata);
+			goto filter_quit;
+		}
+		// scale no further than the smallest tier a client receives: the
+		// encoders of idle tiers stay attached to their pipes
+		for(last = tiers-1; last > 0 && encoder_tier_active(channel, last) == 0; last--)
+			;
+		yuv420p_planes(srcframe, height[0], src, srcstride);
+		for(i = 1; i <= last; i++) {
+			dstdata[i] = dstpipe[i]->allocate_data();
+			dstframe = (struct vsource_frame*) dstdata[i]->ptr;
+			dstframe->imgpts = srcframe->imgpts;
+			dstframe->imgtype = yuv420p;
+			dstframe->linesize[0] = width[i];
+			dstframe->linesize[1] = width[i]>>1;
+			dstframe->linesize[2] = width[i]>>1;
+			dstframe->linesize[3] = 0;
+			yuv420p_planes(dstframe, height[i], dst, dststride);
+			sws_scale(swsctx[i], src, srcstride, 0, height[i-1], dst, dststride);
+			// the next tier scales from this one
+			bcopy(dst, src, sizeof(src));
+			bcopy(dststride, srcstride, sizeof(srcstride));
+		}
+		srcpipe->release_data(srcdata);
+		for(i = 1; i <= last; i++) {
+			dstpipe[i]->store_data(dstdata[i]);
+			dstpipe[i]->notify_all();
+		}
+	}
+	//
+filter_quit:
+	if(srcpipe) {
+		srcpipe->client_unregister(ga_gettid());
+		srcpipe = NULL;
+	}
+	//
+	for(i = 0; i < RTSPCONF_TIER_MAX; i++) {
+		if(swsctx[i])	sws_freeContext(swsctx[i]);
+	}
+	//
+	ga_error("downscale filter: thread terminated.\n");
+	//
+	return NULL;
+}
+
@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __FILTER_DOWNSCALE_H__
+#define __FILTER_DOWNSCALE_H__
+
+#include "ga-module.h"
+
+// simulcast: scales YUV420P frames of the full-resolution pipe into one pipe per tier.
+// arg: NULL-terminated array of the names of the source pipe and the pipes of tier 1, 2, ...
+MODULE MODULE_EXPORT int filter_downscale_init(void *arg);
+MODULE MODULE_EXPORT void* filter_downscale_threadproc(void *arg);
+
+#endif
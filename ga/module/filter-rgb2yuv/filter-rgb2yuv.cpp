@@ -38,10 +38,12 @@ using namespace std;
 static pthread_mutex_t initMutex = PTHREAD_MUTEX_INITIALIZER;
 static map<void*,bool> initialized;
 
+// arg: source pipe, destination pipe, and optionally more destination
+// pipes that get a copy of each frame (e.g., for a downscaler), NULL-ended
 int
 filter_RGB2YUV_init(void *arg) {
 	// arg is image source id
-	int iid;
+	int iid, k;
 	int iwidth;
 	int iheight;
 	int istride;
@@ -73,35 +75,38 @@ filter_RGB2YUV_init(void *arg) {
 	iheight = video_source_height(iid);
 	istride = video_source_stride(iid);
 	//
-	if((pipe = new pipeline()) == NULL) {
-		ga_error("RGB2YUV filter: init pipeline failed.\n");
-		goto init_failed;
-	}
-	// has privdata from the source?
-	if(srcpipe->get_privdata_size() > 0) {
-		if(pipe->alloc_privdata(srcpipe->get_privdata_size()) == NULL) {
-			ga_error("RGB2YUV filter: cannot allocate privdata.\n");
+	for(k = 1; filterpipe[k] != NULL; k++) {
+		if((pipe = new pipeline()) == NULL) {
+			ga_error("RGB2YUV filter: init pipeline failed.\n");
 			goto init_failed;
 		}
-		pipe->set_privdata(srcpipe->get_privdata(), srcpipe->get_privdata_size());
-	}
-	//
-	if((data = pipe->datapool_init(POOLSIZE, sizeof(struct vsource_frame))) == NULL) {
-		ga_error("RGB2YUV filter: cannot allocate data pool.\n");
-		goto init_failed;
-	}
-	// per frame init
-	for(; data != NULL; data = data->next) {
-		if(vsource_frame_init((struct vsource_frame*) data->ptr, iwidth, iheight, istride) == NULL) {
-			ga_error("RGB2YUV filter: init frame failed.\n");
+		// has privdata from the source?
+		if(srcpipe->get_privdata_size() > 0) {
+			if(pipe->alloc_privdata(srcpipe->get_privdata_size()) == NULL) {
+				ga_error("RGB2YUV filter: cannot allocate privdata.\n");
+				goto init_failed;
+			}
+			pipe->set_privdata(srcpipe->get_privdata(), srcpipe->get_privdata_size());
+		}
+		//
+		if((data = pipe->datapool_init(POOLSIZE, sizeof(struct vsource_frame))) == NULL) {
+			ga_error("RGB2YUV filter: cannot allocate data pool.\n");
 			goto init_failed;
 		}
+		// per frame init
+		for(; data != NULL; data = data->next) {
+			if(vsource_frame_init((struct vsource_frame*) data->ptr, iwidth, iheight, istride) == NULL) {
+				ga_error("RGB2YUV filter: init frame failed.\n");
+				goto init_failed;
+			}
+		}
+		//
+		//snprintf(pipename, sizeof(pipename), F_RGB2YUV_PIPEFORMAT, iid);
+		//pipeline::do_register(pipename, pipe);
+		pipeline::do_register(filterpipe[k], pipe);
+		pipe = NULL;
 	}
 	//
-	//snprintf(pipename, sizeof(pipename), F_RGB2YUV_PIPEFORMAT, iid);
-	//pipeline::do_register(pipename, pipe);
-	pipeline::do_register(filterpipe[1], pipe);
-	//
 	pthread_mutex_lock(&initMutex);
 	initialized[arg] = true;
 	pthread_mutex_unlock(&initMutex);
@@ -122,8 +127,10 @@ filter_RGB2YUV_threadproc(void *arg) {
 	//pipeline *srcpipe = (pipeline*) arg;
 	pipeline *srcpipe = pipeline::lookup(filterpipe[0]);
 	pipeline *dstpipe = NULL;
+	pipeline *copypipe[RTSPCONF_TIER_MAX];
 	struct pooldata *srcdata = NULL;
 	struct pooldata *dstdata = NULL;
+	struct pooldata *copydata;
 	struct vsource_frame *srcframe = NULL;
 	struct vsource_frame *dstframe = NULL;
 	// image info
@@ -136,7 +143,7 @@ filter_RGB2YUV_threadproc(void *arg) {
 	unsigned char *dst[] = { NULL, NULL, NULL, NULL };
 	int srcstride[] = { 0, 0, 0, 0 };
 	int dststride[] = { 0, 0, 0, 0 };
-	int pic_size;
+	int pic_size, ncopies = 0, k;
 	//
 	struct SwsContext *swsctx = NULL;
 	//
@@ -159,6 +166,16 @@ filter_RGB2YUV_threadproc(void *arg) {
 		ga_error("RGB2YUV filter: cannot find pipeline '%s'\n", filterpipe[1]/*pipename*/);
 		goto filter_quit;
 	}
+	// each consumer of a pipe takes its frames away, so other consumers
+	// get pipes of their own
+	for(k = 2; filterpipe[k] != NULL && ncopies < RTSPCONF_TIER_MAX; k++) {
+		if((copypipe[ncopies] = pipeline::lookup(filterpipe[k])) == NULL) {
+			ga_error("RGB2YUV filter: cannot find pipeline '%s'\n", filterpipe[k]);
+			goto filter_quit;
+		}
+		ga_error("RGB2YUV filter: frames copied to '%s'\n", filterpipe[k]);
+		ncopies++;
+	}
 	//
 	ga_error("RGB2YUV filter: pipe from '%s' to '%s' (%dx%d, picsize=%d)\n",
 		srcpipe->name(), dstpipe->name(),
@@ -236,6 +253,19 @@ filter_RGB2YUV_threadproc(void *arg) {
 			bcopy(srcframe->imgbuf, dstframe->imgbuf, pic_size);
 		}
 		srcpipe->release_data(srcdata);
+		for(k = 0; k < ncopies; k++) {
+			struct vsource_frame *copyframe;
+			if(copypipe[k]->client_count() == 0)
+				continue;
+			copydata = copypipe[k]->allocate_data();
+			copyframe = (struct vsource_frame*) copydata->ptr;
+			copyframe->imgpts = dstframe->imgpts;
+			copyframe->imgtype = dstframe->imgtype;
+			bcopy(dstframe->linesize, copyframe->linesize, sizeof(copyframe->linesize));
+			bcopy(dstframe->imgbuf, copyframe->imgbuf, pic_size);
+			copypipe[k]->store_data(copydata);
+			copypipe[k]->notify_all();
+		}
 		dstpipe->store_data(dstdata);
 		dstpipe->notify_all();
 		//
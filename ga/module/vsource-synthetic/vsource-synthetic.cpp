@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * A video source that needs no display: it draws a moving test pattern
+ * (scrolling colour bars and a bouncing box), so servers can be run and
+ * load-tested on headless hosts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+
+#include "server.h"
+#include "vsource.h"
+#include "pipeline.h"
+#include "encoder-common.h"
+
+#include "ga-common.h"
+#include "ga-conf.h"
+
+#include "vsource-synthetic.h"
+
+#define	SYNTHETIC_DEF_WIDTH	1280
+#define	SYNTHETIC_DEF_HEIGHT	720
+#define	SYNTHETIC_BOXSIZE	64
+#define	SYNTHETIC_SCROLL	4	// pixels per frame
+
+static pthread_mutex_t initMutex = PTHREAD_MUTEX_INITIALIZER;
+static int initialized = 0;
+
+static int width, height;
+// two widths of colour bars, so a scrolled row is a single copy
+static unsigned char *barrow = NULL;
+
+static const unsigned char bars[][4] = {
+	{ 0xc0, 0xc0, 0xc0, 0xff },	// gray
+	{ 0x00, 0xc0, 0xc0, 0xff },
+	{ 0xc0, 0xc0, 0x00, 0xff },
+	{ 0x00, 0xc0, 0x00, 0xff },
+	{ 0xc0, 0x00, 0xc0, 0xff },
+	{ 0x00, 0x00, 0xc0, 0xff },
+	{ 0xc0, 0x00, 0x00, 0xff },
+	{ 0x00, 0x00, 0x00, 0xff },	// black
+};
+
+static int
+synthetic_readsize(const char *key, int defval, int minval) {
+	char buf[64];
+	int v;
+	if(ga_conf_readv(key, buf, sizeof(buf)) == NULL)
+		return defval;
+	v = ga_conf_readint(key);
+	if(v < minval || (v & 1) != 0) {
+		ga_error("synthetic source: invalid %s = %d, use %d\n", key, v, defval);
+		return defval;
+	}
+	return v;
+}
+
+int
+vsource_init(void *arg) {
+	void **ptr = (void**) arg;
+	const char *pipeformat = (const char *) ptr[0];
+	int i, nbars;
+	vsource_config config;
+	//
+	pthread_mutex_lock(&initMutex);
+	if(initialized) {
+		pthread_mutex_unlock(&initMutex);
+		return 0;
+	}
+	pthread_mutex_unlock(&initMutex);
+	// crop rects do not apply
+	width = synthetic_readsize("synthetic-width", SYNTHETIC_DEF_WIDTH, SYNTHETIC_BOXSIZE);
+	height = synthetic_readsize("synthetic-height", SYNTHETIC_DEF_HEIGHT, SYNTHETIC_BOXSIZE);
+	//
+	if((barrow = (unsigned char*) malloc(width * 4 * 2)) == NULL) {
+		ga_error("synthetic source: alloc pattern failed.\n");
+		return -1;
+	}
+	nbars = sizeof(bars) / sizeof(bars[0]);
+	for(i = 0; i < width * 2; i++) {
+		bcopy(bars[(i % width) * nbars / width], barrow + i * 4, 4);
+	}
+	//
+	bzero(&config, sizeof(config));
+	config.rtp_id = 0;
+	config.width = width;
+	config.height = height;
+	config.stride = width * 4;
+	if(video_source_setup_ex(pipeformat, &config, 1) < 0) {
+		return -1;
+	}
+	ga_error("synthetic source: %dx%d test pattern.\n", width, height);
+	//
+	pthread_mutex_lock(&initMutex);
+	initialized = 1;
+	pthread_mutex_unlock(&initMutex);
+	//
+	return 0;
+}
+
+static void
+synthetic_draw(struct vsource_frame *frame, long long n) {
+	int y, offset, boxx, boxy, rangex, rangey;
+	unsigned char *row;
+	// scrolling bars
+	offset = (int) ((n * SYNTHETIC_SCROLL) % width);
+	for(y = 0; y < height; y++) {
+		bcopy(barrow + offset * 4, frame->imgbuf + y * frame->stride, width * 4);
+	}
+	// the box bounces between the borders
+	rangex = width - SYNTHETIC_BOXSIZE;
+	rangey = height - SYNTHETIC_BOXSIZE;
+	boxx = (int) ((n * 7) % (2 * rangex));
+	boxy = (int) ((n * 5) % (2 * rangey));
+	if(boxx > rangex)	boxx = 2 * rangex - boxx;
+	if(boxy > rangey)	boxy = 2 * rangey - boxy;
+	for(y = boxy; y < boxy + SYNTHETIC_BOXSIZE; y++) {
+		row = frame->imgbuf + y * frame->stride + boxx * 4;
+		memset(row, 0xff, SYNTHETIC_BOXSIZE * 4);
+	}
+	return;
+}
+
+void *
+vsource_threadproc(void *arg) {
+	int frame_interval;
+	long long n = 0;
+	struct timeval tv;
+	struct pooldata *data;
+	struct vsource_frame *frame;
+	pipeline *pipe;
+	char pipename[64];
+	struct timeval initialTv, captureTv;
+	const char *pipeformat = (const char *) arg;
+	struct RTSPConf *rtspconf = rtspconf_global();
+	//
+	frame_interval = 1000000/rtspconf->video_fps;	// in the unit of us
+	frame_interval++;
+	//
+	snprintf(pipename, sizeof(pipename), pipeformat, 0);
+	if((pipe = pipeline::lookup(pipename)) == NULL) {
+		ga_error("synthetic source: cannot find pipeline '%s'\n", pipename);
+		exit(-1);
+	}
+	//
+	ga_error("synthetic source thread started: tid=%ld\n", ga_gettid());
+	gettimeofday(&initialTv, NULL);
+	while(true) {
+		//
+		gettimeofday(&tv, NULL);
+		if(encoder_running() == 0) {
+#ifdef WIN32
+			Sleep(1);
+#else
+			usleep(1000);
+#endif
+			continue;
+		}
+		//
+		data = pipe->allocate_data();
+		frame = (struct vsource_frame*) data->ptr;
+		frame->imgtype = rgba;
+		frame->linesize[0] = frame->stride;
+		gettimeofday(&captureTv, NULL);
+		synthetic_draw(frame, n++);
+		frame->imgpts = tvdiff_us(&captureTv, &initialTv)/frame_interval;
+		pipe->store_data(data);
+		pipe->notify_all();
+		//
+		ga_usleep(frame_interval, &tv);
+	}
+	//
+	ga_error("synthetic source thread terminated.\n");
+	//
+	return NULL;
+}
+
+void
+vsource_deinit(void *arg) {
+	if(barrow != NULL) {
+		free(barrow);
+		barrow = NULL;
+	}
+	return;
+}
+
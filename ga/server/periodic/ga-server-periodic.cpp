@@ -18,6 +18,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
 
 #include "ga-common.h"
 #include "ga-conf.h"
@@ -26,32 +30,95 @@
 #include "server.h"
 #include "controller.h"
 #include "encoder-common.h"
+#include "encoder-control.h"
+#include "rtspserver.h"
+#include "vsource.h"
+#include "pipeline.h"
+#include "sessions.h"
 
 // image source pipeline:
 //	vsource -- [vsource-%d] --> filter -- [filter-%d] --> encoder
+// with simulcast tiers, the filter copies its frames for the downscaler:
+//	filter -- [filter-0-scale] --> downscale -- [filter-0-tier%d] --> encoder (per tier)
 
 static const char *imagepipefmt = "image-%d";
 static const char *imagepipe0 = "image-0";
 static const char *filterpipe0 = "filter-0";
+static const char *tierpipe0[] = { "filter-0-scale", "filter-0-tier1", "filter-0-tier2", NULL };
+static const char *tierpipe[RTSPCONF_TIER_MAX+1];
+// source, destination, and the source of the downscaler
+static const char *filterpipe[] = { imagepipe0, filterpipe0, NULL, NULL };
 
 static struct gaRect *prect = NULL;
 static struct gaRect rect;
 
-static struct ga_module *m_vsource, *m_filter, *m_vencoder, *m_asource, *m_aencoder, *m_ctrl;
+static struct ga_module *m_vsource, *m_filter, *m_downscale, *m_vencoder, *m_asource, *m_aencoder, *m_ctrl;
+
+// video-source = desktop (default) or synthetic; server-audio = 0 for hosts
+// without a sound device
+static int enable_audio = 1;
+
+// video-pipeline = local (default), or capture and encoder for the two
+// processes sharing the image pipes through shared memory
+enum pipeline_process {
+	PIPELINE_LOCAL = 0,
+	PIPELINE_CAPTURE,
+	PIPELINE_ENCODER
+};
+static int pipeproc = PIPELINE_LOCAL;
+static char pipeshm[64] = "/ga-image-%d";
+
+static int
+read_pipeline_config() {
+	char value[64] = "local";
+	ga_conf_readv("video-pipeline", value, sizeof(value));
+	ga_conf_readv("video-pipeline-shm", pipeshm, sizeof(pipeshm));
+	if(strcmp(value, "local") == 0) {
+		pipeproc = PIPELINE_LOCAL;
+	} else if(strcmp(value, "capture") == 0) {
+		pipeproc = PIPELINE_CAPTURE;
+	} else if(strcmp(value, "encoder") == 0) {
+		pipeproc = PIPELINE_ENCODER;
+	} else {
+		ga_error("video-pipeline: unknown process '%s'.\n", value);
+		return -1;
+	}
+	if(pipeproc != PIPELINE_LOCAL) {
+		ga_error("*** Video pipeline: %s process, shared pools %s\n",
+			value, pipeshm);
+	}
+	return 0;
+}
 
 int
 load_modules() {
-	if((m_vsource = ga_load_module("mod/vsource-desktop", "vsource_")) == NULL)
-		return -1;
+	char vsource[64] = "desktop";
+	char modname[128];
+	if(pipeproc != PIPELINE_ENCODER) {
+		ga_conf_readv("video-source", vsource, sizeof(vsource));
+		snprintf(modname, sizeof(modname), "mod/vsource-%s", vsource);
+		if((m_vsource = ga_load_module(modname, "vsource_")) == NULL)
+			return -1;
+	}
+	// the capture process runs the image source only
+	if(pipeproc == PIPELINE_CAPTURE)
+		return 0;
 	if((m_filter = ga_load_module("mod/filter-rgb2yuv", "filter_RGB2YUV_")) == NULL)
 		return -1;
+	if(rtspconf_global()->video_tiers > 1) {
+		if((m_downscale = ga_load_module("mod/filter-downscale", "filter_downscale_")) == NULL)
+			return -1;
+	}
 	if((m_vencoder = ga_load_module("mod/encoder-video", "vencoder_")) == NULL)
 		return -1;
 #ifndef __APPLE__
-	if((m_asource = ga_load_module("mod/asource-system", "asource_")) == NULL)
-		return -1;
-	if((m_aencoder = ga_load_module("mod/encoder-audio", "aencoder_")) == NULL)
-		return -1;
+	enable_audio = ga_conf_readbool("server-audio", 1);
+	if(enable_audio) {
+		if((m_asource = ga_load_module("mod/asource-system", "asource_")) == NULL)
+			return -1;
+		if((m_aencoder = ga_load_module("mod/encoder-audio", "aencoder_")) == NULL)
+			return -1;
+	}
 #endif
 	if((m_ctrl = ga_load_module("mod/ctrl-sdl", "sdlmsg_replay_")) == NULL)
 		return -1;
@@ -62,19 +129,41 @@ int
 init_modules() {
 	struct RTSPConf *conf = rtspconf_global();
 	static const void *vsourcearg[] = { (void*) imagepipefmt, (void*) prect };
-	static const char *filterpipe[] = { imagepipe0, filterpipe0 };
+	if(pipeproc == PIPELINE_CAPTURE) {
+		video_source_shm(pipeshm);
+		ga_init_single_module_or_quit("image source", m_vsource, (void*) vsourcearg);
+		return 0;
+	}
 	if(conf->ctrlenable) {
 		ga_init_single_module_or_quit("controller", m_ctrl, (void *) prect);
 	}
 	// controller server is built-in - no need to init
 	// note the order of the two modules ...
-	ga_init_single_module_or_quit("image source", m_vsource, (void*) /*imagepipefmt*/vsourcearg);
+	if(pipeproc == PIPELINE_ENCODER) {
+		if(video_source_attach(imagepipefmt, pipeshm) <= 0) {
+			ga_error("cannot attach to the image source.\n");
+			exit(-1);
+		}
+	} else {
+		ga_init_single_module_or_quit("image source", m_vsource, (void*) /*imagepipefmt*/vsourcearg);
+	}
+	if(conf->video_tiers > 1)
+		filterpipe[2] = tierpipe0[0];
 	ga_init_single_module_or_quit("filter", m_filter, (void*) filterpipe);
+	if(conf->video_tiers > 1) {
+		int i;
+		for(i = 0; i < conf->video_tiers && tierpipe0[i] != NULL; i++)
+			tierpipe[i] = tierpipe0[i];
+		tierpipe[i] = NULL;
+		ga_init_single_module_or_quit("downscale filter", m_downscale, (void*) tierpipe);
+	}
 	//
 	ga_init_single_module_or_quit("video encoder", m_vencoder, NULL);
 #ifndef __APPLE__
-	ga_init_single_module_or_quit("audio source", m_asource, NULL);
-	ga_init_single_module_or_quit("audio encoder", m_aencoder, NULL);
+	if(enable_audio) {
+		ga_init_single_module_or_quit("audio source", m_asource, NULL);
+		ga_init_single_module_or_quit("audio encoder", m_aencoder, NULL);
+	}
 #endif
 	return 0;
 }
@@ -82,27 +171,79 @@ init_modules() {
 int
 run_modules() {
 	struct RTSPConf *conf = rtspconf_global();
-	static const char *filterpipe[] =  { imagepipe0, filterpipe0 };
+	if(pipeproc == PIPELINE_CAPTURE) {
+		ga_run_single_module_or_quit("image source", m_vsource->threadproc, (void*) imagepipefmt);
+		return 0;
+	}
 	// controller server is built-in, but replay is a module
 	if(conf->ctrlenable) {
 		ga_run_single_module_or_quit("control server", ctrl_server_thread, conf);
 		ga_run_single_module_or_quit("control replayer", m_ctrl->threadproc, conf);
 	}
+	// encoder control server is built-in
+	if(conf->encoder_control != NULL) {
+		ga_run_single_module_or_quit("encoder control", encoder_control_thread, conf);
+	}
 	// video
-	ga_run_single_module_or_quit("image source", m_vsource->threadproc, (void*) imagepipefmt);
+	if(pipeproc != PIPELINE_ENCODER)
+		ga_run_single_module_or_quit("image source", m_vsource->threadproc, (void*) imagepipefmt);
 	ga_run_single_module_or_quit("filter 0", m_filter->threadproc, (void*) filterpipe);
 	encoder_register_vencoder(m_vencoder->threadproc, (void*) filterpipe0);
+	// simulcast: one encoder per tier, fed by the shared downscaler
+	if(conf->video_tiers > 1) {
+		int i;
+		ga_run_single_module_or_quit("downscale filter", m_downscale->threadproc, (void*) tierpipe);
+		for(i = 1; tierpipe[i] != NULL; i++)
+			encoder_register_vencoder(m_vencoder->threadproc, (void*) tierpipe[i]);
+	}
 #ifndef __APPLE__
 	// audio
-	ga_run_single_module_or_quit("audio source", m_asource->threadproc, NULL);
-	encoder_register_aencoder(m_aencoder->threadproc, NULL);
+	if(enable_audio) {
+		ga_run_single_module_or_quit("audio source", m_asource->threadproc, NULL);
+		encoder_register_aencoder(m_aencoder->threadproc, NULL);
+	}
 #endif
 	return 0;
 }
 
+// the capture process has no RTSP clients: it captures while an encoder
+// process is attached to the image pipe, through a client without muxers
+static void
+capture_main() {
+	pipeline *pipe = pipeline::lookup(imagepipe0);
+	RTSPContext ctx;
+	bool running = false;
+	//
+	bzero(&ctx, sizeof(ctx));
+	ctx.fd = -1;
+	ctx.session_id = strdup("capture");
+	while(pipe != NULL) {
+		if(pipe->client_count() > 0 && !running) {
+			ctx.state = SERVER_STATE_PLAYING;
+			if(encoder_register_client(&ctx) == 0) {
+				ga_error("capture: encoder process attached.\n");
+				running = true;
+			}
+		} else if(pipe->client_count() <= 0 && running) {
+			ctx.state = SERVER_STATE_TEARDOWN;
+			encoder_unregister_client(&ctx);
+			ga_error("capture: encoder process detached.\n");
+			running = false;
+		}
+#ifdef WIN32
+		Sleep(100);
+#else
+		usleep(100000);
+#endif
+	}
+	ga_error("capture: no image pipe '%s'.\n", imagepipe0);
+	return;
+}
+
 int
 main(int argc, char *argv[]) {
 	int notRunning = 0;
+	int loaded = 0;
 #ifdef WIN32
 	if(CoInitializeEx(NULL, COINIT_MULTITHREADED) < 0) {
 		fprintf(stderr, "cannot initialize COM.\n");
@@ -121,6 +262,20 @@ main(int argc, char *argv[]) {
 	//
 	if(rtspconf_parse(rtspconf_global()) < 0)
 					{ return -1; }
+	if(read_pipeline_config() < 0)	{ return -1; }
+	// many desktops: codecs and modules are loaded once, before the
+	// session workers are forked, and the rest runs in a worker
+	if(sessions_configured() > 0) {
+		if(load_modules() < 0)	{ return -1; }
+		if(sessions_run() < 0)	{ return -1; }
+		ga_closelog();
+		ga_openlog();
+		ga_error("*** Session %d\n", sessions_id());
+		if(rtspconf_parse(rtspconf_global()) < 0)
+					{ return -1; }
+		if(read_pipeline_config() < 0)	{ return -1; }
+		loaded = 1;
+	}
 	//
 	prect = NULL;
 	//
@@ -134,10 +289,15 @@ main(int argc, char *argv[]) {
 			prect->right, prect->bottom);
 	}
 	//
-	if(load_modules() < 0)	 	{ return -1; }
+	if(!loaded && load_modules() < 0)	{ return -1; }
 	if(init_modules() < 0)	 	{ return -1; }
 	if(run_modules() < 0)	 	{ return -1; }
 	//
+	if(pipeproc == PIPELINE_CAPTURE) {
+		capture_main();
+		ga_deinit();
+		return 0;
+	}
 	rtspserver_main(NULL);
 	// alternatively, it is able to create a thread to run rtspserver_main:
 	//	pthread_create(&t, NULL, rtspserver_main, NULL);
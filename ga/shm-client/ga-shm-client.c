@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+#endif
+
+#include "ga-shm-client.h"
+
+struct ga_shm_client {
+	struct ga_shm_header *hdr;
+	struct ga_shm_entry *entry;
+	const uint8_t *data;
+	size_t size;
+	int slot;
+	uint64_t next;		// sequence number of the next packet
+	int waitkey[GA_SHM_STREAM_MAX];
+	unsigned long long resyncs;
+};
+
+static void
+futex_wake(volatile uint32_t *addr) {
+#ifdef __linux__
+	syscall(__NR_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+static void
+futex_wait(volatile uint32_t *addr, uint32_t val, int ms) {
+#ifdef __linux__
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	syscall(__NR_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+	if(*addr == val)
+		usleep(ms * 1000);
+#endif
+}
+
+// start over from the newest packet; video waits for a keyframe, which
+// the server is asked for
+static void
+resync(ga_shm_client *c) {
+	int i;
+	c->next = c->hdr->write_seq;
+	for(i = 0; i < GA_SHM_STREAM_MAX; i++)
+		c->waitkey[i] = 1;
+	__sync_fetch_and_add(&c->hdr->keyreq, 1);
+}
+
+ga_shm_client *
+ga_shm_attach(const char *name) {
+	ga_shm_client *c;
+	struct ga_shm_header *hdr;
+	struct stat st;
+	void *addr;
+	int fd, i;
+	//
+	if((fd = shm_open(name, O_RDWR, 0)) < 0)
+		return NULL;
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct ga_shm_header)) {
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(addr == MAP_FAILED)
+		return NULL;
+	hdr = (struct ga_shm_header*) addr;
+	if(hdr->magic != GA_SHM_MAGIC || hdr->version != GA_SHM_VERSION
+	|| hdr->data_offset + hdr->data_size > (uint64_t) st.st_size) {
+		munmap(addr, st.st_size);
+		errno = EPROTO;
+		return NULL;
+	}
+	if((c = (ga_shm_client*) calloc(1, sizeof(ga_shm_client))) == NULL) {
+		munmap(addr, st.st_size);
+		return NULL;
+	}
+	c->hdr = hdr;
+	c->entry = (struct ga_shm_entry*) ((uint8_t*) addr + hdr->entry_offset);
+	c->data = (const uint8_t*) addr + hdr->data_offset;
+	c->size = st.st_size;
+	for(c->slot = -1, i = 0; i < GA_SHM_READER_MAX; i++) {
+		if(__sync_bool_compare_and_swap(&hdr->readers[i].pid, 0, (uint32_t) getpid())) {
+			c->slot = i;
+			break;
+		}
+	}
+	if(c->slot < 0) {
+		munmap(addr, st.st_size);
+		free(c);
+		errno = EBUSY;
+		return NULL;
+	}
+	// the server starts its encoders for the first reader
+	__sync_fetch_and_add(&hdr->attach, 1);
+	futex_wake(&hdr->attach);
+	resync(c);
+	c->resyncs = 0;
+	return c;
+}
+
+void
+ga_shm_detach(ga_shm_client *c) {
+	if(c == NULL)
+		return;
+	c->hdr->readers[c->slot].pid = 0;
+	__sync_fetch_and_add(&c->hdr->attach, 1);
+	futex_wake(&c->hdr->attach);
+	munmap(c->hdr, c->size);
+	free(c);
+}
+
+int
+ga_shm_nstreams(ga_shm_client *c) {
+	return c->hdr->nstreams < GA_SHM_STREAM_MAX ? c->hdr->nstreams : GA_SHM_STREAM_MAX;
+}
+
+const struct ga_shm_stream *
+ga_shm_stream_info(ga_shm_client *c, int stream) {
+	const struct ga_shm_stream *st;
+	if(stream < 0 || stream >= GA_SHM_STREAM_MAX)
+		return NULL;
+	st = &c->hdr->streams[stream];
+	if(st->type == 0)
+		return NULL;
+	__sync_synchronize();
+	return st;
+}
+
+// wait until packet c->next is published.  returns 0 if it is, or -1 on
+// timeout.
+static int
+wait_packet(ga_shm_client *c, int timeout_ms) {
+	uint32_t val;
+	//
+	if(c->hdr->write_seq > c->next)
+		return 0;
+	if(timeout_ms <= 0)
+		return -1;
+	__sync_fetch_and_add(&c->hdr->waiters, 1);
+	val = c->hdr->notify;
+	__sync_synchronize();
+	if(c->hdr->write_seq <= c->next)
+		futex_wait(&c->hdr->notify, val, timeout_ms);
+	__sync_fetch_and_sub(&c->hdr->waiters, 1);
+	return c->hdr->write_seq > c->next ? 0 : -1;
+}
+
+int
+ga_shm_read(ga_shm_client *c, struct ga_shm_packet *pkt, void *buf, int buflen, int timeout_ms) {
+	struct ga_shm_header *hdr = c->hdr;
+	struct ga_shm_entry *e, copy;
+	uint64_t seq, off, first;
+	//
+	while(1) {
+		if(wait_packet(c, timeout_ms) < 0) {
+			// no packets for a while: is the server still there?
+			if(kill((pid_t) hdr->pid, 0) < 0 && errno == ESRCH)
+				return -1;
+			return 0;
+		}
+		if(hdr->write_seq - c->next > hdr->nentries) {
+			c->resyncs++;
+			resync(c);
+			continue;
+		}
+		e = &c->entry[c->next & (hdr->nentries - 1)];
+		seq = e->seq;
+		__sync_synchronize();
+		copy = *e;
+		if(seq != c->next || copy.stream >= GA_SHM_STREAM_MAX) {
+			c->resyncs++;
+			resync(c);
+			continue;
+		}
+		pkt->stream = copy.stream;
+		pkt->flags = copy.flags;
+		pkt->pts = copy.pts;
+		pkt->size = copy.size;
+		if((int) copy.size <= buflen) {
+			off = copy.pos & (hdr->data_size - 1);
+			first = hdr->data_size - off < copy.size ? hdr->data_size - off : copy.size;
+			memcpy(buf, c->data + off, first);
+			memcpy((uint8_t*) buf + first, c->data, copy.size - first);
+		}
+		__sync_synchronize();
+		// overwritten while being copied?
+		if(e->seq != seq || hdr->write_pos - copy.pos > hdr->data_size) {
+			c->resyncs++;
+			resync(c);
+			continue;
+		}
+		c->next++;
+		if(c->waitkey[copy.stream]) {
+			if(hdr->streams[copy.stream].type == GA_SHM_VIDEO
+			&& (copy.flags & GA_SHM_FLAG_KEY) == 0)
+				continue;
+			c->waitkey[copy.stream] = 0;
+		}
+		return (int) copy.size <= buflen ? (int) copy.size : -2;
+	}
+	return -1;
+}
+
+unsigned long long
+ga_shm_resyncs(ga_shm_client *c) {
+	return c->resyncs;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __GA_SHM_CLIENT_H__
+#define __GA_SHM_CLIENT_H__
+
+// reader of the shared-memory packet ring published by a GA server with
+// 'shm-publish' set.  a reader takes no locks and never slows down the
+// server: if it falls behind, it skips to the next keyframe of each video
+// stream.  a reader is used by one thread.
+
+#include <stdint.h>
+#include "ga-shm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ga_shm_packet {
+	int stream;		// index of ga_shm_stream_info()
+	int flags;		// GA_SHM_FLAG_*
+	int64_t pts;		// in microseconds
+	int size;
+};
+
+typedef struct ga_shm_client ga_shm_client;
+
+// returns NULL if the ring does not exist, or has no free reader slot
+ga_shm_client * ga_shm_attach(const char *name);
+void ga_shm_detach(ga_shm_client *c);
+int ga_shm_nstreams(ga_shm_client *c);
+// NULL if the stream has not been described yet, i.e., before its first packet.
+// a stream is described again when its encoder is re-opened: check at keyframes.
+const struct ga_shm_stream * ga_shm_stream_info(ga_shm_client *c, int stream);
+// copy the next packet into buf, waiting up to timeout_ms for one.
+// returns the packet size, 0 on timeout, -1 if the server is gone, or
+// -2 if buf is too small (the packet is skipped, pkt->size tells its size).
+int ga_shm_read(ga_shm_client *c, struct ga_shm_packet *pkt, void *buf, int buflen, int timeout_ms);
+// times the reader was overrun and resumed at a keyframe
+unsigned long long ga_shm_resyncs(ga_shm_client *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2013 Chun-Ying Huang
+ *
+ * This file is part of Gaming Anywere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// shm-reader: attach to the shared-memory ring of a ga-server and report
+// what arrives.  usage: shm-reader [-t seconds] [-o file] [-s ms] name
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "ga-shm-client.h"
+
+#define	READ_BUFFER	(8*1024*1024)
+
+static volatile int quit = 0;
+
+static void
+handle_signal(int sig) {
+	quit = 1;
+}
+
+static long long
+now_ms() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+static void
+usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-t seconds] [-o stream0-dump] [-s slow-ms] name\n", prog);
+	exit(-1);
+}
+
+int
+main(int argc, char *argv[]) {
+	ga_shm_client *c;
+	struct ga_shm_packet pkt;
+	unsigned long long packets[GA_SHM_STREAM_MAX], keys[GA_SHM_STREAM_MAX], bytes[GA_SHM_STREAM_MAX];
+	int described[GA_SHM_STREAM_MAX];
+	unsigned char *buf;
+	const char *dumpfile = NULL;
+	FILE *dump = NULL;
+	long long start, elapsed;
+	int seconds = 0, slow = 0;
+	int i, ch, ret;
+	//
+	while((ch = getopt(argc, argv, "t:o:s:")) != -1) {
+		switch(ch) {
+		case 't': seconds = atoi(optarg); break;
+		case 'o': dumpfile = optarg; break;
+		case 's': slow = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1)
+		usage(argv[0]);
+	if((buf = (unsigned char*) malloc(READ_BUFFER)) == NULL) {
+		fprintf(stderr, "shm-reader: out of memory\n");
+		return -1;
+	}
+	if((c = ga_shm_attach(argv[optind])) == NULL) {
+		perror("shm-reader: attach");
+		return -1;
+	}
+	if(dumpfile != NULL && (dump = fopen(dumpfile, "wb")) == NULL) {
+		perror("shm-reader: open dump");
+		ga_shm_detach(c);
+		return -1;
+	}
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	bzero(packets, sizeof(packets));
+	bzero(keys, sizeof(keys));
+	bzero(bytes, sizeof(bytes));
+	bzero(described, sizeof(described));
+	start = now_ms();
+	while(!quit) {
+		if(seconds > 0 && now_ms() - start >= seconds * 1000LL)
+			break;
+		ret = ga_shm_read(c, &pkt, buf, READ_BUFFER, 500);
+		if(ret == 0)
+			continue;
+		if(ret == -1) {
+			fprintf(stderr, "shm-reader: server is gone\n");
+			break;
+		}
+		if(ret == -2) {
+			fprintf(stderr, "shm-reader: packet of %d bytes skipped\n", pkt.size);
+			continue;
+		}
+		if(described[pkt.stream] == 0) {
+			const struct ga_shm_stream *st = ga_shm_stream_info(c, pkt.stream);
+			if(st != NULL && st->type == GA_SHM_VIDEO) {
+				printf("stream %d: video, codec %u, %ux%u, extradata %u bytes\n",
+					pkt.stream, st->codec_id, st->width, st->height, st->extradata_size);
+			} else if(st != NULL) {
+				printf("stream %d: audio, codec %u, %uHz, %u channels\n",
+					pkt.stream, st->codec_id, st->samplerate, st->channels);
+			}
+			described[pkt.stream] = 1;
+		}
+		packets[pkt.stream]++;
+		bytes[pkt.stream] += ret;
+		if(pkt.flags & GA_SHM_FLAG_KEY)
+			keys[pkt.stream]++;
+		if(dump != NULL && pkt.stream == 0)
+			fwrite(buf, 1, ret, dump);
+		if(slow > 0)
+			usleep(slow * 1000);
+	}
+	elapsed = now_ms() - start;
+	if(elapsed <= 0)
+		elapsed = 1;
+	for(i = 0; i < GA_SHM_STREAM_MAX; i++) {
+		if(packets[i] == 0)
+			continue;
+		printf("stream %d: %llu packets, %llu keyframes, %.1f kbps\n",
+			i, packets[i], keys[i], 8.0 * bytes[i] / elapsed);
+	}
+	printf("resyncs: %llu\n", ga_shm_resyncs(c));
+	if(dump != NULL)
+		fclose(dump);
+	ga_shm_detach(c);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# Emulate a constrained network path on the loopback interface (Linux only,
+# requires root and the sch_netem module).  Run the server and the client
+# on the same host (rtsp://127.0.0.1:8554/desktop) with congestion-control
+# enabled, and watch the 'rtcp: stream' and 'rate control' lines in the
+# server log converge to the emulated capacity.
+#
+# For retransmissions, run 'loss' with nack-history on the server and
+# video-nack on the client: the client logs the share of lost packets
+# recovered ('nack:' lines), and the server the resent and expired ones
+# ('rtx:' lines, when the client leaves).
+#
+# For FEC, run 'losses' with fec enabled on the server: each loss rate
+# is held for STEP seconds, the client logs 'recv:' lines (recovered
+# packets and FEC overhead), and the server 'fec:' lines (group sizes,
+# and the overhead in bytes when the client leaves).
+#
+# For picture loss recovery, run 'loss' with video-pli on the client: it
+# logs the time from each loss to the next decoded keyframe, and the mean
+# ('picture repaired' lines).
+#
+# For multicast, run 'multicast' first to route multicast groups over
+# the loopback interface, set multicast-group and multicast-interface =
+# 127.0.0.1 on the server, and start clients on .../desktop/multicast.
+#
+# usage:
+#	netem-loopback.sh start <rate> [delay] [loss]	e.g., start 2mbit 20ms 0.5%
+#	netem-loopback.sh steps [delay]			8mbit -> 2mbit -> 5mbit, 30s each
+#	netem-loopback.sh loss <loss> [delay]		e.g., loss 2% 20ms, no rate limit
+#	netem-loopback.sh losses [delay]		1% -> 5% -> 10% loss, 30s each
+#	netem-loopback.sh multicast			route 224.0.0.0/4 over lo
+#	netem-loopback.sh show
+#	netem-loopback.sh stop
+
+DEV=${DEV:-lo}
+STEP=${STEP:-30}
+
+netem() {
+	# netem queue limit in packets, deep enough to show queuing delay
+	tc qdisc replace dev $DEV root netem rate $1 delay ${2:-10ms} loss ${3:-0%} limit 1000
+}
+
+case "$1" in
+start)
+	[ -z "$2" ] && { echo "usage: $0 start <rate> [delay] [loss]"; exit 1; }
+	netem "$2" "$3" "$4"
+	;;
+steps)
+	for rate in 8mbit 2mbit 5mbit; do
+		echo "`date +%T` link capacity = $rate"
+		netem $rate "$2"
+		sleep $STEP
+	done
+	tc qdisc del dev $DEV root
+	;;
+loss)
+	[ -z "$2" ] && { echo "usage: $0 loss <loss> [delay]"; exit 1; }
+	tc qdisc replace dev $DEV root netem delay ${3:-10ms} loss $2
+	;;
+losses)
+	for loss in 1% 5% 10%; do
+		echo "`date +%T` loss = $loss"
+		tc qdisc replace dev $DEV root netem delay ${2:-10ms} loss $loss
+		sleep $STEP
+	done
+	tc qdisc del dev $DEV root
+	;;
+multicast)
+	ip link set dev $DEV multicast on
+	ip route replace 224.0.0.0/4 dev $DEV
+	;;
+show)
+	tc -s qdisc show dev $DEV
+	;;
+stop)
+	tc qdisc del dev $DEV root
+	;;
+*)
+	echo "usage: $0 {start <rate> [delay] [loss]|steps [delay]|loss <loss> [delay]|losses [delay]|multicast|show|stop}"
+	exit 1
+	;;
+esac
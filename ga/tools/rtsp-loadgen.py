@@ -0,0 +1,495 @@
+#!/usr/bin/env python
+#
+# Load-test an RTSP server with concurrent viewers: open N sessions (RTP over
+# UDP, or interleaved in the RTSP connection), receive the video stream
+# without decoding it, and report per-client throughput, frame rate,
+# inter-arrival jitter (RFC 3550), loss and time to the first packet, along
+# with the CPU used by the server (read from /proc, so run it on the server
+# host) and by this tool.
+#
+# With --ramp, clients are added --step at a time, one measurement interval
+# each, until an interval breaks one of the SLOs; the last client count that
+# met them all is reported.
+#
+# The server does not need a display with config/server.synthetic.conf:
+#	ga-server-periodic config/server.synthetic.conf
+#	rtsp-loadgen.py rtsp://127.0.0.1:8554/desktop -n 20 -t 60 -p `pidof ga-server-periodic`
+#	rtsp-loadgen.py rtsp://127.0.0.1:8554/desktop --ramp --step 4 --transport mixed -p ...
+#
+# Losses counted here include drops in this tool's own socket buffers; keep
+# its CPU (reported with the server's) well below one core.
+#
+
+import argparse
+import errno
+import os
+import re
+import resource
+import select
+import socket
+import struct
+import sys
+import time
+
+RTSP_TIMEOUT = 10		# seconds to reach PLAY
+STALL_TIMEOUT = 3		# seconds without a packet while playing
+UDP_RCVBUF = 4 * 1024 * 1024
+
+def server_cpu(pid):
+	# utime + stime, in seconds
+	if pid is None:
+		return None
+	try:
+		f = open("/proc/%d/stat" % pid).read()
+	except (IOError, OSError):
+		return None
+	f = f[f.rindex(")") + 2:].split()
+	return (int(f[11]) + int(f[12])) / float(os.sysconf("SC_CLK_TCK"))
+
+def own_cpu():
+	t = os.times()
+	return t[0] + t[1]
+
+def parse_sdp(sdp):
+	# the first video stream: payload type, clock rate and control url
+	video = media = None
+	for line in sdp.splitlines():
+		if line.startswith("m="):
+			f = line[2:].split()
+			media = { "type": f[0], "pt": int(f[3]), "clock": 90000, "control": None }
+			if f[0] == "video" and video is None:
+				video = media
+		elif media is None:
+			continue
+		elif line.startswith("a=control:"):
+			media["control"] = line[10:].strip()
+		elif line.startswith("a=rtpmap:"):
+			m = re.match(r"a=rtpmap:(\d+)\s+[^/]+/(\d+)", line)
+			if m and int(m.group(1)) == media["pt"]:
+				media["clock"] = int(m.group(2))
+	return video
+
+def udp_pair():
+	# an even RTP port and the next one for RTCP
+	for i in range(100):
+		rtp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+		rtp.bind(("", 0))
+		port = rtp.getsockname()[1]
+		if port & 1 == 0:
+			rtcp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+			try:
+				rtcp.bind(("", port + 1))
+				for s in (rtp, rtcp):
+					s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, UDP_RCVBUF)
+					s.setblocking(False)
+				return rtp, rtcp, port
+			except (IOError, OSError):
+				rtcp.close()
+		rtp.close()
+	raise IOError("no free RTP/RTCP port pair")
+
+class Stats:
+	def __init__(self):
+		self.packets = self.bytes = self.frames = 0
+		self.expected = 0
+		self.other = 0		# other payload types, e.g., FEC
+		self.invalid = 0
+
+	def copy(self):
+		s = Stats()
+		s.__dict__.update(self.__dict__)
+		return s
+
+class Client:
+	def __init__(self, idx, url, host, port, tcp):
+		self.idx = idx
+		self.url = url
+		self.tcp = tcp
+		self.state = "OPTIONS"
+		self.error = None
+		self.cseq = 0
+		self.buf = b""
+		self.session = None
+		self.rtp = self.rtcp = None
+		self.st = Stats()
+		self.snap = Stats()
+		self.ssrc = None
+		self.base_seq = self.max_seq = None
+		self.cycles = 0
+		self.transit = None
+		self.jitter = 0.0
+		self.ttfp = None
+		self.last_rx = None
+		self.stalls = 0
+		self.t0 = time.time()
+		self.s = socket.create_connection((host, port), RTSP_TIMEOUT)
+		self.s.setblocking(False)
+		self.request("OPTIONS", url)
+
+	def name(self):
+		return "#%d/%s" % (self.idx, "tcp" if self.tcp else "udp")
+
+	def sockets(self):
+		return [s for s in (self.s, self.rtp, self.rtcp) if s is not None]
+
+	def request(self, method, url, headers=""):
+		self.cseq += 1
+		if self.session is not None:
+			headers += "Session: %s\r\n" % self.session
+		msg = "%s %s RTSP/1.0\r\nCSeq: %d\r\nUser-Agent: rtsp-loadgen\r\n%s\r\n" % (
+			method, url, self.cseq, headers)
+		self.s.setblocking(True)
+		try:
+			self.s.sendall(msg.encode())
+		finally:
+			self.s.setblocking(False)
+		self.state = method
+
+	def fail(self, reason):
+		if self.error is None:
+			self.error = reason
+		self.close()
+
+	def close(self):
+		for s in self.sockets():
+			s.close()
+		self.s = self.rtp = self.rtcp = None
+
+	def teardown(self):
+		if self.s is not None and self.session is not None:
+			try:
+				self.request("TEARDOWN", self.url)
+			except (IOError, OSError):
+				pass
+		self.close()
+
+	def on_readable(self, s, now):
+		try:
+			if s is self.s:
+				data = s.recv(262144)
+				if not data:
+					self.fail("connection closed by the server")
+					return
+				self.buf += data
+				self.parse_control(now)
+			elif s is self.rtp:
+				while self.rtp is not None:
+					self.on_rtp(s.recv(65536), now)
+			else:
+				while self.rtcp is not None:
+					s.recv(65536)
+		except (IOError, OSError) as e:
+			if e.errno not in (errno.EAGAIN, errno.EWOULDBLOCK, errno.EINTR):
+				self.fail(str(e))
+
+	def parse_control(self, now):
+		# interleaved packets ($, channel, length) and RTSP responses
+		while self.buf and self.s is not None:
+			if self.buf[:1] == b"$":
+				if len(self.buf) < 4:
+					return
+				ch, n = struct.unpack("!BH", self.buf[1:4])
+				if len(self.buf) < 4 + n:
+					return
+				if ch == 0:
+					self.on_rtp(self.buf[4:4 + n], now)
+				self.buf = self.buf[4 + n:]
+				continue
+			i = self.buf.find(b"\r\n\r\n")
+			if i < 0:
+				return
+			head = self.buf[:i].decode("latin-1")
+			m = re.search(r"(?im)^content-length:\s*(\d+)", head)
+			clen = int(m.group(1)) if m else 0
+			if len(self.buf) < i + 4 + clen:
+				return
+			body = self.buf[i + 4:i + 4 + clen].decode("latin-1")
+			self.buf = self.buf[i + 4 + clen:]
+			try:
+				self.on_response(head, body)
+			except (IOError, OSError, ValueError) as e:
+				self.fail("%s: %s" % (self.state, e))
+
+	def on_response(self, head, body):
+		f = head.split(None, 2)
+		if len(f) < 2 or not f[0].startswith("RTSP/"):
+			raise ValueError("bad response")
+		if int(f[1]) != 200:
+			raise ValueError("status %s" % f[1])
+		if self.state == "OPTIONS":
+			self.request("DESCRIBE", self.url, "Accept: application/sdp\r\n")
+		elif self.state == "DESCRIBE":
+			self.video = parse_sdp(body)
+			if self.video is None:
+				raise ValueError("no video stream")
+			m = re.search(r"(?im)^content-base:\s*(\S+)", head)
+			base = m.group(1) if m else self.url
+			ctl = self.video["control"] or "streamid=0"
+			if ctl.startswith("rtsp://"):
+				self.track = ctl
+			else:
+				self.track = base.rstrip("/") + "/" + ctl
+			if self.tcp:
+				transport = "RTP/AVP/TCP;unicast;interleaved=0-1"
+			else:
+				self.rtp, self.rtcp, port = udp_pair()
+				transport = "RTP/AVP;unicast;client_port=%d-%d" % (port, port + 1)
+			self.request("SETUP", self.track, "Transport: %s\r\n" % transport)
+		elif self.state == "SETUP":
+			m = re.search(r"(?im)^session:\s*([^;\r\n]+)", head)
+			if m is None:
+				raise ValueError("no session")
+			self.session = m.group(1).strip()
+			self.request("PLAY", self.url, "Range: npt=0.000-\r\n")
+		elif self.state == "PLAY":
+			self.state = "PLAYING"
+
+	def on_rtp(self, pkt, now):
+		st = self.st
+		if len(pkt) < 12:
+			st.invalid += 1
+			return
+		b0, b1, seq, ts, ssrc = struct.unpack("!BBHII", pkt[:12])
+		if b0 >> 6 != 2:
+			st.invalid += 1
+			return
+		if self.ttfp is None:
+			self.ttfp = now - self.t0
+		self.last_rx = now
+		if b1 & 0x7f != self.video["pt"]:
+			st.other += 1
+			return
+		if self.ssrc is None:
+			self.ssrc = ssrc
+		elif ssrc != self.ssrc:
+			st.invalid += 1
+			return
+		st.packets += 1
+		st.bytes += len(pkt)
+		if b1 & 0x80:
+			st.frames += 1
+		# extended sequence numbers, as in RFC 3550 A.1 without probation
+		if self.base_seq is None:
+			self.base_seq = self.max_seq = seq
+		else:
+			delta = (seq - self.max_seq) & 0xffff
+			if delta < 0x8000:
+				if seq < self.max_seq:
+					self.cycles += 0x10000
+				self.max_seq = seq
+		st.expected = self.cycles + self.max_seq - self.base_seq + 1
+		# inter-arrival jitter, RFC 3550 A.8, in timestamp units
+		transit = now * self.video["clock"] - ts
+		if self.transit is not None:
+			d = abs(transit - self.transit)
+			# a wrapped timestamp is not a real difference
+			if d < 0x80000000:
+				self.jitter += (d - self.jitter) / 16.0
+		self.transit = transit
+
+	def check(self, now):
+		if self.s is None:
+			return
+		if self.state != "PLAYING":
+			if now - self.t0 > RTSP_TIMEOUT:
+				self.fail("%s: timed out" % self.state)
+		elif now - (self.last_rx or self.t0) > STALL_TIMEOUT:
+			# count it once per stall
+			self.stalls += 1
+			self.last_rx = now
+
+	def window(self, secs):
+		# figures since the last call
+		a, b = self.snap, self.st
+		self.snap = b.copy()
+		expected = b.expected - a.expected
+		lost = max(0, expected - (b.packets - a.packets))
+		return {
+			"kbps": (b.bytes - a.bytes) * 8 / 1000.0 / secs,
+			"fps": (b.frames - a.frames) / float(secs),
+			"loss": 100.0 * lost / expected if expected > 0 else 0.0,
+			"jitter": 1000.0 * self.jitter / self.video["clock"] if self.ttfp else 0.0,
+			"ttfp": 1000.0 * self.ttfp if self.ttfp is not None else None,
+			"invalid": b.invalid - a.invalid,
+		}
+
+def pct(values, p):
+	if not values:
+		return 0.0
+	values = sorted(values)
+	return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+class LoadGen:
+	def __init__(self, args):
+		self.args = args
+		m = re.match(r"rtsp://([^:/]+)(?::(\d+))?", args.url)
+		if m is None:
+			raise ValueError("invalid url: %s" % args.url)
+		self.host, self.port = m.group(1), int(m.group(2) or 554)
+		self.clients = []
+		self.pid = args.pid
+
+	def add_clients(self, n):
+		for i in range(n):
+			idx = len(self.clients)
+			if self.args.transport == "mixed":
+				tcp = idx & 1 == 1
+			else:
+				tcp = self.args.transport == "tcp"
+			try:
+				c = Client(idx, self.args.url, self.host, self.port, tcp)
+			except (IOError, OSError) as e:
+				print("client #%d: %s" % (idx, e))
+				return False
+			self.clients.append(c)
+		return True
+
+	def run_for(self, secs):
+		# receive until the end of the interval
+		end = time.time() + secs
+		while True:
+			now = time.time()
+			if now >= end:
+				return
+			fds = {}
+			for c in self.clients:
+				for s in c.sockets():
+					fds[s.fileno()] = (s, c)
+			if not fds:
+				time.sleep(end - now)
+				return
+			# select() is limited to FD_SETSIZE, poll is not
+			p = select.poll()
+			for fd in fds:
+				p.register(fd, select.POLLIN)
+			for fd, ev in p.poll(min(0.2, end - now) * 1000):
+				s, c = fds[fd]
+				# closed by an earlier event of the same client
+				if s in c.sockets():
+					c.on_readable(s, time.time())
+			now = time.time()
+			for c in self.clients:
+				c.check(now)
+
+	def measure(self, secs):
+		cpu0, own0, t0 = server_cpu(self.pid), own_cpu(), time.time()
+		for c in self.clients:
+			if c.state == "PLAYING":
+				c.window(1)
+		self.run_for(secs)
+		elapsed = time.time() - t0
+		cpu1 = server_cpu(self.pid)
+		res = { "clients": len(self.clients), "elapsed": elapsed }
+		res["server_cpu"] = 100.0 * (cpu1 - cpu0) / elapsed if cpu0 is not None and cpu1 is not None else None
+		res["own_cpu"] = 100.0 * (own_cpu() - own0) / elapsed
+		res["failed"] = [c for c in self.clients if c.error is not None]
+		res["playing"] = [c for c in self.clients if c.error is None and c.state == "PLAYING"]
+		res["per_client"] = [(c, c.window(elapsed)) for c in res["playing"]]
+		return res
+
+	def summary(self, res):
+		w = [x for c, x in res["per_client"]]
+		line = "%3d clients (%d playing, %d failed)" % (res["clients"], len(res["playing"]), len(res["failed"]))
+		if w:
+			line += ": %.0f kbps, fps min %.1f, loss max %.2f%%, jitter p95 %.1f ms, ttfp p95 %.0f ms" % (
+				sum(x["kbps"] for x in w),
+				min(x["fps"] for x in w),
+				max(x["loss"] for x in w),
+				pct([x["jitter"] for x in w], 95),
+				pct([x["ttfp"] for x in w if x["ttfp"] is not None], 95))
+		if res["server_cpu"] is not None:
+			line += ", server cpu %.0f%%" % res["server_cpu"]
+		line += ", own cpu %.0f%%" % res["own_cpu"]
+		print(line)
+
+	def report(self, res):
+		print("%-10s %9s %6s %7s %8s %8s %7s %6s %s" % ("client", "kbps", "fps",
+			"loss%", "jitter", "ttfp", "invalid", "stalls", "error"))
+		for c, x in res["per_client"]:
+			print("%-10s %9.0f %6.1f %7.2f %6.1fms %6.0fms %7d %6d" % (c.name(),
+				x["kbps"], x["fps"], x["loss"], x["jitter"],
+				x["ttfp"] if x["ttfp"] is not None else -1, x["invalid"], c.stalls))
+		for c in res["failed"]:
+			print("%-10s %s" % (c.name(), c.error))
+
+	def violations(self, res):
+		a, v = self.args, []
+		if res["failed"]:
+			v.append("%d sessions failed" % len(res["failed"]))
+		for c, x in res["per_client"]:
+			if x["loss"] > a.max_loss:
+				v.append("%s loss %.2f%%" % (c.name(), x["loss"]))
+			if x["jitter"] > a.max_jitter:
+				v.append("%s jitter %.1f ms" % (c.name(), x["jitter"]))
+			if a.min_fps > 0 and x["fps"] < a.min_fps:
+				v.append("%s %.1f fps" % (c.name(), x["fps"]))
+			if x["ttfp"] is None or x["ttfp"] > a.max_ttfp:
+				v.append("%s no packet within %d ms" % (c.name(), a.max_ttfp))
+			if x["invalid"] > 0:
+				v.append("%s %d invalid packets" % (c.name(), x["invalid"]))
+		return v
+
+	def close(self):
+		for c in self.clients:
+			c.teardown()
+
+def main():
+	p = argparse.ArgumentParser(description="RTSP/RTP load generator")
+	p.add_argument("url")
+	p.add_argument("-n", "--clients", type=int, default=10, help="clients, or the first step with --ramp")
+	p.add_argument("-t", "--time", type=int, default=30, help="seconds to measure, per step with --ramp")
+	p.add_argument("-p", "--pid", type=int, default=None, help="server pid, for its CPU usage")
+	p.add_argument("--transport", choices=("udp", "tcp", "mixed"), default="udp")
+	p.add_argument("--warmup", type=float, default=3, help="seconds before measuring new clients")
+	p.add_argument("--ramp", action="store_true", help="add clients until an SLO breaks")
+	p.add_argument("--step", type=int, default=5)
+	p.add_argument("--max-clients", type=int, default=1000)
+	p.add_argument("--max-loss", type=float, default=1.0, help="percent")
+	p.add_argument("--max-jitter", type=float, default=30.0, help="ms")
+	p.add_argument("--min-fps", type=float, default=0, help="e.g., 90%% of video-fps; 0 - not checked")
+	p.add_argument("--max-ttfp", type=int, default=3000, help="ms")
+	args = p.parse_args()
+	# an RTSP connection and two UDP sockets per client
+	soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+	want = 3 * (args.max_clients if args.ramp else args.clients) + 64
+	if soft < want:
+		try:
+			resource.setrlimit(resource.RLIMIT_NOFILE, (min(want, hard), hard))
+		except (ValueError, OSError):
+			pass
+	lg = LoadGen(args)
+	try:
+		if not args.ramp:
+			lg.add_clients(args.clients)
+			lg.run_for(args.warmup)
+			res = lg.measure(args.time)
+			lg.report(res)
+			lg.summary(res)
+			v = lg.violations(res)
+			for x in v[:20]:
+				print("SLO: %s" % x)
+			return 1 if v else 0
+		good, n = 0, args.clients
+		while n <= args.max_clients:
+			if not lg.add_clients(n - len(lg.clients)):
+				break
+			lg.run_for(args.warmup)
+			res = lg.measure(args.time)
+			lg.summary(res)
+			v = lg.violations(res)
+			if v:
+				lg.report(res)
+				for x in v[:20]:
+					print("SLO: %s" % x)
+				break
+			good = n
+			n += args.step
+		print("max clients within SLOs: %d" % good)
+		return 0
+	except KeyboardInterrupt:
+		return 1
+	finally:
+		lg.close()
+
+if __name__ == "__main__":
+	sys.exit(main())
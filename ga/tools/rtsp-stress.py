@@ -0,0 +1,141 @@
+#!/usr/bin/env python
+#
+# Stress the RTSP front end: hold many idle connections open, and run
+# DESCRIBE/SETUP/TEARDOWN cycles on new connections as fast as the server
+# answers them.  Compare the server's thread count and memory (read from
+# /proc, so run it on the server host) with rtsp-io-threads = 0 and > 0.
+#
+# Idle connections are closed by the server after rtsp-session-timeout,
+# set it to 0 (or longer than the test) on the server.
+#
+# usage:
+#	rtsp-stress.py <url> [idle] [seconds] [server-pid]
+#	e.g., rtsp-stress.py rtsp://127.0.0.1:8554/desktop 2000 60 `pidof ga-server-periodic`
+#
+
+import os
+import re
+import resource
+import socket
+import sys
+import time
+
+def usage():
+	sys.stderr.write("usage: %s <url> [idle] [seconds] [server-pid]\n" % sys.argv[0])
+	sys.exit(1)
+
+def server_status(pid):
+	if pid is None:
+		return ""
+	st = {}
+	try:
+		for line in open("/proc/%d/status" % pid):
+			k, v = line.split(":", 1)
+			st[k] = v.strip()
+	except (IOError, OSError, ValueError):
+		return "server gone"
+	return "server threads %s, rss %s" % (st.get("Threads", "?"), st.get("VmRSS", "?"))
+
+class Conn:
+	def __init__(self, host, port):
+		self.s = socket.create_connection((host, port), 10)
+		self.cseq = 0
+		self.buf = b""
+
+	def request(self, method, url, headers=""):
+		self.cseq += 1
+		msg = "%s %s RTSP/1.0\r\nCSeq: %d\r\n%s\r\n" % (method, url, self.cseq, headers)
+		self.s.sendall(msg.encode())
+		# headers, then the body
+		while b"\r\n\r\n" not in self.buf:
+			data = self.s.recv(65536)
+			if not data:
+				raise IOError("connection closed by the server")
+			self.buf += data
+		head, self.buf = self.buf.split(b"\r\n\r\n", 1)
+		head = head.decode("latin-1")
+		m = re.search(r"(?im)^content-length:\s*(\d+)", head)
+		clen = int(m.group(1)) if m else 0
+		while len(self.buf) < clen:
+			data = self.s.recv(65536)
+			if not data:
+				raise IOError("connection closed by the server")
+			self.buf += data
+		body, self.buf = self.buf[:clen], self.buf[clen:]
+		status = int(head.split(None, 2)[1])
+		return status, head, body.decode("latin-1")
+
+	def close(self):
+		self.s.close()
+
+def cycle(host, port, url):
+	c = Conn(host, port)
+	try:
+		c.request("OPTIONS", url)
+		status, head, sdp = c.request("DESCRIBE", url, "Accept: application/sdp\r\n")
+		if status != 200:
+			raise IOError("DESCRIBE: %d" % status)
+		# the first stream, interleaved: no UDP ports to allocate here
+		m = re.search(r"(?m)^a=control:(\S+)", sdp)
+		track = url.rstrip("/") + "/" + (m.group(1) if m else "streamid=0")
+		status, head, body = c.request("SETUP", track,
+			"Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n")
+		if status != 200:
+			raise IOError("SETUP: %d" % status)
+		m = re.search(r"(?im)^session:\s*([^;\r\n]+)", head)
+		c.request("TEARDOWN", url, "Session: %s\r\n" % (m.group(1) if m else ""))
+	finally:
+		c.close()
+
+def main():
+	if len(sys.argv) < 2:
+		usage()
+	url = sys.argv[1]
+	nidle = int(sys.argv[2]) if len(sys.argv) > 2 else 1000
+	duration = int(sys.argv[3]) if len(sys.argv) > 3 else 30
+	pid = int(sys.argv[4]) if len(sys.argv) > 4 else None
+	m = re.match(r"rtsp://([^:/]+)(?::(\d+))?", url)
+	if m is None:
+		usage()
+	host, port = m.group(1), int(m.group(2) or 554)
+	# one descriptor per idle connection
+	soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+	want = nidle + 64
+	if soft < want:
+		try:
+			resource.setrlimit(resource.RLIMIT_NOFILE, (min(want, hard), hard))
+		except (ValueError, OSError):
+			pass
+	print("before: %s" % server_status(pid))
+	idle = []
+	t0 = time.time()
+	for i in range(nidle):
+		try:
+			idle.append(socket.create_connection((host, port), 10))
+		except (IOError, OSError) as e:
+			print("idle connection %d: %s" % (i, e))
+			break
+	print("%d idle connections in %.1fs: %s" % (len(idle), time.time() - t0, server_status(pid)))
+	# DESCRIBE/SETUP cycles
+	ok = failed = 0
+	t0 = last = time.time()
+	while time.time() - t0 < duration:
+		try:
+			cycle(host, port, url)
+			ok += 1
+		except (IOError, OSError) as e:
+			failed += 1
+			if failed <= 10:
+				print("cycle failed: %s" % e)
+		if time.time() - last >= 5:
+			last = time.time()
+			print("%d cycles (%.1f/s), %d failed: %s" % (ok,
+				ok / (last - t0), failed, server_status(pid)))
+	print("done: %d cycles, %d failed: %s" % (ok, failed, server_status(pid)))
+	for s in idle:
+		s.close()
+	time.sleep(1)
+	print("after: %s" % server_status(pid))
+
+if __name__ == "__main__":
+	main()